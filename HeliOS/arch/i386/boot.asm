@@ -1,7 +1,8 @@
 ; Declare constants for the multiboot header.
 MBALIGN  equ  1 << 0            ; align loaded modules on page boundaries
 MEMINFO  equ  1 << 1            ; provide memory map
-MBFLAGS  equ  MBALIGN | MEMINFO ; this is the Multiboot 'flag' field
+VIDEO    equ  1 << 2            ; ask for the graphics mode below
+MBFLAGS  equ  MBALIGN | MEMINFO | VIDEO ; this is the Multiboot 'flag' field
 MAGIC    equ  0x1BADB002        ; 'magic number' lets bootloader find the header
 CHECKSUM equ -(MAGIC + MBFLAGS)   ; checksum of above, to prove we are multiboot
 
@@ -37,6 +38,7 @@ align 4
 ; undefined behavior.
 section .bss
 align 16
+global stack_top
 stack_bottom:
 resb 16384 ; 16 KiB
 stack_top:
@@ -93,25 +95,35 @@ higher_half:
 	extern kernel_main
 	call kernel_main
 
+    ; The boot flow is the first thread, the idle threads take over from here
+    extern thread_exit
+    call thread_exit
+
 ; halt the cpu if nothing else needs to be done
 ; or until next interrupt
 halt:
+    extern work_run
+    call work_run ; Anything deferred that no interrupt exit got to
+    extern pmm_zero_idle
+    call pmm_zero_idle ; Clear pages for the zero pool while there's nothing else to do
+    extern klog_flush
+    call klog_flush ; Push logged messages out to the consoles
     hlt
     jmp halt
 
 ; This will set up our new segment registers. We need to do
 ; something special in order to set CS. We do what is called a
 ; far jump. A jump that includes a segment as well as an offset.
-; This is declared in C as 'extern void gdt_flush();'
+; This is declared in C as 'extern void gdt_flush(struct gdt_ptr* ptr);'
+; %gs is left for the caller, it holds the per-CPU segment.
 global gdt_flush     ; Allows the C code to link to this
-extern gp            ; Says that 'gp' is in another file
 gdt_flush:
-    lgdt [gp]        ; Load the GDT with our 'gp' which is a special pointer
+    mov eax, [esp + 4]
+    lgdt [eax]       ; Load the GDT with the special pointer we were given
     mov ax, 0x10      ; 0x10 is the offset in the GDT to our data segment
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
     mov ss, ax
     jmp 0x08:flush2   ; 0x08 is the offset to our code segment: Far jump!
 flush2:
@@ -15,6 +15,10 @@ global irq12
 global irq13
 global irq14
 global irq15
+global irq_spurious
+global irq_stub_table
+
+section .text
 
 ; 32: irq0
 irq0:
@@ -113,6 +117,22 @@ irq15:
     push byte 47
     jmp irq_common_stub
 
+; 48-254: IOAPIC lines past the ISA ones, MSIs and the local APIC's own vectors, all sent to irq_handler
+; like the PIC lines. Vectors above 127 don't fit a sign extended byte, so these push a dword.
+%assign vec 48
+%rep 255 - 48
+irq %+ vec:
+    cli
+    push byte 0
+    push dword vec
+    jmp irq_common_stub
+%assign vec vec + 1
+%endrep
+
+; 255: spurious local APIC interrupt, must not be acknowledged
+irq_spurious:
+    iret
+
 extern irq_handler
 
 ; This is a stub that we have created for IRQ based ISRs. This calls
@@ -122,12 +142,12 @@ irq_common_stub:
     push ds
     push es
     push fs
-    push gs
+    push gs ; Saved for the frame layout, it's the per-CPU segment and never changes
     mov ax, 0x10
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
+    cld ; The ABI wants DF clear in C, a backwards memmove may have been interrupted. iret restores it.
     mov eax, esp
     push eax
     mov eax, irq_handler
@@ -140,3 +160,12 @@ irq_common_stub:
     popa
     add esp, 8
     iret
+
+section .rodata
+; Entry points for vectors 48-254, irq_init puts them in the IDT
+irq_stub_table:
+%assign vec 48
+%rep 255 - 48
+    dd irq %+ vec
+%assign vec vec + 1
+%endrep
@@ -236,12 +236,12 @@ isr_common_stub:
     push ds
     push es
     push fs
-    push gs
+    push gs ; Saved for the frame layout, it's the per-CPU segment and never changes
     mov ax, 0x10   ; Load the Kernel Data Segment descriptor!
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
+    cld            ; The ABI wants DF clear in C, a backwards memmove may have faulted. iret restores it.
     mov eax, esp   ; Push us the stack
     push eax
     mov eax, fault_handler
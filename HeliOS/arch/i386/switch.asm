@@ -0,0 +1,25 @@
+; Kernel thread context switch
+
+section .text
+
+; void switch_context(uint32_t* old_esp, uint32_t new_esp)
+; Saves the callee saved registers and flags on the current stack, stores its esp through old_esp and
+; resumes whatever was saved on the stack at new_esp. Threads that never ran start from the frame
+; thread_create laid out, which returns into thread_start.
+global switch_context
+switch_context:
+    mov eax, [esp + 4]
+    mov edx, [esp + 8]
+    push ebp
+    push ebx
+    push esi
+    push edi
+    pushf
+    mov [eax], esp
+    mov esp, edx
+    popf
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
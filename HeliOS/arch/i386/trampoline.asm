@@ -0,0 +1,62 @@
+; Application processor startup code. smp_init copies everything from trampoline_start to trampoline_end to
+; TRAMPOLINE_BASE and fills trampoline_params in, then the SIPI drops the AP here in real mode with
+; CS = TRAMPOLINE_BASE >> 4 and IP = 0. Only offsets relative to trampoline_start mean anything.
+
+TRAMPOLINE_BASE equ 0x8000 ; SMP_TRAMPOLINE in smp.h
+%define REL(x) (TRAMPOLINE_BASE + (x) - trampoline_start)
+
+global trampoline_start
+global trampoline_end
+global trampoline_params
+
+section .rodata
+align 16
+bits 16
+trampoline_start:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+    lgdt [tramp_gdt_ptr - trampoline_start]
+    mov eax, cr0
+    or eax, 1 ; Protected mode, paging comes once we're in 32 bit code
+    mov cr0, eax
+    jmp dword 0x08:REL(protected_entry)
+
+bits 32
+protected_entry:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    ; Same paging setup as the BSP, the low 4 MiB are identity mapped while APs start so this keeps running
+    mov eax, [REL(param_cr4)]
+    mov cr4, eax
+    mov eax, [REL(param_cr3)]
+    mov cr3, eax
+    mov eax, [REL(param_cr0)]
+    mov cr0, eax
+    mov esp, [REL(param_stack)]
+    mov eax, [REL(param_entry)]
+    jmp eax ; Higher half C from here on, never returns
+
+align 8
+tramp_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF ; Flat code
+    dq 0x00CF92000000FFFF ; Flat data
+tramp_gdt_ptr:
+    dw tramp_gdt_ptr - tramp_gdt - 1
+    dd REL(tramp_gdt)
+
+align 4
+; struct trampoline_params in smp.c
+trampoline_params:
+param_cr0: dd 0
+param_cr3: dd 0
+param_cr4: dd 0
+param_stack: dd 0
+param_entry: dd 0
+trampoline_end:
@@ -3,41 +3,75 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <kernel/fbcon.h>
 #include <kernel/tty.h>
 
 #include "vga.h"
 
-static const size_t VGA_WIDTH = 80;
-static const size_t VGA_HEIGHT = 25;
+#define VGA_WIDTH 80
+#define VGA_HEIGHT 25
 
 size_t terminal_row;
 size_t terminal_column;
 uint8_t terminal_color;
 uint16_t* const terminal_buffer = (uint16_t* const)0xC00B8000;
 
+// Everything is drawn here first and copied to VGA memory on flush, one row at a time.
+// Rows are a ring starting at shadow_top, so scrolling only moves the start and clears one row.
+static uint16_t shadow[VGA_HEIGHT][VGA_WIDTH];
+static size_t shadow_top = 0;
+// Bit per screen row that differs from VGA memory
+static uint32_t dirty_rows = 0;
+
+static inline uint16_t* shadow_row(size_t y) { return shadow[(shadow_top + y) % VGA_HEIGHT]; }
+
+static void clear_row(size_t y)
+{
+    uint16_t* row = shadow_row(y);
+    for (size_t x = 0; x < VGA_WIDTH; x++)
+        row[x] = vga_entry(' ', terminal_color);
+    dirty_rows |= 0x1u << y;
+}
+
+/// Copies changed rows out to VGA memory
+static void tty_flush(void)
+{
+    for (size_t y = 0; dirty_rows; y++) {
+        if (!(dirty_rows & (0x1u << y))) continue;
+        memcpy(terminal_buffer + y * VGA_WIDTH, shadow_row(y), VGA_WIDTH * sizeof(uint16_t));
+        dirty_rows &= ~(0x1u << y);
+    }
+}
+
 void tty_initialize(void)
 {
     terminal_row = 0;
     terminal_column = 0;
     terminal_color = vga_entry_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK);
-    for (size_t y = 0; y < VGA_HEIGHT; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            const size_t index = y * VGA_WIDTH + x;
-            terminal_buffer[index] = vga_entry(' ', terminal_color);
-        }
-    }
+    shadow_top = 0;
+    for (size_t y = 0; y < VGA_HEIGHT; y++)
+        clear_row(y);
+    tty_flush();
 }
 
 void tty_setcolor(uint8_t color) { terminal_color = color; }
 
 void tty_putentryat(char c, uint8_t color, size_t x, size_t y)
 {
-    const size_t index
-        = y * VGA_WIDTH + x; // position = (y_position * characters_per_line) + x_position
-    terminal_buffer[index] = vga_entry(c, color);
+    shadow_row(y)[x] = vga_entry(c, color);
+    dirty_rows |= 0x1u << y;
+}
+
+static void scroll(void)
+{
+    // The old top row becomes the new bottom one, every row on screen moved so all of them need copying
+    shadow_top = (shadow_top + 1) % VGA_HEIGHT;
+    clear_row(VGA_HEIGHT - 1);
+    dirty_rows = (0x1u << VGA_HEIGHT) - 1;
 }
 
-void tty_putchar(char c)
+/// Puts a character in the shadow buffer only, callers flush and move the cursor once they're done
+static void put(char c)
 {
     switch (c) {
     case '\n':
@@ -49,7 +83,8 @@ void tty_putchar(char c)
         tty_putentryat(' ', terminal_color, --terminal_column, terminal_row);
         break;
     case '\t':
-        tty_writestring("    ");
+        for (int i = 0; i < 4; i++)
+            put(' ');
         break;
     default:
         tty_putentryat(c, terminal_color, terminal_column, terminal_row);
@@ -61,27 +96,41 @@ void tty_putchar(char c)
         terminal_row++;
     }
 
-    size_t i, j;
     if (terminal_row >= VGA_HEIGHT) {
-        for (i = 0; i < VGA_WIDTH; i++) {
-            for (j = 0; j < VGA_HEIGHT; j++) {
-                terminal_buffer[j * VGA_WIDTH + i] = terminal_buffer[(j + 1) * VGA_WIDTH + i];
-            }
-        }
-        // Also clear out the bottom row
-        for (i = 0; i < VGA_WIDTH; i++) {
-            tty_putentryat(' ', terminal_color, i, VGA_HEIGHT - 1);
-        }
-
+        scroll();
         terminal_row = VGA_HEIGHT - 1;
     }
-    tty_update_cursor(terminal_column, terminal_row + 1);
 }
 
+void tty_putchar(char c) { tty_write(&c, 1); }
+
 void tty_write(const char* data, size_t size)
 {
+    // In graphics mode VGA text memory isn't shown, the framebuffer console takes over
+    if (fbcon_active()) {
+        for (size_t i = 0; i < size; i++)
+            fbcon_put(data[i], terminal_color);
+        fbcon_flush();
+        return;
+    }
     for (size_t i = 0; i < size; i++)
-        tty_putchar(data[i]);
+        put(data[i]);
+    tty_flush();
+    tty_update_cursor(terminal_column, terminal_row + 1);
+}
+
+void tty_use_framebuffer(void)
+{
+    if (fbcon_init()) return;
+    // Replay what was printed before the framebuffer was mapped, colours included
+    for (size_t y = 0; y <= terminal_row; y++) {
+        uint16_t* row = shadow_row(y);
+        size_t len = y == terminal_row ? terminal_column : VGA_WIDTH;
+        for (size_t x = 0; x < len; x++)
+            fbcon_put(row[x] & 0xFF, row[x] >> 8);
+        if (y != terminal_row) fbcon_put('\n', terminal_color);
+    }
+    fbcon_flush();
 }
 
 void tty_writestring(const char* data) { tty_write(data, strlen(data)); }
@@ -0,0 +1,54 @@
+#pragma once
+// ACPI table discovery, just enough to find the interrupt controllers and CPUs
+
+#include <kernel/cpu.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ACPI_MAX_IOAPICS 4
+#define ACPI_ISA_IRQS 16
+
+// MPS INTI flags from interrupt source overrides
+#define ACPI_INTI_POLARITY_MASK 0x3
+#define ACPI_INTI_ACTIVE_LOW 0x3
+#define ACPI_INTI_TRIGGER_MASK 0xC
+#define ACPI_INTI_LEVEL 0xC
+
+struct acpi_sdt_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_ioapic {
+    uint8_t id;
+    uintptr_t phys;
+    uint32_t gsi_base;
+};
+
+/// What the MADT says about the interrupt hardware, flattened out of its variable length entries
+struct acpi_madt_info {
+    uintptr_t lapic_phys;
+    bool has_pic; ///< Dual 8259s are wired up too and have to be masked before using the IOAPIC
+    uint8_t cpu_count;
+    uint8_t cpu_apic_ids[MAX_CPUS]; ///< Enabled CPUs, the boot CPU isn't necessarily first
+    uint8_t ioapic_count;
+    struct acpi_ioapic ioapics[ACPI_MAX_IOAPICS];
+    /// ISA IRQ to GSI, identity unless the firmware overrides it
+    uint32_t isa_gsi[ACPI_ISA_IRQS];
+    /// INTI flags for each ISA IRQ, 0 means the ISA default of edge triggered active high
+    uint16_t isa_flags[ACPI_ISA_IRQS];
+};
+
+/// Finds the RSDP and reads the MADT. Needs the direct map, so call after init_memory. Returns -1 without ACPI.
+int acpi_init();
+/// Mapped table with the given signature, or NULL if the firmware doesn't have one
+struct acpi_sdt_header* acpi_find_table(const char* signature);
+/// NULL when there was no (valid) MADT
+const struct acpi_madt_info* acpi_madt();
@@ -0,0 +1,54 @@
+#pragma once
+// Local APIC of the current CPU
+
+#include <stdint.h>
+
+// Vectors the local APIC delivers its own interrupts on, at the top past everything external
+#define LAPIC_TIMER_VECTOR 0xF0
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+// irq_install_handler slot for the LAPIC timer
+#define IRQ_LAPIC_TIMER (LAPIC_TIMER_VECTOR - 32)
+
+// Register offsets
+#define LAPIC_ID 0x020
+#define LAPIC_TPR 0x080
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SVR 0x0F0
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_LVT_MASKED (1 << 16)
+#define LAPIC_LVT_PERIODIC (1 << 17)
+#define LAPIC_TIMER_DIV_16 0x3
+
+// Interrupt command register
+#define LAPIC_ICR_FIXED (0 << 8)
+#define LAPIC_ICR_INIT (5 << 8)
+#define LAPIC_ICR_STARTUP (6 << 8)
+#define LAPIC_ICR_PENDING (1 << 12)
+#define LAPIC_ICR_ASSERT (1 << 14)
+
+/// Maps and software enables the local APIC, does nothing if it already is. Returns -1 if the CPU has none.
+int lapic_init();
+/// Software enables the already mapped local APIC of the CPU this runs on, for APs
+void lapic_enable_local();
+/// True once lapic_init succeeded
+int lapic_present();
+uint32_t lapic_read(uint32_t reg);
+void lapic_write(uint32_t reg, uint32_t value);
+void lapic_eoi();
+/// ID of the CPU this runs on
+uint8_t lapic_id();
+/// Sends an IPI with the given ICR low bits to apic_id and waits until it's delivered, interrupts have to be off
+void lapic_send_ipi(uint8_t apic_id, uint32_t icr);
+
+/// Starts the timer counting down from count once, firing LAPIC_TIMER_VECTOR at zero
+void lapic_timer_oneshot(uint32_t count);
+/// Fires LAPIC_TIMER_VECTOR every count timer counts until stopped
+void lapic_timer_periodic(uint32_t count);
+uint32_t lapic_timer_current();
+void lapic_timer_stop();
@@ -69,3 +69,89 @@ static inline uint32_t indword(uint16_t port)
     __asm__ volatile("in	%%dx,%%eax" : "=a"(res) : "d"(port));
     return res;
 }
+
+/**
+ * Reads <count> words from the I/O-Port <port> into <buf> with a single rep insw
+ *
+ * @param port the port
+ * @param buf the destination
+ * @param count number of words
+ */
+static inline void insw(uint16_t port, void* buf, uint32_t count)
+{
+    __asm__ volatile("rep insw" : "+D"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+/**
+ * Writes <count> words from <buf> to the I/O-Port <port> with a single rep outsw
+ *
+ * @param port the port
+ * @param buf the source
+ * @param count number of words
+ */
+static inline void outsw(uint16_t port, const void* buf, uint32_t count)
+{
+    __asm__ volatile("rep outsw" : "+S"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+/// Disables interrupts and returns the previous EFLAGS so they can be put back with irq_restore
+static inline uint32_t irq_save()
+{
+    uint32_t flags;
+    asm volatile("pushf\n"
+                 "pop %0\n"
+                 "cli"
+                 : "=r"(flags)
+                 :
+                 : "memory");
+    return flags;
+}
+
+/// Restores the interrupt flag saved by irq_save
+static inline void irq_restore(uint32_t flags) { asm volatile("push %0\npopf" : : "r"(flags) : "memory", "cc"); }
+
+/// Reads a model specific register
+static inline uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value)
+{
+    asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+/// Reads the time stamp counter
+static inline uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint32_t read_cr0()
+{
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline uint32_t read_cr3()
+{
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    return cr3;
+}
+
+static inline uint32_t read_cr4()
+{
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr0(uint32_t cr0) { asm volatile("mov %0, %%cr0" ::"r"(cr0)); }
+
+static inline void write_cr4(uint32_t cr4) { asm volatile("mov %0, %%cr4" ::"r"(cr4)); }
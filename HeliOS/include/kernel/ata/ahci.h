@@ -0,0 +1,183 @@
+#pragma once
+// AHCI host controllers. Every port with a disk behind it gets an sATADevice and a block device of its own,
+// commands go out with native command queuing when both the HBA and the drive support it.
+#include <kernel/ata/controller.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* command slots per port the spec allows, the HBA may have fewer */
+#define AHCI_MAX_SLOTS 32
+/* PRD entries per command table, enough for 128 KiB split across pages with room to spare */
+#define AHCI_PRDT_ENTRIES 56
+/* disks we keep state for */
+#define AHCI_MAX_DEVICES 8
+
+/* host capabilities */
+enum {
+    AHCI_CAP_NCS_SHIFT = 8,
+    AHCI_CAP_NCS_MASK = 0x1F,
+    AHCI_CAP_SNCQ = 1 << 30,
+};
+
+/* global host control */
+enum {
+    AHCI_GHC_IE = 1 << 1,
+    AHCI_GHC_AE = 1u << 31,
+};
+
+/* port command and status */
+enum {
+    PORT_CMD_ST = 1 << 0,
+    PORT_CMD_FRE = 1 << 4,
+    PORT_CMD_FR = 1 << 14,
+    PORT_CMD_CR = 1 << 15,
+};
+
+/* port interrupt status and enable */
+enum {
+    PORT_IS_DHRS = 1 << 0,  /* D2H register FIS, non-queued commands finish with this */
+    PORT_IS_PSS = 1 << 1,   /* PIO setup FIS */
+    PORT_IS_SDBS = 1 << 3,  /* set device bits FIS, queued commands finish with this */
+    PORT_IS_DPS = 1 << 5,   /* a PRD with the interrupt bit was processed */
+    PORT_IS_IFS = 1 << 27,  /* interface fatal error */
+    PORT_IS_HBDS = 1 << 28, /* host bus data error */
+    PORT_IS_HBFS = 1 << 29, /* host bus fatal error */
+    PORT_IS_TFES = 1 << 30, /* task file error */
+    PORT_IS_ERROR = PORT_IS_IFS | PORT_IS_HBDS | PORT_IS_HBFS | PORT_IS_TFES,
+};
+
+/* SATA status, device detection and interface power management */
+enum {
+    PORT_SSTS_DET_MASK = 0xF,
+    PORT_SSTS_DET_PRESENT = 3,
+    PORT_SSTS_IPM_SHIFT = 8,
+    PORT_SSTS_IPM_ACTIVE = 1,
+};
+
+/* port signature of a plain ATA disk */
+static const uint32_t SATA_SIG_ATA = 0x00000101;
+
+enum {
+    FIS_TYPE_REG_H2D = 0x27,
+    /* set in the H2D FIS when it carries a command rather than a device control update */
+    FIS_H2D_COMMAND = 0x80,
+};
+
+enum {
+    COMMAND_READ_FPDMA_QUEUED = 0x60,
+    COMMAND_WRITE_FPDMA_QUEUED = 0x61,
+};
+
+/* registers of one port, at 0x100 + port * 0x80 of the ABAR; all dwords, so no padding to pack away */
+typedef volatile struct {
+    uint32_t clb; /* command list base, 1 KiB aligned */
+    uint32_t clbu;
+    uint32_t fb; /* received FIS base, 256 byte aligned */
+    uint32_t fbu;
+    uint32_t is;
+    uint32_t ie;
+    uint32_t cmd;
+    uint32_t rsv0;
+    uint32_t tfd; /* task file data, status in the low byte, error in the next */
+    uint32_t sig;
+    uint32_t ssts;
+    uint32_t sctl;
+    uint32_t serr;
+    uint32_t sact; /* tags of queued commands the device hasn't finished */
+    uint32_t ci;   /* slots issued the HBA hasn't finished */
+    uint32_t sntf;
+    uint32_t fbs;
+    uint32_t rsv1[11];
+    uint32_t vendor[4];
+} sAHCIPort;
+
+/* the memory mapped registers behind BAR5 */
+typedef volatile struct {
+    uint32_t cap;
+    uint32_t ghc;
+    uint32_t is; /* one bit per port with an interrupt pending */
+    uint32_t pi; /* ports implemented */
+    uint32_t vs;
+    uint32_t ccc_ctl;
+    uint32_t ccc_ports;
+    uint32_t em_loc;
+    uint32_t em_ctl;
+    uint32_t cap2;
+    uint32_t bohc;
+    uint8_t rsv[0xA0 - 0x2C];
+    uint8_t vendor[0x100 - 0xA0];
+    sAHCIPort ports[32];
+} sAHCIMem;
+
+_Static_assert(sizeof(sAHCIPort) == 0x80, "AHCI port registers");
+_Static_assert(sizeof(sAHCIMem) == 0x1100, "AHCI HBA registers");
+
+/* one entry of the command list */
+typedef struct {
+    /* command FIS length in dwords, W (bit 6) for writes */
+    uint16_t flags;
+    /* PRD entries in the command table */
+    uint16_t prdtl;
+    /* bytes transferred, written by the HBA */
+    volatile uint32_t prdbc;
+    /* command table base, 128 byte aligned */
+    uint32_t ctba;
+    uint32_t ctbau;
+    uint32_t rsv[4];
+} __attribute__((packed)) sAHCICmdHeader;
+
+enum {
+    CMD_HEADER_WRITE = 1 << 6,
+};
+
+typedef struct {
+    uint32_t dba; /* data base, word aligned */
+    uint32_t dbau;
+    uint32_t rsv;
+    /* byte count minus one, up to 4 MiB; bit 31 asks for an interrupt */
+    uint32_t dbc;
+} __attribute__((packed)) sAHCIPRD;
+
+/* most bytes a single PRD entry can describe */
+static const uint32_t AHCI_PRD_MAX_BYTES = 4 * 1024 * 1024;
+
+typedef struct {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t rsv[48];
+    sAHCIPRD prdt[AHCI_PRDT_ENTRIES];
+} __attribute__((packed)) sAHCICmdTable;
+
+/* register host to device FIS */
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint8_t command;
+    uint8_t featurel;
+    uint8_t lba0;
+    uint8_t lba1;
+    uint8_t lba2;
+    uint8_t device;
+    uint8_t lba3;
+    uint8_t lba4;
+    uint8_t lba5;
+    uint8_t featureh;
+    uint8_t countl;
+    uint8_t counth;
+    uint8_t icc;
+    uint8_t control;
+    uint8_t rsv[4];
+} __attribute__((packed)) sFISRegH2D;
+
+/**
+ * Looks for an AHCI controller on the PCI bus and brings up every port with a disk attached. Runs after
+ * ctrl_init, needs the scheduler for the block layer workers.
+ */
+void ahci_init();
+
+/**
+ * @param id the index of the disk, in port order
+ * @return the device or NULL if there are fewer AHCI disks
+ */
+sATADevice* ahci_get_device(uint8_t id);
@@ -8,7 +8,7 @@
  * Reads or writes from/to an ATA-device
  *
  * @param device the device
- * @param op the operation: OP_READ, OP_WRITE or OP_PACKET
+ * @param op the operation: OP_READ, OP_WRITE or OP_FLUSH
  * @param buffer the buffer to write to
  * @param lba the block-address to start at
  * @param secSize the size of a sector
@@ -16,4 +16,13 @@
  * @return true on success
  */
 bool ata_read_write(
-    sATADevice* device, uint16_t op, void* buffer, uint32_t lba, size_t sec_size, size_t sec_count);
+    sATADevice* device, uint16_t op, void* buffer, uint64_t lba, size_t sec_size, size_t sec_count);
+
+/**
+ * Turns on block-mode with SET MULTIPLE
+ *
+ * @param device the device
+ * @param count sectors per block, at most what IDENTIFY word 47 allows
+ * @return true if the device accepted it
+ */
+bool ata_set_multiple(sATADevice* device, uint8_t count);
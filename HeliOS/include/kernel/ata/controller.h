@@ -1,5 +1,7 @@
 #pragma once
 #include <kernel/ata/partition.h>
+#include <kernel/block.h>
+#include <kernel/sched.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -34,12 +36,29 @@ enum {
     BMR_CMD_READ = 0x8,
 };
 
+/* physical region descriptor, the bus-master's scatter list */
+typedef struct {
+    uint32_t phys;
+    /* byte count, 0 means 64 KiB */
+    uint16_t size;
+    uint16_t flags;
+} __attribute__((packed)) sPRD;
+
+enum {
+    /* set on the last entry of the table */
+    PRD_LAST = 0x8000,
+    /* one entry can't cross a 64 KiB boundary */
+    PRD_BOUNDARY = 0x10000,
+    /* the table takes one page */
+    PRD_ENTRIES = 512,
+};
+
 static const int CTRL_IRQ_BASE = 14;
 
 typedef struct sATAController sATAController;
 typedef struct sATADevice sATADevice;
 typedef bool (*fReadWrite)(
-    sATADevice* device, uint16_t op, void* buffer, uint32_t lba, size_t secSize, size_t secCount);
+    sATADevice* device, uint16_t op, void* buffer, uint64_t lba, size_t secSize, size_t secCount);
 
 struct sATADevice {
     /* the identifier; 0-3; bit0 set means slave */
@@ -50,6 +69,14 @@ struct sATADevice {
     uint8_t slave_bit;
     /* the sector-size */
     size_t sec_size;
+    /* whether transfers go through the bus-master */
+    uint8_t use_dma;
+    /* whether the 48 bit commands are supported */
+    uint8_t lba48;
+    /* sectors per READ/WRITE MULTIPLE block, 0 if block-mode is off */
+    uint8_t multiple;
+    /* number of addressable sectors */
+    uint64_t sectors;
     /* the ata-controller to which the device belongs */
     sATAController* ctrl;
     /* handler-function for reading / writing */
@@ -59,6 +86,8 @@ struct sATADevice {
     // sATAIdentify info;
     /* the partition-table */
     sPartition part_table[PARTITION_COUNT];
+    /* what filesystems read through, registered once the device is known to work */
+    struct block_device bdev;
 };
 
 struct sATAController {
@@ -67,16 +96,31 @@ struct sATAController {
     uint8_t use_dma;
     /* I/O-ports for the controllers */
     uint16_t port_base;
-    /* I/O-ports for bus-mastering */
+    /* I/O-ports for bus-mastering, 0 without */
     uint16_t bmr_base;
+    /* PRD table for the bus-master */
+    sPRD* prdt;
+    uintptr_t prdt_phys;
     int irq;
-    int irqsem;
+    /* set by the IRQ handler, cleared before every command */
+    volatile int irqsem;
+    /* threads waiting for the controller to settle */
+    struct wait_queue wait;
+    /* held for a whole command, the task file registers are shared by both devices */
+    struct mutex lock;
+    /* set once both devices went through device_init, probing runs in a thread per channel */
+    volatile bool probed;
+    /* threads waiting for probed */
+    struct wait_queue probe_wait;
     sATADevice devices[2];
 };
 
 void ctrl_init();
 
+/* the device right away, it's only filled in once its channel is probed */
 sATADevice* ctrl_get_device(uint8_t id);
+/* the device once its channel is probed, blocks for as long as that takes */
+sATADevice* ctrl_wait_device(uint8_t id);
 
 void ctrl_outb(sATAController* ctrl, uint16_t reg, uint8_t value);
 
@@ -89,6 +133,20 @@ void ctrl_inws(sATAController* ctrl, uint16_t reg, uint16_t* buff, size_t count)
 // out words
 void ctrl_outws(sATAController* ctrl, uint16_t reg, const uint16_t* buff, size_t count);
 
+// bus-master registers, offsets from bmr_base
+void ctrl_bmr_outb(sATAController* ctrl, uint16_t reg, uint8_t value);
+void ctrl_bmr_outl(sATAController* ctrl, uint16_t reg, uint32_t value);
+uint8_t ctrl_bmr_inb(sATAController* ctrl, uint16_t reg);
+
+/**
+ * Waits for the interrupt of the command issued last. Without IRQs this returns right away and the
+ * caller's device_poll does the waiting.
+ *
+ * @param ctrl the controller
+ * @return false if neither the interrupt came nor the device left BSY within IRQ_TIMEOUT
+ */
+bool ctrl_wait_intrpt(sATAController* ctrl);
+
 /**
  * Performs a few io-port-reads (just to waste a bit of time ;))
  *
@@ -5,6 +5,8 @@ enum {
     OP_READ = 0,
     OP_WRITE = 1,
     OP_PACKET = 2,
+    /* write barrier, buffer, lba and count are ignored */
+    OP_FLUSH = 3,
 };
 
 enum {
@@ -14,6 +16,11 @@ enum {
     COMMAND_READ_SEC_EXT = 0x24,
     COMMAND_WRITE_SEC = 0x30,
     COMMAND_WRITE_SEC_EXT = 0x34,
+    COMMAND_READ_MULTIPLE = 0xC4,
+    COMMAND_READ_MULTIPLE_EXT = 0x29,
+    COMMAND_WRITE_MULTIPLE = 0xC5,
+    COMMAND_WRITE_MULTIPLE_EXT = 0x39,
+    COMMAND_SET_MULTIPLE = 0xC6,
     COMMAND_READ_DMA = 0xC8,
     COMMAND_READ_DMA_EXT = 0x25,
     COMMAND_WRITE_DMA = 0xCA,
@@ -21,6 +28,7 @@ enum {
     COMMAND_PACKET = 0xA0,
     COMMAND_ATAPI_RESET = 0x8,
     COMMAND_CACHE_FLUSH = 0xE7,
+    COMMAND_CACHE_FLUSH_EXT = 0xEA,
 };
 
 enum {
@@ -42,6 +50,8 @@ enum {
     ATA_REG_COMMAND = 0x7,
     ATA_REG_STATUS = 0x7,
     ATA_REG_CONTROL = 0x206,
+    /* reads the status without acknowledging an interrupt */
+    ATA_REG_ALT_STATUS = 0x206,
 };
 
 enum {
@@ -71,7 +81,7 @@ enum {
 };
 
 static const int DMA_TRANSFER_TIMEOUT = 3000; /* ms */
-static const int DMA_TRANSFER_SLEEPTIME = 20; /* ms */
+static const int DMA_TRANSFER_SLEEPTIME = 1;  /* ms, recheck interval while nothing wakes the wait */
 
 static const int PIO_TRANSFER_TIMEOUT = 3000; /* ms */
 static const int PIO_TRANSFER_SLEEPTIME = 0;  /* ms */
@@ -81,9 +91,9 @@ static const int ATAPI_TRANSFER_SLEEPTIME = 20; /* ms */
 
 static const int ATAPI_WAIT_TIMEOUT = 5000; /* ms */
 static const int ATA_WAIT_TIMEOUT = 500;    /* ms */
-static const int ATA_WAIT_SLEEPTIME = 20;   /* ms */
+static const int ATA_WAIT_SLEEPTIME = 1;    /* ms, recheck interval while nothing wakes the wait */
 
-static const int IRQ_POLL_INTERVAL = 20; /* ms */
+static const int IRQ_POLL_INTERVAL = 20; /* ms, lost interrupts are caught by rechecking this often */
 static const int IRQ_TIMEOUT = 5000;     /* ms */
 
 /* port-bases */
@@ -102,4 +112,6 @@ static const size_t ATA_SEC_SIZE = 512;
 static const uint8_t DEVICE_LBA = 0x40;
 
 void device_init(sATADevice* device);
+/* sets lba48 and sectors from the IDENTIFY data in info */
+void device_parse_capacity(sATADevice* device);
 bool device_poll(sATADevice* device);
@@ -0,0 +1,60 @@
+#pragma once
+// Buffer cache, one sector per buffer, found by (device, lba). Unreferenced buffers sit on an LRU list and are
+// reused oldest first. Dirty buffers are written back by a flusher thread or by bcache_sync.
+
+#include <kernel/block.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Buffers in the cache, each holds one sector
+#define BCACHE_BUFFERS 256
+// Hash buckets, has to stay a power of two
+#define BCACHE_HASH_SIZE 128
+// How often the flusher looks for dirty buffers, and how long one may stay dirty before it's written
+#define BCACHE_FLUSH_INTERVAL 1000
+#define BCACHE_DIRTY_EXPIRE 2000
+
+enum {
+    BUF_VALID = 1 << 0, ///< data holds the sector
+    BUF_DIRTY = 1 << 1, ///< data is newer than the disk
+    BUF_LOADING = 1 << 2, ///< Someone is reading the sector in
+    BUF_WRITING = 1 << 3, ///< Write-back in flight
+};
+
+struct buf {
+    struct block_device* bdev;
+    uint64_t lba;
+    uint8_t* data;
+    size_t size; ///< Bytes allocated for data
+    volatile uint8_t flags;
+    uint32_t refs;
+    uint32_t dirtied; ///< timer ticks when it became dirty
+    struct buf* hash_next;
+    struct buf* lru_prev; ///< Only linked while refs is 0
+    struct buf* lru_next;
+    struct bio bio; ///< Used for write-back and prefetching
+};
+
+/// Starts the flusher, called once the scheduler runs
+void bcache_init();
+/// Returns the sector with a reference held, read from disk unless it's cached. NULL on I/O errors.
+struct buf* bread(struct block_device* bdev, uint64_t lba);
+/// Starts reading count sectors from lba into the cache without waiting, a later bread finds them cached or
+/// waits for the read in flight. Sectors already cached are skipped, and it gives up rather than evict dirty
+/// buffers.
+void bprefetch(struct block_device* bdev, uint64_t lba, size_t count);
+/// Marks the buffer as changed, it's written back later
+void bdirty(struct buf* b);
+/// Writes the buffer back right away, returns 0 on success
+int bwrite(struct buf* b);
+/// Brings cached copies of count sectors from lba up to date after data was written to the disk around the
+/// cache. Sectors that aren't cached are skipped.
+void bupdate(struct block_device* bdev, uint64_t lba, size_t count, const void* data);
+/// Drops the reference from bread
+void brelse(struct buf* b);
+/// Writes back every dirty buffer of bdev, all devices for NULL, then flushes the device caches. Returns 0 on
+/// success.
+int bcache_sync(struct block_device* bdev);
+/// Counters since boot, a bread of a prefetched sector counts as a hit
+void bcache_stats(uint32_t* hits, uint32_t* misses, uint32_t* prefetches);
@@ -0,0 +1,14 @@
+#pragma once
+// Microbenchmarks, built in with -DKERNEL_BENCH (make bench). Every result is one line on the log consoles,
+// the serial line included:
+//   BENCH <name> ops=<n> us=<total> ns_op=<average> ops_s=<rate> mb_s=<bandwidth>
+// mb_s is 0 for benchmarks that don't move data.
+
+#include <kernel/block.h>
+#include <stdint.h>
+
+// Written to when the suite is done, QEMU's isa-debug-exit device listens here and quits
+#define BENCH_EXIT_PORT 0xF4
+
+/// Runs the whole suite. disk is read from directly, mount_id has to have TEST.TXT in its root.
+void bench_run(struct block_device* disk, uint8_t mount_id);
@@ -0,0 +1,102 @@
+#pragma once
+// Block layer between filesystems and disk drivers. Requests (bios) are queued per device, sorted for
+// C-LOOK, merged with their neighbours and handed to the driver by the device's worker thread.
+
+#include <kernel/sched.h>
+#include <kernel/spinlock.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    BIO_READ = 0,
+    BIO_WRITE = 1,
+    /* write barrier, lba, count and buffer are ignored */
+    BIO_FLUSH = 2,
+};
+
+// Most sectors one merged request hands to the driver
+#define BLOCK_MAX_MERGE 256
+// How long a bio can be passed over by the elevator before it's served out of order
+#define BLOCK_EXPIRE_MS 500
+
+struct bio;
+struct block_device;
+
+typedef void (*bio_end_fn)(struct bio* bio);
+/// Moves count sectors in one command, returns false on failure. Only ever called by one thread at a time.
+typedef bool (*block_transfer_fn)(struct block_device* bdev, int op, void* buffer, uint64_t lba, size_t count);
+/// Starts moving count sectors and returns without waiting, the driver reports the outcome with
+/// block_done(req, ok). Up to depth of these are outstanding. Returns false if it couldn't be started.
+typedef bool (*block_start_fn)(
+    struct block_device* bdev, struct bio* req, int op, void* buffer, uint64_t lba, size_t count);
+/// Called after a batch of start calls, for drivers that hold back telling the device about new requests
+typedef void (*block_commit_fn)(struct block_device* bdev);
+
+struct bio {
+    struct block_device* bdev;
+    int op;
+    uint64_t lba;
+    size_t count; ///< In sectors
+    void* buffer;
+    int error; ///< 0 or -1, valid once end runs
+    bio_end_fn end; ///< Runs when the bio is done, may submit more but mustn't sleep
+    void* private; ///< For whoever submitted it
+    struct bio* next; ///< Queue link
+    uint32_t seq; ///< Submission order, flushes wait for everything before them
+    uint64_t expires; ///< ktime_get_ns deadline
+    // Set on the first bio of a dispatched chain
+    uint8_t* bounce; ///< Buffer the driver was given if the chain's own weren't contiguous
+    size_t total; ///< Sectors in the chain
+};
+
+struct block_device {
+    char name[8];
+    size_t sec_size;
+    uint64_t sectors;
+    block_transfer_fn transfer; ///< Synchronous drivers
+    block_start_fn start; ///< Asynchronous drivers, used instead of transfer when set
+    block_commit_fn commit; ///< Optional, with start
+    unsigned int depth; ///< Requests start may have outstanding, 0 counts as 1
+    void* driver_data;
+    // Queue state, owned by the block layer
+    spinlock_t lock;
+    struct bio* pending; ///< Reads and writes sorted by lba
+    struct bio* flushes; ///< Barriers in submission order
+    struct bio* flushing; ///< Barrier the driver has, nothing submitted after it goes until it's done
+    uint32_t next_seq;
+    uint64_t head; ///< Where the last dispatched request ended, C-LOOK continues from here
+    bool busy; ///< Someone is dispatching
+    volatile unsigned int inflight; ///< Dispatched and not done yet
+    struct wait_queue work; ///< The worker sleeps here while nothing is queued
+    struct wait_queue done; ///< block_rw callers sleep here
+    struct thread* worker;
+    bool synced; ///< Flushed already by the bcache_sync(NULL) pass that's running
+};
+
+/// Fills in a bio for block_submit
+void bio_init(struct bio* bio, struct block_device* bdev, int op, uint64_t lba, size_t count, void* buffer,
+    bio_end_fn end, void* private);
+/// Sets up the queue and starts the worker thread, name, sec_size, sectors and transfer have to be filled in
+void block_register(struct block_device* bdev);
+/// Queues bio and returns right away, completion is reported through bio->end
+void block_submit(struct bio* bio);
+/// Called by asynchronous drivers once the request passed to start is finished, from thread or deferred work
+/// context. The bios' end callbacks run from here.
+void block_done(struct bio* req, bool ok);
+/// Whether a driver is behind bdev
+static inline bool block_ready(const struct block_device* bdev) { return bdev->transfer || bdev->start; }
+/// Submits and waits. Returns 0 on success, -1 on failure.
+int block_rw(struct block_device* bdev, int op, uint64_t lba, size_t count, void* buffer);
+
+static inline int block_read(struct block_device* bdev, uint64_t lba, size_t count, void* buffer)
+{
+    return block_rw(bdev, BIO_READ, lba, count, buffer);
+}
+
+static inline int block_write(struct block_device* bdev, uint64_t lba, size_t count, const void* buffer)
+{
+    return block_rw(bdev, BIO_WRITE, lba, count, (void*)buffer);
+}
+
+static inline int block_flush(struct block_device* bdev) { return block_rw(bdev, BIO_FLUSH, 0, 0, NULL); }
@@ -0,0 +1,34 @@
+#pragma once
+// Boot timeline. Each init stage is timestamped with the TSC into a fixed table on the boot CPU, stages may
+// nest. boot_trace_print goes through the consoles, the serial line included, once boot is done.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Stages kept at most, later ones aren't recorded
+#define BOOT_TRACE_MAX 64
+
+struct boot_stage {
+    const char* name;
+    uint64_t start; ///< TSC when the stage began
+    uint64_t end; ///< TSC when it ended, 0 while it runs
+    uint8_t depth; ///< Stages still running around it when it began
+};
+
+/// Starts timing a stage, name has to stay valid. Returns the handle for boot_trace_end, -1 once the table is
+/// full or without a TSC.
+int boot_trace_begin(const char* name);
+void boot_trace_end(int stage);
+/// Copies up to max recorded stages in the order they began, returns how many it copied
+size_t boot_trace_get(struct boot_stage* out, size_t max);
+/// Prints the timeline in boot order and then the stages sorted by how long they took, slowest first.
+/// Converts with the calibrated TSC rate, so only after timer_init.
+void boot_trace_print();
+
+/// Times stmt as a stage called name
+#define BOOT_TRACE(name, stmt)                                                                                         \
+    do {                                                                                                               \
+        int boot_stage_ = boot_trace_begin(name);                                                                      \
+        stmt;                                                                                                          \
+        boot_trace_end(boot_stage_);                                                                                   \
+    } while (0)
@@ -1,5 +1,8 @@
 #pragma once
 
+// Upper bound for per-CPU data
+#define MAX_CPUS 8
+
 // Vendor strings from CPUs.
 #define CPUID_VENDOR_AMD "AuthenticAMD"
 #define CPUID_VENDOR_AMD_OLD "AMDisbetter!" // Early engineering samples of AMD K5 processor
@@ -44,3 +47,18 @@ typedef struct {
  */
 int cpu_print_model(void);
 int cpu_check_apic(void);
+/// 4 MiB pages through CR4.PSE
+int cpu_check_pse(void);
+/// Global pages through CR4.PGE
+int cpu_check_pge(void);
+int cpu_check_tsc(void);
+/// TSC ticks at a constant rate through P-states and halts, so it can be used as a clock
+int cpu_check_invariant_tsc(void);
+/// SSE2 along with FXSR, which CR4.OSFXSR needs
+int cpu_check_sse2(void);
+/// Enhanced rep movsb/stosb
+int cpu_check_erms(void);
+/// Turns on the optional features we use and picks the matching mem* routines in libc
+void cpu_init_features(void);
+/// Index of the CPU we are running on, below MAX_CPUS
+unsigned int cpu_id(void);
@@ -0,0 +1,24 @@
+#pragma once
+// Physically contiguous buffers for bus-master devices
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Carved out of the DMA zone at boot so long contiguous runs are still there once memory fragments
+#define DMA_POOL_SIZE (1024 * 1024)
+
+/// Reserves the DMA pool, called once from pmm_init
+void dma_init();
+
+/**
+ * @brief Allocates a physically contiguous, zeroed buffer below 16 MiB.
+ *
+ * @param size Bytes needed, rounded up to whole pages
+ * @param align Physical alignment, a power of two. Anything below PAGE_SIZE means page aligned.
+ * @param boundary The buffer won't cross a multiple of this, a power of two or 0 for no limit
+ * @param phys Receives the physical address for the device
+ * @return Kernel virtual address of the buffer, or NULL on failure
+ */
+void* dma_alloc(size_t size, size_t align, size_t boundary, uintptr_t* phys);
+/// Frees a buffer from dma_alloc, size has to match the allocation
+void dma_free(void* virt, size_t size);
@@ -0,0 +1,18 @@
+#pragma once
+// Text console on the linear framebuffer GRUB sets up for us
+
+#include <kernel/multiboot.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Copies the framebuffer description out of the multiboot info. Has to run before init_memory drops the
+/// identity mapping mbd is reachable through. Returns -1 if there is no 32 bpp RGB framebuffer.
+int fbcon_probe(multiboot_info_t* mbd);
+/// Maps the framebuffer and allocates the cell buffers, needs the heap. Returns 0 once the console is live.
+int fbcon_init();
+bool fbcon_active();
+/// Queues a character with a VGA attribute byte, nothing is drawn until fbcon_flush
+void fbcon_put(char c, uint8_t color);
+/// Draws every cell that changed since the last flush
+void fbcon_flush();
@@ -0,0 +1,10 @@
+#pragma once
+// Built in console font
+
+#include <stdint.h>
+
+#define FONT_WIDTH 8
+#define FONT_HEIGHT 8
+#define FONT_GLYPHS 128
+
+extern const uint8_t font8x8[FONT_GLYPHS][FONT_HEIGHT];
@@ -0,0 +1,43 @@
+#pragma once
+// Lazy FPU and SSE state for kernel threads. CR0.TS stays set while the running thread's registers aren't
+// loaded, so its first FPU or SSE instruction traps with #NM and the handler loads them. A thread that used
+// them has them saved when it's switched out and can carry on from any CPU, if nobody else touched the
+// registers meanwhile they're still there and aren't reloaded. Threads that never use the FPU cost the
+// scheduler a single test. Vector code outside such a thread's own context, memcpy and interrupt handlers
+// included, goes between kernel_fpu_begin and kernel_fpu_end.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Sections inside a section, like a page fault zeroing a frame in the middle of a memcpy
+#define FPU_NEST_MAX 2
+
+struct thread;
+
+/// What FXSAVE writes
+struct fpu_state {
+    uint8_t area[512];
+} __attribute__((aligned(16)));
+
+/// Enables lazy switching once cpu_init_features turned SSE on, needs the slab allocator and the scheduler.
+/// Does nothing on CPUs without FXSR and SSE2, the FPU is simply never used there.
+void fpu_init();
+/// Same for an AP, after fpu_init ran on the boot CPU
+void fpu_init_cpu();
+/// Saves prev's registers if it used them, the scheduler calls this before switching away while
+/// this_cpu()->fpu_live is set
+void fpu_switch_out(struct thread* prev);
+/// Frees whatever a dead thread kept
+void fpu_release(struct thread* t);
+
+/// Makes the registers usable for vector code until kernel_fpu_end, keeping the running thread's state and
+/// any section this one interrupted safe. Interrupts and preemption stay off in between, so sections should
+/// stay short and must not sleep.
+void kernel_fpu_begin();
+void kernel_fpu_end();
+/// Whether this CPU is inside a section, faults that would have to sleep are refused then
+bool kernel_fpu_active();
+/// Whether a section may touch [addr, addr + len). Only the direct map is sure never to fault into a file
+/// and wait for the disk.
+bool kernel_fpu_range_ok(const void* addr, size_t len);
@@ -0,0 +1,42 @@
+#pragma once
+// Directory entry cache, hashed by (filesystem, parent directory, name). Filesystems fill a directory in one
+// pass and mark it complete, a miss in a complete directory is answered without touching the disk. Names
+// compare case-insensitively, like FAT's. Entries are evicted least recently used first, which makes their
+// directory incomplete again.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Cached names, positive and negative, across all filesystems
+#define DCACHE_MAX_ENTRIES 1024
+// Hash buckets, has to stay a power of two
+#define DCACHE_HASH_SIZE 256
+// Longest name an entry holds
+#define DCACHE_NAME_MAX 255
+
+/// What a filesystem keeps about a name, copied out on lookups
+struct dcache_entry {
+    uint32_t ino; ///< The filesystem's own id for it, the first cluster for FAT
+    uint32_t size;
+    uint8_t attrib;
+    uint32_t loc; ///< Where the filesystem keeps the entry itself, the sector for FAT
+    uint16_t loc_offset; ///< And the byte offset in it
+};
+
+void dcache_init();
+/// Looks name up in directory parent of filesystem sb. Returns 1 and fills *out if it exists, 0 if it's known
+/// not to, -1 if the cache can't tell.
+int dcache_lookup(const void* sb, uint32_t parent, const char* name, struct dcache_entry* out);
+/// Caches name, replacing whatever was cached for it
+void dcache_add(const void* sb, uint32_t parent, const char* name, const struct dcache_entry* entry);
+/// Remembers that name doesn't exist in parent
+void dcache_add_negative(const void* sb, uint32_t parent, const char* name);
+/// Starts filling parent, the token goes to dcache_fill_end
+uint32_t dcache_fill_begin(const void* sb, uint32_t parent);
+/// Marks parent complete unless some of its entries were evicted since dcache_fill_begin
+void dcache_fill_end(const void* sb, uint32_t parent, uint32_t token);
+/// Drops everything cached for parent, for when it changes on disk
+void dcache_invalidate_dir(const void* sb, uint32_t parent);
+/// Counters since boot, answers from complete directories count as hits
+void dcache_stats(uint32_t* hits, uint32_t* misses);
@@ -77,25 +77,75 @@ typedef struct fat_filetable_s {
     uint32_t size;      //!< Size of file
 } __attribute__((packed)) fat_filetable_t;
 
-// TODO: Resize these fields
+// FAT32 tables are cached this many sectors at a time, FAT12/16 ones are small enough to keep whole
+#define FAT_WINDOW_SECTORS 32
+
+/* what fat_entry makes of a table entry that doesn't point at another cluster */
+enum {
+    FAT_CHAIN_END = 0xFFFFFFFF, /* last cluster of the file */
+    FAT_CHAIN_BAD = 0xFFFFFFFE, /* free, bad or out of range, the chain is broken */
+};
+
+/* written to mark the last cluster of a chain, cut down to the width of the table's entries */
+#define FAT_EOC 0x0FFFFFFF
+
+/* FAT32 FSInfo sector, the counts are hints and 0xFFFFFFFF when unknown */
+enum {
+    FSINFO_LEAD_SIG = 0x41615252,  /* at 0 */
+    FSINFO_STRUCT_SIG = 0x61417272, /* at 484 */
+    FSINFO_FREE_COUNT = 488,
+    FSINFO_NEXT_FREE = 492,
+};
+
+/* directory entry attributes */
+enum {
+    FAT_ATTR_VOLUME_ID = 0x08,
+    FAT_ATTR_DIRECTORY = 0x10,
+    FAT_ATTR_LFN = 0x0F,
+};
+
+// Sector numbers are relative to lba_start
 struct fat_fs {
     uint32_t lba_start;
-    uint16_t total_sectors;
+    uint32_t total_sectors;
     uint16_t sector_size;
-    uint16_t fat_size;
-    uint16_t root_dir_sectors;
-    uint16_t first_root_dir_sector;
-    uint16_t first_data_sector;
-    uint16_t data_sectors;
-    uint16_t first_fat_sector;
-    uint16_t total_clusters;
+    uint8_t sectors_per_cluster;
+    uint32_t fat_size;
+    uint32_t root_dir_sectors;
+    uint32_t first_root_dir_sector;
+    uint32_t first_data_sector;
+    uint32_t data_sectors;
+    uint32_t first_fat_sector;
+    uint32_t total_clusters;
+    /* FAT32 only, FAT12/16 keep the root directory in a fixed area */
+    uint32_t root_cluster;
     uint8_t fat_type;
     sATADevice* device;
+    /* cached FAT sectors, the whole table unless it's FAT32 */
+    uint8_t* table;
+    uint32_t table_start;
+    uint32_t table_sectors;
+    /* held while looking at the cache, a FAT32 window may be reloaded under it */
+    struct mutex table_lock;
+    uint8_t table_count;
+    /* one bit per cluster, set while it's in use. Clusters 0 and 1 and the bits past the last one are set. */
+    uint32_t* used_map;
+    uint32_t free_clusters;
+    /* where allocations start looking, the FSInfo next free hint on FAT32 */
+    uint32_t next_free;
+    /* relative sector of the FAT32 FSInfo, 0 if there's none */
+    uint32_t fsinfo_sector;
+    /* held while clusters are allocated or freed and while files change size */
+    struct mutex alloc_lock;
+    /* woken whenever a bio of one of the volume's batches finishes */
+    struct wait_queue io_wait;
 };
 
 typedef struct fat_filetable_s fat_filetable;
 
-void init_fat(sATADevice* device, uint32_t lba_start);
-int fat_open_file(const inode_t* inode, char* buffer, size_t buffer_size);
+void* init_fat(sATADevice* device, uint32_t lba_start);
+int fat_open_file(const inode_t* inode, uint32_t offset, char* buffer, size_t len, struct readahead* ra);
+int fat_write_file(inode_t* inode, uint32_t offset, const char* buffer, size_t len, struct readahead* ra);
+int fat_truncate(inode_t* inode, uint32_t size, struct readahead* ra);
 void fat_close_file(void* file_start);
 int fat_find_inode(inode_t* inode);
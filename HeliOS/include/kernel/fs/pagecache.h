@@ -0,0 +1,48 @@
+#pragma once
+// Page cache, file data in 4 KiB pages found by (inode, page index). Pages are filled through the filesystem,
+// which reads whole clusters straight into them and anything smaller through the buffer cache. Unreferenced
+// pages sit on an LRU list and are reused oldest first. vfs_read copies out of them, vfs_mmap maps them.
+
+#include <kernel/fs/readahead.h>
+#include <kernel/fs/vfs.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Pages the cache may hold at once
+#define PCACHE_PAGES 256
+// Hash buckets, has to stay a power of two
+#define PCACHE_HASH_SIZE 128
+
+enum {
+    PAGE_VALID = 1 << 0, ///< data holds the file's contents, zeroed past its end
+    PAGE_LOADING = 1 << 1, ///< Someone is reading the page in
+};
+
+struct cached_page {
+    inode_t* inode;
+    uint32_t index; ///< Offset in the file in pages
+    uint8_t* data; ///< A frame of its own in the direct map, allocated on first use
+    volatile uint8_t flags;
+    uint32_t refs;
+    struct cached_page* hash_next;
+    struct cached_page* lru_prev; ///< Only linked while refs is 0
+    struct cached_page* lru_next;
+};
+
+void pcache_init();
+/// Returns page index of inode with a reference held, read in unless it's cached. ra is the reader's
+/// read-ahead state. NULL on I/O errors or when every page is referenced.
+struct cached_page* pcache_get(inode_t* inode, uint32_t index, struct readahead* ra);
+/// Like pcache_get but never reads, NULL unless the page is cached already
+struct cached_page* pcache_find(inode_t* inode, uint32_t index);
+/// Whether the page is cached right now, without taking a reference or counting a hit
+bool pcache_cached(const inode_t* inode, uint32_t index);
+/// Drops the reference from pcache_get or pcache_find
+void pcache_put(struct cached_page* page);
+/// Copies len bytes of data written at offset of inode into whatever pages of it are cached, zeroes for a NULL
+/// data. Called after the filesystem wrote them so readers and mappings see the file as it is on disk.
+void pcache_update(inode_t* inode, uint32_t offset, const void* data, size_t len);
+/// Forgets every page of inode, none of them may be referenced anymore. Called before the inode is freed.
+void pcache_drop_inode(inode_t* inode);
+/// Counters since boot
+void pcache_stats(uint32_t* hits, uint32_t* misses);
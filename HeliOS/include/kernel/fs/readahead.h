@@ -0,0 +1,26 @@
+#pragma once
+// Per open file read-ahead. Units are whatever the filesystem reads in, clusters for FAT. Sequential access
+// grows the window, anything else shrinks it again.
+
+#include <stdint.h>
+
+// Window on the first sequential hit, it doubles from there up to the file's maximum
+#define RA_MIN_WINDOW 1
+// Filesystems size max_window so a full window stays around this many sectors, a slice of the buffer cache
+#define RA_MAX_SECTORS 64
+
+struct readahead {
+    uint32_t next; ///< Unit a sequential reader asks for next
+    uint32_t window; ///< Units kept prefetched past the current one, 0 while access looks random
+    uint32_t ahead; ///< First unit not prefetched yet
+    uint32_t max_window; ///< Set by the filesystem, 0 turns read-ahead off
+    // Where the filesystem's last read ended, so the next one doesn't have to find its place from the start
+    uint32_t cursor_unit;
+    uint32_t cursor; ///< The filesystem's own handle for cursor_unit, a cluster for FAT. 0 if there's none.
+    uint32_t cursor_gen; ///< The file's generation when the cursor was set, it's stale once that moves on
+};
+
+void ra_init(struct readahead* ra, uint32_t max_window);
+/// Records a read of unit in a file of limit units. Returns how many units to prefetch starting at *start,
+/// 0 if everything the window wants is already on its way.
+uint32_t ra_access(struct readahead* ra, uint32_t unit, uint32_t limit, uint32_t* start);
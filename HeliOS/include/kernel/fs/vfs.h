@@ -1,6 +1,7 @@
 #pragma once
 #include <kernel/ata/device.h>
 #include <kernel/ata/partition.h>
+#include <kernel/fs/readahead.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -29,39 +30,92 @@ struct mount {
     sATADevice* device;
     sPartition* partition;
     filesystem_t* filesystem;
+    void* fs_private; // The filesystem's state for this volume, from fs_init. NULL until it's set up.
 };
 typedef struct mount mount_t;
 
 // NOTE: This is not the same as linux inode because I am stupid and don't understand it. I am just stealing the name.
 // TODO: I need to store sector information or some way for the fs to find the file immediately.
 typedef struct inode_s {
-    int id;               // inode id in cache
+    int id;               // inode id in cache, -1 if it isn't cached
     mount_t* mount;       // Top level device information
-    dir_t* dir;           // File location and name
+    dir_t* dir;           // File location and name, only valid while the filesystem looks the file up
     uint32_t init_sector; // Initial sector of the filesystem
+    uint32_t first_cluster; // Where the filesystem's chain for the file starts, 0 while it has none
+    uint32_t parent;      // The filesystem's id for the directory holding the file
+    uint32_t entry_sector; // Where the filesystem's directory entry for the file is
+    uint16_t entry_offset;
     size_t f_size;        // File size
+    uint32_t generation;  // Bumped whenever the file loses clusters, so positions remembered before are dropped
+    // Cache bookkeeping, owned by the vfs
+    char* key;                // Full path the inode is cached under
+    uint32_t hash;            // Of mount id and key
+    struct inode_s* hash_next;
+    struct inode_s* lru_prev; // Unreferenced inodes only, most recently used at the head
+    struct inode_s* lru_next;
+    uint32_t refs;            // Open files using the inode
 } inode_t;
 
 typedef struct {
-    void* file_ptr;
-    unsigned char* read_ptr;
+    inode_t* inode; // Referenced until the file is closed
+    uint32_t pos;   // Where vfs_read continues
     size_t file_size;
+    struct readahead ra;
 } FILE;
 
-// TODO: flesh out arguments
-typedef int (*f_read)(const inode_t* inode, char* buffer, size_t buffer_size);
-typedef void (*f_init)(sATADevice* device, uint32_t lba_start);
+enum {
+    VFS_SEEK_SET,
+    VFS_SEEK_CUR,
+    VFS_SEEK_END,
+};
+
+/// Reads up to len bytes starting at offset into buffer. Returns how many it read, fewer only at the end of the
+/// file, or -1 on errors. ra is the open file's read-ahead state.
+typedef int (*f_read)(const inode_t* inode, uint32_t offset, char* buffer, size_t len, struct readahead* ra);
+/// Writes len bytes starting at offset, growing the file as needed and filling any gap with zeroes. Returns len
+/// or -1 on errors.
+typedef int (*f_write)(inode_t* inode, uint32_t offset, const char* buffer, size_t len, struct readahead* ra);
+/// Cuts the file down to size or grows it with zeroes, returns 0 on success
+typedef int (*f_truncate)(inode_t* inode, uint32_t size, struct readahead* ra);
+/// Sets up the volume at lba_start and returns the filesystem's state for it, which each callback finds again
+/// through inode->mount->fs_private. NULL if the volume can't be used.
+typedef void* (*f_init)(sATADevice* device, uint32_t lba_start);
 
 struct filesystem_s {
     uint8_t id;
     uint8_t fs_type;
     f_init fs_init;
     f_read read_handler; // Reads inode
+    f_write write_handler;
+    f_truncate truncate;
     int (*find_inode)(inode_t* inode);
 };
 
 void vfs_init(uint8_t maximum_filesystems, uint8_t maximum_mounts, size_t inode_cache_size);
 bool register_fs(uint8_t fs);
+/// Opens a file without reading any of it, NULL if it doesn't exist
 FILE* vfs_open(dir_t* directory);
 void vfs_close(FILE* file);
+/// Reads up to len bytes at the file's position and moves past them. Returns the number read, 0 at the end of
+/// the file, -1 on errors.
+int vfs_read(FILE* file, void* buffer, size_t len);
+/// Like vfs_read at offset, the file's position stays where it is
+int vfs_pread(FILE* file, void* buffer, size_t len, uint32_t offset);
+/// Writes len bytes at the file's position and moves past them. Returns len or -1 on errors.
+int vfs_write(FILE* file, const void* buffer, size_t len);
+/// Like vfs_write at offset, the file's position stays where it is
+int vfs_pwrite(FILE* file, const void* buffer, size_t len, uint32_t offset);
+/// Cuts the file down to size or grows it with zeroes. Returns 0 on success.
+int vfs_truncate(FILE* file, uint32_t size);
+/// Moves the position relative to whence, one of VFS_SEEK_*. Returns the new position or -1 if it would end up
+/// outside the file.
+int32_t vfs_seek(FILE* file, int32_t offset, int whence);
+/// Maps len bytes of the file starting at offset, which has to be page aligned, read-only into kernel space.
+/// Pages are shared with the page cache and read in as they're touched, past the end of the file they read
+/// as zeroes up to the next page. The mapping stays valid after the file is closed. NULL on failure.
+void* vfs_mmap(FILE* file, uint32_t offset, size_t len);
+/// Removes a mapping made by vfs_mmap
+void vfs_munmap(void* addr);
+/// Inode cache counters since boot
+void vfs_inode_stats(uint32_t* hits, uint32_t* misses);
 int mount(uint8_t id, sATADevice* device, sPartition* partition, uint8_t fs_type);
@@ -2,9 +2,24 @@
 #define _GDT_H
 
 #include <stddef.h>
+#include <stdint.h>
 
-void gdt_set_gate(int index, unsigned long base, unsigned long limit, unsigned char access, unsigned char gran);
+/* Every CPU gets its own GDT with the same layout, so the
+ *  selectors are the same everywhere and only the per-CPU
+ *  segment and the TSS point somewhere different */
+#define GDT_ENTRIES 5
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_PERCPU 0x18 /* Loaded into %gs, based at the CPU's struct cpu */
+#define GDT_TSS 0x20
+
+struct cpu;
+
+void gdt_set_gate(unsigned int cpu, int index, unsigned long base, unsigned long limit, unsigned char access,
+    unsigned char gran);
 void gdt_init();
+/// Builds and loads the GDT and TSS for cpu on the CPU this runs on, then points %gs at it
+void gdt_init_cpu(struct cpu* cpu);
 
 /* Defines a GDT entry. We say packed, because it prevents the
  *  compiler from doing things that it thinks is best: Prevent
@@ -25,4 +40,18 @@ struct gdt_ptr {
         unsigned int base;
 } __attribute__((packed));
 
+/* Hardware task state. We never switch tasks with it, it only
+ *  holds the stack the CPU switches to when coming from ring 3 */
+struct tss {
+        uint32_t prev_tss;
+        uint32_t esp0, ss0;
+        uint32_t esp1, ss1;
+        uint32_t esp2, ss2;
+        uint32_t cr3, eip, eflags;
+        uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+        uint32_t es, cs, ss, ds, fs, gs;
+        uint32_t ldt;
+        uint16_t trap, iomap_base;
+} __attribute__((packed));
+
 #endif /* _GDT_H */
@@ -1,6 +1,16 @@
 #pragma once
 #include <kernel/sys.h>
 #include <stdint.h>
+
+// IRQ n arrives on vector IRQ_VECTOR_BASE + n. 0-15 are the ISA lines, with the IOAPIC every other GSI below
+// IRQ_GSI_MAX keeps its own number, irq_alloc hands out the rest up to IRQ_LOCAL_BASE for MSIs and the local
+// APIC's own sources sit at the top. Vector 255 is the spurious vector and never reaches irq_handler.
+#define IRQ_VECTOR_BASE 32
+#define IRQ_COUNT (255 - IRQ_VECTOR_BASE)
+#define IRQ_GSI_MAX 48
+#define IRQ_LOCAL_BASE (0xF0 - IRQ_VECTOR_BASE)
+#define IRQ_VECTOR(irq) (IRQ_VECTOR_BASE + (irq))
+
 /* This defines what the stack looks like after an ISR was running */
 struct irq_regs {
     unsigned int gs, fs, es, ds; /* pushed the segs last */
@@ -39,3 +49,13 @@ void irq_init();
 void irq_remap(void);
 void irq_uninstall_handler(int irq);
 void irq_install_handler(int irq, void (*handler)(struct irq_regs* r));
+/// Switches from the 8259s to the IOAPIC when the MADT has one, needs acpi_init first
+void irq_init_apic();
+/// True once interrupts are routed through the IOAPIC and acknowledged at the local APIC
+int irq_using_apic();
+void irq_mask(int irq);
+void irq_unmask(int irq);
+/// Installs handler on a free irq past the GSIs, for MSIs. Returns the irq or -1 if none are left.
+int irq_alloc(void (*handler)(struct irq_regs* r));
+/// Delivers an IOAPIC routed irq to the CPU with the given local APIC ID. Returns -1 if it can't be moved.
+int irq_set_affinity(int irq, uint8_t apic_id);
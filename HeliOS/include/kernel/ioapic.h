@@ -0,0 +1,15 @@
+#pragma once
+// IOAPIC redirection of GSIs to IRQ vectors
+
+#include <kernel/acpi.h>
+#include <stdint.h>
+
+/// Maps every IOAPIC in the MADT and points ISA IRQs (after overrides) and the remaining GSIs at their
+/// irq numbers, all masked. Returns -1 if none could be set up.
+int ioapic_init(const struct acpi_madt_info* madt);
+/// True if irq comes in through an IOAPIC pin
+int ioapic_routed(int irq);
+void ioapic_mask(int irq);
+void ioapic_unmask(int irq);
+/// Sends irq to the local APIC with the given ID
+int ioapic_set_dest(int irq, uint8_t apic_id);
@@ -0,0 +1,32 @@
+#pragma once
+// Per-vector interrupt counts and latency histograms, in ktime_get_cycles units
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define IRQ_STAT_VECTORS 256
+#define IRQ_STAT_BUCKETS 20
+// Bucket b counts durations from 2^(b + IRQ_STAT_MIN_SHIFT) cycles up to the next power of two, the
+// first and last buckets also take everything below and above
+#define IRQ_STAT_MIN_SHIFT 8
+
+struct irq_stat {
+    uint32_t count;
+    uint64_t handler_cycles; ///< Total spent in the handler
+    uint32_t handler_max;
+    uint64_t eoi_cycles; ///< Total from entering the C handler to the EOI, what the line sees as busy
+    uint32_t eoi_max;
+    uint32_t handler_hist[IRQ_STAT_BUCKETS];
+    uint32_t eoi_hist[IRQ_STAT_BUCKETS];
+};
+
+/// Called by irq_handler and fault_handler, eoi is handler for exceptions since they have none
+void irq_stat_record(uint8_t vector, uint64_t handler, uint64_t eoi);
+/// One vector's numbers summed over every CPU. Only this CPU's share is guaranteed consistent, the others
+/// may be mid update. Returns false if it never fired.
+bool irq_stat_get(uint8_t vector, struct irq_stat* out);
+/// Upper bound in cycles for the pct'th percentile of a histogram
+uint64_t irq_stat_percentile(const uint32_t* hist, uint32_t count, uint32_t pct);
+void irq_stat_reset();
+/// Prints every vector that fired with count, average, p99 and max in microseconds
+void irq_stat_print();
@@ -0,0 +1,53 @@
+#pragma once
+// dmesg style kernel log, messages land in a ring buffer and reach the consoles later from idle
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KLOG_ERR 0
+#define KLOG_WARN 1
+#define KLOG_INFO 2
+#define KLOG_DEBUG 3
+
+// Ring size in records, has to stay a power of two
+#define KLOG_RECORDS 256
+// Longest message kept per record, anything past it is cut off
+#define KLOG_TEXT_SIZE 116
+// Console backends flushed to, the VGA tty included
+#define KLOG_MAX_CONSOLES 4
+
+struct klog_record {
+    volatile uint32_t seq; ///< Sequence number once the record is complete
+    uint32_t ticks; ///< Timer ticks (ms) when it was logged
+    uint8_t level;
+    uint8_t len;
+    char text[KLOG_TEXT_SIZE];
+};
+
+typedef void (*klog_console_t)(const char* data, size_t len);
+
+/// Messages above this level are dropped before any formatting happens
+extern int klog_level;
+
+#define klog(level, ...)                                                                                               \
+    do {                                                                                                               \
+        if ((level) <= klog_level) klog_write(level, __VA_ARGS__);                                                     \
+    } while (0)
+
+#define klog_err(...) klog(KLOG_ERR, __VA_ARGS__)
+#define klog_warn(...) klog(KLOG_WARN, __VA_ARGS__)
+#define klog_info(...) klog(KLOG_INFO, __VA_ARGS__)
+#define klog_debug(...) klog(KLOG_DEBUG, __VA_ARGS__)
+
+/// Registers the tty console and routes kprintf into the log
+void klog_init();
+/// Formats a message into the ring, safe from interrupt handlers. Use the klog macro so filtered levels cost nothing.
+void klog_write(int level, const char* format, ...);
+void klog_vwrite(int level, const char* format, va_list args);
+/// Adds an output the ring gets drained into, returns -1 when all slots are taken
+int klog_add_console(klog_console_t console);
+/// Drains pending records to every console. Called from idle, does nothing if another flush is running.
+void klog_flush();
+/// Number of records overwritten before they could be flushed
+uint32_t klog_dropped();
@@ -0,0 +1,17 @@
+#pragma once
+// High resolution time from the TSC, falls back to the timer clock when the TSC can't be trusted
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Calibrates the TSC against the PIT, called from timer_init
+void ktime_init();
+/// Nanoseconds since boot
+uint64_t ktime_get_ns();
+/// Raw TSC value for cheap interval measurements, convert differences with ktime_cycles_to_ns
+uint64_t ktime_get_cycles();
+uint64_t ktime_cycles_to_ns(uint64_t cycles);
+/// Calibrated TSC rate, 0 without a TSC
+uint32_t ktime_tsc_khz();
+/// True when ktime_get_ns runs off an invariant TSC
+bool ktime_tsc_stable();
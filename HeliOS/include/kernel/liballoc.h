@@ -61,6 +61,32 @@ extern void* liballoc_alloc(size_t);
  */
 extern int liballoc_free(void*, size_t);
 
+#define LIBALLOC_HIST_BUCKETS 16 ///< Request sizes up to 2^0 .. 2^14 bytes, the last bucket takes the rest
+#define LIBALLOC_SITES 64 ///< Allocation sites tracked, has to stay a power of two
+
+/// Live allocations charged to one caller of malloc, calloc or realloc
+struct liballoc_site {
+    void* site; ///< Return address of the call
+    unsigned int allocs; ///< Allocations made from here so far
+    unsigned int live_bytes; ///< Bytes, headers included, that haven't been freed yet
+};
+
+struct liballoc_stats {
+    unsigned long long allocated; ///< Bytes taken from the system through liballoc_alloc
+    unsigned long long inuse; ///< Bytes handed out by malloc
+    long long warnings;
+    long long errors;
+    long long possible_overruns;
+    unsigned int histogram[LIBALLOC_HIST_BUCKETS]; ///< Requests per power of two size
+};
+
+/// Copies the heap counters
+extern void liballoc_get_stats(struct liballoc_stats* stats);
+/// Fills out with up to n allocation sites, most live bytes first. Returns how many were written.
+extern size_t liballoc_top_sites(struct liballoc_site* out, size_t n);
+/// Prints the heap counters, the size histogram and the top_n allocation sites
+extern void liballoc_print_stats(size_t top_n);
+
 extern void* PREFIX(malloc)(size_t); ///< The standard function.
 extern void* PREFIX(realloc)(void*, size_t); ///< The standard function.
 extern void* PREFIX(calloc)(size_t, size_t); ///< The standard function.
@@ -2,11 +2,35 @@
 // Contains Physical Memory Manager
 
 #include <kernel/interrupts.h>
+#include <kernel/multiboot.h>
+#include <kernel/sys.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #define PAGE_SIZE 4096
 
+#define PAGE_FLAG_PRESENT (1 << 0)
+#define PAGE_FLAG_WRITE   (1 << 1)
+#define PAGE_FLAG_USER    (1 << 2)
+#define PAGE_FLAG_WRITETHROUGH (1 << 3)
+#define PAGE_FLAG_NOCACHE (1 << 4) // Needed for MMIO registers
+#define PAGE_FLAG_HUGE    (1 << 7) // PDE maps a 4 MiB page directly, needs CR4.PSE
+#define PAGE_FLAG_GLOBAL  (1 << 8) // Not flushed on CR3 reloads, needs CR4.PGE
+#define PAGE_FLAG_COW     (1 << 9) // Available to the OS, marks a read-only PTE sharing its frame copy-on-write
+
+// First directory slot of the higher half
+#define KERNEL_PD_START 768
+// Directory slot that points back at the directory itself
+#define RECURSIVE_PD_SLOT 1023
+
+// The first 896 MiB of physical memory is mapped at KERNEL_OFFSET, frames past that can't be handed out as
+// kernel virtual addresses.
+#define DIRECT_MAP_SIZE (896 * 1024 * 1024)
+// What's left of the higher half up to the recursive window holds vmalloc mappings
+#define VMALLOC_START (KERNEL_OFFSET + DIRECT_MAP_SIZE)
+#define VMALLOC_END   ((uintptr_t)RECURSIVE_PD_SLOT << 22)
+
 #if 0
 typedef struct page {
     uint32_t present : 1;
@@ -28,7 +52,9 @@ typedef struct page_table {
 typedef struct page_dir {
     // Physical location of each table, this is what the processor looks at
     uintptr_t physical_tables[1024] __attribute__((aligned(4096)));
-    page_table_t* tables[1024]; // How i represent page tables, processor should peak at this
+    // How i represent page tables, processor should peak at this. NULL for slots mapped with 4 MiB pages and
+    // for tables that haven't been created yet.
+    page_table_t* tables[1024];
     uintptr_t physical_addr; // Physical address where this is stored
 } page_dir_t;
 
@@ -38,17 +64,74 @@ enum PMM_ERROR_CODE {
     OVERLAP = (1 << 1), // Allocating multiple frames leads to overlaping memory regions
     IA_DIFF = (1 << 2), // Allocating before and after test resulted in different frames
     RUN_DIFF = (1 << 3), // Allocating differed between both runs
+    LARGE_RUN = (1 << 4), // Runs larger than a bitmap word failed to allocate or weren't marked used
+    FREE_DIFF = (1 << 5), // Free frame count differed after freeing everything
+};
+
+// Largest buddy block is 2^PMM_MAX_ORDER frames
+#define PMM_MAX_ORDER 20
+
+/// Physical memory zones, each has its own free lists
+enum PMM_ZONE {
+    ZONE_DMA = 0, // Below 16 MiB, reachable by ISA DMA
+    ZONE_NORMAL = 1, // Rest of the direct map at KERNEL_OFFSET
+    ZONE_HIGH = 2, // Above the direct map, only usable through physical addresses
+    PMM_NUM_ZONES,
 };
 
-void init_memory(uint32_t mem_high, uint32_t phys_alloc_start);
-void pmm_init(uint32_t mem_high);
+extern page_dir_t* kernel_page_dir;
+
+typedef struct pmm_stats {
+    size_t present_frames; // Usable frames the memory map reported
+    size_t free_frames;    // In the free lists and the single frame pool
+    size_t used_frames;    // Handed out and not freed yet
+    size_t failed_allocs;  // Requests that couldn't be satisfied
+    size_t zone_present[PMM_NUM_ZONES];
+    size_t zone_free[PMM_NUM_ZONES];
+    size_t free_blocks[PMM_MAX_ORDER + 1]; // Free blocks of each order, all zones together
+} pmm_stats_t;
+
+void init_memory(multiboot_info_t* mbd, uint32_t phys_alloc_start);
+/// Builds the free map from the multiboot memory map, mbd has to be readable through the higher half
+void pmm_init(multiboot_info_t* mbd);
 void invalidate(uint32_t vaddr);
 void reload_cr3();
+/// Drops every TLB entry, global ones included
+void flush_tlb_all();
+/// Returns the physical address vaddr is mapped to, or 0 if it isn't mapped
 uintptr_t get_physaddr(uintptr_t virtualaddr);
-uint32_t find_frames(size_t num_frames);
+/// Returns the page table covering vaddr, creating an empty one if create is set. Returns NULL for
+/// 4 MiB mappings, the recursive slot, or when there's no table and none could be created.
+page_table_t* get_page_table(uintptr_t vaddr, bool create);
+/// Allocates num_frames physically contiguous frames from the normal zone, falling back to DMA.
+/// Returns the kernel virtual address of the first frame, or 0 on failure.
 uintptr_t kalloc_frames(size_t num_frames);
+/// Same as kalloc_frames but the frames come back cleared. Single frames are served from a pool that
+/// pmm_zero_idle keeps filled, so they cost nothing to clear at allocation time.
+uintptr_t kalloc_zeroed_frames(size_t num_frames);
+/// Clears a few frames for the zero pool. Called when the CPU has nothing better to do.
+void pmm_zero_idle();
+/// Allocates num_frames physically contiguous frames from zone, falling back to the zones below it.
+/// Returns the physical address of the first frame, or 0 on failure.
+uintptr_t kalloc_phys_frames(size_t num_frames, uint8_t zone);
 /// Frees contiguous region of frames
 void kfree_frames(uintptr_t first_frame, size_t num_frames);
+/// Frees contiguous region of frames by physical address
+void kfree_phys_frames(uintptr_t phys, size_t num_frames);
+/// Takes another reference on an allocated frame, for mappings that share it
+void pmm_frame_get(uintptr_t phys);
+/// Drops a reference on an allocated frame, freeing it once the last one is gone
+void pmm_frame_put(uintptr_t phys);
+/// References held on a frame, 0 if it's free
+uint16_t pmm_frame_refs(uintptr_t phys);
+/// Free frames in a zone, or in all of them if zone is negative
+size_t pmm_free_frames(int zone);
+void pmm_print_zones();
+/// Snapshot of the PMM counters, all of them are kept up to date as frames move so this is cheap
+void pmm_get_stats(pmm_stats_t* stats);
+/// Share of free memory, in per mille, that can't serve an allocation of 2^order frames because it's
+/// split into smaller blocks. 0 means every free frame could, 1000 that none could.
+uint32_t pmm_fragmentation_index(uint32_t order);
 void page_fault(struct irq_regs* r);
 /// Tests pmm functionality. Fails if not successful.
 uint8_t test_pmm();
@@ -2,7 +2,34 @@
 #include <stddef.h>
 #include <stdint.h>
 
-typedef struct {
+/* configuration space offsets, reads and writes are a dword at a time */
+enum {
+    PCI_REG_COMMAND = 0x04, /* status in the upper half */
+    PCI_REG_CLASS = 0x08,  /* class, subclass, prog-if and revision from the top */
+    PCI_REG_HEADER = 0x0C, /* header type in bits 16-23 */
+    PCI_REG_BAR0 = 0x10,
+    PCI_REG_BUS = 0x18, /* bridges: primary, secondary and subordinate bus from the bottom */
+    PCI_REG_CAP_PTR = 0x34,
+    PCI_REG_INTERRUPT = 0x3C, /* interrupt line the firmware routed INTx to, in the low byte */
+};
+
+enum {
+    PCI_CMD_IO = 1 << 0,
+    PCI_CMD_MEMORY = 1 << 1,
+    PCI_CMD_BUS_MASTER = 1 << 2,
+    /* status bit 4, the device has a capability list */
+    PCI_STATUS_CAP_LIST = 1 << 20,
+};
+
+enum {
+    PCI_CAP_MSI = 0x05,
+    PCI_CAP_MSIX = 0x11,
+};
+
+/* header type bit 7, functions 1-7 only exist when function 0 has it set */
+static const uint8_t PCI_HEADER_MULTIFUNC = 0x80;
+
+typedef struct pci_device {
     uint8_t bus;
     uint8_t dev;
     uint8_t func;
@@ -12,13 +39,31 @@ typedef struct {
     uint8_t base_class;
     uint8_t sub_class;
     uint8_t prog_interface;
-    uint8_t rev_id; // Not read yet
+    uint8_t rev_id;
     uint8_t irq;    // Not read yet
     // Bar stuff
+    // Lookup table chains, in scan order
+    struct pci_device* id_next;
+    struct pci_device* class_next;
 } pci_device_t;
 
-const pci_device_t* get_device_by_index(uint8_t index);
+/// Enumerates the buses behind every host bridge and through every PCI-PCI bridge, through ECAM when the
+/// ACPI MCFG table has it. Needs acpi_init and the heap.
+void pci_init();
+const pci_device_t* get_device_by_index(size_t index);
 const pci_device_t* get_device_by_id(uint16_t device_id);
 const pci_device_t* get_device_by_class(uint8_t base_class, uint8_t sub_class);
+/// The next device with the given vendor and device id after from, the first one for NULL
+const pci_device_t* pci_find_device(uint16_t vendor_id, uint16_t device_id, const pci_device_t* from);
 const uint32_t pci_config_read_word(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+void pci_config_write_word(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value);
+/// Prints what pci_init found
 void list_devices();
+/// Offset of the capability with the given id in dev's configuration space, 0 if it has none
+uint8_t pci_find_capability(const pci_device_t* dev, uint8_t cap_id);
+/// Points dev's single MSI message at vector on the CPU with the given local APIC ID and enables it. Returns
+/// -1 if the device can't do MSI.
+int pci_enable_msi(const pci_device_t* dev, uint8_t vector, uint8_t apic_id);
+/// Points entry of dev's MSI-X table at vector on the CPU with the given local APIC ID, unmasks it and enables
+/// MSI-X. Returns -1 if the device has no MSI-X or fewer entries.
+int pci_enable_msix(const pci_device_t* dev, uint16_t entry, uint8_t vector, uint8_t apic_id);
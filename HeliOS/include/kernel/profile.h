@@ -0,0 +1,43 @@
+#pragma once
+// Statistical sampling profiler. The timer interrupts record where the CPU they hit was, eip and the call
+// chain found through the saved ebp frames, into a ring per CPU. While it's off every tick pays for one
+// well predicted branch on profile_enabled.
+//
+// profile_dump writes the samples straight to COM1, one per line:
+//   S <cpu> <eip> <caller> <caller's caller> ...
+// with every address in hex, innermost first, between a PROFILE begin and a PROFILE end line. They
+// symbolize against the linked kernel, e.g. awk '$1 == "S" { print $3 }' | addr2line -f -e HeliOS.kernel
+
+#include <kernel/interrupts.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Samples kept per CPU, the oldest are overwritten. Has to stay a power of two.
+#define PROFILE_RING 1024
+// Return addresses kept per sample on top of eip
+#define PROFILE_DEPTH 8
+
+struct profile_sample {
+    uint32_t eip;
+    uint8_t cpu;
+    uint8_t depth; ///< How many entries of stack are filled
+    uint32_t stack[PROFILE_DEPTH]; ///< Return addresses, innermost first
+};
+
+extern volatile bool profile_enabled;
+
+void profile_record(struct irq_regs* r);
+
+/// Called from every timer interrupt, takes a sample once the CPU's period is up
+static inline void profile_tick(struct irq_regs* r)
+{
+    if (__builtin_expect(profile_enabled, 0)) profile_record(r);
+}
+
+/// Drops what was recorded and starts sampling every period_ms on each CPU. The timers are sped up to match
+/// where they tick slower than that. With callgraph unset only eip is kept.
+void profile_start(uint32_t period_ms, bool callgraph);
+/// Stops sampling and puts the timers back, the samples stay until the next start
+void profile_stop();
+/// Stops sampling and writes every sample to COM1
+void profile_dump();
@@ -0,0 +1,93 @@
+#pragma once
+// Reader-writer spinlocks for read-mostly tables. Any number of readers hold the lock together, a writer
+// holds it alone. Waiting writers keep new readers out, so a steady stream of lookups can't starve them.
+
+#include <kernel/spinlock.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RW_WRITER 0x80000000
+
+typedef struct rwlock {
+    volatile uint32_t state; ///< Readers holding it, RW_WRITER set while a writer does
+    volatile uint32_t writers_waiting;
+#ifdef LOCK_STATS
+    struct lock_stats stats;
+#endif
+} rwlock_t;
+
+#define RWLOCK_INIT { .state = 0, .writers_waiting = 0 }
+
+static inline void rwlock_init(rwlock_t* lock) { *lock = (rwlock_t)RWLOCK_INIT; }
+
+/// Readers can't take the lock again while holding it, a writer arriving in between would deadlock both
+static inline void read_lock(rwlock_t* lock)
+{
+    preempt_disable();
+    bool waited = false;
+    while (true) {
+        while (lock->writers_waiting || lock->state & RW_WRITER) {
+            waited = true;
+            cpu_relax();
+        }
+        // A writer may have come in since, back out again if so
+        if (!(__atomic_fetch_add(&lock->state, 1, __ATOMIC_ACQUIRE) & RW_WRITER)) break;
+        __atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELAXED);
+    }
+    LOCK_STAT(lock, waited);
+}
+
+static inline void read_unlock(rwlock_t* lock)
+{
+    __atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+static inline void write_lock(rwlock_t* lock)
+{
+    preempt_disable();
+    __atomic_fetch_add(&lock->writers_waiting, 1, __ATOMIC_RELAXED);
+    bool waited = false;
+    uint32_t expected = 0;
+    while (!__atomic_compare_exchange_n(&lock->state, &expected, RW_WRITER, false, __ATOMIC_ACQUIRE,
+        __ATOMIC_RELAXED)) {
+        waited = true;
+        expected = 0;
+        cpu_relax();
+    }
+    __atomic_fetch_sub(&lock->writers_waiting, 1, __ATOMIC_RELAXED);
+    LOCK_STAT(lock, waited);
+}
+
+static inline void write_unlock(rwlock_t* lock)
+{
+    // Readers backing out may still touch the count, only clear our bit
+    __atomic_fetch_and(&lock->state, ~RW_WRITER, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+static inline uint32_t read_lock_irqsave(rwlock_t* lock)
+{
+    uint32_t flags = irq_save();
+    read_lock(lock);
+    return flags;
+}
+
+static inline void read_unlock_irqrestore(rwlock_t* lock, uint32_t flags)
+{
+    read_unlock(lock);
+    irq_restore(flags);
+}
+
+static inline uint32_t write_lock_irqsave(rwlock_t* lock)
+{
+    uint32_t flags = irq_save();
+    write_lock(lock);
+    return flags;
+}
+
+static inline void write_unlock_irqrestore(rwlock_t* lock, uint32_t flags)
+{
+    write_unlock(lock);
+    irq_restore(flags);
+}
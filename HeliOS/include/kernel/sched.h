@@ -0,0 +1,125 @@
+#pragma once
+// Preemptive kernel threads on per-CPU run queues. Idle CPUs steal runnable threads from busy ones.
+
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define THREAD_STACK_FRAMES 4
+// How long a thread runs before others waiting on the same CPU get a turn
+#define SCHED_SLICE_MS 10
+
+enum thread_state {
+    THREAD_RUNNABLE, ///< Running or on a run queue
+    THREAD_BLOCKED,
+    THREAD_DEAD,
+};
+
+typedef void (*thread_fn_t)(void* arg);
+
+struct thread {
+    uint32_t esp; ///< Saved by switch_context while switched out
+    volatile enum thread_state state;
+    volatile bool on_cpu; ///< Still running or in the middle of being switched away from
+    unsigned int cpu; ///< Run queue it belongs to
+    struct thread* next; ///< Run queue link
+    uintptr_t stack; ///< Bottom of the stack, 0 for threads that started on a boot stack
+    thread_fn_t entry;
+    void* arg;
+    const char* name;
+    struct fpu_state* fpu; ///< Saved FPU and SSE registers, allocated the first time it uses them
+    int fpu_cpu; ///< CPU whose registers it loaded last
+};
+
+/// Turns the boot flow into the first thread and creates the boot CPU's idle thread
+void sched_init();
+/// Same for an AP, the flow calling this becomes its idle thread and never returns
+void __attribute__((noreturn)) sched_start_ap();
+/// Starts a thread on the least loaded CPU. Returns NULL if there's no memory for it.
+struct thread* thread_create(const char* name, thread_fn_t entry, void* arg);
+/// Ends the calling thread, only returns if the scheduler isn't running
+void thread_exit();
+struct thread* thread_current();
+/// Makes a blocked thread runnable again, safe from interrupt handlers and any CPU
+void thread_wake(struct thread* t);
+/// Gives up the CPU to whatever is next on the run queue
+void schedule();
+void sched_yield();
+/// True if the caller is a thread that may block, false in idle threads, with preemption disabled or
+/// before the scheduler runs. Waits have to busy wait or halt instead then.
+bool sched_can_block();
+/// Timer interrupts call this once the current slice is used up. Returns true while other threads are
+/// waiting for this CPU, so the caller keeps ticking.
+bool sched_tick();
+/// Reacts to new threads on this CPU's queue, called from the reschedule IPI
+void sched_kick();
+/// Switches threads on the way out of an interrupt if the tick or a wakeup asked for it
+void sched_irq_exit();
+
+struct wait_entry {
+    struct thread* thread;
+    struct wait_entry* next;
+};
+
+/// Threads waiting for something, woken by whoever makes it happen
+struct wait_queue {
+    spinlock_t lock;
+    struct wait_entry* head;
+};
+
+#define WAIT_QUEUE_INIT { SPINLOCK_INIT, NULL }
+
+void wait_queue_init(struct wait_queue* wq);
+/// Wakes every waiter, they recheck their condition. Safe from interrupt handlers.
+void wake_up(struct wait_queue* wq);
+
+/// Sleeping lock for long critical sections like a whole disk command. Waiters block instead of spinning
+/// and holders may sleep, so it can't be taken from interrupt handlers.
+struct mutex {
+    volatile bool locked;
+    struct wait_queue wait;
+};
+
+#define MUTEX_INIT { false, WAIT_QUEUE_INIT }
+
+void mutex_init(struct mutex* m);
+void mutex_lock(struct mutex* m);
+/// Returns true with the mutex held, false right away if someone else has it
+bool mutex_trylock(struct mutex* m);
+void mutex_unlock(struct mutex* m);
+
+/// One wait in progress, lives on the waiter's stack. Use wait_event rather than this directly.
+struct wait_state {
+    struct wait_entry entry;
+    struct wait_queue* wq; ///< NULL to only wait for the timeout
+    struct timer timer;
+    volatile bool expired;
+    bool timed;
+    bool block; ///< Whether this thread can block or has to halt instead
+    uint32_t flags;
+};
+
+/// Queues the caller on wq and arms the timeout, millis 0 waits forever. Has to be followed by wait_sleep
+/// until the condition holds, then wait_end.
+void wait_begin(struct wait_state* ws, struct wait_queue* wq, uint32_t millis);
+/// Sleeps until woken, returns false once the timeout has passed
+bool wait_sleep(struct wait_state* ws);
+void wait_end(struct wait_state* ws);
+
+/// Blocks until cond is true or millis pass (0 waits forever), evaluates to whether cond came true. Whoever
+/// makes cond true has to call wake_up(wq) afterwards. Where sched_can_block is false this halts instead, so
+/// it works before the scheduler runs and from the idle loop.
+#define wait_event_timeout(wq, cond, millis)                                                                   \
+    ({                                                                                                         \
+        bool __done = (cond);                                                                                  \
+        if (!__done) {                                                                                         \
+            struct wait_state __ws;                                                                            \
+            wait_begin(&__ws, (wq), (millis));                                                                 \
+            while (!(__done = (cond)) && wait_sleep(&__ws)) { }                                                \
+            wait_end(&__ws);                                                                                   \
+        }                                                                                                      \
+        __done;                                                                                                \
+    })
+
+#define wait_event(wq, cond) wait_event_timeout(wq, cond, 0)
@@ -0,0 +1,65 @@
+#pragma once
+// Sequence locks for small, often read values like the clock. Readers take no lock at all, they copy the
+// data and retry if a writer was in the middle of changing it. Writers are serialized by a spinlock.
+//
+//     uint32_t seq;
+//     do {
+//         seq = read_seqbegin(&lock);
+//         copy = data;
+//     } while (read_seqretry(&lock, seq));
+
+#include <kernel/spinlock.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct seqlock {
+    volatile uint32_t sequence; ///< Odd while a writer is in the middle of an update
+    spinlock_t lock;
+} seqlock_t;
+
+#define SEQLOCK_INIT { 0, SPINLOCK_INIT }
+
+static inline void seqlock_init(seqlock_t* sl) { *sl = (seqlock_t)SEQLOCK_INIT; }
+
+static inline uint32_t read_seqbegin(const seqlock_t* sl)
+{
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&sl->sequence, __ATOMIC_ACQUIRE)) & 1)
+        asm volatile("pause");
+    return seq;
+}
+
+/// True if what was read since read_seqbegin may be torn and has to be read again
+static inline bool read_seqretry(const seqlock_t* sl, uint32_t start)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return sl->sequence != start;
+}
+
+/// Readers spin while a writer holds this, so writers can't be interrupted by anything that reads. Use
+/// write_seqlock_irqsave unless interrupts are already off.
+static inline void write_seqlock(seqlock_t* sl)
+{
+    spin_lock(&sl->lock);
+    __atomic_store_n(&sl->sequence, sl->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_sequnlock(seqlock_t* sl)
+{
+    __atomic_store_n(&sl->sequence, sl->sequence + 1, __ATOMIC_RELEASE);
+    spin_unlock(&sl->lock);
+}
+
+static inline uint32_t write_seqlock_irqsave(seqlock_t* sl)
+{
+    uint32_t flags = irq_save();
+    write_seqlock(sl);
+    return flags;
+}
+
+static inline void write_sequnlock_irqrestore(seqlock_t* sl, uint32_t flags)
+{
+    write_sequnlock(sl);
+    irq_restore(flags);
+}
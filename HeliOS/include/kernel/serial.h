@@ -0,0 +1,27 @@
+#pragma once
+// 16550 UART driver, transmit goes through an interrupt driven ring so callers never wait on the line
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define COM1_PORT 0x3F8
+#define COM2_PORT 0x2F8
+
+#define SERIAL_DEFAULT_BAUD 115200
+// Bytes queued per port before writers have to wait for the UART, must be a power of two
+#define SERIAL_TX_RING_SIZE 4096
+
+/**
+ * @brief Programs the UART at port for 8N1 and hooks its IRQ.
+ *
+ * @param port COM1_PORT or COM2_PORT
+ * @param baud Anything that divides 115200
+ * @return 0 on success, -1 if the port is unknown or no UART answers the loopback test
+ */
+int serial_init(uint16_t port, uint32_t baud);
+/// Queues data for transmission, only blocks once the ring is full
+void serial_write(uint16_t port, const char* data, size_t len);
+/// Waits until everything queued on port has left the FIFO, for panics and benchmark harness sync points
+void serial_drain(uint16_t port);
+/// klog console backend writing to COM1
+void serial_console(const char* data, size_t len);
@@ -0,0 +1,62 @@
+#pragma once
+// Contains the slab allocator, object caches for fixed size kernel structures
+
+#include <kernel/spinlock.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct kmem_slab kmem_slab_t;
+typedef struct kmem_cache kmem_cache_t;
+
+typedef void (*kmem_ctor)(void* obj);
+
+// Slabs are carved out of power of two frame runs so an object's slab can be found by masking its address
+struct kmem_slab {
+    kmem_slab_t* next;
+    kmem_slab_t* prev;
+    kmem_cache_t* cache;
+    uint16_t first_free; // Index of the first free object, SLAB_END when full
+    uint16_t inuse;
+    void* objects;       // First object in the slab
+    uint16_t free_list[]; // Index of the next free object, one per object
+};
+
+struct kmem_cache {
+    const char* name;
+    size_t obj_size;  // Object size rounded up to the alignment
+    size_t align;
+    kmem_ctor ctor;   // Runs once per object when its slab is created
+    size_t slab_frames;
+    uint16_t objs_per_slab;
+    kmem_slab_t* partial; // Slabs with some objects free
+    kmem_slab_t* full;    // Slabs with every object in use
+    kmem_slab_t* empty;   // Slabs with every object free
+    size_t num_slabs;
+    size_t num_empty;
+    size_t num_active;   // Objects currently handed out
+    spinlock_t lock;     // Guards the lists and counters, taken irqsave since IRQ and #NM paths allocate
+};
+
+/**
+ * Creates a new object cache
+ *
+ * @param name name of the cache, used for debugging output
+ * @param size size of each object
+ * @param align alignment of each object, 0 for word alignment
+ * @param ctor optional constructor, objects must be returned to the cache in their constructed state
+ * @return the cache, or NULL on failure
+ */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor ctor);
+
+/// Frees every slab of the cache and the cache itself. All objects must already be freed.
+void kmem_cache_destroy(kmem_cache_t* cache);
+
+/// Allocates an object from the cache, returns NULL if out of memory. Safe from any CPU and from interrupt
+/// handlers; constructors run with the cache's lock held.
+void* kmem_cache_alloc(kmem_cache_t* cache);
+
+/// Allocates a zeroed object, only useful for caches without a constructor
+void* kmem_cache_zalloc(kmem_cache_t* cache);
+
+/// Returns an object to the cache it came from
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
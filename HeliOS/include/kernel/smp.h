@@ -0,0 +1,71 @@
+#pragma once
+// Application processor startup, per-CPU data and inter-processor interrupts
+
+#include <kernel/cpu.h>
+#include <kernel/gdt.h>
+#include <kernel/spinlock.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Real mode entry point for the APs, has to be page aligned below 1 MiB and agree with trampoline.asm
+#define SMP_TRAMPOLINE 0x8000
+// Kernel stack for each AP
+#define SMP_STACK_FRAMES 4
+
+// IPI vectors, next to the LAPIC timer at the top of the vector space
+#define IPI_RESCHEDULE_VECTOR 0xF1
+#define IPI_TLB_VECTOR 0xF2
+#define IPI_CALL_VECTOR 0xF3
+// Hands a timer deadline to the boot CPU, which runs the clock event
+#define IPI_TIMER_VECTOR 0xF4
+
+typedef void (*smp_call_fn)(void* arg);
+
+/// Per-CPU data, %gs points at the running CPU's one
+struct cpu {
+    struct cpu* self; ///< What %gs:0 reads, keep it first
+    uint32_t preempt_count; ///< %gs:4, see preempt_disable in spinlock.h
+    unsigned int id; ///< Index into cpus, 0 is the boot CPU
+    uint8_t apic_id;
+    volatile bool online;
+    uintptr_t stack_top;
+    struct tss tss;
+
+    // Mailbox for smp_call_function
+    spinlock_t call_lock;
+    volatile smp_call_fn call_fn;
+    void* call_arg;
+    volatile bool call_done;
+
+    // Lazy FPU switching, see fpu.h
+    struct thread* fpu_owner; ///< Whose state the registers hold, as long as its fpu_cpu agrees
+    bool fpu_live; ///< CR0.TS is clear for fpu_owner, the running thread, which may have changed them
+};
+
+_Static_assert(offsetof(struct cpu, preempt_count) == CPU_PREEMPT_COUNT_OFFSET, "spinlock.h reads it by offset");
+
+extern struct cpu cpus[MAX_CPUS];
+
+static inline struct cpu* this_cpu()
+{
+    struct cpu* cpu;
+    asm volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+/// Starts every other CPU the MADT lists. Needs acpi_init, the local APIC and the PIT.
+void smp_init();
+/// CPUs that made it online, the boot CPU included
+unsigned int smp_cpu_count();
+
+/// Sends vector to cpu, which has to be online
+void smp_send_ipi(unsigned int cpu, uint8_t vector);
+void smp_send_reschedule(unsigned int cpu);
+/// Drops pages from the TLB of every other online CPU and waits until they have, count 0 flushes
+/// everything. Works with interrupts off and locks held, CPUs that can't take the IPI because they spin on
+/// a lock with interrupts off serve the request from cpu_relax.
+void smp_tlb_shootdown(const uintptr_t* pages, size_t count);
+/// Runs fn(arg) on cpu from its IPI handler, returns -1 if cpu isn't online. With wait set this only
+/// returns once fn is done.
+int smp_call_function(unsigned int cpu, smp_call_fn fn, void* arg, bool wait);
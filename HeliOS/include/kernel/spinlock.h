@@ -0,0 +1,131 @@
+#pragma once
+// Busy-waiting ticket locks, with variants that keep interrupts off while held. Waiters get the lock in
+// the order they arrived, so no CPU can be starved by the others.
+
+#include <kernel/asm.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/// How often a lock was taken and how often that meant waiting for another holder. Only counted with
+/// LOCK_STATS defined, otherwise the locks carry no counters at all.
+struct lock_stats {
+    uint32_t acquired;
+    uint32_t contended;
+};
+
+typedef struct spinlock {
+    union {
+        volatile uint32_t word; ///< Both halves, for trylock
+        struct {
+            volatile uint16_t owner; ///< Ticket being served
+            volatile uint16_t next; ///< Next ticket handed out
+        };
+    };
+#ifdef LOCK_STATS
+    struct lock_stats stats;
+#endif
+} spinlock_t;
+
+#define SPINLOCK_INIT { .word = 0 }
+
+#ifdef LOCK_STATS
+#define LOCK_STAT(lock, waited)                                                                                \
+    do {                                                                                                       \
+        __atomic_fetch_add(&(lock)->stats.acquired, 1, __ATOMIC_RELAXED);                                      \
+        if (waited) __atomic_fetch_add(&(lock)->stats.contended, 1, __ATOMIC_RELAXED);                         \
+    } while (0)
+#else
+#define LOCK_STAT(lock, waited) ((void)(waited))
+#endif
+
+/// Prints a lock's counters under name, or that they weren't built in
+void lock_stats_print(const char* name, const struct lock_stats* stats);
+#ifdef LOCK_STATS
+#define LOCK_STATS_OF(lock) (&(lock)->stats)
+#else
+#define LOCK_STATS_OF(lock) ((const struct lock_stats*)0)
+#endif
+
+// Offset of preempt_count in struct cpu, %gs points at the running CPU's one
+#define CPU_PREEMPT_COUNT_OFFSET 4
+
+/// Keeps the scheduler from switching threads on this CPU until the matching preempt_enable. A single
+/// instruction, so it can't be torn by an interrupt or a migration.
+static inline void preempt_disable() { asm volatile("incl %%gs:%c0" : : "i"(CPU_PREEMPT_COUNT_OFFSET) : "memory"); }
+
+static inline void preempt_enable() { asm volatile("decl %%gs:%c0" : : "i"(CPU_PREEMPT_COUNT_OFFSET) : "memory"); }
+
+static inline uint32_t preempt_count()
+{
+    uint32_t count;
+    asm volatile("movl %%gs:%c1, %0" : "=r"(count) : "i"(CPU_PREEMPT_COUNT_OFFSET));
+    return count;
+}
+
+/// CPUs owing smp_tlb_shootdown an invalidation, a bit each. Lock holders may have interrupts off, so the
+/// IPI can't reach a CPU spinning on their lock with interrupts off too. Spinners serve theirs instead.
+extern volatile uint32_t tlb_shootdown_mask;
+void smp_tlb_poll();
+
+/// What every busy wait does once per round
+static inline void cpu_relax()
+{
+    if (__builtin_expect(tlb_shootdown_mask != 0, 0)) smp_tlb_poll();
+    asm volatile("pause");
+}
+
+static inline void spin_lock_init(spinlock_t* lock) { *lock = (spinlock_t)SPINLOCK_INIT; }
+
+/// Holders can't be preempted, a thread spinning on the same CPU would never let them finish
+static inline void spin_lock(spinlock_t* lock)
+{
+    preempt_disable();
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    bool waited = false;
+    // Spin on a plain read so the cache line isn't bounced around while someone else holds it
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        waited = true;
+        cpu_relax();
+    }
+    LOCK_STAT(lock, waited);
+}
+
+/// Returns true with the lock held, false right away if someone else has it or is waiting for it
+static inline bool spin_trylock(spinlock_t* lock)
+{
+    preempt_disable();
+    uint32_t word = lock->word;
+    uint16_t owner = word & 0xFFFF;
+    // Free means the next ticket is the one being served, take it by bumping next
+    if (owner == word >> 16
+        && __atomic_compare_exchange_n(&lock->word, &word, word + 0x10000, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        LOCK_STAT(lock, false);
+        return true;
+    }
+    preempt_enable();
+    return false;
+}
+
+static inline void spin_unlock(spinlock_t* lock)
+{
+    // Only the holder writes owner, so a plain increment is enough to hand over to the next ticket
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+static inline bool spin_is_locked(const spinlock_t* lock) { return lock->owner != lock->next; }
+
+/// Disables interrupts, then takes the lock. Returns the previous interrupt state for
+/// spin_unlock_irqrestore, so nested users don't turn interrupts back on early.
+static inline uint32_t spin_lock_irqsave(spinlock_t* lock)
+{
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags)
+{
+    spin_unlock(lock);
+    irq_restore(flags);
+}
@@ -1,8 +1,46 @@
 #pragma once
+#include <stdbool.h>
 #include <stdint.h>
 
+struct irq_regs;
+
+typedef void (*timer_callback_t)(void* data);
+
+/// Callback timer on the timer wheel, owned by the caller and only touched through the timer_* functions.
+/// Callbacks run from the boot CPU's timer interrupt with interrupts off.
+struct timer {
+    struct timer* next;
+    struct timer** pprev; ///< NULL while not pending
+    uint32_t expires; ///< Tick it fires on
+    timer_callback_t callback;
+    void* data;
+};
+
 void timer_phase(int hz);
 void timer_handler(struct irq_regs* r);
 void timer_poll();
+/// Milliseconds since timer_init
+unsigned int timer_get_ticks();
+void timer_setup(struct timer* t, timer_callback_t callback, void* data);
+/// Fires t millis from now (at least one tick), re-arms it if already pending
+void timer_add(struct timer* t, uint32_t millis);
+/// Returns whether t was still pending. Once this returns the callback isn't running either, so don't call
+/// it from t's own callback.
+bool timer_del(struct timer* t);
+/// Sets *expired once millis have passed, for bounding a wait. timer_del it when done early.
+void timer_start_timeout(struct timer* t, volatile bool* expired, uint32_t millis);
 void sleep(uint32_t millis);
+/// Sleeps with microsecond resolution when the LAPIC timer drives the clock, millisecond steps on the PIT
+void usleep(uint64_t micros);
+/// Nanoseconds since timer_init
+uint64_t timer_now_ns();
+/// Busy waits on PIT channel 2, for calibrating other clocks. Interrupts can be off, at most 54 ms.
+void pit_wait(uint32_t ms);
+/// Makes sure the boot CPU's clock event comes around once the running thread's slice is up
+void timer_slice_start();
 void timer_init();
+/// Starts the periodic scheduler tick on an AP, the boot CPU has to have run timer_init
+void timer_init_ap();
+/// Makes every CPU's timer interrupt come around at least every millis, 0 goes back to normal. For the profiler,
+/// call with interrupts enabled.
+void timer_sample_period(uint32_t millis);
@@ -0,0 +1,64 @@
+#pragma once
+// Static tracepoints. TRACE compiles to a test of one bit in trace_mask, marked unlikely, so a disabled
+// tracepoint costs a load and a branch that's never taken. Enabled ones write a timestamped binary record
+// into the running CPU's ring. Slots are claimed with an atomic add and published with a sequence number,
+// so interrupts, other CPUs and readers never need a lock.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Records kept per CPU, the oldest are overwritten. Has to stay a power of two.
+#define TRACE_RING 2048
+
+// Arguments a, b, c per event
+enum trace_event {
+    TRACE_PMM_ALLOC, ///< phys, frames, caller
+    TRACE_PMM_FREE, ///< phys, frames, caller
+    TRACE_HEAP_ALLOC, ///< pointer, size, caller
+    TRACE_HEAP_FREE, ///< pointer, 0, caller
+    TRACE_IRQ_ENTRY, ///< vector, eip, 0
+    TRACE_IRQ_EXIT, ///< vector, 0, 0
+    TRACE_BLOCK_SUBMIT, ///< bio, lba, count | op << 24
+    TRACE_BLOCK_COMPLETE, ///< bio, lba, error
+    TRACE_VFS_OPEN, ///< mount id, 0, 0
+    TRACE_VFS_OPEN_DONE, ///< inode or 0 if it failed, 1 if the inode was cached, 0
+    TRACE_VFS_READ, ///< inode, offset, length
+    TRACE_VFS_READ_DONE, ///< inode, offset, bytes read or -1
+    TRACE_EVENTS,
+};
+
+_Static_assert(TRACE_EVENTS <= 32, "trace_mask has a bit per event");
+
+#define TRACE_ALL ((1u << TRACE_EVENTS) - 1)
+
+struct trace_record {
+    volatile uint32_t seq; ///< Position in the ring plus one once the record is complete
+    uint16_t event;
+    uint8_t cpu;
+    uint64_t tsc; ///< ktime_get_cycles when it was recorded
+    uint32_t a, b, c;
+};
+
+/// Events recorded, a bit per enum trace_event
+extern volatile uint32_t trace_mask;
+
+void trace_record(uint16_t event, uint32_t a, uint32_t b, uint32_t c);
+
+#define TRACE(event, a, b, c)                                                                                          \
+    do {                                                                                                               \
+        if (__builtin_expect(trace_mask & (1u << (event)), 0))                                                         \
+            trace_record(event, (uint32_t)(a), (uint32_t)(b), (uint32_t)(c));                                          \
+    } while (0)
+
+/// Empties every ring and records the events in mask from now on
+void trace_start(uint32_t mask);
+void trace_stop();
+/// Copies the complete records still in cpu's ring into out, oldest first. Returns how many it copied.
+size_t trace_read(unsigned int cpu, struct trace_record* out, size_t max);
+/// Name of an event for dumps
+const char* trace_event_name(uint16_t event);
+/// Stops tracing and writes every CPU's records to COM1 merged by timestamp, one per line:
+///   T <tsc> <cpu> <event> <a> <b> <c>
+/// with tsc in decimal and the arguments in hex
+void trace_dump();
@@ -8,6 +8,8 @@ void tty_setcolor(uint8_t color);
 void tty_putchar(char c);
 void tty_write(const char* data, size_t size);
 void tty_writestring(const char* data);
+/// Moves output over to the framebuffer console if fbcon_probe found one, keeping what's on screen
+void tty_use_framebuffer(void);
 
 void tty_enable_cursor(uint8_t cursor_start, uint8_t cursor_end);
 void tty_disable_cursor();
@@ -0,0 +1,60 @@
+#pragma once
+// virtio-blk disks. Each one gets an sATADevice with its own block device, so filesystems mount it like an
+// ATA disk. Requests take one ring slot each through indirect descriptors, the device is notified once per
+// block layer batch.
+#include <kernel/ata/controller.h>
+#include <kernel/memory.h>
+#include <kernel/virtio/virtio.h>
+#include <stdint.h>
+
+/* PCI device id of the transitional virtio-blk device, the modern only one (0x1042) has no legacy interface */
+static const uint16_t VIRTIO_BLK_DEVICE_ID = 0x1001;
+
+/* disks we keep state for */
+#define VIRTIO_BLK_MAX_DEVICES 4
+/* requests in flight per disk, also capped by the queue size */
+#define VIRTIO_BLK_MAX_REQS 64
+/* data segments of one request, a merged block layer request split at every page and one more */
+#define VIRTIO_BLK_MAX_SEGS (BLOCK_MAX_MERGE * 512 / PAGE_SIZE + 1)
+
+enum {
+    VIRTIO_BLK_F_SEG_MAX = 1 << 2,
+    VIRTIO_BLK_F_RO = 1 << 5,
+    VIRTIO_BLK_F_FLUSH = 1 << 9,
+};
+
+/* device config, after the common registers */
+enum {
+    VIRTIO_BLK_CFG_CAPACITY = 0x00, /* 64 bit, in 512 byte sectors */
+    VIRTIO_BLK_CFG_SEG_MAX = 0x0C,  /* 32 bit */
+};
+
+enum {
+    VIRTIO_BLK_T_IN = 0,
+    VIRTIO_BLK_T_OUT = 1,
+    VIRTIO_BLK_T_FLUSH = 4,
+};
+
+enum {
+    VIRTIO_BLK_S_OK = 0,
+    VIRTIO_BLK_S_IOERR = 1,
+    VIRTIO_BLK_S_UNSUPP = 2,
+};
+
+struct virtio_blk_req_hdr {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector; /* always in 512 byte units */
+} __attribute__((packed));
+
+/**
+ * Brings up every virtio-blk device on the PCI bus. Needs the scheduler, the partition tables are already read
+ * through the block layer.
+ */
+void virtio_blk_init();
+
+/**
+ * @param id the index of the disk, in PCI order
+ * @return the device or NULL if there are fewer virtio disks
+ */
+sATADevice* virtio_blk_get_device(uint8_t id);
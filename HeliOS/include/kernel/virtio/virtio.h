@@ -0,0 +1,121 @@
+#pragma once
+// Virtio over the legacy PCI interface: the device's registers sit in I/O BAR0 and every queue is a split
+// virtqueue in one physically contiguous block of memory.
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+static const uint16_t VIRTIO_VENDOR = 0x1AF4;
+
+/* legacy I/O registers, offsets from BAR0 */
+enum {
+    VIRTIO_REG_DEVICE_FEATURES = 0x00, /* 32 bit */
+    VIRTIO_REG_GUEST_FEATURES = 0x04,  /* 32 bit */
+    VIRTIO_REG_QUEUE_PFN = 0x08,       /* 32 bit, queue address >> 12 */
+    VIRTIO_REG_QUEUE_SIZE = 0x0C,      /* 16 bit */
+    VIRTIO_REG_QUEUE_SELECT = 0x0E,    /* 16 bit */
+    VIRTIO_REG_QUEUE_NOTIFY = 0x10,    /* 16 bit */
+    VIRTIO_REG_STATUS = 0x12,          /* 8 bit */
+    VIRTIO_REG_ISR = 0x13,             /* 8 bit, reading acknowledges the interrupt */
+    /* only there while MSI-X is enabled, and then the device config moves up by 4 */
+    VIRTIO_REG_CONFIG_VECTOR = 0x14, /* 16 bit */
+    VIRTIO_REG_QUEUE_VECTOR = 0x16,  /* 16 bit */
+};
+
+#define VIRTIO_REG_CONFIG(msix) ((msix) ? 0x18 : 0x14)
+#define VIRTIO_NO_VECTOR 0xFFFF
+
+enum {
+    VIRTIO_STATUS_ACKNOWLEDGE = 1,
+    VIRTIO_STATUS_DRIVER = 2,
+    VIRTIO_STATUS_DRIVER_OK = 4,
+    VIRTIO_STATUS_FAILED = 0x80,
+};
+
+/* ring features, the device specific ones are below bit 24 */
+enum {
+    VIRTIO_RING_F_INDIRECT_DESC = 1 << 28,
+    VIRTIO_RING_F_EVENT_IDX = 1 << 29,
+};
+
+enum {
+    VIRTQ_DESC_F_NEXT = 1,
+    VIRTQ_DESC_F_WRITE = 2, /* the device writes into the buffer */
+    VIRTQ_DESC_F_INDIRECT = 4,
+};
+
+enum {
+    VIRTQ_AVAIL_F_NO_INTERRUPT = 1,
+    VIRTQ_USED_F_NO_NOTIFY = 1,
+};
+
+/* legacy queues are laid out with this alignment between the avail and the used ring; the ring structures
+ * are naturally aligned, so they need no packing */
+#define VIRTQ_ALIGN 4096
+
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtq_avail {
+    uint16_t flags;
+    volatile uint16_t idx;
+    /* size entries, followed by used_event */
+    uint16_t ring[];
+};
+
+struct virtq_used_elem {
+    uint32_t id; /* head descriptor of the finished chain */
+    uint32_t len; /* bytes the device wrote */
+};
+
+struct virtq_used {
+    volatile uint16_t flags;
+    volatile uint16_t idx;
+    /* size entries, followed by avail_event */
+    volatile struct virtq_used_elem ring[];
+};
+
+struct virtqueue {
+    uint16_t io_base;
+    uint16_t index;
+    uint16_t size;
+    /* whether notifications and interrupts are suppressed through the event indices */
+    bool event_idx;
+    struct virtq_desc* desc;
+    struct virtq_avail* avail;
+    struct virtq_used* used;
+    void* mem;
+    size_t mem_size;
+    /* the next used entry we haven't looked at */
+    uint16_t last_used;
+    /* avail idx the device was last notified of */
+    uint16_t kicked;
+};
+
+/**
+ * Resets the device and acknowledges it, then negotiates features: the device's offer masked by wanted.
+ *
+ * @return the features both sides agreed on
+ */
+uint32_t virtio_negotiate(uint16_t io_base, uint32_t wanted);
+void virtio_set_status(uint16_t io_base, uint8_t status);
+
+/**
+ * Allocates queue index of the device and hands it over
+ *
+ * @return false if the device hasn't got that queue or there's no DMA memory for it
+ */
+bool vq_init(struct virtqueue* vq, uint16_t io_base, uint16_t index, bool event_idx);
+/// Makes the chain starting at descriptor head available, the device isn't told until vq_kick
+void vq_publish(struct virtqueue* vq, uint16_t head);
+/// Notifies the device of everything published since the last kick, unless it said it doesn't need it
+void vq_kick(struct virtqueue* vq);
+/// Takes the next used entry, returns false if the device hasn't finished anything new
+bool vq_next_used(struct virtqueue* vq, uint32_t* id, uint32_t* len);
+/// Asks for an interrupt on the next used entry. Returns true if entries came in meanwhile, those won't interrupt
+/// anymore so the caller has to look again.
+bool vq_enable_cb(struct virtqueue* vq);
@@ -0,0 +1,26 @@
+#pragma once
+// Virtually contiguous allocations backed by frames from anywhere in physical memory
+
+#include <kernel/vmm.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Allocates size bytes rounded up to whole pages in the vmalloc window. Frames come from the high zone
+/// first and don't have to be contiguous, so this keeps working once physical memory is fragmented.
+/// Returns NULL on failure.
+void* vmalloc(size_t size);
+/// Frees memory returned by vmalloc
+void vfree(void* addr);
+/// Reserves size bytes rounded up to whole pages in the vmalloc window as a vm area with VMA_FLAGS flags,
+/// nothing is mapped until pages are touched. Set the area's ops to back it with something other than zeroed
+/// frames. Returns NULL on failure.
+vm_area_t* vmalloc_area(size_t size, uint32_t flags);
+/// Releases an area from vmalloc_area
+void vfree_area(vm_area_t* area);
+/// True if addr lies in the vmalloc window
+int is_vmalloc_addr(const void* addr);
+/// Maps size bytes of device memory at phys into the vmalloc window. flags are extra PAGE_FLAG_* bits,
+/// PAGE_FLAG_NOCACHE for registers. Returns the virtual address of phys or NULL on failure.
+void* ioremap(uintptr_t phys, size_t size, uint32_t flags);
+/// Removes a mapping made by ioremap
+void iounmap(void* addr);
@@ -0,0 +1,75 @@
+#pragma once
+// Page mapping on top of kernel_page_dir
+
+#include <kernel/memory.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Past this many pages a single TLB flush is cheaper than an invlpg for each of them
+#define TLB_BATCH_MAX 32
+
+/// Pages whose TLB entries went stale, flushed in one go once the page tables are updated
+typedef struct tlb_batch {
+    uintptr_t pages[TLB_BATCH_MAX];
+    size_t count;
+    bool overflow; // More pages than fit, flush everything
+    bool global; // A global mapping changed, a CR3 reload alone won't drop it
+} tlb_batch_t;
+
+void tlb_batch_init(tlb_batch_t* batch);
+/// Records a page whose mapping changed. flags are the flags of the old mapping.
+void tlb_batch_add(tlb_batch_t* batch, uintptr_t vaddr, uint32_t flags);
+/// Invalidates everything recorded, either page by page or with a single flush
+void tlb_batch_flush(tlb_batch_t* batch);
+
+/**
+ * @brief Maps num_pages pages starting at virt to the physical range starting at phys.
+ * Page tables are created as needed, existing mappings are replaced.
+ *
+ * @param flags PAGE_FLAG_* bits for the new entries, PAGE_FLAG_PRESENT is implied
+ * @return 0 on success, -1 if a page table couldn't be allocated or the range hits a 4 MiB mapping.
+ * Nothing stays mapped on failure.
+ */
+int vmm_map_range(uintptr_t virt, uintptr_t phys, size_t num_pages, uint32_t flags);
+/// Unmaps num_pages pages starting at virt. Pages that aren't mapped are skipped.
+void vmm_unmap_range(uintptr_t virt, size_t num_pages);
+
+enum VMA_FLAGS {
+    VMA_WRITE = (1 << 0),
+    VMA_USER = (1 << 1),
+};
+
+typedef struct vm_area vm_area_t;
+
+/// Hooks for areas backed by something other than zeroed frames
+struct vm_area_ops {
+    /// Maps the page at page, which isn't present. Returns 0 when the access can be retried, -1 otherwise.
+    int (*fault)(vm_area_t* area, uintptr_t page);
+    /// Called once the area's pages are unmapped, before it's forgotten
+    void (*release)(vm_area_t* area);
+};
+
+/// A reserved range of virtual memory. Pages are backed by zeroed frames the first time they are touched,
+/// unless the area has ops.
+struct vm_area {
+    uintptr_t start; // Page aligned
+    uintptr_t end;   // One past the last byte, page aligned
+    uint32_t flags;  // VMA_FLAGS
+    const struct vm_area_ops* ops; // NULL for anonymous memory
+    void* private;   // Whatever ops keeps about the area
+    struct vm_area* next;
+};
+
+/// Reserves [start, start + size) without backing it. Returns NULL if the range is unaligned, overlaps
+/// another area or runs into a 4 MiB mapping.
+vm_area_t* vmm_reserve(uintptr_t start, size_t size, uint32_t flags);
+/// Unmaps an area, dropping the frame references its pages held, and forgets it
+void vmm_release(vm_area_t* area);
+/// Returns the area containing addr, or NULL
+vm_area_t* vmm_find_area(uintptr_t addr);
+/// Creates an area at dst sharing every page src has touched so far. Writable pages in both areas become
+/// read-only and get copied by whichever side writes first. Areas with ops can't be cloned.
+vm_area_t* vmm_clone_cow(vm_area_t* src, uintptr_t dst);
+/// Resolves demand-zero and copy-on-write faults. Returns 0 when the access can be retried, -1 otherwise.
+int vmm_handle_fault(uintptr_t addr, uint32_t err_code);
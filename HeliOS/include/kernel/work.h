@@ -0,0 +1,23 @@
+#pragma once
+// Deferred work: interrupt handlers acknowledge their device, queue a work item and return. Queued items run
+// later with interrupts enabled, on the way out of the outermost interrupt or from the idle loop.
+
+#include <stdbool.h>
+
+typedef void (*work_fn_t)(void* data);
+
+/// Owned by whoever queues it, usually static next to the driver's state
+struct work {
+    struct work* next;
+    work_fn_t fn;
+    void* data;
+    volatile bool queued;
+};
+
+void work_setup(struct work* w, work_fn_t fn, void* data);
+/// Queues w to run once, safe from interrupt handlers. Returns false if it was still queued from before.
+bool work_queue(struct work* w);
+/// Runs queued work until the queue is empty, including anything queued meanwhile. Does nothing when
+/// already draining further up the stack, that caller picks the new items up.
+void work_run();
+bool work_pending();
@@ -0,0 +1,238 @@
+#include <kernel/acpi.h>
+#include <kernel/memory.h>
+#include <kernel/sys.h>
+#include <kernel/vmalloc.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BIOS_EBDA_SEGMENT 0x40E
+#define BIOS_ROM_START 0xE0000
+#define BIOS_ROM_END 0x100000
+
+#define MADT_FLAG_PCAT_COMPAT (1 << 0)
+#define MADT_CPU_ENABLED (1 << 0)
+
+enum {
+    MADT_LAPIC = 0,
+    MADT_IOAPIC = 1,
+    MADT_OVERRIDE = 2,
+    MADT_LAPIC_ADDRESS = 5,
+};
+
+struct rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt;
+    // ACPI 2.0+
+    uint32_t length;
+    uint64_t xsdt;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct madt {
+    struct acpi_sdt_header header;
+    uint32_t lapic;
+    uint32_t flags;
+    uint8_t entries[];
+} __attribute__((packed));
+
+struct madt_entry {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct madt_lapic {
+    struct madt_entry entry;
+    uint8_t acpi_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_ioapic {
+    struct madt_entry entry;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+} __attribute__((packed));
+
+struct madt_override {
+    struct madt_entry entry;
+    uint8_t bus;
+    uint8_t source;
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed));
+
+struct madt_lapic_address {
+    struct madt_entry entry;
+    uint16_t reserved;
+    uint64_t address;
+} __attribute__((packed));
+
+static struct acpi_sdt_header* root = NULL; // RSDT or XSDT
+static bool root_is_xsdt = false;
+static struct acpi_madt_info madt_info;
+static bool have_madt = false;
+
+static bool checksum(const void* data, size_t len)
+{
+    const uint8_t* bytes = data;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < len; i++)
+        sum += bytes[i];
+    return sum == 0;
+}
+
+/// Tables are usually in RAM under the direct map, anything else gets its own mapping which is kept for good.
+/// With a signature, only the header is looked at unless it matches, NULL otherwise.
+static struct acpi_sdt_header* map_table(uintptr_t phys, const char* signature)
+{
+    struct acpi_sdt_header* header;
+    if (phys + sizeof(struct acpi_sdt_header) <= DIRECT_MAP_SIZE) {
+        header = (struct acpi_sdt_header*)(phys + KERNEL_OFFSET);
+        if (signature && memcmp(header->signature, signature, 4) != 0) return NULL;
+        if (phys + header->length <= DIRECT_MAP_SIZE) return header;
+    }
+    header = ioremap(phys, sizeof(struct acpi_sdt_header), 0);
+    if (!header) return NULL;
+    bool match = !signature || memcmp(header->signature, signature, 4) == 0;
+    uint32_t length = header->length;
+    iounmap(header);
+    return match ? ioremap(phys, length, 0) : NULL;
+}
+
+/// Gives back the mapping of a table from map_table that turned out to be no use
+static void unmap_table(struct acpi_sdt_header* table)
+{
+    if (is_vmalloc_addr(table)) iounmap(table);
+}
+
+static struct rsdp* scan_rsdp(uintptr_t start, uintptr_t end)
+{
+    for (uintptr_t phys = start; phys + sizeof(struct rsdp) <= end; phys += 16) {
+        struct rsdp* rsdp = (struct rsdp*)(phys + KERNEL_OFFSET);
+        if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 && checksum(rsdp, 20)) return rsdp;
+    }
+    return NULL;
+}
+
+static struct rsdp* find_rsdp()
+{
+    // First KiB of the EBDA, then the BIOS ROM area
+    uintptr_t ebda = (uintptr_t)*(uint16_t*)(BIOS_EBDA_SEGMENT + KERNEL_OFFSET) << 4;
+    struct rsdp* rsdp = ebda ? scan_rsdp(ebda, ebda + 1024) : NULL;
+    if (!rsdp) rsdp = scan_rsdp(BIOS_ROM_START, BIOS_ROM_END);
+    return rsdp;
+}
+
+struct acpi_sdt_header* acpi_find_table(const char* signature)
+{
+    if (!root) return NULL;
+    size_t entry_size = root_is_xsdt ? sizeof(uint64_t) : sizeof(uint32_t);
+    size_t count = (root->length - sizeof(struct acpi_sdt_header)) / entry_size;
+    uint8_t* entries = (uint8_t*)root + sizeof(struct acpi_sdt_header);
+    for (size_t i = 0; i < count; i++) {
+        uint64_t phys;
+        if (root_is_xsdt)
+            memcpy(&phys, entries + i * entry_size, sizeof(uint64_t));
+        else
+            phys = *(uint32_t*)(entries + i * entry_size);
+        // Nothing past 4 GiB is reachable without PAE
+        if (phys >> 32) continue;
+        struct acpi_sdt_header* table = map_table(phys, signature);
+        if (!table) continue;
+        if (!checksum(table, table->length)) {
+            printf("ACPI: %.4s has a bad checksum\n", signature);
+            unmap_table(table);
+            continue;
+        }
+        return table;
+    }
+    return NULL;
+}
+
+static void parse_madt(struct madt* madt)
+{
+    memset(&madt_info, 0, sizeof(madt_info));
+    madt_info.lapic_phys = madt->lapic;
+    madt_info.has_pic = madt->flags & MADT_FLAG_PCAT_COMPAT;
+    for (uint32_t i = 0; i < ACPI_ISA_IRQS; i++)
+        madt_info.isa_gsi[i] = i;
+
+    uint8_t* p = madt->entries;
+    uint8_t* end = (uint8_t*)madt + madt->header.length;
+    while (p + sizeof(struct madt_entry) <= end) {
+        struct madt_entry* entry = (struct madt_entry*)p;
+        if (entry->length < sizeof(struct madt_entry) || p + entry->length > end) break;
+        switch (entry->type) {
+        case MADT_LAPIC: {
+            struct madt_lapic* cpu = (struct madt_lapic*)entry;
+            if (!(cpu->flags & MADT_CPU_ENABLED)) break;
+            if (madt_info.cpu_count < MAX_CPUS)
+                madt_info.cpu_apic_ids[madt_info.cpu_count++] = cpu->apic_id;
+            else
+                printf("ACPI: ignoring CPU with APIC ID %d, only %d supported\n", cpu->apic_id, MAX_CPUS);
+            break;
+        }
+        case MADT_IOAPIC: {
+            struct madt_ioapic* ioapic = (struct madt_ioapic*)entry;
+            if (madt_info.ioapic_count == ACPI_MAX_IOAPICS) break;
+            struct acpi_ioapic* out = &madt_info.ioapics[madt_info.ioapic_count++];
+            out->id = ioapic->id;
+            out->phys = ioapic->address;
+            out->gsi_base = ioapic->gsi_base;
+            break;
+        }
+        case MADT_OVERRIDE: {
+            struct madt_override* override = (struct madt_override*)entry;
+            // Bus 0 is ISA, the only kind of override there is
+            if (override->bus != 0 || override->source >= ACPI_ISA_IRQS) break;
+            madt_info.isa_gsi[override->source] = override->gsi;
+            madt_info.isa_flags[override->source] = override->flags;
+            break;
+        }
+        case MADT_LAPIC_ADDRESS: {
+            struct madt_lapic_address* address = (struct madt_lapic_address*)entry;
+            if (!(address->address >> 32)) madt_info.lapic_phys = address->address;
+            break;
+        }
+        }
+        p += entry->length;
+    }
+    have_madt = true;
+}
+
+int acpi_init()
+{
+    struct rsdp* rsdp = find_rsdp();
+    if (!rsdp) {
+        puts("ACPI: no RSDP found");
+        return -1;
+    }
+    if (rsdp->revision >= 2 && rsdp->xsdt && !(rsdp->xsdt >> 32) && checksum(rsdp, rsdp->length)) {
+        root = map_table(rsdp->xsdt, NULL);
+        root_is_xsdt = true;
+    } else {
+        root = map_table(rsdp->rsdt, NULL);
+    }
+    if (!root || !checksum(root, root->length)) {
+        puts("ACPI: root table is invalid");
+        if (root) unmap_table(root);
+        root = NULL;
+        return -1;
+    }
+
+    struct madt* madt = (struct madt*)acpi_find_table("APIC");
+    if (madt) {
+        parse_madt(madt);
+        printf("ACPI: %d CPUs, %d IOAPICs\n", madt_info.cpu_count, madt_info.ioapic_count);
+    }
+    return 0;
+}
+
+const struct acpi_madt_info* acpi_madt() { return have_madt ? &madt_info : NULL; }
@@ -0,0 +1,77 @@
+#include <kernel/apic.h>
+#include <kernel/asm.h>
+#include <kernel/cpu.h>
+#include <kernel/memory.h>
+#include <kernel/vmalloc.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define IA32_APIC_BASE_MSR 0x1B
+#define APIC_BASE_ENABLE (1 << 11)
+#define SVR_ENABLE (1 << 8)
+
+static volatile uint32_t* lapic = NULL;
+
+int lapic_init()
+{
+    if (lapic) return 0;
+    if (!cpu_check_apic()) return -1;
+    uint64_t base = rdmsr(IA32_APIC_BASE_MSR);
+    uintptr_t phys = base & 0xFFFFF000;
+    wrmsr(IA32_APIC_BASE_MSR, base | APIC_BASE_ENABLE);
+
+    lapic = ioremap(phys, PAGE_SIZE, PAGE_FLAG_NOCACHE);
+    if (!lapic) {
+        printf("lapic_init: couldn't map the local APIC at 0x%X\n", phys);
+        return -1;
+    }
+    lapic_enable_local();
+    return 0;
+}
+
+void lapic_enable_local()
+{
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+}
+
+int lapic_present() { return lapic != NULL; }
+
+uint32_t lapic_read(uint32_t reg) { return lapic[reg / sizeof(uint32_t)]; }
+
+void lapic_write(uint32_t reg, uint32_t value) { lapic[reg / sizeof(uint32_t)] = value; }
+
+void lapic_eoi() { lapic_write(LAPIC_EOI, 0); }
+
+uint8_t lapic_id() { return lapic_read(LAPIC_ID) >> 24; }
+
+void lapic_send_ipi(uint8_t apic_id, uint32_t icr)
+{
+    lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING)
+        asm volatile("pause");
+}
+
+void lapic_timer_oneshot(uint32_t count)
+{
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, count);
+}
+
+void lapic_timer_periodic(uint32_t count)
+{
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, count);
+}
+
+uint32_t lapic_timer_current() { return lapic_read(LAPIC_TIMER_CURRENT); }
+
+void lapic_timer_stop()
+{
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+}
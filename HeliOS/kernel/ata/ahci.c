@@ -0,0 +1,463 @@
+#include <kernel/apic.h>
+#include <kernel/ata/ahci.h>
+#include <kernel/ata/device.h>
+#include <kernel/dma.h>
+#include <kernel/interrupts.h>
+#include <kernel/ktime.h>
+#include <kernel/memory.h>
+#include <kernel/pci/pci.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <kernel/vmalloc.h>
+#include <kernel/work.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+static const int AHCI_CLASS = 0x01;
+static const int AHCI_SUBCLASS = 0x06;
+static const int AHCI_BAR = 5;
+
+static const int AHCI_CMD_TIMEOUT = 3000;  /* ms, for the commands we wait on ourselves */
+static const int AHCI_PORT_TIMEOUT = 500;  /* ms, for the command engine to start or stop */
+static const int AHCI_POLL_INTERVAL = 2;   /* ms, how often completions are looked for without MSI */
+
+#define NS_PER_MS 1000000ULL
+
+#define DISK_OF_DEVICE(dev) ((sAHCIDisk*)((uint8_t*)(dev) - offsetof(sAHCIDisk, device)))
+
+typedef struct {
+    /* the port number on the HBA */
+    uint8_t port;
+    sAHCIPort* regs;
+    sAHCICmdHeader* cmd_list;
+    uintptr_t cmd_list_phys;
+    uint8_t* fis;
+    uintptr_t fis_phys;
+    sAHCICmdTable* tables;
+    uintptr_t tables_phys;
+    /* command slots we use, the HBA's count capped by the drive's queue depth */
+    uint8_t depth;
+    /* whether reads and writes go out as READ/WRITE FPDMA QUEUED */
+    uint8_t ncq;
+    /* guards the slot state below and the issue registers */
+    spinlock_t lock;
+    /* slots taken, issued or being built */
+    uint32_t busy;
+    /* slots handed to the HBA and not reaped yet */
+    uint32_t issued;
+    /* reap is restarting the command engine after an error, nothing gets issued meanwhile */
+    bool recovering;
+    /* block layer request per issued slot */
+    struct bio* reqs[AHCI_MAX_SLOTS];
+    /* port interrupt status collected by the IRQ handler for reap */
+    volatile uint32_t irq_status;
+    struct work reap;
+    /* looks for completions while there's no MSI */
+    struct timer poll;
+    /* woken by the IRQ handler, for the commands issued before the block device exists */
+    struct wait_queue wait;
+    sATADevice device;
+} sAHCIDisk;
+
+static const pci_device_t* ahci_ctrl;
+static sAHCIMem* hba;
+static uint8_t hba_slots;
+static bool use_msi = false;
+
+static sAHCIDisk disks[AHCI_MAX_DEVICES];
+static size_t num_disks = 0;
+
+static bool ahci_read_write(
+    sATADevice* device, uint16_t op, void* buffer, uint64_t lba, size_t secSize, size_t secCount);
+static bool ahci_start(struct block_device* bdev, struct bio* req, int op, void* buffer, uint64_t lba, size_t count);
+
+/// Waits until none of mask is set in *reg. Goes by ktime, which keeps running with interrupts off too.
+static bool wait_clear(volatile uint32_t* reg, uint32_t mask, uint32_t timeout)
+{
+    uint64_t deadline = ktime_get_ns() + timeout * NS_PER_MS;
+    while (*reg & mask) {
+        if (ktime_get_ns() >= deadline) return false;
+        asm volatile("pause");
+    }
+    return true;
+}
+
+static bool port_stop(sAHCIPort* regs)
+{
+    regs->cmd &= ~PORT_CMD_ST;
+    if (!wait_clear(&regs->cmd, PORT_CMD_CR, AHCI_PORT_TIMEOUT)) return false;
+    regs->cmd &= ~PORT_CMD_FRE;
+    return wait_clear(&regs->cmd, PORT_CMD_FR, AHCI_PORT_TIMEOUT);
+}
+
+static bool port_start(sAHCIPort* regs)
+{
+    if (!wait_clear(&regs->cmd, PORT_CMD_CR, AHCI_PORT_TIMEOUT)) return false;
+    // Clears whatever error state the port was left in, it has to be gone before ST goes up
+    regs->serr = 0xFFFFFFFF;
+    regs->is = 0xFFFFFFFF;
+    regs->cmd |= PORT_CMD_FRE;
+    regs->cmd |= PORT_CMD_ST;
+    return true;
+}
+
+/**
+ * Fills in slot's command header, FIS and PRD table.
+ *
+ * @param ncq whether this is a queued command, the count then goes into the features and the tag into the count
+ * @return false if the buffer needs more PRD entries than a table has, or isn't mapped
+ */
+static bool build_command(sAHCIDisk* disk, int slot, uint8_t command, bool write, void* buffer, uint64_t lba,
+    size_t count, bool ncq)
+{
+    sAHCICmdTable* table = disk->tables + slot;
+    memset(table, 0, offsetof(sAHCICmdTable, prdt));
+
+    // One entry per physically contiguous run
+    size_t entries = 0;
+    uintptr_t virt = (uintptr_t)buffer;
+    size_t bytes = buffer ? count * disk->device.sec_size : 0;
+    while (bytes) {
+        uintptr_t phys = get_physaddr(virt);
+        if (!phys || phys & 1) return false;
+        size_t len = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+        if (len > bytes) len = bytes;
+        sAHCIPRD* last = entries ? table->prdt + entries - 1 : NULL;
+        uint32_t last_len = last ? last->dbc + 1 : 0;
+        if (last && last->dba + last_len == phys && last_len + len <= AHCI_PRD_MAX_BYTES) {
+            last->dbc += len;
+        } else {
+            if (entries == AHCI_PRDT_ENTRIES) return false;
+            table->prdt[entries].dba = phys;
+            table->prdt[entries].dbau = 0;
+            table->prdt[entries].rsv = 0;
+            table->prdt[entries].dbc = len - 1;
+            entries++;
+        }
+        virt += len;
+        bytes -= len;
+    }
+
+    sFISRegH2D* fis = (sFISRegH2D*)table->cfis;
+    fis->type = FIS_TYPE_REG_H2D;
+    fis->flags = FIS_H2D_COMMAND;
+    fis->command = command;
+    fis->device = command == COMMAND_IDENTIFY ? 0 : DEVICE_LBA;
+    fis->lba0 = lba & 0xFF;
+    fis->lba1 = (lba >> 8) & 0xFF;
+    fis->lba2 = (lba >> 16) & 0xFF;
+    fis->lba3 = (lba >> 24) & 0xFF;
+    fis->lba4 = (lba >> 32) & 0xFF;
+    fis->lba5 = (lba >> 40) & 0xFF;
+    if (!disk->device.lba48) fis->device |= (lba >> 24) & 0xF;
+    // A count of 0 means the most a command can do, 256 or 65536 sectors
+    if (ncq) {
+        fis->featurel = count & 0xFF;
+        fis->featureh = (count >> 8) & 0xFF;
+        fis->countl = slot << 3;
+    } else {
+        fis->countl = count & 0xFF;
+        fis->counth = (count >> 8) & 0xFF;
+    }
+
+    sAHCICmdHeader* header = disk->cmd_list + slot;
+    header->flags = (sizeof(sFISRegH2D) / 4) | (write ? CMD_HEADER_WRITE : 0);
+    header->prdtl = entries;
+    header->prdbc = 0;
+    header->ctba = disk->tables_phys + slot * sizeof(sAHCICmdTable);
+    header->ctbau = 0;
+    return true;
+}
+
+static uint8_t rw_command(sAHCIDisk* disk, int op, bool ncq)
+{
+    if (op == BIO_FLUSH) return disk->device.lba48 ? COMMAND_CACHE_FLUSH_EXT : COMMAND_CACHE_FLUSH;
+    if (ncq) return op == BIO_WRITE ? COMMAND_WRITE_FPDMA_QUEUED : COMMAND_READ_FPDMA_QUEUED;
+    if (disk->device.lba48) return op == BIO_WRITE ? COMMAND_WRITE_DMA_EXT : COMMAND_READ_DMA_EXT;
+    return op == BIO_WRITE ? COMMAND_WRITE_DMA : COMMAND_READ_DMA;
+}
+
+/**
+ * Runs one non-queued command in slot 0 and waits for it. Only for the time before the block device is
+ * registered, after that everything goes through ahci_start.
+ */
+static bool exec_command(sAHCIDisk* disk, uint8_t command, bool write, void* buffer, uint64_t lba, size_t count)
+{
+    if (!build_command(disk, 0, command, write, buffer, lba, count, false)) return false;
+    sAHCIPort* regs = disk->regs;
+    regs->is = 0xFFFFFFFF;
+    regs->ci = 1;
+    uint32_t start = timer_get_ticks();
+    // The interrupt only wakes us early, the registers decide
+    while (regs->ci & 1 && !(regs->is & PORT_IS_ERROR)) {
+        if (timer_get_ticks() - start >= (uint32_t)AHCI_CMD_TIMEOUT) break;
+        wait_event_timeout(&disk->wait, !(regs->ci & 1) || regs->is & PORT_IS_ERROR, AHCI_POLL_INTERVAL);
+    }
+    bool ok = !(regs->ci & 1) && !(regs->is & PORT_IS_ERROR) && !(regs->tfd & CMD_ST_ERROR);
+    if (!ok) {
+        printf("AHCI port %d: command 0x%X failed, status 0x%X\n", disk->port, command, regs->tfd & 0xFFFF);
+        port_stop(regs);
+        port_start(regs);
+    }
+    regs->is = 0xFFFFFFFF;
+    return ok;
+}
+
+/// Collects finished slots and hands them back to the block layer, runs as deferred work
+static void ahci_reap(void* data)
+{
+    sAHCIDisk* disk = data;
+    sAHCIPort* regs = disk->regs;
+    struct bio* done[AHCI_MAX_SLOTS];
+    size_t num_done = 0;
+
+    uint32_t flags = spin_lock_irqsave(&disk->lock);
+    uint32_t status = __atomic_exchange_n(&disk->irq_status, 0, __ATOMIC_ACQUIRE);
+    // Without MSI nobody acknowledges at the port but us
+    status |= regs->is;
+    regs->is = status;
+    uint32_t finished = disk->issued & ~(regs->ci | regs->sact);
+    bool failed = status & PORT_IS_ERROR || regs->tfd & CMD_ST_ERROR;
+    if (failed) {
+        // An error aborts every queued command, which of them actually made it can't be told apart
+        printf("AHCI port %d: error, status 0x%X, interrupt 0x%X\n", disk->port, regs->tfd & 0xFFFF, status);
+        finished = disk->issued;
+        disk->recovering = true;
+    }
+    for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        if (!(finished & (1u << slot))) continue;
+        done[num_done++] = disk->reqs[slot];
+        disk->reqs[slot] = NULL;
+    }
+    disk->issued &= ~finished;
+    disk->busy &= ~finished;
+    if (!use_msi && disk->issued) timer_add(&disk->poll, AHCI_POLL_INTERVAL);
+    spin_unlock_irqrestore(&disk->lock, flags);
+
+    // Restarting the engine can wait out AHCI_PORT_TIMEOUT several times, far too long to hold the lock with
+    // interrupts off. Nothing is issued, and reap doesn't run twice at once, so the port is ours.
+    if (failed) {
+        port_stop(regs);
+        port_start(regs);
+        flags = spin_lock_irqsave(&disk->lock);
+        disk->recovering = false;
+        spin_unlock_irqrestore(&disk->lock, flags);
+    }
+
+    // block_done may start the next requests right away, which takes the lock again
+    for (size_t i = 0; i < num_done; i++)
+        block_done(done[i], !failed);
+}
+
+static void ahci_poll(void* data)
+{
+    sAHCIDisk* disk = data;
+    work_queue(&disk->reap);
+}
+
+static void ahci_irq_handler(struct irq_regs* r)
+{
+    (void)r;
+    uint32_t pending = hba->is;
+    for (size_t i = 0; i < num_disks; i++) {
+        sAHCIDisk* disk = disks + i;
+        if (!(pending & (1u << disk->port))) continue;
+        // The port's status has to be acknowledged before the HBA's, or the HBA bit comes right back
+        uint32_t status = disk->regs->is;
+        disk->regs->is = status;
+        __atomic_or_fetch(&disk->irq_status, status, __ATOMIC_RELEASE);
+        work_queue(&disk->reap);
+        wake_up(&disk->wait);
+    }
+    hba->is = pending;
+}
+
+static bool ahci_start(struct block_device* bdev, struct bio* req, int op, void* buffer, uint64_t lba, size_t count)
+{
+    sAHCIDisk* disk = bdev->driver_data;
+    // The block layer keeps at most depth requests outstanding, so there is a free slot
+    uint32_t flags = spin_lock_irqsave(&disk->lock);
+    int slot = 0;
+    while (slot < disk->depth && disk->busy & (1u << slot))
+        slot++;
+    if (slot == disk->depth) {
+        spin_unlock_irqrestore(&disk->lock, flags);
+        return false;
+    }
+    disk->busy |= 1u << slot;
+    spin_unlock_irqrestore(&disk->lock, flags);
+
+    // Flushes can't be queued, the block layer only sends them with nothing else outstanding
+    bool ncq = disk->ncq && op != BIO_FLUSH;
+    if (!build_command(disk, slot, rw_command(disk, op, ncq), op == BIO_WRITE, buffer, lba, count, ncq)) {
+        printf("AHCI port %d: buffer for 0x%llX doesn't fit a command\n", disk->port, lba);
+        flags = spin_lock_irqsave(&disk->lock);
+        disk->busy &= ~(1u << slot);
+        spin_unlock_irqrestore(&disk->lock, flags);
+        return false;
+    }
+
+    flags = spin_lock_irqsave(&disk->lock);
+    if (disk->recovering) {
+        disk->busy &= ~(1u << slot);
+        spin_unlock_irqrestore(&disk->lock, flags);
+        return false;
+    }
+    disk->reqs[slot] = req;
+    disk->issued |= 1u << slot;
+    // SACT has to be set before CI for a queued command
+    if (ncq) disk->regs->sact = 1u << slot;
+    disk->regs->ci = 1u << slot;
+    if (!use_msi) timer_add(&disk->poll, AHCI_POLL_INTERVAL);
+    spin_unlock_irqrestore(&disk->lock, flags);
+    return true;
+}
+
+static bool ahci_read_write(
+    sATADevice* device, uint16_t op, void* buffer, uint64_t lba, size_t secSize, size_t secCount)
+{
+    (void)secSize;
+    int bop = op == OP_FLUSH ? BIO_FLUSH : op == OP_WRITE ? BIO_WRITE : BIO_READ;
+    if (block_ready(&device->bdev)) return !block_rw(&device->bdev, bop, lba, secCount, buffer);
+    sAHCIDisk* disk = DISK_OF_DEVICE(device);
+    return exec_command(disk, rw_command(disk, bop, false), op == OP_WRITE, buffer, lba, secCount);
+}
+
+/// Sets up the port's memory, identifies the drive on it and registers its block device
+static bool port_init(sAHCIDisk* disk, uint8_t id)
+{
+    sAHCIPort* regs = disk->regs;
+    sATADevice* device = &disk->device;
+    spin_lock_init(&disk->lock);
+    disk->recovering = false;
+    wait_queue_init(&disk->wait);
+    work_setup(&disk->reap, ahci_reap, disk);
+    timer_setup(&disk->poll, ahci_poll, disk);
+
+    if (!port_stop(regs)) {
+        printf("AHCI port %d: command engine doesn't stop\n", disk->port);
+        return false;
+    }
+    disk->cmd_list = dma_alloc(sizeof(sAHCICmdHeader) * AHCI_MAX_SLOTS, 1024, 0, &disk->cmd_list_phys);
+    disk->fis = dma_alloc(256, 256, 0, &disk->fis_phys);
+    disk->tables = dma_alloc(sizeof(sAHCICmdTable) * hba_slots, 128, 0, &disk->tables_phys);
+    if (!disk->cmd_list || !disk->fis || !disk->tables) {
+        printf("AHCI port %d: no DMA memory\n", disk->port);
+        if (disk->cmd_list) dma_free(disk->cmd_list, sizeof(sAHCICmdHeader) * AHCI_MAX_SLOTS);
+        if (disk->fis) dma_free(disk->fis, 256);
+        if (disk->tables) dma_free(disk->tables, sizeof(sAHCICmdTable) * hba_slots);
+        return false;
+    }
+    regs->clb = disk->cmd_list_phys;
+    regs->clbu = 0;
+    regs->fb = disk->fis_phys;
+    regs->fbu = 0;
+    regs->ie = use_msi ? PORT_IS_DHRS | PORT_IS_PSS | PORT_IS_SDBS | PORT_IS_DPS | PORT_IS_ERROR : 0;
+    if (!port_start(regs)) {
+        printf("AHCI port %d: command engine doesn't start\n", disk->port);
+        return false;
+    }
+
+    device->id = id;
+    device->sec_size = ATA_SEC_SIZE;
+    device->lba48 = 1;
+    if (!exec_command(disk, COMMAND_IDENTIFY, false, device->info, 0, 1)) return false;
+    if (!(device->info[49] & (1 << 9))) {
+        printf("AHCI port %d: drive does not support lba\n", disk->port);
+        return false;
+    }
+    device_parse_capacity(device);
+    device->present = true;
+    device->use_dma = true;
+    device->ctrl = NULL;
+    device->rw_handler = ahci_read_write;
+
+    // Word 76 bit 8: NCQ supported, word 75 holds the drive's queue depth minus one
+    disk->ncq = hba->cap & AHCI_CAP_SNCQ && device->info[76] & (1 << 8);
+    disk->depth = 1;
+    if (disk->ncq) {
+        disk->depth = (device->info[75] & 0x1F) + 1;
+        if (disk->depth > hba_slots) disk->depth = hba_slots;
+    }
+    printf("AHCI disk %d on port %d: 0x%llX sectors, LBA%d, ", id, disk->port, device->sectors,
+        device->lba48 ? 48 : 28);
+    if (disk->ncq)
+        printf("NCQ with %d commands\n", disk->depth);
+    else
+        puts("no NCQ");
+
+    uint16_t buffer[256];
+    if (!ahci_read_write(device, OP_READ, buffer, 0, device->sec_size, 1)) {
+        puts("Unable to read partition table");
+        device->present = false;
+        return false;
+    }
+    part_fill_partitions(device->part_table, buffer);
+    part_print(device->part_table);
+
+    snprintf(device->bdev.name, sizeof(device->bdev.name), "ahci%d", id);
+    device->bdev.sec_size = device->sec_size;
+    device->bdev.sectors = device->sectors;
+    device->bdev.start = ahci_start;
+    device->bdev.depth = disk->depth;
+    device->bdev.driver_data = disk;
+    block_register(&device->bdev);
+    return true;
+}
+
+void ahci_init()
+{
+    ahci_ctrl = get_device_by_class(AHCI_CLASS, AHCI_SUBCLASS);
+    if (!ahci_ctrl) return;
+    const pci_device_t* pci = ahci_ctrl;
+
+    uint32_t command = pci_config_read_word(pci->bus, pci->dev, pci->func, PCI_REG_COMMAND) & 0xFFFF;
+    pci_config_write_word(
+        pci->bus, pci->dev, pci->func, PCI_REG_COMMAND, command | PCI_CMD_MEMORY | PCI_CMD_BUS_MASTER);
+    uint32_t abar = pci_config_read_word(pci->bus, pci->dev, pci->func, PCI_REG_BAR0 + AHCI_BAR * 4) & ~0xF;
+    hba = ioremap(abar, sizeof(sAHCIMem), PAGE_FLAG_NOCACHE);
+    if (!abar || !hba) {
+        puts("AHCI: can't map the HBA registers");
+        return;
+    }
+    hba->ghc |= AHCI_GHC_AE;
+    hba_slots = ((hba->cap >> AHCI_CAP_NCS_SHIFT) & AHCI_CAP_NCS_MASK) + 1;
+
+    if (lapic_present()) {
+        int irq = irq_alloc(ahci_irq_handler);
+        if (irq >= 0 && !pci_enable_msi(pci, IRQ_VECTOR(irq), lapic_id()))
+            use_msi = true;
+        else if (irq >= 0)
+            irq_uninstall_handler(irq);
+    }
+    printf("AHCI %d.%d, %d command slots, completions by %s\n", hba->vs >> 16, (hba->vs >> 8) & 0xFF, hba_slots,
+        use_msi ? "MSI" : "polling");
+
+    uint32_t implemented = hba->pi;
+    for (uint8_t port = 0; port < 32 && num_disks < AHCI_MAX_DEVICES; port++) {
+        if (!(implemented & (1u << port))) continue;
+        sAHCIPort* regs = &hba->ports[port];
+        uint32_t ssts = regs->ssts;
+        if ((ssts & PORT_SSTS_DET_MASK) != PORT_SSTS_DET_PRESENT
+            || ((ssts >> PORT_SSTS_IPM_SHIFT) & 0xF) != PORT_SSTS_IPM_ACTIVE)
+            continue;
+        if (regs->sig != SATA_SIG_ATA) {
+            printf("AHCI port %d: no disk, signature 0x%X\n", port, regs->sig);
+            continue;
+        }
+        sAHCIDisk* disk = disks + num_disks;
+        disk->port = port;
+        disk->regs = regs;
+        // The handler only looks at disks below num_disks, so this one's interrupts are enabled up front
+        if (port_init(disk, num_disks)) num_disks++;
+    }
+    hba->is = 0xFFFFFFFF;
+    if (use_msi) hba->ghc |= AHCI_GHC_IE;
+}
+
+sATADevice* ahci_get_device(uint8_t id)
+{
+    if (id >= num_disks) return NULL;
+    return &disks[id].device;
+}
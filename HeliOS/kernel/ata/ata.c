@@ -2,79 +2,263 @@
 #include <kernel/ata/ata.h>
 #include <kernel/ata/controller.h>
 #include <kernel/ata/device.h>
+#include <kernel/memory.h>
+#include <kernel/sched.h>
 #include <stdio.h>
 
-static uint16_t get_command(sATADevice* device, uint16_t op);
+static uint16_t get_command(sATADevice* device, uint16_t op, bool dma, bool ext);
 static bool setup_command(sATADevice* device, uint32_t lba, size_t sec_count, uint16_t cmd);
+static void issue_command(sATADevice* device, uint64_t lba, size_t sec_count, uint16_t command, bool ext);
+static bool transfer(sATADevice* device, uint16_t op, void* buffer, uint64_t lba, size_t sec_size, size_t sec_count);
+static bool pio_transfer(
+    sATADevice* device, uint16_t op, void* buffer, uint64_t lba, size_t sec_size, size_t sec_count, bool ext);
+static bool flush(sATADevice* device);
+static bool build_prdt(sATAController* ctrl, void* buffer, size_t bytes);
+static bool dma_transfer(sATADevice* device, uint16_t op, uint64_t lba, size_t sec_count, bool ext);
+
+// What one command can address: 28 bit LBAs with an 8 bit count and 48 bit LBAs with a 16 bit one
+#define LBA28_LIMIT 0x10000000ULL
+#define LBA28_MAX_SECTORS 256
+#define LBA48_MAX_SECTORS 65536
+// Worst case every page is its own PRD entry, plus one for a buffer that doesn't start page aligned
+#define DMA_MAX_BYTES ((PRD_ENTRIES - 1) * PAGE_SIZE)
 
-// TODO: Add DMA support, currently just PIO
-//       Also need support for ATAPI
 bool ata_read_write(
-    sATADevice* device, uint16_t op, void* buffer, uint32_t lba, size_t sec_size, size_t sec_count)
+    sATADevice* device, uint16_t op, void* buffer, uint64_t lba, size_t sec_size, size_t sec_count)
 {
-    sATAController* ctrl = device->ctrl;
-    uint16_t command = get_command(device, op);
-    if (!command) return false;
+    mutex_lock(&device->ctrl->lock);
+    bool res = op == OP_FLUSH ? flush(device) : transfer(device, op, buffer, lba, sec_size, sec_count);
+    mutex_unlock(&device->ctrl->lock);
+    return res;
+}
 
-    // bool st = setup_command(device, lba, secCount, command);
-    // PIO Transfer:
+bool ata_set_multiple(sATADevice* device, uint8_t count)
+{
+    sATAController* ctrl = device->ctrl;
+    mutex_lock(&ctrl->lock);
+    issue_command(device, 0, count, COMMAND_SET_MULTIPLE, false);
+    bool res = ctrl_wait_intrpt(ctrl) && device_poll(device)
+        && !(ctrl_inb(ctrl, ATA_REG_STATUS) & (CMD_ST_ERROR | CMD_ST_DISK_FAULT));
+    mutex_unlock(&ctrl->lock);
+    return res;
+}
 
+/// Selects the device and loads the task file registers, the high order bytes first for 48 bit commands,
+/// then issues it
+static void issue_command(sATADevice* device, uint64_t lba, size_t sec_count, uint16_t command, bool ext)
+{
+    sATAController* ctrl = device->ctrl;
     device_poll(device);
-    // printf("Selecting Device %d using 0x%X\n", device->id,
-    // 0xE0 | ((device->id & SLAVE_BIT) << 4) | ((lba >> 24) & 0x0F));
-    ctrl_outb(
-        ctrl, ATA_REG_DRIVE_SELECT, 0xE0 | ((device->id & SLAVE_BIT) << 4) | ((lba >> 24) & 0x0F));
+    // 48 bit commands carry the whole LBA in the address registers, 28 bit ones keep bits 24-27 here
+    uint8_t select = 0xA0 | DEVICE_LBA | ((device->id & SLAVE_BIT) << 4);
+    if (!ext) select |= (lba >> 24) & 0x0F;
+    // printf("Selecting Device %d using 0x%X\n", device->id, select);
+    ctrl_outb(ctrl, ATA_REG_DRIVE_SELECT, select);
     ctrl_wait(ctrl);
-    ctrl_outb(ctrl, ATA_REG_SECTOR_COUNT, (unsigned char)sec_count);
+    ctrl->irqsem = 0;
+    // Each register is a two deep FIFO for 48 bit commands. A count of 0 means 256 or 65536.
+    if (ext) {
+        ctrl_outb(ctrl, ATA_REG_SECTOR_COUNT, (uint8_t)(sec_count >> 8));
+        ctrl_outb(ctrl, ATA_REG_ADDRESS1, (uint8_t)(lba >> 24));
+        ctrl_outb(ctrl, ATA_REG_ADDRESS2, (uint8_t)(lba >> 32));
+        ctrl_outb(ctrl, ATA_REG_ADDRESS3, (uint8_t)(lba >> 40));
+    }
+    ctrl_outb(ctrl, ATA_REG_SECTOR_COUNT, (uint8_t)sec_count);
     ctrl_outb(ctrl, ATA_REG_ADDRESS1, (uint8_t)lba);
     ctrl_outb(ctrl, ATA_REG_ADDRESS2, (uint8_t)(lba >> 8));
     ctrl_outb(ctrl, ATA_REG_ADDRESS3, (uint8_t)(lba >> 16));
     ctrl_outb(ctrl, ATA_REG_COMMAND, command);
     ctrl_wait(ctrl);
+}
 
-    if (command == COMMAND_READ_SEC) {
-        // For each sector we want to get
-        for (size_t i = 0; i < sec_count; i++) {
-            // First we poll the device to wait for it to be ready
-            if (!device_poll(device)) {
+// TODO: Need support for ATAPI
+static bool transfer(sATADevice* device, uint16_t op, void* buffer, uint64_t lba, size_t sec_size, size_t sec_count)
+{
+    if (op != OP_READ && op != OP_WRITE) return false;
+    if (!device->lba48 && lba + sec_count > LBA28_LIMIT) {
+        printf("Device %d can't address sector 0x%llX without LBA48\n", device->id, lba + sec_count - 1);
+        return false;
+    }
+
+    // Split into what one command can take, buffers the PRD table can't describe go through PIO
+    uint8_t* pos = buffer;
+    while (sec_count) {
+        size_t count = sec_count;
+        if (count > (device->lba48 ? LBA48_MAX_SECTORS : LBA28_MAX_SECTORS))
+            count = device->lba48 ? LBA48_MAX_SECTORS : LBA28_MAX_SECTORS;
+        bool dma = device->use_dma;
+        if (dma && count * sec_size > DMA_MAX_BYTES) count = DMA_MAX_BYTES / sec_size;
+        // The 28 bit commands are a few port writes cheaper, so stay on them where they reach
+        bool ext = device->lba48 && (lba + count > LBA28_LIMIT || count > LBA28_MAX_SECTORS);
+        dma = dma && build_prdt(device->ctrl, pos, count * sec_size);
+        bool res = dma ? dma_transfer(device, op, lba, count, ext)
+                       : pio_transfer(device, op, pos, lba, sec_size, count, ext);
+        if (!res) return false;
+        pos += count * sec_size;
+        lba += count;
+        sec_count -= count;
+    }
+    return true;
+}
+
+static bool pio_transfer(
+    sATADevice* device, uint16_t op, void* buffer, uint64_t lba, size_t sec_size, size_t sec_count, bool ext)
+{
+    sATAController* ctrl = device->ctrl;
+    uint16_t command = get_command(device, op, false, ext);
+
+    // bool st = setup_command(device, lba, secCount, command);
+    // PIO Transfer:
+    issue_command(device, lba, sec_count, command, ext);
+
+    // READ/WRITE MULTIPLE move a whole block per DRQ and interrupt instead of a single sector
+    uint16_t* words = buffer;
+    size_t sec_words = sec_size / sizeof(uint16_t);
+    size_t block = device->multiple ? device->multiple : 1;
+    if (op == OP_READ) {
+        // For each block we want to get
+        for (size_t i = 0; i < sec_count; i += block) {
+            size_t n = sec_count - i < block ? sec_count - i : block;
+            // The device interrupts once per block when its data is ready
+            if (!ctrl_wait_intrpt(ctrl) || !device_poll(device)) {
                 printf("Polling failed for device %d\n", device->id);
                 return false;
             }
-            ctrl_inws(ctrl, ATA_REG_DATA, buffer, sec_size / sizeof(uint16_t));
-            // Flush cache
-            ctrl_outb(ctrl, ATA_REG_COMMAND, COMMAND_CACHE_FLUSH);
-            device_poll(device);
+            ctrl_inws(ctrl, ATA_REG_DATA, words, n * sec_words);
+            words += n * sec_words;
         }
-    } else if (command == COMMAND_WRITE_SEC) {
-        // For each sector we want to get
-        for (size_t i = 0; i < sec_count; i++) {
-            // First we poll the device to wait for it to be ready
-            if (!device_poll(device)) {
+    } else {
+        // For each block we want to send
+        for (size_t i = 0; i < sec_count; i += block) {
+            size_t n = sec_count - i < block ? sec_count - i : block;
+            // The first block is asked for by DRQ alone, every one after by an interrupt
+            if ((i && !ctrl_wait_intrpt(ctrl)) || !device_poll(device)) {
                 printf("Polling failed for device %d\n", device->id);
                 return false;
             }
-            ctrl_outws(ctrl, ATA_REG_DATA, buffer, sec_size / sizeof(uint16_t));
+            ctrl_outws(ctrl, ATA_REG_DATA, words, n * sec_words);
+            words += n * sec_words;
+        }
+        // The last interrupt says the data is on the device, not that it reached the medium. That takes
+        // an OP_FLUSH.
+        if (!ctrl_wait_intrpt(ctrl) || !device_poll(device)) return false;
+    }
+
+    if (ctrl_inb(ctrl, ATA_REG_STATUS) & (CMD_ST_ERROR | CMD_ST_DISK_FAULT)) {
+        printf("PIO transfer failed for device %d, error 0x%X\n", device->id, ctrl_inb(ctrl, ATA_REG_ERROR));
+        return false;
+    }
+    return true;
+}
+
+/// Write barrier, returns once everything written before is on the medium
+static bool flush(sATADevice* device)
+{
+    sATAController* ctrl = device->ctrl;
+    issue_command(device, 0, 0, device->lba48 ? COMMAND_CACHE_FLUSH_EXT : COMMAND_CACHE_FLUSH, false);
+    if (!ctrl_wait_intrpt(ctrl) || !device_poll(device)
+        || ctrl_inb(ctrl, ATA_REG_STATUS) & (CMD_ST_ERROR | CMD_ST_DISK_FAULT)) {
+        printf("Cache flush failed for device %d\n", device->id);
+        return false;
+    }
+    return true;
+}
+
+/// Describes buffer in the controller's PRD table, one entry per physically contiguous run inside a 64 KiB
+/// window. Returns false if it doesn't fit the table or isn't word aligned.
+static bool build_prdt(sATAController* ctrl, void* buffer, size_t bytes)
+{
+    uintptr_t virt = (uintptr_t)buffer;
+    if (virt & 1 || bytes & 1 || !bytes) return false;
+    size_t n = 0;
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+    while (bytes) {
+        uintptr_t phys = get_physaddr(virt);
+        if (!phys) return false;
+        // Never past the page, the next one can be anywhere physically
+        size_t len = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+        if (len > bytes) len = bytes;
+        bool extends = run_len && run_start + run_len == phys
+            && (run_start & ~(PRD_BOUNDARY - 1)) == ((phys + len - 1) & ~(PRD_BOUNDARY - 1));
+        if (extends) {
+            run_len += len;
+        } else {
+            if (run_len) {
+                if (n == PRD_ENTRIES) return false;
+                ctrl->prdt[n++] = (sPRD) { run_start, (uint16_t)run_len, 0 };
+            }
+            run_start = phys;
+            run_len = len;
         }
-        // Flush cache
-        ctrl_outb(ctrl, ATA_REG_COMMAND, COMMAND_CACHE_FLUSH);
-        device_poll(device);
+        virt += len;
+        bytes -= len;
     }
+    if (n == PRD_ENTRIES) return false;
+    ctrl->prdt[n] = (sPRD) { run_start, (uint16_t)run_len, PRD_LAST };
+    return true;
+}
+
+/// Done, failed or stopped, leaves the bus-master status in *status
+static bool dma_settled(sATAController* ctrl, uint8_t* status)
+{
+    *status = ctrl_bmr_inb(ctrl, BMR_REG_STATUS);
+    return !(*status & BMR_STATUS_DMA) || *status & (BMR_STATUS_IRQ | BMR_STATUS_ERROR);
+}
+
+/// Runs a command through the bus-master with the PRD table build_prdt filled in
+static bool dma_transfer(sATADevice* device, uint16_t op, uint64_t lba, size_t sec_count, bool ext)
+{
+    sATAController* ctrl = device->ctrl;
+    // The bus-master writes memory when the disk is read, so the direction bit is the other way round
+    uint8_t direction = op == OP_WRITE ? 0 : BMR_CMD_READ;
 
+    ctrl_bmr_outb(ctrl, BMR_REG_COMMAND, direction);
+    ctrl_bmr_outl(ctrl, BMR_REG_PRDT, ctrl->prdt_phys);
+    // Both bits clear by writing them back
+    ctrl_bmr_outb(ctrl, BMR_REG_STATUS, ctrl_bmr_inb(ctrl, BMR_REG_STATUS) | BMR_STATUS_IRQ | BMR_STATUS_ERROR);
+
+    issue_command(device, lba, sec_count, get_command(device, op, true, ext), ext);
+    ctrl_bmr_outb(ctrl, BMR_REG_COMMAND, direction | BMR_CMD_START);
+
+    // The IRQ handler wakes us when the device is done, the interval only catches lost interrupts
+    int interval = ctrl->use_irq ? IRQ_POLL_INTERVAL : DMA_TRANSFER_SLEEPTIME;
+    uint8_t bmr_status;
+    int waited = 0;
+    bool done = true;
+    while (!wait_event_timeout(&ctrl->wait, dma_settled(ctrl, &bmr_status), interval)) {
+        waited += interval;
+        if (waited >= DMA_TRANSFER_TIMEOUT) {
+            done = false;
+            break;
+        }
+    }
+    ctrl_bmr_outb(ctrl, BMR_REG_COMMAND, direction);
+    ctrl_bmr_outb(ctrl, BMR_REG_STATUS, BMR_STATUS_IRQ | BMR_STATUS_ERROR);
+    // Reading the status register also acknowledges the device's interrupt
+    done = done && device_poll(device);
+    uint8_t status = ctrl_inb(ctrl, ATA_REG_STATUS);
+    if (!done || bmr_status & BMR_STATUS_ERROR || status & (CMD_ST_ERROR | CMD_ST_DISK_FAULT)) {
+        printf("DMA transfer failed for device %d, status 0x%X, bus-master 0x%X\n", device->id, status,
+            bmr_status);
+        return false;
+    }
     return true;
 }
 
-static uint16_t get_command(sATADevice* device, uint16_t op)
+static uint16_t get_command(sATADevice* device, uint16_t op, bool dma, bool ext)
 {
-    switch (op) {
-    case OP_READ:
-        return COMMAND_READ_SEC;
-    case OP_WRITE:
-        return COMMAND_WRITE_SEC;
-    case OP_PACKET: // TODO: Figure out wtf this is
-        return COMMAND_PACKET;
+    bool write = op == OP_WRITE;
+    if (dma) {
+        if (ext) return write ? COMMAND_WRITE_DMA_EXT : COMMAND_READ_DMA_EXT;
+        return write ? COMMAND_WRITE_DMA : COMMAND_READ_DMA;
+    }
+    if (device->multiple > 1) {
+        if (ext) return write ? COMMAND_WRITE_MULTIPLE_EXT : COMMAND_READ_MULTIPLE_EXT;
+        return write ? COMMAND_WRITE_MULTIPLE : COMMAND_READ_MULTIPLE;
     }
-    // IDK just gonna return zero if not valid
-    return 0;
+    if (ext) return write ? COMMAND_WRITE_SEC_EXT : COMMAND_READ_SEC_EXT;
+    return write ? COMMAND_WRITE_SEC : COMMAND_READ_SEC;
 }
 
 static bool setup_command(sATADevice* device, uint32_t lba, size_t sec_count, uint16_t cmd)
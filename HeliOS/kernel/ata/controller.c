@@ -1,6 +1,10 @@
 #include <kernel/asm.h>
 #include <kernel/ata/controller.h>
 #include <kernel/ata/device.h>
+#include <kernel/dma.h>
+#include <kernel/interrupts.h>
+#include <kernel/ktime.h>
+#include <kernel/memory.h>
 #include <kernel/pci/pci.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -17,8 +21,38 @@ static const pci_device_t* ide_ctrl;
 
 static sATAController ctrls[2];
 
+static void ctrl_irq_handler(struct irq_regs* r)
+{
+    int irq = r->int_no - IRQ_VECTOR_BASE;
+    for (size_t i = 0; i < 2; i++) {
+        sATAController* ctrl = ctrls + i;
+        if (ctrl->irq != irq) continue;
+        // Reading the status register acknowledges the interrupt on the device
+        ctrl_inb(ctrl, ATA_REG_STATUS);
+        ctrl->irqsem = 1;
+        wake_up(&ctrl->wait);
+    }
+}
+
+/// Identifies both devices of a channel. Each channel has a thread of its own so one's timeouts don't hold up
+/// the other, or the rest of boot.
+static void ctrl_probe(void* arg)
+{
+    sATAController* ctrl = arg;
+    // Init attached drives, beginning with slave
+    for (short int j = 1; j >= 0; j--)
+        device_init(ctrl->devices + j);
+    ctrl->probed = true;
+    wake_up(&ctrl->probe_wait);
+}
+
 void ctrl_init()
 {
+    // Without a controller there's nothing to wait for
+    for (size_t i = 0; i < 2; i++) {
+        wait_queue_init(&ctrls[i].probe_wait);
+        ctrls[i].probed = true;
+    }
     ide_ctrl = get_device_by_class(IDE_CTRL_CLASS, IDE_CTRL_SUBCLASS);
     if (!ide_ctrl) {
         puts("Could not get IDE controller.");
@@ -40,24 +74,57 @@ void ctrl_init()
     ctrls[1].irq = CTRL_IRQ_BASE + 1;
     ctrls[1].port_base = PORTBASE_SECONDARY;
 
+    // BAR4 holds the bus-master registers, 8 ports per channel. Only I/O space BARs are the real thing.
+    uint32_t bar = pci_config_read_word(ide_ctrl->bus, ide_ctrl->dev, ide_ctrl->func, PCI_REG_BAR0 + IDE_CTRL_BAR * 4);
+    uint16_t bmr_base = bar & 0x1 ? bar & 0xFFFC : 0;
+    if (bmr_base) {
+        pci_config_write_word(ide_ctrl->bus, ide_ctrl->dev, ide_ctrl->func, PCI_REG_COMMAND,
+            (status & 0xFFFF) | PCI_CMD_IO | PCI_CMD_BUS_MASTER);
+    } else {
+        puts("IDE controller has no bus-master, using PIO");
+    }
+
     for (size_t i = 0; i < 2; i++) {
         printf("Initializing controller: %d\n", ctrls[i].id);
 
         ctrls[i].use_irq = false;
         ctrls[i].use_dma = false;
+        ctrls[i].irqsem = 0;
+        ctrls[i].bmr_base = 0;
+        if (bmr_base) {
+            // The table itself has to stay inside one 64 KiB window
+            ctrls[i].prdt = dma_alloc(PRD_ENTRIES * sizeof(sPRD), 4, PRD_BOUNDARY, &ctrls[i].prdt_phys);
+            if (ctrls[i].prdt) {
+                ctrls[i].bmr_base = bmr_base + i * 8;
+                ctrls[i].use_dma = true;
+            }
+        }
+        wait_queue_init(&ctrls[i].wait);
+        mutex_init(&ctrls[i].lock);
+        irq_install_handler(ctrls[i].irq, ctrl_irq_handler);
+        ctrls[i].use_irq = true;
 
-        // Init attached drives, beginning with slave
-        for (short int j = 1; j >= 0; j--) {
+        for (size_t j = 0; j < 2; j++) {
             ctrls[i].devices[j].present = false;
             ctrls[i].devices[j].id = i * 2 + j;
             ctrls[i].devices[j].ctrl = ctrls + i;
-            device_init(ctrls[i].devices + j);
         }
+        ctrls[i].probed = false;
+        // IDENTIFY completes through the IRQ or times out on the timer, either way the other channel and
+        // the rest of boot carry on meanwhile
+        if (!thread_create(i ? "ata probe 1" : "ata probe 0", ctrl_probe, ctrls + i)) ctrl_probe(ctrls + i);
     }
 }
 
 sATADevice* ctrl_get_device(uint8_t id) { return ctrls[id / 2].devices + id % 2; }
 
+sATADevice* ctrl_wait_device(uint8_t id)
+{
+    sATAController* ctrl = ctrls + id / 2;
+    wait_event(&ctrl->probe_wait, ctrl->probed);
+    return ctrl->devices + id % 2;
+}
+
 void ctrl_outb(sATAController* ctrl, uint16_t reg, uint8_t value)
 {
     outb(ctrl->port_base + reg, value);
@@ -68,14 +135,33 @@ uint16_t ctrl_inw(sATAController* ctrl, uint16_t reg) { return inw(ctrl->port_ba
 
 void ctrl_inws(sATAController* ctrl, uint16_t reg, uint16_t* buff, size_t count)
 {
-    for (size_t i = 0; i < count; i++)
-        buff[i] = inw(ctrl->port_base + reg);
+    insw(ctrl->port_base + reg, buff, count);
 }
 
 void ctrl_outws(sATAController* ctrl, uint16_t reg, const uint16_t* buff, size_t count)
 {
-    for (size_t i = 0; i < count; i++)
-        outword(ctrl->port_base + reg, buff[i]);
+    outsw(ctrl->port_base + reg, buff, count);
+}
+
+void ctrl_bmr_outb(sATAController* ctrl, uint16_t reg, uint8_t value) { outb(ctrl->bmr_base + reg, value); }
+void ctrl_bmr_outl(sATAController* ctrl, uint16_t reg, uint32_t value) { outdword(ctrl->bmr_base + reg, value); }
+uint8_t ctrl_bmr_inb(sATAController* ctrl, uint16_t reg) { return inb(ctrl->bmr_base + reg); }
+
+bool ctrl_wait_intrpt(sATAController* ctrl)
+{
+    if (!ctrl->use_irq) return true;
+    // Each wait can overshoot its interval, so the timeout goes by the clock
+    uint64_t deadline = ktime_get_ns() + (uint64_t)IRQ_TIMEOUT * 1000000;
+    while (!wait_event_timeout(&ctrl->wait, ctrl->irqsem, IRQ_POLL_INTERVAL)) {
+        // The interrupt got lost, but the device is done anyway
+        if (!(ctrl_inb(ctrl, ATA_REG_ALT_STATUS) & CMD_ST_BUSY)) break;
+        if (ktime_get_ns() >= deadline) {
+            printf("Controller %d timed out waiting for an interrupt\n", ctrl->id);
+            return false;
+        }
+    }
+    ctrl->irqsem = 0;
+    return true;
 }
 
 void ctrl_wait(sATAController* ctrl)
@@ -2,9 +2,12 @@
 #include <kernel/ata/controller.h>
 #include <kernel/ata/device.h>
 #include <kernel/ata/partition.h>
+#include <kernel/sched.h>
 #include <kernel/timer.h>
 #include <stdio.h>
 
+static bool device_block_transfer(struct block_device* bdev, int op, void* buffer, uint64_t lba, size_t count);
+
 static bool device_identify(sATADevice* device, uint16_t cmd);
 
 // TODO: Clean this up a bit.
@@ -27,6 +30,16 @@ void device_init(sATADevice* device)
     if (!(device->info[0] & (1 << 15))) {
         device->sec_size = ATA_SEC_SIZE;
         device->rw_handler = ata_read_write;
+        // Word 49 bit 8: DMA supported
+        device->use_dma = ctrl->use_dma && (device->info[49] & (1 << 8));
+        // Word 47 low byte: most sectors per READ/WRITE MULTIPLE block, for whatever goes through PIO
+        uint8_t max_multiple = device->info[47] & 0xFF;
+        device->multiple = 0;
+        if (max_multiple > 1 && ata_set_multiple(device, max_multiple))
+            device->multiple = max_multiple;
+        printf("Device %d transfers using %s", device->id, device->use_dma ? "DMA" : "PIO");
+        if (device->multiple) printf(", %d sectors per block", device->multiple);
+        printf(", LBA%d\n", device->lba48 ? 48 : 28);
         printf("Device %d is an ATA-device\n", device->id);
         // Read partition table
         if (!ata_read_write(device, OP_READ, buffer, 0, device->sec_size, 1)) {
@@ -40,9 +53,23 @@ void device_init(sATADevice* device)
         // }
         part_fill_partitions(device->part_table, buffer);
         part_print(device->part_table);
+
+        snprintf(device->bdev.name, sizeof(device->bdev.name), "ata%d", device->id);
+        device->bdev.sec_size = device->sec_size;
+        device->bdev.sectors = device->sectors;
+        device->bdev.transfer = device_block_transfer;
+        device->bdev.driver_data = device;
+        block_register(&device->bdev);
     }
 }
 
+static bool device_block_transfer(struct block_device* bdev, int op, void* buffer, uint64_t lba, size_t count)
+{
+    sATADevice* device = bdev->driver_data;
+    uint16_t ata_op = op == BIO_FLUSH ? OP_FLUSH : op == BIO_WRITE ? OP_WRITE : OP_READ;
+    return device->rw_handler(device, ata_op, buffer, lba, device->sec_size, count);
+}
+
 static bool device_identify(sATADevice* device, uint16_t cmd)
 {
     // ata-atapi-8 7.12
@@ -54,8 +81,8 @@ static bool device_identify(sATADevice* device, uint16_t cmd)
     ctrl_outb(ctrl, ATA_REG_DRIVE_SELECT, device_select);
     ctrl_wait(ctrl);
 
-    /* disable interrupts */
-    ctrl_outb(ctrl, ATA_REG_CONTROL, CTRL_NIEN);
+    /* interrupts only when someone handles them, IDENTIFY itself is polled either way */
+    ctrl_outb(ctrl, ATA_REG_CONTROL, ctrl->use_irq ? 0 : CTRL_NIEN);
 
     /* check whether the device exists */
     ctrl_outb(ctrl, ATA_REG_COMMAND, cmd);
@@ -94,22 +121,41 @@ static bool device_identify(sATADevice* device, uint16_t cmd)
         return false;
     }
 
-    uint32_t lba_num = device->info[60] | (device->info[61] << 16);
-    printf("Device %d LBA support: 0x%X\n", device->id, lba_num);
+    device_parse_capacity(device);
+    printf("Device %d LBA support: 0x%llX\n", device->id, device->sectors);
     return true;
 }
 
+void device_parse_capacity(sATADevice* device)
+{
+    // Word 83 bit 10: 48 bit address feature set, the count then is in words 100-103
+    device->lba48 = device->info[83] & (1 << 10) ? 1 : 0;
+    if (device->lba48) {
+        device->sectors = device->info[100] | ((uint64_t)device->info[101] << 16)
+            | ((uint64_t)device->info[102] << 32) | ((uint64_t)device->info[103] << 48);
+    } else {
+        device->sectors = device->info[60] | ((uint32_t)device->info[61] << 16);
+    }
+}
+
+/// Done being busy, ready for data or failed, leaves the status it read in *status
+static bool device_settled(sATAController* ctrl, uint8_t* status)
+{
+    *status = ctrl_inb(ctrl, ATA_REG_STATUS);
+    if (!(*status & CMD_ST_BUSY) || *status & CMD_ST_DRQ) return true;
+    return *status & (CMD_ST_ERROR | CMD_ST_DISK_FAULT);
+}
+
 bool device_poll(sATADevice* device)
 {
-    uint32_t elapsed = 0;
     sATAController* ctrl = device->ctrl;
-    uint8_t status = ctrl_inb(ctrl, ATA_REG_STATUS);
-    while (status & CMD_ST_BUSY && !(status & CMD_ST_DRQ) && elapsed < ATA_WAIT_TIMEOUT) {
-        if (status & CMD_ST_ERROR || status & CMD_ST_DISK_FAULT) return false;
-        sleep(20);
-        elapsed += 20;
-        status = ctrl_inb(ctrl, ATA_REG_STATUS);
+    uint8_t status;
+    // The thread blocks in between so others get the CPU. Nothing wakes the queue while the controller
+    // runs without its IRQ, so the status is rechecked every ATA_WAIT_SLEEPTIME. Sleeps can run long, the
+    // timeout goes by the clock and not by how many of them there were.
+    uint32_t start = timer_get_ticks();
+    while (!wait_event_timeout(&ctrl->wait, device_settled(ctrl, &status), ATA_WAIT_SLEEPTIME)) {
+        if (timer_get_ticks() - start >= (uint32_t)ATA_WAIT_TIMEOUT) return false;
     }
-    if (elapsed >= ATA_WAIT_TIMEOUT) return false;
-    return true;
+    return !(status & CMD_ST_BUSY) || status & CMD_ST_DRQ;
 }
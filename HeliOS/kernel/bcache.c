@@ -0,0 +1,343 @@
+#include <kernel/bcache.h>
+#include <kernel/liballoc.h>
+#include <kernel/sched.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BUF_OF_BIO(bio) ((struct buf*)((uint8_t*)(bio) - offsetof(struct buf, bio)))
+
+static struct buf bufs[BCACHE_BUFFERS];
+static struct buf* hash[BCACHE_HASH_SIZE];
+// Unreferenced buffers, most recently released at the head
+static struct buf* lru_head = NULL;
+static struct buf* lru_tail = NULL;
+// Guards the hash, the LRU list and every buffer's flags and refs. Sector data isn't covered, filesystems
+// order their own updates.
+static spinlock_t cache_lock = SPINLOCK_INIT;
+// Only one bcache_sync(NULL) pass at a time, they share the synced flags in the block devices
+static struct mutex sync_lock = MUTEX_INIT;
+// Woken when a load or a write-back finishes
+static struct wait_queue load_wait;
+static struct wait_queue wb_wait;
+static uint32_t hits = 0;
+static uint32_t misses = 0;
+static uint32_t prefetches = 0;
+
+struct writeback {
+    volatile uint32_t pending;
+    volatile bool failed;
+};
+
+static inline size_t hash_of(struct block_device* bdev, uint64_t lba)
+{
+    return ((uint32_t)lba ^ (uint32_t)(lba >> 32) ^ ((uintptr_t)bdev >> 4)) & (BCACHE_HASH_SIZE - 1);
+}
+
+static void lru_remove(struct buf* b)
+{
+    if (b->lru_prev)
+        b->lru_prev->lru_next = b->lru_next;
+    else
+        lru_head = b->lru_next;
+    if (b->lru_next)
+        b->lru_next->lru_prev = b->lru_prev;
+    else
+        lru_tail = b->lru_prev;
+    b->lru_prev = b->lru_next = NULL;
+}
+
+static void lru_push(struct buf* b)
+{
+    b->lru_prev = NULL;
+    b->lru_next = lru_head;
+    if (lru_head)
+        lru_head->lru_prev = b;
+    else
+        lru_tail = b;
+    lru_head = b;
+}
+
+static struct buf* lookup(struct block_device* bdev, uint64_t lba)
+{
+    for (struct buf* b = hash[hash_of(bdev, lba)]; b; b = b->hash_next) {
+        if (b->bdev == bdev && b->lba == lba) return b;
+    }
+    return NULL;
+}
+
+static void hash_remove(struct buf* b)
+{
+    struct buf** link = &hash[hash_of(b->bdev, b->lba)];
+    while (*link != b)
+        link = &(*link)->hash_next;
+    *link = b->hash_next;
+    b->hash_next = NULL;
+}
+
+static void grab(struct buf* b)
+{
+    if (b->refs++ == 0) lru_remove(b);
+}
+
+/// Reuses the least recently used clean buffer for (bdev, lba), called with the lock held. Returns NULL if
+/// every unreferenced buffer is dirty or there are none.
+static struct buf* claim(struct block_device* bdev, uint64_t lba)
+{
+    struct buf* b = lru_tail;
+    while (b && b->flags & (BUF_DIRTY | BUF_WRITING | BUF_LOADING))
+        b = b->lru_prev;
+    if (!b) return NULL;
+    if (b->bdev) hash_remove(b);
+    b->bdev = bdev;
+    b->lba = lba;
+    b->flags = 0;
+    size_t bucket = hash_of(bdev, lba);
+    b->hash_next = hash[bucket];
+    hash[bucket] = b;
+    grab(b);
+    return b;
+}
+
+static void writeback_end(struct bio* bio)
+{
+    struct buf* b = BUF_OF_BIO(bio);
+    struct writeback* wb = bio->private;
+    uint32_t flags = spin_lock_irqsave(&cache_lock);
+    b->flags &= ~BUF_WRITING;
+    // Stays dirty so the next round retries it
+    if (bio->error) {
+        if (!(b->flags & BUF_DIRTY)) b->dirtied = timer_get_ticks();
+        b->flags |= BUF_DIRTY;
+        wb->failed = true;
+    }
+    spin_unlock_irqrestore(&cache_lock, flags);
+    brelse(b);
+    // wb lives on the waiter's stack, it can be gone right after this
+    __atomic_sub_fetch(&wb->pending, 1, __ATOMIC_RELEASE);
+    wake_up(&wb_wait);
+}
+
+/// Writes back the dirty buffers of bdev (any for NULL) that have been dirty for at least min_age ms. They're
+/// all submitted before waiting, so the block layer gets to merge neighbours.
+static int writeback(struct block_device* bdev, uint32_t min_age)
+{
+    struct writeback wb = { 0, false };
+    uint32_t now = timer_get_ticks();
+    for (size_t i = 0; i < BCACHE_BUFFERS; i++) {
+        struct buf* b = bufs + i;
+        uint32_t flags = spin_lock_irqsave(&cache_lock);
+        bool take = b->flags & BUF_DIRTY && !(b->flags & BUF_WRITING) && (!bdev || b->bdev == bdev)
+            && now - b->dirtied >= min_age;
+        if (take) {
+            grab(b);
+            b->flags = (b->flags & ~BUF_DIRTY) | BUF_WRITING;
+        }
+        spin_unlock_irqrestore(&cache_lock, flags);
+        if (!take) continue;
+        __atomic_add_fetch(&wb.pending, 1, __ATOMIC_RELAXED);
+        bio_init(&b->bio, b->bdev, BIO_WRITE, b->lba, 1, b->data, writeback_end, &wb);
+        block_submit(&b->bio);
+    }
+    wait_event(&wb_wait, __atomic_load_n(&wb.pending, __ATOMIC_ACQUIRE) == 0);
+    return wb.failed ? -1 : 0;
+}
+
+static void bcache_flusher(void* arg)
+{
+    (void)arg;
+    while (true) {
+        sleep(BCACHE_FLUSH_INTERVAL);
+        writeback(NULL, BCACHE_DIRTY_EXPIRE);
+    }
+}
+
+void bcache_init()
+{
+    wait_queue_init(&load_wait);
+    wait_queue_init(&wb_wait);
+    for (size_t i = 0; i < BCACHE_BUFFERS; i++)
+        lru_push(bufs + i);
+    if (!thread_create("bflush", bcache_flusher, NULL))
+        puts("bcache: no flusher thread, dirty buffers wait for bcache_sync");
+}
+
+struct buf* bread(struct block_device* bdev, uint64_t lba)
+{
+    if (!block_ready(bdev)) return NULL;
+    uint32_t flags = spin_lock_irqsave(&cache_lock);
+    struct buf* b = lookup(bdev, lba);
+    if (b) {
+        grab(b);
+    } else {
+        b = claim(bdev, lba);
+        if (!b) {
+            // Everything unreferenced is dirty, clean it and try once more
+            spin_unlock_irqrestore(&cache_lock, flags);
+            writeback(NULL, 0);
+            flags = spin_lock_irqsave(&cache_lock);
+            b = lookup(bdev, lba);
+            if (b)
+                grab(b);
+            else
+                b = claim(bdev, lba);
+        }
+        if (!b) {
+            spin_unlock_irqrestore(&cache_lock, flags);
+            puts("bcache: every buffer is in use");
+            return NULL;
+        }
+    }
+
+    while (true) {
+        if (b->flags & BUF_VALID) {
+            hits++;
+            spin_unlock_irqrestore(&cache_lock, flags);
+            return b;
+        }
+        if (!(b->flags & BUF_LOADING)) break;
+        spin_unlock_irqrestore(&cache_lock, flags);
+        wait_event(&load_wait, !(b->flags & BUF_LOADING));
+        flags = spin_lock_irqsave(&cache_lock);
+    }
+    // Nobody had it, or their read failed. Others wait for us while we load.
+    b->flags |= BUF_LOADING;
+    misses++;
+    spin_unlock_irqrestore(&cache_lock, flags);
+
+    bool ok = true;
+    if (b->size != bdev->sec_size) {
+        kfree(b->data);
+        b->data = kmalloc(bdev->sec_size);
+        b->size = b->data ? bdev->sec_size : 0;
+        ok = b->data != NULL;
+    }
+    ok = ok && !block_read(bdev, lba, 1, b->data);
+
+    flags = spin_lock_irqsave(&cache_lock);
+    b->flags &= ~BUF_LOADING;
+    if (ok) b->flags |= BUF_VALID;
+    spin_unlock_irqrestore(&cache_lock, flags);
+    wake_up(&load_wait);
+    if (!ok) {
+        brelse(b);
+        return NULL;
+    }
+    return b;
+}
+
+static void prefetch_end(struct bio* bio)
+{
+    struct buf* b = BUF_OF_BIO(bio);
+    uint32_t flags = spin_lock_irqsave(&cache_lock);
+    b->flags &= ~BUF_LOADING;
+    // A failed prefetch leaves it invalid, bread then tries on its own
+    if (!bio->error) b->flags |= BUF_VALID;
+    spin_unlock_irqrestore(&cache_lock, flags);
+    wake_up(&load_wait);
+    brelse(b);
+}
+
+void bprefetch(struct block_device* bdev, uint64_t lba, size_t count)
+{
+    if (!block_ready(bdev)) return;
+    // Submitted one by one, the block layer merges them back into a single command
+    for (size_t i = 0; i < count; i++) {
+        uint32_t flags = spin_lock_irqsave(&cache_lock);
+        if (lookup(bdev, lba + i)) {
+            spin_unlock_irqrestore(&cache_lock, flags);
+            continue;
+        }
+        struct buf* b = claim(bdev, lba + i);
+        if (b) {
+            b->flags |= BUF_LOADING;
+            prefetches++;
+        }
+        spin_unlock_irqrestore(&cache_lock, flags);
+        if (!b) return;
+
+        if (b->size != bdev->sec_size) {
+            kfree(b->data);
+            b->data = kmalloc(bdev->sec_size);
+            b->size = b->data ? bdev->sec_size : 0;
+        }
+        if (!b->data) {
+            bio_init(&b->bio, bdev, BIO_READ, lba + i, 1, NULL, prefetch_end, NULL);
+            b->bio.error = -1;
+            prefetch_end(&b->bio);
+            return;
+        }
+        bio_init(&b->bio, bdev, BIO_READ, lba + i, 1, b->data, prefetch_end, NULL);
+        block_submit(&b->bio);
+    }
+}
+
+void bdirty(struct buf* b)
+{
+    uint32_t flags = spin_lock_irqsave(&cache_lock);
+    if (!(b->flags & BUF_DIRTY)) b->dirtied = timer_get_ticks();
+    b->flags |= BUF_DIRTY;
+    spin_unlock_irqrestore(&cache_lock, flags);
+}
+
+int bwrite(struct buf* b)
+{
+    uint32_t flags = spin_lock_irqsave(&cache_lock);
+    b->flags &= ~BUF_DIRTY;
+    spin_unlock_irqrestore(&cache_lock, flags);
+    int res = block_write(b->bdev, b->lba, 1, b->data);
+    if (res) bdirty(b);
+    return res;
+}
+
+void bupdate(struct block_device* bdev, uint64_t lba, size_t count, const void* data)
+{
+    const uint8_t* src = data;
+    for (size_t i = 0; i < count; i++, src += bdev->sec_size) {
+        uint32_t flags = spin_lock_irqsave(&cache_lock);
+        struct buf* b = lookup(bdev, lba + i);
+        if (b && b->flags & BUF_VALID)
+            grab(b);
+        else
+            b = NULL;
+        spin_unlock_irqrestore(&cache_lock, flags);
+        if (!b) continue;
+        memcpy(b->data, src, bdev->sec_size);
+        brelse(b);
+    }
+}
+
+void brelse(struct buf* b)
+{
+    if (!b) return;
+    uint32_t flags = spin_lock_irqsave(&cache_lock);
+    if (--b->refs == 0) lru_push(b);
+    spin_unlock_irqrestore(&cache_lock, flags);
+}
+
+int bcache_sync(struct block_device* bdev)
+{
+    int res = writeback(bdev, 0);
+    if (bdev) return block_flush(bdev) || res ? -1 : 0;
+
+    // Flush every device that has something cached, once each however many devices there are
+    mutex_lock(&sync_lock);
+    for (size_t i = 0; i < BCACHE_BUFFERS; i++)
+        if (bufs[i].bdev) bufs[i].bdev->synced = false;
+    for (size_t i = 0; i < BCACHE_BUFFERS; i++) {
+        struct block_device* dev = bufs[i].bdev;
+        if (!dev || dev->synced) continue;
+        dev->synced = true;
+        if (block_flush(dev)) res = -1;
+    }
+    mutex_unlock(&sync_lock);
+    return res;
+}
+
+void bcache_stats(uint32_t* hit_count, uint32_t* miss_count, uint32_t* prefetch_count)
+{
+    *hit_count = hits;
+    *miss_count = misses;
+    *prefetch_count = prefetches;
+}
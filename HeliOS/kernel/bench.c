@@ -0,0 +1,234 @@
+#include <kernel/asm.h>
+#include <kernel/bench.h>
+#include <kernel/fs/vfs.h>
+#include <kernel/klog.h>
+#include <kernel/ktime.h>
+#include <kernel/liballoc.h>
+#include <kernel/memory.h>
+#include <kernel/serial.h>
+#include <kernel/tty.h>
+#include <stdio.h>
+#include <string.h>
+
+// Blocks of each size allocated before any is freed
+#define FRAME_ROUNDS 32
+// Single frames taken to fragment the free lists, every other one is given back
+#define FRAG_FRAMES 2048
+#define CHURN_SLOTS 64
+#define CHURN_OPS 20000
+// memcpy and memset move this much per size
+#define BANDWIDTH_TOTAL (64 * 1024 * 1024)
+#define BANDWIDTH_PAGES 256
+#define OUTPUT_LINES 128
+// Disk reads go through a buffer of this many sectors
+#define DISK_CHUNK 256
+#define DISK_SEQ_CHUNKS 32
+#define DISK_RANDOM_READS 256
+#define DISK_RANDOM_SECTORS 8
+#define VFS_OPENS 1000
+
+static uint32_t seed = 0x2545F491;
+
+static uint32_t next_random()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static void report(const char* name, uint32_t ops, uint64_t cycles, uint64_t bytes)
+{
+    uint64_t ns = ktime_cycles_to_ns(cycles);
+    uint32_t ns_op = ops ? ns / ops : 0;
+    uint32_t ops_s = ns ? (uint64_t)ops * 1000000000 / ns : 0;
+    // bytes per ns is GB/s, times 1000 makes it MB/s
+    uint32_t mb_s = ns ? bytes * 1000 / ns : 0;
+    printf("BENCH %s ops=%u us=%u ns_op=%u ops_s=%u mb_s=%u\n", name, ops, (uint32_t)(ns / 1000), ns_op, ops_s,
+        mb_s);
+    // Results mustn't be lapped in the ring by whatever the next benchmark prints
+    klog_flush();
+}
+
+static void bench_frames(const char* state)
+{
+    static const size_t sizes[] = { 1, 4, 16, 64, 256 };
+    uintptr_t blocks[FRAME_ROUNDS];
+    char name[48];
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint32_t got = 0;
+        uint64_t start = ktime_get_cycles();
+        for (; got < FRAME_ROUNDS; got++) {
+            blocks[got] = kalloc_frames(sizes[s]);
+            if (!blocks[got]) break;
+        }
+        uint64_t alloc = ktime_get_cycles() - start;
+        start = ktime_get_cycles();
+        for (uint32_t i = 0; i < got; i++)
+            kfree_frames(blocks[i], sizes[s]);
+        uint64_t freeing = ktime_get_cycles() - start;
+        snprintf(name, sizeof(name), "kalloc_frames_%d_%s", sizes[s], state);
+        report(name, got, alloc, 0);
+        snprintf(name, sizeof(name), "kfree_frames_%d_%s", sizes[s], state);
+        report(name, got, freeing, 0);
+    }
+}
+
+static void bench_pmm()
+{
+    printf("BENCH pmm_frag_index_clean value=%u\n", pmm_fragmentation_index(4));
+    bench_frames("clean");
+    // Pin every other frame so the buddies can't merge back
+    uintptr_t* frames = kmalloc(FRAG_FRAMES * sizeof(uintptr_t));
+    if (!frames) return;
+    for (size_t i = 0; i < FRAG_FRAMES; i++)
+        frames[i] = kalloc_frames(1);
+    for (size_t i = 0; i < FRAG_FRAMES; i += 2) {
+        if (frames[i]) kfree_frames(frames[i], 1);
+    }
+    printf("BENCH pmm_frag_index_fragmented value=%u\n", pmm_fragmentation_index(4));
+    bench_frames("fragmented");
+    for (size_t i = 1; i < FRAG_FRAMES; i += 2) {
+        if (frames[i]) kfree_frames(frames[i], 1);
+    }
+    kfree(frames);
+}
+
+static void bench_kmalloc()
+{
+    void* slots[CHURN_SLOTS] = { 0 };
+    uint64_t bytes = 0;
+    uint64_t start = ktime_get_cycles();
+    for (uint32_t i = 0; i < CHURN_OPS; i++) {
+        uint32_t slot = next_random() % CHURN_SLOTS;
+        kfree(slots[slot]);
+        // Mostly small objects with the odd larger one, roughly what the kernel asks for
+        size_t size = next_random() % 8 ? 16 + next_random() % 256 : 512 + next_random() % 3584;
+        slots[slot] = kmalloc(size);
+        bytes += size;
+    }
+    uint64_t cycles = ktime_get_cycles() - start;
+    for (uint32_t i = 0; i < CHURN_SLOTS; i++)
+        kfree(slots[i]);
+    report("kmalloc_churn", CHURN_OPS, cycles, bytes);
+}
+
+static void bench_bandwidth()
+{
+    uint8_t* a = (uint8_t*)kalloc_frames(BANDWIDTH_PAGES);
+    uint8_t* b = (uint8_t*)kalloc_frames(BANDWIDTH_PAGES);
+    static const size_t sizes[] = { 64, 4096, BANDWIDTH_PAGES * PAGE_SIZE };
+    char name[48];
+    if (a && b) {
+        memset(a, 0x5A, BANDWIDTH_PAGES * PAGE_SIZE);
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            uint32_t rounds = BANDWIDTH_TOTAL / sizes[s];
+            uint64_t start = ktime_get_cycles();
+            for (uint32_t i = 0; i < rounds; i++)
+                memcpy(b, a, sizes[s]);
+            uint64_t cycles = ktime_get_cycles() - start;
+            snprintf(name, sizeof(name), "memcpy_%d", sizes[s]);
+            report(name, rounds, cycles, BANDWIDTH_TOTAL);
+
+            start = ktime_get_cycles();
+            for (uint32_t i = 0; i < rounds; i++)
+                memset(b, i, sizes[s]);
+            cycles = ktime_get_cycles() - start;
+            snprintf(name, sizeof(name), "memset_%d", sizes[s]);
+            report(name, rounds, cycles, BANDWIDTH_TOTAL);
+        }
+    }
+    if (a) kfree_frames((uintptr_t)a, BANDWIDTH_PAGES);
+    if (b) kfree_frames((uintptr_t)b, BANDWIDTH_PAGES);
+}
+
+static void bench_output()
+{
+    static const char line[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.\n";
+    uint64_t start = ktime_get_cycles();
+    for (uint32_t i = 0; i < OUTPUT_LINES; i++)
+        tty_write(line, sizeof(line) - 1);
+    report("tty_write", OUTPUT_LINES, ktime_get_cycles() - start, OUTPUT_LINES * (sizeof(line) - 1));
+
+    // printf only formats into the log ring, the consoles see the lines once it's flushed. The ring holds
+    // more than OUTPUT_LINES records, nothing is dropped.
+    start = ktime_get_cycles();
+    for (uint32_t i = 0; i < OUTPUT_LINES; i++)
+        printf("printf %d %s 0x%X\n", i, "bench", i * 0x1234);
+    uint64_t format = ktime_get_cycles() - start;
+    start = ktime_get_cycles();
+    klog_flush();
+    uint64_t flush = ktime_get_cycles() - start;
+    report("printf", OUTPUT_LINES, format, 0);
+    report("klog_flush", OUTPUT_LINES, flush, 0);
+}
+
+static void bench_disk(struct block_device* disk)
+{
+    if (!disk || !disk->sectors) return;
+    uint8_t* buffer = (uint8_t*)kalloc_frames(CEIL_DIV(DISK_CHUNK * disk->sec_size, PAGE_SIZE));
+    if (!buffer) return;
+    // Straight to the block layer, the buffer cache would only measure memcpy
+    uint32_t ops = 0;
+    uint64_t start = ktime_get_cycles();
+    for (uint32_t i = 0; i < DISK_SEQ_CHUNKS; i++) {
+        uint64_t lba = (uint64_t)i * DISK_CHUNK;
+        if (lba + DISK_CHUNK > disk->sectors) break;
+        if (block_read(disk, lba, DISK_CHUNK, buffer)) break;
+        ops++;
+    }
+    report("disk_seq_read", ops, ktime_get_cycles() - start, (uint64_t)ops * DISK_CHUNK * disk->sec_size);
+
+    ops = 0;
+    start = ktime_get_cycles();
+    for (uint32_t i = 0; i < DISK_RANDOM_READS && disk->sectors > DISK_RANDOM_SECTORS; i++) {
+        uint64_t lba = next_random() % (disk->sectors - DISK_RANDOM_SECTORS);
+        if (block_read(disk, lba, DISK_RANDOM_SECTORS, buffer)) break;
+        ops++;
+    }
+    report("disk_random_read", ops, ktime_get_cycles() - start, (uint64_t)ops * DISK_RANDOM_SECTORS * disk->sec_size);
+    kfree_frames((uintptr_t)buffer, CEIL_DIV(DISK_CHUNK * disk->sec_size, PAGE_SIZE));
+}
+
+static void bench_vfs(uint8_t mount_id)
+{
+    dir_t present = { .mount_id = mount_id, .path = "", .filename = "TEST", .file_extension = "TXT" };
+    dir_t missing = { .mount_id = mount_id, .path = "", .filename = "NOENT", .file_extension = "BIN" };
+    // The first open reads the directory in, everything after is served from the caches
+    FILE* warm = vfs_open(&present);
+    if (!warm) {
+        puts("BENCH vfs skipped, TEST.TXT is missing");
+        return;
+    }
+    vfs_close(warm);
+    // Leaves a negative dentry behind
+    vfs_open(&missing);
+
+    uint32_t ops = 0;
+    uint64_t start = ktime_get_cycles();
+    for (; ops < VFS_OPENS; ops++) {
+        FILE* f = vfs_open(&present);
+        if (!f) break;
+        vfs_close(f);
+    }
+    report("vfs_open_hit", ops, ktime_get_cycles() - start, 0);
+
+    // Misses don't get an inode, every one goes down to the filesystem and its (negative) dentry
+    start = ktime_get_cycles();
+    for (uint32_t i = 0; i < VFS_OPENS; i++)
+        vfs_open(&missing);
+    report("vfs_open_miss", VFS_OPENS, ktime_get_cycles() - start, 0);
+}
+
+void bench_run(struct block_device* disk, uint8_t mount_id)
+{
+    printf("BENCH start tsc_khz=%u\n", ktime_tsc_khz());
+    bench_pmm();
+    bench_kmalloc();
+    bench_bandwidth();
+    bench_output();
+    bench_disk(disk);
+    bench_vfs(mount_id);
+    puts("BENCH done");
+    klog_flush();
+    serial_drain(COM1_PORT);
+    outb(BENCH_EXIT_PORT, 0);
+}
@@ -0,0 +1,316 @@
+#include <kernel/block.h>
+#include <kernel/ktime.h>
+#include <kernel/liballoc.h>
+#include <kernel/trace.h>
+#include <stdio.h>
+#include <string.h>
+
+#define NS_PER_MS 1000000ULL
+
+static void queue_drain(struct block_device* bdev);
+
+void bio_init(struct bio* bio, struct block_device* bdev, int op, uint64_t lba, size_t count, void* buffer,
+    bio_end_fn end, void* private)
+{
+    bio->bdev = bdev;
+    bio->op = op;
+    bio->lba = lba;
+    bio->count = count;
+    bio->buffer = buffer;
+    bio->error = 0;
+    bio->end = end;
+    bio->private = private;
+    bio->next = NULL;
+}
+
+/// Sorted by lba, bios for the same lba stay in submission order
+static void queue_insert(struct block_device* bdev, struct bio* bio)
+{
+    struct bio** link = &bdev->pending;
+    while (*link && (*link)->lba <= bio->lba)
+        link = &(*link)->next;
+    bio->next = *link;
+    *link = bio;
+}
+
+/// The oldest flush not done yet, bios submitted after it have to wait for it. Called with the lock held.
+static const struct bio* queue_barrier(const struct block_device* bdev)
+{
+    return bdev->flushing ? bdev->flushing : bdev->flushes;
+}
+
+/// Whether bio may go to the driver now, or is held back by barrier
+static inline bool bio_allowed(const struct bio* bio, const struct bio* barrier)
+{
+    return !barrier || (int32_t)(bio->seq - barrier->seq) < 0;
+}
+
+/// Takes the bio at *link off the queue along with every following one it can be merged with, chained
+/// through next. Nothing held back by barrier gets merged in.
+static struct bio* queue_take(struct bio** link, const struct bio* barrier)
+{
+    struct bio* first = *link;
+    struct bio* last = first;
+    size_t total = first->count;
+    while (last->next && last->next->op == first->op && last->next->lba == last->lba + last->count
+        && total + last->next->count <= BLOCK_MAX_MERGE && bio_allowed(last->next, barrier)) {
+        last = last->next;
+        total += last->count;
+    }
+    *link = last->next;
+    last->next = NULL;
+    return first;
+}
+
+/// Picks what goes to the driver next, called with the lock held
+static struct bio* queue_pick(struct block_device* bdev)
+{
+    // Barriers go once everything submitted before them is done, that's when nothing is in flight and no older
+    // request is left in the queue
+    struct bio* flush = bdev->flushes;
+    if (flush && !bdev->inflight) {
+        bool older = false;
+        for (struct bio* b = bdev->pending; b && !older; b = b->next)
+            older = (int32_t)(b->seq - flush->seq) < 0;
+        if (!older) {
+            bdev->flushes = flush->next;
+            flush->next = NULL;
+            bdev->flushing = flush;
+            return flush;
+        }
+    }
+    // Nothing submitted after a flush may overtake it, neither on its own nor merged into an older bio
+    const struct bio* barrier = queue_barrier(bdev);
+
+    // The oldest bio that waited too long goes first, so a busy region can't starve the rest of the disk
+    uint64_t now = ktime_get_ns();
+    struct bio** expired = NULL;
+    for (struct bio** link = &bdev->pending; *link; link = &(*link)->next) {
+        if ((*link)->expires > now || !bio_allowed(*link, barrier)) continue;
+        if (!expired || (int32_t)((*link)->seq - (*expired)->seq) < 0) expired = link;
+    }
+    if (expired) return queue_take(expired, barrier);
+
+    // C-LOOK: continue upwards from the head, wrap around to the lowest lba at the end
+    struct bio** link = &bdev->pending;
+    while (*link && ((*link)->lba < bdev->head || !bio_allowed(*link, barrier)))
+        link = &(*link)->next;
+    if (!*link) {
+        link = &bdev->pending;
+        while (*link && !bio_allowed(*link, barrier))
+            link = &(*link)->next;
+    }
+    return *link ? queue_take(link, barrier) : NULL;
+}
+
+static void complete(struct bio* chain, bool ok)
+{
+    while (chain) {
+        // end may free or resubmit the bio
+        struct bio* next = chain->next;
+        chain->next = NULL;
+        chain->error = ok ? 0 : -1;
+        TRACE(TRACE_BLOCK_COMPLETE, chain, chain->lba, chain->error);
+        chain->end(chain);
+        chain = next;
+    }
+}
+
+/// Hands a chain from queue_take to the driver as a single transfer
+static void dispatch(struct block_device* bdev, struct bio* first)
+{
+    first->bounce = NULL;
+    first->total = first->count;
+    if (first->op == BIO_FLUSH) {
+        if (bdev->start) {
+            if (!bdev->start(bdev, first, BIO_FLUSH, NULL, 0, 0)) block_done(first, false);
+            return;
+        }
+        block_done(first, bdev->transfer(bdev, BIO_FLUSH, NULL, 0, 0));
+        return;
+    }
+
+    size_t total = 0;
+    bool contiguous = true;
+    uint8_t* expect = first->buffer;
+    for (struct bio* b = first; b; b = b->next) {
+        contiguous = contiguous && b->buffer == expect;
+        expect = (uint8_t*)b->buffer + b->count * bdev->sec_size;
+        total += b->count;
+    }
+    bdev->head = first->lba + total;
+
+    // Scattered buffers go through a bounce buffer, a copy costs less than another command
+    if (!contiguous) {
+        first->bounce = kmalloc(total * bdev->sec_size);
+        if (!first->bounce) {
+            // Split the chain back up, everything after the first goes back into the queue
+            uint32_t flags = spin_lock_irqsave(&bdev->lock);
+            for (struct bio *b = first->next, *next; b; b = next) {
+                next = b->next;
+                queue_insert(bdev, b);
+            }
+            spin_unlock_irqrestore(&bdev->lock, flags);
+            first->next = NULL;
+            total = first->count;
+        } else if (first->op == BIO_WRITE) {
+            size_t offset = 0;
+            for (struct bio* b = first; b; offset += b->count * bdev->sec_size, b = b->next)
+                memcpy(first->bounce + offset, b->buffer, b->count * bdev->sec_size);
+        }
+    }
+    first->total = total;
+    void* buffer = first->bounce ? first->bounce : first->buffer;
+    if (bdev->start) {
+        if (!bdev->start(bdev, first, first->op, buffer, first->lba, total)) block_done(first, false);
+        return;
+    }
+    block_done(first, bdev->transfer(bdev, first->op, buffer, first->lba, total));
+}
+
+void block_done(struct bio* req, bool ok)
+{
+    struct block_device* bdev = req->bdev;
+    if (req->bounce) {
+        if (ok && req->op == BIO_READ) {
+            size_t offset = 0;
+            for (struct bio* b = req; b; offset += b->count * bdev->sec_size, b = b->next)
+                memcpy(b->buffer, req->bounce + offset, b->count * bdev->sec_size);
+        }
+        kfree(req->bounce);
+        req->bounce = NULL;
+    }
+    complete(req, ok);
+
+    uint32_t flags = spin_lock_irqsave(&bdev->lock);
+    // req may already be freed or resubmitted, but no other flush is dispatched while it counts as inflight
+    if (bdev->flushing == req) bdev->flushing = NULL;
+    bdev->inflight--;
+    spin_unlock_irqrestore(&bdev->lock, flags);
+    // A slot opened up, whatever is queued can go now
+    if (bdev->start) {
+        if (bdev->worker)
+            wake_up(&bdev->work);
+        else
+            queue_drain(bdev);
+    }
+}
+
+/// Serves the queue until it's empty. Only one caller dispatches at a time, anyone else returns right away and
+/// their bios get picked up by the one already at it.
+static void queue_drain(struct block_device* bdev)
+{
+    uint32_t flags = spin_lock_irqsave(&bdev->lock);
+    if (bdev->busy) {
+        spin_unlock_irqrestore(&bdev->lock, flags);
+        return;
+    }
+    bdev->busy = true;
+    unsigned int depth = bdev->depth ? bdev->depth : 1;
+    struct bio* chain;
+    bool started = false;
+    while (bdev->inflight < depth && (chain = queue_pick(bdev))) {
+        bdev->inflight++;
+        spin_unlock_irqrestore(&bdev->lock, flags);
+        dispatch(bdev, chain);
+        started = true;
+        flags = spin_lock_irqsave(&bdev->lock);
+    }
+    bdev->busy = false;
+    spin_unlock_irqrestore(&bdev->lock, flags);
+    // One doorbell for the whole batch
+    if (started && bdev->commit) bdev->commit(bdev);
+}
+
+/// Whether queue_drain would find something to hand to the driver
+static bool dispatchable(struct block_device* bdev)
+{
+    uint32_t flags = spin_lock_irqsave(&bdev->lock);
+    bool res = false;
+    if (bdev->inflight < (bdev->depth ? bdev->depth : 1)) {
+        const struct bio* barrier = queue_barrier(bdev);
+        for (struct bio* b = bdev->pending; b && !res; b = b->next)
+            res = bio_allowed(b, barrier);
+        if (!res && bdev->flushes && !bdev->inflight) res = true;
+    }
+    spin_unlock_irqrestore(&bdev->lock, flags);
+    return res;
+}
+
+static void block_worker(void* arg)
+{
+    struct block_device* bdev = arg;
+    while (true) {
+        wait_event(&bdev->work, dispatchable(bdev));
+        queue_drain(bdev);
+    }
+}
+
+void block_register(struct block_device* bdev)
+{
+    spin_lock_init(&bdev->lock);
+    bdev->pending = NULL;
+    bdev->flushes = NULL;
+    bdev->flushing = NULL;
+    bdev->next_seq = 0;
+    bdev->head = 0;
+    bdev->busy = false;
+    bdev->inflight = 0;
+    bdev->synced = false;
+    wait_queue_init(&bdev->work);
+    wait_queue_init(&bdev->done);
+    bdev->worker = thread_create(bdev->name, block_worker, bdev);
+    if (!bdev->worker) printf("block: no worker for %s, requests run in the submitter\n", bdev->name);
+}
+
+void block_submit(struct bio* bio)
+{
+    struct block_device* bdev = bio->bdev;
+    bio->error = 0;
+    bio->next = NULL;
+    bio->expires = ktime_get_ns() + BLOCK_EXPIRE_MS * NS_PER_MS;
+    TRACE(TRACE_BLOCK_SUBMIT, bio, bio->lba, bio->count | (uint32_t)bio->op << 24);
+
+    uint32_t flags = spin_lock_irqsave(&bdev->lock);
+    bio->seq = bdev->next_seq++;
+    if (bio->op == BIO_FLUSH) {
+        struct bio** link = &bdev->flushes;
+        while (*link)
+            link = &(*link)->next;
+        *link = bio;
+    } else {
+        queue_insert(bdev, bio);
+    }
+    spin_unlock_irqrestore(&bdev->lock, flags);
+
+    // Callers that can't sleep can't count on the worker getting the CPU either
+    if (!bdev->worker || !sched_can_block())
+        queue_drain(bdev);
+    else
+        wake_up(&bdev->work);
+}
+
+static void sync_end(struct bio* bio)
+{
+    // The waiter's stack frame, bio included, can be gone as soon as done is set
+    struct block_device* bdev = bio->bdev;
+    *(volatile bool*)bio->private = true;
+    wake_up(&bdev->done);
+}
+
+int block_rw(struct block_device* bdev, int op, uint64_t lba, size_t count, void* buffer)
+{
+    if (!block_ready(bdev)) return -1;
+    if (op != BIO_FLUSH && bdev->sectors && lba + count > bdev->sectors) {
+        printf("block: %s has no sector 0x%llX\n", bdev->name, lba + count - 1);
+        return -1;
+    }
+    if (op != BIO_FLUSH && !count) return 0;
+
+    volatile bool done = false;
+    struct bio bio;
+    bio_init(&bio, bdev, op, lba, count, buffer, sync_end, (void*)&done);
+    block_submit(&bio);
+    wait_event(&bdev->done, done);
+    return bio.error;
+}
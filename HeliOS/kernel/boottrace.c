@@ -0,0 +1,84 @@
+#include <kernel/asm.h>
+#include <kernel/boottrace.h>
+#include <kernel/cpu.h>
+#include <kernel/ktime.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// Only the boot CPU records, before the scheduler runs anything else, so nothing here needs a lock
+static struct boot_stage stages[BOOT_TRACE_MAX];
+static size_t count = 0;
+static uint8_t depth = 0;
+// -1 until the first stage asks, CPUs without a TSC record nothing
+static int have_tsc = -1;
+
+int boot_trace_begin(const char* name)
+{
+    if (have_tsc < 0) have_tsc = cpu_check_tsc() != 0;
+    if (!have_tsc || count >= BOOT_TRACE_MAX) return -1;
+    struct boot_stage* s = stages + count;
+    s->name = name;
+    s->end = 0;
+    s->depth = depth++;
+    s->start = rdtsc();
+    return count++;
+}
+
+void boot_trace_end(int stage)
+{
+    if (stage < 0) return;
+    stages[stage].end = rdtsc();
+    depth--;
+}
+
+size_t boot_trace_get(struct boot_stage* out, size_t max)
+{
+    size_t n = count < max ? count : max;
+    for (size_t i = 0; i < n; i++)
+        out[i] = stages[i];
+    return n;
+}
+
+static inline uint32_t to_us(uint64_t cycles) { return ktime_cycles_to_ns(cycles) / 1000; }
+
+static inline uint64_t took(const struct boot_stage* s) { return s->end ? s->end - s->start : 0; }
+
+void boot_trace_print()
+{
+    if (!count) {
+        puts("boot trace: nothing recorded");
+        return;
+    }
+    if (!ktime_tsc_khz()) puts("boot trace: TSC not calibrated, times are in cycles");
+    uint64_t first = stages[0].start;
+    uint64_t last = first;
+    uint64_t top_level = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (stages[i].end > last) last = stages[i].end;
+        if (!stages[i].depth) top_level += took(stages + i);
+    }
+
+    puts("boot timeline     start us    took us  stage");
+    for (size_t i = 0; i < count; i++) {
+        const struct boot_stage* s = stages + i;
+        printf("%22u %10u  %*s%s%s\n", to_us(s->start - first), to_us(took(s)), s->depth * 2, "", s->name,
+            s->end ? "" : " (unfinished)");
+    }
+
+    // Insertion sort on indices, there are only a few dozen stages
+    uint8_t order[BOOT_TRACE_MAX];
+    for (size_t i = 0; i < count; i++) {
+        size_t j = i;
+        for (; j && took(stages + order[j - 1]) < took(stages + i); j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+    uint64_t total = last - first;
+    puts("slowest stages       took us  share  stage");
+    for (size_t i = 0; i < count; i++) {
+        const struct boot_stage* s = stages + order[i];
+        uint32_t permille = total ? took(s) * 1000 / total : 0;
+        printf("%22u %4u.%u%%  %s\n", to_us(took(s)), permille / 10, permille % 10, s->name);
+    }
+    printf("boot took %u us, %u us of it outside any stage\n", to_us(total), to_us(total - top_level));
+}
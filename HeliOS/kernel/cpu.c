@@ -1,6 +1,9 @@
 #include <cpuid.h>
 #include <kernel/cpu.h>
+#include <kernel/smp.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 enum {
         CPUID_FEAT_ECX_SSE3 = 1 << 0,
@@ -64,7 +67,13 @@ enum {
         CPUID_FEAT_EDX_HTT = 1 << 28,
         CPUID_FEAT_EDX_TM = 1 << 29,
         CPUID_FEAT_EDX_IA64 = 1 << 30,
-        CPUID_FEAT_EDX_PBE = 1 << 31
+        CPUID_FEAT_EDX_PBE = 1 << 31,
+
+        // Leaf 7, subleaf 0
+        CPUID_FEAT_EBX7_ERMS = 1 << 9,
+
+        // Leaf 0x80000007
+        CPUID_FEAT_EDX8_INVARIANT_TSC = 1 << 8
 };
 
 /* Example: Get CPU's model number */
@@ -84,6 +93,13 @@ static int check_apic(void)
         return edx & CPUID_FEAT_EDX_APIC;
 }
 
+static int check_edx_feature(unsigned int feature)
+{
+        unsigned int eax, unused, edx;
+        if (!__get_cpuid(1, &eax, &unused, &unused, &edx)) return 0;
+        return edx & feature;
+}
+
 // WTF is this for loop bullshit
 /**
  * @brief Prints CPU vendor model.
@@ -117,3 +133,68 @@ int cpu_check_apic(void)
 {
         return check_apic();
 }
+
+int cpu_check_pse(void)
+{
+        return check_edx_feature(CPUID_FEAT_EDX_PSE);
+}
+
+int cpu_check_pge(void)
+{
+        return check_edx_feature(CPUID_FEAT_EDX_PGE);
+}
+
+int cpu_check_tsc(void)
+{
+        return check_edx_feature(CPUID_FEAT_EDX_TSC);
+}
+
+int cpu_check_invariant_tsc(void)
+{
+        unsigned int eax, ebx, ecx, edx;
+        if (__get_cpuid_max(0x80000000, NULL) < 0x80000007) return 0;
+        __cpuid(0x80000007, eax, ebx, ecx, edx);
+        return edx & CPUID_FEAT_EDX8_INVARIANT_TSC;
+}
+
+int cpu_check_sse2(void)
+{
+        return check_edx_feature(CPUID_FEAT_EDX_SSE2) && check_edx_feature(CPUID_FEAT_EDX_FXSR);
+}
+
+int cpu_check_erms(void)
+{
+        unsigned int eax, ebx, ecx, edx;
+        if (__get_cpuid_max(0, NULL) < 7) return 0;
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        return ebx & CPUID_FEAT_EBX7_ERMS;
+}
+
+/// Lets SSE instructions run: no FPU emulation, CR4.OSFXSR and unmasked SIMD exceptions
+static void enable_sse(void)
+{
+        uint32_t cr0, cr4;
+        asm volatile("mov %%cr0, %0" : "=r"(cr0));
+        cr0 &= ~(0x1 << 2); // EM
+        cr0 |= 0x1 << 1; // MP
+        asm volatile("mov %0, %%cr0" : : "r"(cr0));
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        cr4 |= (0x1 << 9) | (0x1 << 10); // OSFXSR, OSXMMEXCPT
+        asm volatile("mov %0, %%cr4" : : "r"(cr4));
+}
+
+void cpu_init_features(void)
+{
+        unsigned int features = 0;
+        if (cpu_check_sse2()) {
+                enable_sse();
+                features |= STRING_FEAT_SSE2;
+        }
+        if (cpu_check_erms()) features |= STRING_FEAT_ERMS;
+        string_select(features);
+}
+
+unsigned int cpu_id(void)
+{
+        return this_cpu()->id;
+}
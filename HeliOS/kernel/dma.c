@@ -0,0 +1,103 @@
+#include <kernel/dma.h>
+#include <kernel/memory.h>
+#include <kernel/spinlock.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define POOL_PAGES (DMA_POOL_SIZE / PAGE_SIZE)
+
+static uintptr_t pool_phys;
+// One bit per pool page, set when in use
+static uint32_t pool_map[POOL_PAGES / 32];
+static spinlock_t pool_lock = SPINLOCK_INIT;
+
+static inline bool page_used(size_t page) { return pool_map[page / 32] & (0x1u << (page % 32)); }
+
+static void mark_pages(size_t first, size_t count, bool used)
+{
+    for (size_t page = first; page < first + count; page++) {
+        if (used)
+            pool_map[page / 32] |= 0x1u << (page % 32);
+        else
+            pool_map[page / 32] &= ~(0x1u << (page % 32));
+    }
+}
+
+/// True if [phys, phys + size) stays on one side of every multiple of boundary
+static inline bool within_boundary(uintptr_t phys, size_t size, size_t boundary)
+{
+    return !boundary || (phys & ~(boundary - 1)) == ((phys + size - 1) & ~(boundary - 1));
+}
+
+void dma_init()
+{
+    pool_phys = kalloc_phys_frames(POOL_PAGES, ZONE_DMA);
+    if (!pool_phys) printf("dma_init: couldn't reserve the %d KiB DMA pool\n", DMA_POOL_SIZE / 1024);
+}
+
+/// First fit search of the pool. Returns the first page or POOL_PAGES if nothing fits.
+static size_t pool_find(size_t pages, size_t align, size_t boundary)
+{
+    size_t step = align / PAGE_SIZE;
+    // The pool itself is only page aligned, so start from the first page that meets the alignment
+    size_t page = ((pool_phys + align - 1) & ~(align - 1)) - pool_phys;
+    for (page /= PAGE_SIZE; page + pages <= POOL_PAGES; page += step) {
+        if (!within_boundary(pool_phys + page * PAGE_SIZE, pages * PAGE_SIZE, boundary)) continue;
+        size_t i = 0;
+        while (i < pages && !page_used(page + i))
+            i++;
+        if (i == pages) return page;
+    }
+    return POOL_PAGES;
+}
+
+void* dma_alloc(size_t size, size_t align, size_t boundary, uintptr_t* phys)
+{
+    if (!size || (align & (align - 1)) || (boundary & (boundary - 1))) return NULL;
+    if (align < PAGE_SIZE) align = PAGE_SIZE;
+    size_t pages = CEIL_DIV(size, PAGE_SIZE);
+    if (boundary && pages * PAGE_SIZE > boundary) return NULL;
+
+    uintptr_t addr = 0;
+    if (pool_phys) {
+        uint32_t flags = spin_lock_irqsave(&pool_lock);
+        size_t page = pool_find(pages, align, boundary);
+        if (page < POOL_PAGES) {
+            mark_pages(page, pages, true);
+            addr = pool_phys + page * PAGE_SIZE;
+        }
+        spin_unlock_irqrestore(&pool_lock, flags);
+    }
+
+    // Pool is full, buddy blocks are aligned to their own size so ask for one big enough for the alignment
+    if (!addr) {
+        size_t span = pages > align / PAGE_SIZE ? pages : align / PAGE_SIZE;
+        size_t block = 1;
+        while (block < span)
+            block <<= 1;
+        if (boundary && block * PAGE_SIZE > boundary) return NULL;
+        addr = kalloc_phys_frames(span, ZONE_DMA);
+        if (!addr) return NULL;
+        if (span > pages) kfree_phys_frames(addr + pages * PAGE_SIZE, span - pages);
+    }
+
+    void* virt = (void*)(addr + KERNEL_OFFSET);
+    memset(virt, 0, pages * PAGE_SIZE);
+    if (phys) *phys = addr;
+    return virt;
+}
+
+void dma_free(void* virt, size_t size)
+{
+    if (!virt || !size) return;
+    uintptr_t addr = (uintptr_t)virt - KERNEL_OFFSET;
+    size_t pages = CEIL_DIV(size, PAGE_SIZE);
+    if (!pool_phys || addr < pool_phys || addr >= pool_phys + DMA_POOL_SIZE) {
+        kfree_phys_frames(addr, pages);
+        return;
+    }
+    uint32_t flags = spin_lock_irqsave(&pool_lock);
+    mark_pages((addr - pool_phys) / PAGE_SIZE, pages, false);
+    spin_unlock_irqrestore(&pool_lock, flags);
+}
@@ -0,0 +1,187 @@
+#include <kernel/fbcon.h>
+#include <kernel/font.h>
+#include <kernel/liballoc.h>
+#include <kernel/vmalloc.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TAB_WIDTH 4
+
+struct fb_info {
+    uintptr_t phys;
+    uint32_t pitch;
+    uint32_t width;
+    uint32_t height;
+    uint8_t red_pos, red_size;
+    uint8_t green_pos, green_size;
+    uint8_t blue_pos, blue_size;
+};
+
+static struct fb_info info;
+static bool probed = false;
+static bool active = false;
+
+static uint8_t* fb;
+static size_t cols, rows;
+// Cells hold VGA style char | attribute << 8 entries. cells is what should be on screen, as a ring of rows
+// starting at top so scrolling doesn't copy anything. shown is what the framebuffer has, in screen order.
+static uint16_t* cells;
+static uint16_t* shown;
+static size_t top = 0;
+static size_t cursor_x = 0, cursor_y = 0;
+// Rows that may differ from shown, one byte each so any resolution works
+static uint8_t* dirty;
+
+static uint32_t palette[16];
+// Glyph cache: every possible font row byte expanded to a per pixel mask, so drawing a glyph row is
+// eight branchless stores instead of testing bits
+static uint32_t row_masks[256][FONT_WIDTH];
+
+// Standard VGA text colours
+static const uint32_t vga_rgb[16] = {
+    0x000000, 0x0000AA, 0x00AA00, 0x00AAAA, 0xAA0000, 0xAA00AA, 0xAA5500, 0xAAAAAA,
+    0x555555, 0x5555FF, 0x55FF55, 0x55FFFF, 0xFF5555, 0xFF55FF, 0xFFFF55, 0xFFFFFF,
+};
+
+static inline uint32_t pack_channel(uint32_t value, uint8_t pos, uint8_t size)
+{
+    return (value >> (8 - size)) << pos;
+}
+
+int fbcon_probe(multiboot_info_t* mbd)
+{
+    if (!(mbd->flags & MULTIBOOT_INFO_FRAMEBUFFER_INFO)) return -1;
+    if (mbd->framebuffer_type != MULTIBOOT_FRAMEBUFFER_TYPE_RGB || mbd->framebuffer_bpp != 32) return -1;
+    if (mbd->framebuffer_addr >> 32) return -1;
+
+    info.phys = mbd->framebuffer_addr;
+    info.pitch = mbd->framebuffer_pitch;
+    info.width = mbd->framebuffer_width;
+    info.height = mbd->framebuffer_height;
+    info.red_pos = mbd->framebuffer_red_field_position;
+    info.red_size = mbd->framebuffer_red_mask_size;
+    info.green_pos = mbd->framebuffer_green_field_position;
+    info.green_size = mbd->framebuffer_green_mask_size;
+    info.blue_pos = mbd->framebuffer_blue_field_position;
+    info.blue_size = mbd->framebuffer_blue_mask_size;
+    probed = true;
+    return 0;
+}
+
+int fbcon_init()
+{
+    if (!probed) return -1;
+    cols = info.width / FONT_WIDTH;
+    rows = info.height / FONT_HEIGHT;
+
+    fb = ioremap(info.phys, (size_t)info.pitch * info.height, 0);
+    cells = kmalloc(cols * rows * sizeof(uint16_t));
+    shown = kmalloc(cols * rows * sizeof(uint16_t));
+    dirty = kmalloc(rows);
+    if (!fb || !cells || !shown || !dirty) {
+        printf("fbcon: couldn't set up a %dx%d console\n", cols, rows);
+        if (fb) iounmap(fb);
+        kfree(cells);
+        kfree(shown);
+        kfree(dirty);
+        return -1;
+    }
+
+    for (int i = 0; i < 16; i++) {
+        uint32_t rgb = vga_rgb[i];
+        palette[i] = pack_channel(rgb >> 16 & 0xFF, info.red_pos, info.red_size)
+            | pack_channel(rgb >> 8 & 0xFF, info.green_pos, info.green_size)
+            | pack_channel(rgb & 0xFF, info.blue_pos, info.blue_size);
+    }
+    for (int byte = 0; byte < 256; byte++)
+        for (int x = 0; x < FONT_WIDTH; x++)
+            row_masks[byte][x] = byte >> x & 0x1 ? 0xFFFFFFFF : 0;
+
+    // shown starts out not matching anything so the first flush paints the whole screen
+    for (size_t i = 0; i < cols * rows; i++) {
+        cells[i] = ' ' | 0x07 << 8;
+        shown[i] = 0xFFFF;
+    }
+    memset(dirty, 1, rows);
+    top = cursor_x = cursor_y = 0;
+    active = true;
+    fbcon_flush();
+    return 0;
+}
+
+bool fbcon_active() { return active; }
+
+static inline uint16_t* cell_row(size_t y) { return cells + ((top + y) % rows) * cols; }
+
+static void draw_cell(size_t x, size_t y, uint16_t entry)
+{
+    uint8_t c = entry & 0xFF;
+    const uint8_t* glyph = font8x8[c < FONT_GLYPHS ? c : '?'];
+    uint32_t bg = palette[entry >> 12 & 0xF];
+    uint32_t diff = palette[entry >> 8 & 0xF] ^ bg;
+    uint8_t* line = fb + y * FONT_HEIGHT * info.pitch + x * FONT_WIDTH * sizeof(uint32_t);
+    for (int gy = 0; gy < FONT_HEIGHT; gy++, line += info.pitch) {
+        uint32_t* px = (uint32_t*)line;
+        const uint32_t* mask = row_masks[glyph[gy]];
+        for (int gx = 0; gx < FONT_WIDTH; gx++)
+            px[gx] = bg ^ (diff & mask[gx]);
+    }
+}
+
+void fbcon_flush()
+{
+    if (!active) return;
+    for (size_t y = 0; y < rows; y++) {
+        if (!dirty[y]) continue;
+        uint16_t* want = cell_row(y);
+        uint16_t* have = shown + y * cols;
+        // Only cells that really changed get redrawn, after a scroll blank areas stay untouched
+        for (size_t x = 0; x < cols; x++) {
+            if (want[x] == have[x]) continue;
+            draw_cell(x, y, want[x]);
+            have[x] = want[x];
+        }
+        dirty[y] = 0;
+    }
+}
+
+static void scroll()
+{
+    top = (top + 1) % rows;
+    uint16_t* row = cell_row(rows - 1);
+    for (size_t x = 0; x < cols; x++)
+        row[x] = ' ' | 0x07 << 8;
+    memset(dirty, 1, rows);
+}
+
+void fbcon_put(char c, uint8_t color)
+{
+    if (!active) return;
+    switch (c) {
+    case '\n':
+        cursor_x = 0;
+        cursor_y++;
+        break;
+    case '\b':
+        if (cursor_x == 0) break;
+        cursor_x--;
+        cell_row(cursor_y)[cursor_x] = ' ' | color << 8;
+        dirty[cursor_y] = 1;
+        break;
+    case '\t':
+        for (int i = 0; i < TAB_WIDTH; i++)
+            fbcon_put(' ', color);
+        break;
+    default:
+        cell_row(cursor_y)[cursor_x++] = (uint8_t)c | color << 8;
+        dirty[cursor_y] = 1;
+    }
+    if (cursor_x >= cols) {
+        cursor_x = 0;
+        cursor_y++;
+    }
+    if (cursor_y >= rows) {
+        scroll();
+        cursor_y = rows - 1;
+    }
+}
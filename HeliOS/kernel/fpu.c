@@ -0,0 +1,145 @@
+#include <kernel/asm.h>
+#include <kernel/cpu.h>
+#include <kernel/fpu.h>
+#include <kernel/interrupts.h>
+#include <kernel/memory.h>
+#include <kernel/sched.h>
+#include <kernel/slab.h>
+#include <kernel/smp.h>
+#include <kernel/sys.h>
+#include <stdio.h>
+
+#define CR0_TS (1 << 3)
+// Device not available, raised by FPU and SSE instructions while CR0.TS is set
+#define ISR_NM 7
+
+struct fpu_nest {
+    uint32_t depth; ///< Sections open on the CPU
+    uint32_t flags[FPU_NEST_MAX + 1]; ///< eflags from each open section's kernel_fpu_begin
+    struct fpu_state saved[FPU_NEST_MAX]; ///< What each interrupted section had in the registers
+};
+
+static bool enabled = false;
+static struct fpu_nest nesting[MAX_CPUS];
+static kmem_cache_t* fpu_cache;
+// Right after FNINIT, what threads start with
+static struct fpu_state initial;
+
+static inline void fxsave(struct fpu_state* s) { asm volatile("fxsave %0" : "=m"(*s)); }
+static inline void fxrstor(const struct fpu_state* s) { asm volatile("fxrstor %0" : : "m"(*s)); }
+static inline void clts() { asm volatile("clts"); }
+static inline void stts() { write_cr0(read_cr0() | CR0_TS); }
+
+/// Loads the running thread's registers, CR0.TS was set. Interrupts are off, #NM comes in on an interrupt gate.
+static void device_not_available(struct irq_regs* r)
+{
+    (void)r;
+    struct thread* t = thread_current();
+    if (!t) panic("fpu: FPU used before the scheduler runs");
+    const struct fpu_state* state = t->fpu;
+    // Allocated while TS is still set, the allocator's own vector code brackets itself
+    if (!state) {
+        t->fpu = kmem_cache_alloc(fpu_cache);
+        if (!t->fpu) panic("fpu: no memory for a thread's FPU state");
+        t->fpu_cpu = -1;
+        state = &initial;
+    }
+    struct cpu* cpu = this_cpu();
+    clts();
+    cpu->fpu_live = true;
+    // Nobody used them since this thread was last here
+    if (cpu->fpu_owner == t && t->fpu_cpu == (int)cpu->id) return;
+    fxrstor(state);
+    cpu->fpu_owner = t;
+    t->fpu_cpu = cpu->id;
+}
+
+void fpu_init()
+{
+    if (!cpu_check_sse2()) return;
+    fpu_cache = kmem_cache_create("fpu", sizeof(struct fpu_state), 16, NULL);
+    if (!fpu_cache) {
+        puts("fpu: no cache for FPU state, lazy switching stays off");
+        return;
+    }
+    asm volatile("fninit");
+    fxsave(&initial);
+    install_isr_handler(ISR_NM, device_not_available);
+    enabled = true;
+    fpu_init_cpu();
+}
+
+void fpu_init_cpu()
+{
+    if (!enabled) return;
+    struct cpu* cpu = this_cpu();
+    cpu->fpu_owner = NULL;
+    cpu->fpu_live = false;
+    stts();
+}
+
+void fpu_switch_out(struct thread* prev)
+{
+    struct cpu* cpu = this_cpu();
+    // The registers stay loaded for prev in case it comes back here first
+    if (prev->state != THREAD_DEAD)
+        fxsave(prev->fpu);
+    else
+        cpu->fpu_owner = NULL;
+    cpu->fpu_live = false;
+    stts();
+}
+
+void fpu_release(struct thread* t)
+{
+    if (!t->fpu) return;
+    kmem_cache_free(fpu_cache, t->fpu);
+    t->fpu = NULL;
+}
+
+void kernel_fpu_begin()
+{
+    uint32_t flags = irq_save();
+    // Interrupts alone don't keep the section on this CPU, anything waiting inside it lets them back in
+    preempt_disable();
+    struct cpu* cpu = this_cpu();
+    struct fpu_nest* nest = nesting + cpu->id;
+    if (nest->depth++) {
+        if (nest->depth > FPU_NEST_MAX + 1) panic("fpu: kernel_fpu_begin nested too deep");
+        nest->flags[nest->depth - 1] = flags;
+        if (enabled) fxsave(&nest->saved[nest->depth - 2]);
+        return;
+    }
+    nest->flags[0] = flags;
+    if (!enabled) return;
+    if (cpu->fpu_live) {
+        // The running thread's, it gets them back through #NM
+        fxsave(cpu->fpu_owner->fpu);
+        cpu->fpu_live = false;
+    } else {
+        clts();
+    }
+    cpu->fpu_owner = NULL;
+}
+
+void kernel_fpu_end()
+{
+    struct fpu_nest* nest = nesting + cpu_id();
+    uint32_t flags = nest->flags[--nest->depth];
+    if (nest->depth) {
+        if (enabled) fxrstor(&nest->saved[nest->depth - 1]);
+    } else if (enabled) {
+        stts();
+    }
+    preempt_enable();
+    irq_restore(flags);
+}
+
+bool kernel_fpu_active() { return nesting[cpu_id()].depth != 0; }
+
+bool kernel_fpu_range_ok(const void* addr, size_t len)
+{
+    uintptr_t start = (uintptr_t)addr;
+    return start >= KERNEL_OFFSET && start - KERNEL_OFFSET <= DIRECT_MAP_SIZE
+        && len <= DIRECT_MAP_SIZE - (start - KERNEL_OFFSET);
+}
@@ -0,0 +1,241 @@
+#include <kernel/fs/dcache.h>
+#include <kernel/liballoc.h>
+#include <kernel/spinlock.h>
+#include <string.h>
+
+// Directories filled so far, a handful per filesystem in practice
+#define DCACHE_DIR_HASH_SIZE 64
+
+struct dentry {
+    struct dentry* hash_next;
+    struct dentry** hash_pprev;
+    struct dentry* lru_prev; ///< Towards the most recently used end
+    struct dentry* lru_next;
+    const void* sb;
+    uint32_t parent;
+    uint32_t hash;
+    bool negative;
+    struct dcache_entry entry;
+    char name[];
+};
+
+struct dcache_dir {
+    struct dcache_dir* next;
+    const void* sb;
+    uint32_t parent;
+    bool complete; ///< Every name in the directory is cached
+    uint32_t evictions; ///< Entries of this directory evicted so far
+};
+
+static struct dentry* hash[DCACHE_HASH_SIZE];
+static struct dcache_dir* dirs[DCACHE_DIR_HASH_SIZE];
+// Most recently used at the head
+static struct dentry* lru_head = NULL;
+static struct dentry* lru_tail = NULL;
+static size_t count = 0;
+// Guards everything above. Never held across an allocation or a disk access.
+static spinlock_t dcache_lock = SPINLOCK_INIT;
+static uint32_t hits = 0;
+static uint32_t misses = 0;
+
+static inline char fold(char c) { return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c; }
+
+static bool name_equal(const char* a, const char* b)
+{
+    while (*a && fold(*a) == fold(*b)) {
+        a++;
+        b++;
+    }
+    return fold(*a) == fold(*b);
+}
+
+static uint32_t hash_of(const void* sb, uint32_t parent, const char* name)
+{
+    // FNV-1a over the folded name, then the directory mixed in
+    uint32_t h = 2166136261u;
+    for (; *name; name++)
+        h = (h ^ (uint8_t)fold(*name)) * 16777619u;
+    return h ^ (parent * 0x9E3779B1u) ^ ((uintptr_t)sb >> 4);
+}
+
+static struct dcache_dir* find_dir(const void* sb, uint32_t parent)
+{
+    for (struct dcache_dir* d = dirs[(parent ^ ((uintptr_t)sb >> 4)) & (DCACHE_DIR_HASH_SIZE - 1)]; d; d = d->next) {
+        if (d->sb == sb && d->parent == parent) return d;
+    }
+    return NULL;
+}
+
+static struct dentry* find(const void* sb, uint32_t parent, const char* name, uint32_t h)
+{
+    for (struct dentry* d = hash[h & (DCACHE_HASH_SIZE - 1)]; d; d = d->hash_next) {
+        if (d->hash == h && d->sb == sb && d->parent == parent && name_equal(d->name, name)) return d;
+    }
+    return NULL;
+}
+
+static void lru_remove(struct dentry* d)
+{
+    if (d->lru_prev)
+        d->lru_prev->lru_next = d->lru_next;
+    else
+        lru_head = d->lru_next;
+    if (d->lru_next)
+        d->lru_next->lru_prev = d->lru_prev;
+    else
+        lru_tail = d->lru_prev;
+}
+
+static void lru_push(struct dentry* d)
+{
+    d->lru_prev = NULL;
+    d->lru_next = lru_head;
+    if (lru_head)
+        lru_head->lru_prev = d;
+    else
+        lru_tail = d;
+    lru_head = d;
+}
+
+/// Takes d out of the cache, the caller frees it once the lock is dropped
+static void unlink(struct dentry* d)
+{
+    *d->hash_pprev = d->hash_next;
+    if (d->hash_next) d->hash_next->hash_pprev = d->hash_pprev;
+    lru_remove(d);
+    count--;
+}
+
+void dcache_init()
+{
+    memset(hash, 0, sizeof(hash));
+    memset(dirs, 0, sizeof(dirs));
+}
+
+int dcache_lookup(const void* sb, uint32_t parent, const char* name, struct dcache_entry* out)
+{
+    uint32_t h = hash_of(sb, parent, name);
+    uint32_t flags = spin_lock_irqsave(&dcache_lock);
+    int res = -1;
+    struct dentry* d = find(sb, parent, name, h);
+    if (d) {
+        lru_remove(d);
+        lru_push(d);
+        if (!d->negative) *out = d->entry;
+        res = d->negative ? 0 : 1;
+    } else {
+        struct dcache_dir* dir = find_dir(sb, parent);
+        if (dir && dir->complete) res = 0;
+    }
+    if (res >= 0)
+        hits++;
+    else
+        misses++;
+    spin_unlock_irqrestore(&dcache_lock, flags);
+    return res;
+}
+
+static void insert(const void* sb, uint32_t parent, const char* name, const struct dcache_entry* entry)
+{
+    size_t len = strlen(name);
+    if (len > DCACHE_NAME_MAX) return;
+    struct dentry* fresh = kmalloc(sizeof(struct dentry) + len + 1);
+    if (!fresh) return;
+    fresh->sb = sb;
+    fresh->parent = parent;
+    fresh->hash = hash_of(sb, parent, name);
+    fresh->negative = !entry;
+    if (entry) fresh->entry = *entry;
+    memcpy(fresh->name, name, len + 1);
+
+    struct dentry* old;
+    struct dentry* evicted = NULL;
+    uint32_t flags = spin_lock_irqsave(&dcache_lock);
+    old = find(sb, parent, name, fresh->hash);
+    if (old) unlink(old);
+    if (count >= DCACHE_MAX_ENTRIES && lru_tail) {
+        evicted = lru_tail;
+        unlink(evicted);
+        struct dcache_dir* dir = find_dir(evicted->sb, evicted->parent);
+        if (dir) {
+            dir->complete = false;
+            dir->evictions++;
+        }
+    }
+    struct dentry** bucket = &hash[fresh->hash & (DCACHE_HASH_SIZE - 1)];
+    fresh->hash_next = *bucket;
+    fresh->hash_pprev = bucket;
+    if (*bucket) (*bucket)->hash_pprev = &fresh->hash_next;
+    *bucket = fresh;
+    lru_push(fresh);
+    count++;
+    spin_unlock_irqrestore(&dcache_lock, flags);
+    kfree(old);
+    kfree(evicted);
+}
+
+void dcache_add(const void* sb, uint32_t parent, const char* name, const struct dcache_entry* entry)
+{
+    insert(sb, parent, name, entry);
+}
+
+void dcache_add_negative(const void* sb, uint32_t parent, const char* name) { insert(sb, parent, name, NULL); }
+
+uint32_t dcache_fill_begin(const void* sb, uint32_t parent)
+{
+    struct dcache_dir* fresh = kmalloc(sizeof(struct dcache_dir));
+    uint32_t flags = spin_lock_irqsave(&dcache_lock);
+    struct dcache_dir* dir = find_dir(sb, parent);
+    if (!dir && fresh) {
+        dir = fresh;
+        fresh = NULL;
+        dir->sb = sb;
+        dir->parent = parent;
+        dir->complete = false;
+        dir->evictions = 0;
+        struct dcache_dir** bucket = &dirs[(parent ^ ((uintptr_t)sb >> 4)) & (DCACHE_DIR_HASH_SIZE - 1)];
+        dir->next = *bucket;
+        *bucket = dir;
+    }
+    // Without a record the directory can't be marked complete, the token just has to be something
+    uint32_t token = dir ? dir->evictions : 0;
+    spin_unlock_irqrestore(&dcache_lock, flags);
+    kfree(fresh);
+    return token;
+}
+
+void dcache_fill_end(const void* sb, uint32_t parent, uint32_t token)
+{
+    uint32_t flags = spin_lock_irqsave(&dcache_lock);
+    struct dcache_dir* dir = find_dir(sb, parent);
+    if (dir && dir->evictions == token) dir->complete = true;
+    spin_unlock_irqrestore(&dcache_lock, flags);
+}
+
+void dcache_invalidate_dir(const void* sb, uint32_t parent)
+{
+    struct dentry* dropped = NULL;
+    uint32_t flags = spin_lock_irqsave(&dcache_lock);
+    struct dcache_dir* dir = find_dir(sb, parent);
+    if (dir) dir->complete = false;
+    for (struct dentry *d = lru_head, *next; d; d = next) {
+        next = d->lru_next;
+        if (d->sb != sb || d->parent != parent) continue;
+        unlink(d);
+        // lru_next is free now, reuse it to chain what has to be freed
+        d->lru_next = dropped;
+        dropped = d;
+    }
+    spin_unlock_irqrestore(&dcache_lock, flags);
+    while (dropped) {
+        struct dentry* next = dropped->lru_next;
+        kfree(dropped);
+        dropped = next;
+    }
+}
+
+void dcache_stats(uint32_t* hit_count, uint32_t* miss_count)
+{
+    *hit_count = hits;
+    *miss_count = misses;
+}
@@ -2,296 +2,928 @@
 #include <kernel/ata/ata.h>
 #include <kernel/ata/controller.h>
 #include <kernel/ata/device.h>
+#include <kernel/bcache.h>
+#include <kernel/fs/dcache.h>
 #include <kernel/fs/fat.h>
 #include <kernel/fs/vfs.h>
+#include <kernel/klog.h>
 #include <kernel/liballoc.h>
 #include <stdio.h>
 #include <string.h>
 
+// Requests a file read or write keeps in flight, each up to BLOCK_MAX_MERGE sectors
+#define FAT_IO_BATCH 8
+
 enum {
     DIRECTORY_TYPE,
     FILE_TYPE,
 };
 
-static fat_BS_t* fat_boot;
-// TODO: setup proper storage of filesystems
-static struct fat_fs* fat;
+/* bios of a file read or write, submitted together and waited for together */
+struct fat_batch {
+    struct fat_fs* fs;
+    struct bio bios[FAT_IO_BATCH];
+    size_t count;
+    volatile uint32_t pending;
+    volatile bool failed;
+};
+
+static inline uint32_t cluster_sector(const struct fat_fs* fs, uint32_t cluster)
+{
+    return fs->first_data_sector + (cluster - 2) * fs->sectors_per_cluster;
+}
+
+/// Makes sure the FAT sector holding byte offset of the table is cached, table_lock has to be held
+static bool table_load(struct fat_fs* fs, uint32_t offset)
+{
+    uint32_t sector = offset / fs->sector_size;
+    if (fs->table_sectors && sector >= fs->table_start && sector < fs->table_start + fs->table_sectors) return true;
+    // FAT12/16 tables are small enough to keep whole, the window covers all of them and never slides
+    uint32_t start = fs->fat_type == FAT32 ? sector - sector % FAT_WINDOW_SECTORS : 0;
+    uint32_t count = fs->fat_type == FAT32 ? fs->fat_size - start : fs->fat_size;
+    if (fs->fat_type == FAT32 && count > FAT_WINDOW_SECTORS) count = FAT_WINDOW_SECTORS;
+    struct block_device* bdev = &fs->device->bdev;
+    uint32_t lba = fs->lba_start + fs->first_fat_sector + start;
+    fs->table_sectors = 0;
+    if (fs->fat_type != FAT32) {
+        // Nothing is dirty before the whole table loaded once, and once it has it never reloads
+        if (block_read(bdev, lba, count, fs->table)) {
+            klog_err("fat: could not read FAT sector %d\n", fs->first_fat_sector + start);
+            return false;
+        }
+    } else {
+        // Windows come and go, they're read through the buffer cache so they see entries not written back yet
+        bprefetch(bdev, lba, count);
+        for (uint32_t i = 0; i < count; i++) {
+            struct buf* b = bread(bdev, lba + i);
+            if (!b) {
+                klog_err("fat: could not read FAT sector %d\n", fs->first_fat_sector + start + i);
+                return false;
+            }
+            memcpy(fs->table + i * fs->sector_size, b->data, fs->sector_size);
+            brelse(b);
+        }
+    }
+    fs->table_start = start;
+    fs->table_sectors = count;
+    return true;
+}
+
+/// Byte offset of cluster's entry in the table
+static inline uint32_t entry_offset(const struct fat_fs* fs, uint32_t cluster)
+{
+    if (fs->fat_type == FAT12) return cluster + cluster / 2;
+    return fs->fat_type == FAT16 ? cluster * 2 : cluster * 4;
+}
+
+/// The table entry of cluster as it's stored, table_lock has to be held
+static bool table_get(struct fat_fs* fs, uint32_t cluster, uint32_t* value)
+{
+    uint32_t offset = entry_offset(fs, cluster);
+    if (!table_load(fs, offset)) return false;
+    const uint8_t* entry = fs->table + offset - fs->table_start * fs->sector_size;
+    if (fs->fat_type == FAT12) {
+        // 12 bit entries share a byte, odd clusters take the upper bits. The table is whole, so the second
+        // byte is always there.
+        *value = entry[0] | (entry[1] << 8);
+        *value = cluster & 1 ? *value >> 4 : *value & 0xFFF;
+    } else if (fs->fat_type == FAT16) {
+        *value = *(const uint16_t*)entry;
+    } else {
+        *value = *(const uint32_t*)entry & 0x0FFFFFFF;
+    }
+    return true;
+}
+
+/// Sets the table entry of cluster to value in the cache and in every copy of the FAT on disk. The sectors
+/// are only dirtied, the buffer cache writes them back together. table_lock has to be held.
+static bool table_set(struct fat_fs* fs, uint32_t cluster, uint32_t value)
+{
+    uint32_t offset = entry_offset(fs, cluster);
+    if (!table_load(fs, offset)) return false;
+    uint8_t* entry = fs->table + offset - fs->table_start * fs->sector_size;
+    size_t bytes;
+    if (fs->fat_type == FAT12) {
+        uint16_t both = entry[0] | (entry[1] << 8);
+        both = cluster & 1 ? (both & 0x000F) | (value & 0xFFF) << 4 : (both & 0xF000) | (value & 0xFFF);
+        entry[0] = both;
+        entry[1] = both >> 8;
+        bytes = 2;
+    } else if (fs->fat_type == FAT16) {
+        *(uint16_t*)entry = value;
+        bytes = 2;
+    } else {
+        // The top 4 bits are reserved and have to be kept
+        *(uint32_t*)entry = (*(uint32_t*)entry & 0xF0000000) | (value & 0x0FFFFFFF);
+        bytes = 4;
+    }
+
+    // FAT12 entries may straddle two sectors, so go byte by byte. The buffers stay cached between them.
+    for (uint8_t copy = 0; copy < fs->table_count; copy++) {
+        for (size_t i = 0; i < bytes; i++) {
+            uint32_t sector = fs->first_fat_sector + copy * fs->fat_size + (offset + i) / fs->sector_size;
+            struct buf* b = bread(&fs->device->bdev, fs->lba_start + sector);
+            if (!b) {
+                klog_err("fat: could not update FAT sector %d\n", sector);
+                return false;
+            }
+            b->data[(offset + i) % fs->sector_size] = entry[i];
+            bdirty(b);
+            brelse(b);
+        }
+    }
+    return true;
+}
+
+/// The cluster after cluster in its chain, FAT_CHAIN_END after the last one or FAT_CHAIN_BAD
+static uint32_t fat_entry(struct fat_fs* fs, uint32_t cluster)
+{
+    if (cluster < 2 || cluster >= fs->total_clusters + 2) return FAT_CHAIN_BAD;
+    uint32_t end = fs->fat_type == FAT12 ? 0xFF8 : fs->fat_type == FAT16 ? 0xFFF8 : 0x0FFFFFF8;
+    uint32_t value;
+    mutex_lock(&fs->table_lock);
+    bool ok = table_get(fs, cluster, &value);
+    mutex_unlock(&fs->table_lock);
+
+    if (!ok) return FAT_CHAIN_BAD;
+    if (value >= end) return FAT_CHAIN_END;
+    if (value < 2 || value >= fs->total_clusters + 2) return FAT_CHAIN_BAD;
+    return value;
+}
+
+static inline bool cluster_used(const struct fat_fs* fs, uint32_t cluster)
+{
+    return fs->used_map[cluster / 32] & (1u << (cluster % 32));
+}
+
+static inline void mark_used(struct fat_fs* fs, uint32_t cluster, bool used)
+{
+    if (used)
+        fs->used_map[cluster / 32] |= 1u << (cluster % 32);
+    else
+        fs->used_map[cluster / 32] &= ~(1u << (cluster % 32));
+}
+
+/// Builds the free cluster bitmap from the table, a single pass at mount
+static bool build_used_map(struct fat_fs* fs)
+{
+    uint32_t end = fs->total_clusters + 2;
+    uint32_t words = (end + 31) / 32;
+    fs->used_map = kmalloc(words * sizeof(uint32_t));
+    if (!fs->used_map) return false;
+    memset(fs->used_map, 0, words * sizeof(uint32_t));
+    // Clusters 0 and 1 don't exist, neither do the ones past the end of the last word
+    mark_used(fs, 0, true);
+    mark_used(fs, 1, true);
+    for (uint32_t c = end; c < words * 32; c++)
+        mark_used(fs, c, true);
+
+    fs->free_clusters = 0;
+    bool ok = true;
+    mutex_lock(&fs->table_lock);
+    for (uint32_t c = 2; c < end && ok; c++) {
+        uint32_t value;
+        ok = table_get(fs, c, &value);
+        if (ok && value)
+            mark_used(fs, c, true);
+        else if (ok)
+            fs->free_clusters++;
+    }
+    mutex_unlock(&fs->table_lock);
+    return ok;
+}
+
+/// Reads the FAT32 FSInfo for its next free hint, falling back to the start of the volume
+static void fsinfo_load(struct fat_fs* fs, uint16_t sector)
+{
+    fs->next_free = 2;
+    fs->fsinfo_sector = 0;
+    if (fs->fat_type != FAT32 || !sector || sector == 0xFFFF) return;
+    struct buf* b = bread(&fs->device->bdev, fs->lba_start + sector);
+    if (!b) return;
+    const uint8_t* data = b->data;
+    if (*(const uint32_t*)data == FSINFO_LEAD_SIG && *(const uint32_t*)(data + 484) == FSINFO_STRUCT_SIG) {
+        uint32_t hint = *(const uint32_t*)(data + FSINFO_NEXT_FREE);
+        if (hint >= 2 && hint < fs->total_clusters + 2) fs->next_free = hint;
+        fs->fsinfo_sector = sector;
+    }
+    brelse(b);
+}
+
+/// Puts the free count and the next free hint back into FSInfo, written back along with the FAT
+static void fsinfo_update(struct fat_fs* fs)
+{
+    if (!fs->fsinfo_sector) return;
+    struct buf* b = bread(&fs->device->bdev, fs->lba_start + fs->fsinfo_sector);
+    if (!b) return;
+    *(uint32_t*)(b->data + FSINFO_FREE_COUNT) = fs->free_clusters;
+    *(uint32_t*)(b->data + FSINFO_NEXT_FREE) = fs->next_free;
+    bdirty(b);
+    brelse(b);
+}
 
-static void list_directory(struct fat_fs* fs, fat_filetable_t* tables, size_t tables_size, size_t* num_tables);
-static void* fat_open_cluster(
-    const struct fat_fs* fs, uint16_t* buffer, uint16_t buffer_size, uint32_t cluster, uint16_t sector);
-static int fat_open_sector(
-    const struct fat_fs* fs, uint16_t* buffer, uint16_t buffer_size, uint32_t sector, uint8_t type);
+/// Looks at the free runs in [from, to). Keeps the smallest one holding want clusters in *best, or the largest
+/// one while none does. Returns true once a run of exactly want turns up, nothing beats that.
+static bool scan_runs(const struct fat_fs* fs, uint32_t from, uint32_t to, uint32_t want, uint32_t* best,
+    uint32_t* best_len)
+{
+    uint32_t c = from;
+    while (c < to) {
+        // Full words go by at once
+        if (c % 32 == 0 && fs->used_map[c / 32] == 0xFFFFFFFF) {
+            c += 32;
+            continue;
+        }
+        if (cluster_used(fs, c)) {
+            c++;
+            continue;
+        }
+        uint32_t start = c;
+        while (c < to && !cluster_used(fs, c))
+            c++;
+        uint32_t len = c - start;
+        bool better = len >= want ? *best_len < want || len < *best_len : *best_len < want && len > *best_len;
+        if (better) {
+            *best = start;
+            *best_len = len;
+        }
+        if (len == want) return true;
+    }
+    return false;
+}
+
+/// Best fit search for a run of want free clusters, starting at the next free hint so it wins ties. Returns
+/// the run's first cluster and its length in *len, which is short of want when no run is big enough. 0 if
+/// every cluster is used.
+static uint32_t find_run(const struct fat_fs* fs, uint32_t want, uint32_t* len)
+{
+    uint32_t best = 0;
+    *len = 0;
+    if (!scan_runs(fs, fs->next_free, fs->total_clusters + 2, want, &best, len))
+        scan_runs(fs, 2, fs->next_free, want, &best, len);
+    return best;
+}
+
+/// Allocates count clusters and chains them after last, 0 when the file has none yet. The clusters right
+/// after last are taken when they're free so the file stays in one run, best fit runs otherwise. Returns the
+/// first new cluster, 0 if there aren't enough free ones. alloc_lock has to be held.
+static uint32_t alloc_chain(struct fat_fs* fs, uint32_t last, uint32_t count)
+{
+    if (!count || count > fs->free_clusters) return 0;
+    uint32_t end = fs->total_clusters + 2;
+    uint32_t first = 0;
+    bool ok = true;
+    mutex_lock(&fs->table_lock);
+    while (count && ok) {
+        uint32_t start;
+        uint32_t len = 0;
+        if (last && last + 1 < end && !cluster_used(fs, last + 1)) {
+            start = last + 1;
+            while (len < count && start + len < end && !cluster_used(fs, start + len))
+                len++;
+        } else {
+            start = find_run(fs, count, &len);
+        }
+        if (len > count) len = count;
+        for (uint32_t i = 0; i < len && ok; i++) {
+            mark_used(fs, start + i, true);
+            ok = table_set(fs, start + i, i + 1 < len ? start + i + 1 : FAT_EOC);
+        }
+        if (ok && last) ok = table_set(fs, last, start);
+        if (!first) first = start;
+        last = start + len - 1;
+        fs->free_clusters -= len;
+        fs->next_free = last + 1 < end ? last + 1 : 2;
+        count -= len;
+    }
+    mutex_unlock(&fs->table_lock);
+    fsinfo_update(fs);
+    if (!ok) klog_err("fat: could not allocate clusters, the FAT may be inconsistent\n");
+    return ok ? first : 0;
+}
+
+/// Frees cluster and everything chained after it. alloc_lock has to be held.
+static bool free_chain(struct fat_fs* fs, uint32_t cluster)
+{
+    bool ok = true;
+    while (cluster < FAT_CHAIN_BAD && ok) {
+        uint32_t next = fat_entry(fs, cluster);
+        mutex_lock(&fs->table_lock);
+        ok = table_set(fs, cluster, 0);
+        mutex_unlock(&fs->table_lock);
+        mark_used(fs, cluster, false);
+        fs->free_clusters++;
+        cluster = next;
+    }
+    fsinfo_update(fs);
+    return ok;
+}
 
-// TODO: make a struct for all the useful data (FAT_FS esc thing).
-//       return success or failure bool
-void init_fat(sATADevice* device, uint32_t lba_start)
+/// Reads the volume's boot sector and sets up everything needed to use it. Returns the instance the mount
+/// keeps as its fs_private, NULL if the volume can't be used.
+void* init_fat(sATADevice* device, uint32_t lba_start)
 {
-    uint16_t buffer[256] = { 0 };
     printf("Attempting to read device %d\n", device->id);
-    bool res = device->rw_handler(device, OP_READ, buffer, lba_start, device->sec_size, 1);
-    if (!res) {
+    struct buf* b = bread(&device->bdev, lba_start);
+    if (!b) {
         printf("Failed to read device %d\n", device->id);
-        return;
+        return NULL;
     }
     printf("Read success\n");
-    fat_boot = kmalloc(sizeof(fat_BS_t));
-    fat = kmalloc(sizeof(struct fat_fs));
-    memcpy(fat_boot, buffer, sizeof(fat_BS_t));
-
-    fat->total_sectors = (fat_boot->total_sectors_16 == 0) ? fat_boot->total_sectors_32 : fat_boot->total_sectors_16;
-    printf("total sectors: %d\n", fat->total_sectors);
-    // int fat_size = (fat_boot->table_size_16 == 0)? fat_boot_ext_32->table_size_16 :
-    // fat_boot->table_size_16;
-    fat->fat_size = fat_boot->table_size_16;
-    printf("Fat size: %d\n", fat->fat_size);
-    fat->sector_size = fat_boot->bytes_per_sector;
-    printf("Sector size: %d\n", fat->sector_size);
-    fat->root_dir_sectors
-        = ((fat_boot->root_entry_count * 32) + (fat_boot->bytes_per_sector - 1)) / fat_boot->bytes_per_sector;
-
-    fat->data_sectors = fat->total_sectors
-        - (fat_boot->reserved_sector_count + (fat_boot->table_count * fat->fat_size) + fat->root_dir_sectors);
-
-    fat->total_clusters = fat->data_sectors / fat_boot->sectors_per_cluster;
+    struct fat_fs* fs = kmalloc(sizeof(struct fat_fs));
+    if (!fs) {
+        brelse(b);
+        return NULL;
+    }
+    fat_BS_t boot;
+    memcpy(&boot, b->data, sizeof(fat_BS_t));
+    brelse(b);
+    wait_queue_init(&fs->io_wait);
+    const fat_extBS_32_t* ext32 = (const fat_extBS_32_t*)boot.extended_section;
+
+    fs->total_sectors = (boot.total_sectors_16 == 0) ? boot.total_sectors_32 : boot.total_sectors_16;
+    printf("total sectors: %d\n", fs->total_sectors);
+    fs->fat_size = boot.table_size_16 == 0 ? ext32->table_size_32 : boot.table_size_16;
+    printf("Fat size: %d\n", fs->fat_size);
+    fs->sector_size = boot.bytes_per_sector;
+    printf("Sector size: %d\n", fs->sector_size);
+    fs->sectors_per_cluster = boot.sectors_per_cluster;
+    fs->root_dir_sectors
+        = ((boot.root_entry_count * 32) + (boot.bytes_per_sector - 1)) / boot.bytes_per_sector;
+
+    fs->data_sectors = fs->total_sectors
+        - (boot.reserved_sector_count + (boot.table_count * fs->fat_size) + fs->root_dir_sectors);
+
+    fs->total_clusters = fs->data_sectors / boot.sectors_per_cluster;
 
     // TODO: Support ExFAT
-    if (fat->total_clusters < 4085) {
-        fat->fat_type = FAT12;
-    } else if (fat->total_clusters < 65525) {
-        fat->fat_type = FAT16;
+    if (fs->total_clusters < 4085) {
+        fs->fat_type = FAT12;
+    } else if (fs->total_clusters < 65525) {
+        fs->fat_type = FAT16;
     } else {
-        fat->fat_type = FAT32;
-    }
-
-    printf("FAT Type: %d\n", fat->fat_type);
-
-    // NOTE: I know I am using FAT16 now so I am just going to tailor for that while testing
-    //       Most everything below this should be moved to an fopen function
-
-    fat->first_data_sector
-        = fat_boot->reserved_sector_count + (fat_boot->table_count * fat->fat_size) + fat->root_dir_sectors;
-    printf("first_data_sector: %d\n", fat->first_data_sector);
-    fat->first_root_dir_sector = fat->first_data_sector - fat->root_dir_sectors;
-    printf("first_root_dir_sector: %d\n", fat->first_root_dir_sector);
-
-    printf("secperclust: %d\n", fat_boot->sectors_per_cluster);
-    fat->lba_start = lba_start;
-    fat->device = device;
-    // int cluster = 2;
-    //
-    // int first_sector_of_cluster
-    //     = ((cluster - 2) * fat_boot->sectors_per_cluster) + first_data_sector;
-
-    // NOTE: I think this translates properly, if i understand, multiple sectors make up a cluster,
-    // since this is the first one i can just use the sector and i'll increment from there.
-    return;
-    int active_cluster = 2;
-    bool next = true;
-    while (next) {
-        uint8_t fat_table[fat->sector_size];
-        uint16_t fat_offset = active_cluster * 2;
-        // NOTE: Not sure first_root_dir_sector is right here, might have to manually find first
-        // sector of active_cluster
-        uint16_t fat_sector = fat->first_root_dir_sector + (fat_offset / fat->sector_size);
-        uint16_t ent_offset = fat_offset % fat->sector_size;
-        memset(buffer, 0, sizeof(uint16_t) * 256);
-        printf("Reading sector: %d, cluster: %d\n", fat_sector, active_cluster);
-        if (!device->rw_handler(device, OP_READ, (uint16_t*)buffer, 63 + fat_sector, device->sec_size, 1)) {
-            printf("Could not read from disk\n");
-            return;
+        fs->fat_type = FAT32;
+    }
+
+    printf("FAT Type: %d\n", fs->fat_type);
+
+    fs->first_fat_sector = boot.reserved_sector_count;
+    fs->first_data_sector
+        = boot.reserved_sector_count + (boot.table_count * fs->fat_size) + fs->root_dir_sectors;
+    printf("first_data_sector: %d\n", fs->first_data_sector);
+    fs->first_root_dir_sector = fs->first_data_sector - fs->root_dir_sectors;
+    printf("first_root_dir_sector: %d\n", fs->first_root_dir_sector);
+    fs->root_cluster = fs->fat_type == FAT32 ? ext32->root_cluster : 0;
+
+    printf("secperclust: %d\n", boot.sectors_per_cluster);
+    fs->lba_start = lba_start;
+    fs->device = device;
+
+    // FAT16 tops out at 128 KiB of table, FAT32 ones can be far bigger and get a window
+    mutex_init(&fs->table_lock);
+    uint32_t cached = fs->fat_type == FAT32 ? FAT_WINDOW_SECTORS : fs->fat_size;
+    fs->table = kmalloc(cached * fs->sector_size);
+    fs->table_start = 0;
+    fs->table_sectors = 0;
+    fs->used_map = NULL;
+    if (!fs->table) {
+        puts("fat: no memory for the FAT cache");
+        kfree(fs);
+        return NULL;
+    }
+    mutex_lock(&fs->table_lock);
+    table_load(fs, 0);
+    mutex_unlock(&fs->table_lock);
+
+    fs->table_count = boot.table_count;
+    mutex_init(&fs->alloc_lock);
+    fsinfo_load(fs, ext32->fat_info);
+    if (!build_used_map(fs)) {
+        puts("fat: could not build the free cluster map, the volume is read-only");
+        kfree(fs->used_map);
+        fs->used_map = NULL;
+        return fs;
+    }
+    printf("fat: %d of %d clusters free\n", fs->free_clusters, fs->total_clusters);
+    return fs;
+}
+
+static void batch_end(struct bio* bio)
+{
+    struct fat_batch* batch = bio->private;
+    if (bio->error) batch->failed = true;
+    __atomic_sub_fetch(&batch->pending, 1, __ATOMIC_RELEASE);
+    wake_up(&batch->fs->io_wait);
+}
+
+/// Waits for everything submitted through batch, it's empty again afterwards
+static void batch_wait(struct fat_batch* batch)
+{
+    wait_event(&batch->fs->io_wait, __atomic_load_n(&batch->pending, __ATOMIC_ACQUIRE) == 0);
+    batch->count = 0;
+}
+
+/// Moves whole sectors between the disk and buffer, split into requests the block layer takes as they are.
+/// Written sectors are copied into the buffer cache too if it holds them.
+static void transfer_direct(
+    struct fat_fs* fs, struct fat_batch* batch, int op, uint32_t sector, char* buffer, size_t sectors)
+{
+    struct block_device* bdev = &fs->device->bdev;
+    while (sectors) {
+        if (batch->count == FAT_IO_BATCH) batch_wait(batch);
+        size_t count = sectors < BLOCK_MAX_MERGE ? sectors : BLOCK_MAX_MERGE;
+        struct bio* bio = batch->bios + batch->count++;
+        bio_init(bio, bdev, op, fs->lba_start + sector, count, buffer, batch_end, batch);
+        __atomic_add_fetch(&batch->pending, 1, __ATOMIC_RELAXED);
+        block_submit(bio);
+        if (op == BIO_WRITE) bupdate(bdev, fs->lba_start + sector, count, buffer);
+        sector += count;
+        buffer += count * fs->sector_size;
+        sectors -= count;
+    }
+}
+
+/// Moves bytes starting skip bytes into sector between the buffer cache and buffer. Writes go to the disk
+/// right away, file data never waits in the cache where direct reads couldn't see it.
+static bool transfer_cached(struct fat_fs* fs, int op, uint32_t sector, size_t skip, char* buffer, size_t bytes)
+{
+    while (bytes) {
+        struct buf* b = bread(&fs->device->bdev, fs->lba_start + sector);
+        if (!b) {
+            klog_err("fat: could not read sector %d\n", sector);
+            return false;
         }
-        memcpy(fat_table, (uint8_t*)buffer, fat->sector_size);
-        unsigned short table_value = *(unsigned short*)&fat_table[ent_offset];
-        // for (size_t i = 64; i < sector_size; i++) {
-        //     printf("0x%X ", fat_table[i]);
-        // }
-        // return;
-        printf("\ntable_value: %d\n", table_value);
-        for (size_t i = 0; i < fat->sector_size; i += 64) {
-            if (fat_table[i] == 0x0) {
-                puts("No more files");
-                next = false;
-                break;
-            } else if (fat_table[i] == 0xE5) {
-                // TODO: Unused entry
-            }
-            if (fat_table[i + 10] == 0x0F) {
-                puts("long file name entry");
-            } else {
-                puts("not long file name");
-                printf("i: %d\n", i);
-                for (size_t j = i; j < 11 + i; j++) {
-                    printf("%c", fat_table[j]);
-                }
-                puts("");
+        size_t n = fs->sector_size - skip < bytes ? fs->sector_size - skip : bytes;
+        if (op == BIO_READ) {
+            memcpy(buffer, b->data + skip, n);
+        } else {
+            memcpy(b->data + skip, buffer, n);
+            if (bwrite(b)) {
+                klog_err("fat: could not write sector %d\n", sector);
+                brelse(b);
+                return false;
             }
         }
+        brelse(b);
+        buffer += n;
+        bytes -= n;
+        skip = 0;
+        sector++;
+    }
+    return true;
+}
 
-        const int to_check = 64;
-        // for (int k = to_check; k < to_check + 32; k++) {
-        //     printf("i: %d, 0x%X ", k, fat_table[k]);
-        // }
-        // puts("");
-
-        // Manually read file test.txt
-
-        uint16_t cluster = ((fat_table[to_check + 27] << 8) | (fat_table[to_check + 26])) - 2;
-        printf("test cluster: %d\n", cluster);
-        printf("secperclust: %d\n", fat_boot->sectors_per_cluster);
-
-        uint16_t fat_offset2 = cluster * fat_boot->sectors_per_cluster;
-        uint16_t fat_sector2 = fat->first_data_sector + fat_offset2;
-        memset(buffer, 0, sizeof(uint16_t) * 256);
-        printf("Fat offset: %d. Reading sector: %d\n", fat_offset2, fat_sector2 + 63);
-        if (!device->rw_handler(device, OP_READ, (uint16_t*)buffer, fat_sector2 + 63, device->sec_size, 1)) {
-            printf("Could not read from disk\n");
-            return;
-        }
+/// Moves bytes starting skip bytes into the contiguous clusters at sector. At least a cluster's worth of
+/// whole sectors goes straight between buffer and disk, anything smaller and the partial sectors at either end
+/// through the buffer cache.
+static bool transfer_run(
+    struct fat_fs* fs, struct fat_batch* batch, int op, uint32_t sector, size_t skip, char* buffer, size_t bytes)
+{
+    sector += skip / fs->sector_size;
+    skip %= fs->sector_size;
+    if (skip) {
+        size_t n = fs->sector_size - skip < bytes ? fs->sector_size - skip : bytes;
+        if (!transfer_cached(fs, op, sector++, skip, buffer, n)) return false;
+        buffer += n;
+        bytes -= n;
+    }
+    size_t sectors = bytes / fs->sector_size;
+    if (sectors >= fs->sectors_per_cluster) {
+        transfer_direct(fs, batch, op, sector, buffer, sectors);
+        sector += sectors;
+        buffer += sectors * fs->sector_size;
+        bytes -= sectors * fs->sector_size;
+    }
+    return transfer_cached(fs, op, sector, 0, buffer, bytes);
+}
 
-        uint8_t* tmp = (uint8_t*)buffer;
-        uint32_t fsize = 0;
-        for (size_t i = 0; i < 4; i++) {
-            fsize += fat_table[32 - i] << ((4 - i) * 8);
-        }
-        for (int i = 0; i < fsize; i++) {
-            if (tmp[i]) printf("%c", tmp[i]);
+/// The cluster holding unit of the file, starting from the read-ahead cursor when it's not past it
+static uint32_t seek_cluster(struct fat_fs* fs, const inode_t* inode, const struct readahead* ra, uint32_t unit)
+{
+    uint32_t at = 0;
+    uint32_t cluster = inode->first_cluster;
+    // A file cut down since may have freed the cursor's cluster
+    if (ra->cursor && ra->cursor_gen == inode->generation && ra->cursor_unit <= unit) {
+        at = ra->cursor_unit;
+        cluster = ra->cursor;
+    }
+    for (; at < unit && cluster < FAT_CHAIN_BAD; at++)
+        cluster = fat_entry(fs, cluster);
+    return cluster;
+}
+
+/// Prefetches count clusters of the file starting at unit start, cluster being the one at unit from
+static void prefetch(struct fat_fs* fs, uint32_t cluster, uint32_t from, uint32_t start, uint32_t count)
+{
+    for (; from < start && cluster < FAT_CHAIN_BAD; from++)
+        cluster = fat_entry(fs, cluster);
+    // Adjacent clusters are merged into one request by the block layer
+    for (; count && cluster < FAT_CHAIN_BAD; count--) {
+        bprefetch(&fs->device->bdev, fs->lba_start + cluster_sector(fs, cluster), fs->sectors_per_cluster);
+        cluster = fat_entry(fs, cluster);
+    }
+}
+
+/// Moves len bytes at offset of the file, which has clusters for all of them, between disk and buffer. Each
+/// contiguous run of clusters goes with as few requests as the block layer allows.
+static bool transfer(
+    struct fat_fs* fs, const inode_t* inode, int op, uint32_t offset, char* buffer, size_t len, struct readahead* ra)
+{
+    size_t cluster_size = (size_t)fs->sectors_per_cluster * fs->sector_size;
+    uint32_t unit = offset / cluster_size;
+    uint32_t cluster = seek_cluster(fs, inode, ra, unit);
+    struct fat_batch batch = { .fs = fs, .count = 0, .pending = 0, .failed = false };
+    size_t done = 0;
+    bool ok = true;
+    while (done < len && ok) {
+        if (cluster >= FAT_CHAIN_BAD) {
+            klog_err("fat: cluster chain ends after %d of %d bytes\n", offset + done, inode->f_size);
+            ok = false;
+            break;
         }
-        puts("");
-
-        if (table_value >= 0xFFF8) {
-            puts("No more clusters in chain");
-            next = false;
-        } else if (table_value == 0xFFF7) {
-            puts("Sector marked as bad");
-            next = false;
-        } else {
-            active_cluster = table_value;
-            // active_cluster++;
-            // next = false;
+        size_t skip = (offset + done) % cluster_size;
+        size_t left = len - done;
+        uint32_t first = cluster;
+        uint32_t run = 1;
+        uint32_t next = fat_entry(fs, cluster);
+        while (next == cluster + 1 && (size_t)run * cluster_size - skip < left) {
+            cluster = next;
+            run++;
+            next = fat_entry(fs, cluster);
         }
+        size_t bytes = (size_t)run * cluster_size - skip < left ? (size_t)run * cluster_size - skip : left;
+        ok = transfer_run(fs, &batch, op, cluster_sector(fs, first), skip, buffer + done, bytes);
+        done += bytes;
+        // Remember the last cluster of the run, the next sequential access starts there or right after it
+        unit += run - 1;
+        ra->cursor_unit = unit;
+        ra->cursor = cluster;
+        ra->cursor_gen = inode->generation;
+        unit++;
+        cluster = next;
     }
+    batch_wait(&batch);
+    return ok && !batch.failed;
 }
 
-/// Max number of files to check, eventually should be infinite but i don't trust myself yet.
-const static uint8_t MAX_FILES = 16;
-
 // TODO: Ignores file extensions
-int fat_open_file(const inode_t* inode, char* buffer, size_t buffer_size)
+int fat_open_file(const inode_t* inode, uint32_t offset, char* buffer, size_t len, struct readahead* ra)
 {
     // TODO: Support directories
-    // TODO: Account for filesize
+    struct fat_fs* fs = inode->mount->fs_private;
+    if (offset >= inode->f_size) return 0;
+    if (len > inode->f_size - offset) len = inode->f_size - offset;
+    size_t cluster_size = (size_t)fs->sectors_per_cluster * fs->sector_size;
+    uint32_t units = (inode->f_size + cluster_size - 1) / cluster_size;
+    uint32_t unit = offset / cluster_size;
+    if (!ra->max_window)
+        ra->max_window = fs->sectors_per_cluster < RA_MAX_SECTORS ? RA_MAX_SECTORS / fs->sectors_per_cluster : 1;
 
-    return fat_open_sector(fat, (uint16_t*)buffer, buffer_size, inode->init_sector, FILE_TYPE);
+    // Reads of less than a cluster go through the buffer cache, load their clusters and the read-ahead window
+    // past them in one go. Larger ones keep the disk busy on their own. Reads that stay in the cluster of the
+    // one before had it prefetched already and don't count as accesses.
+    uint32_t last = (offset + len - 1) / cluster_size;
+    if (len < cluster_size && ra->next != last + 1) {
+        uint32_t cluster = seek_cluster(fs, inode, ra, unit);
+        prefetch(fs, cluster, unit, unit, last - unit + 1);
+        uint32_t start;
+        uint32_t count = ra_access(ra, last, units, &start);
+        if (count) prefetch(fs, cluster, unit, start, count);
+    }
+    return transfer(fs, inode, BIO_READ, offset, buffer, len, ra) ? (int)len : -1;
 }
 
-void fat_close_file(void* file_start) { kfree(file_start); }
+/// Writes the file's size and first cluster back into its directory entry
+static bool update_entry(struct fat_fs* fs, const inode_t* inode)
+{
+    struct buf* b = bread(&fs->device->bdev, fs->lba_start + inode->entry_sector);
+    if (!b) {
+        klog_err("fat: could not update the directory entry of %s\n", inode->key);
+        return false;
+    }
+    fat_filetable_t* entry = (fat_filetable_t*)(b->data + inode->entry_offset);
+    entry->size = inode->f_size;
+    entry->cluster = inode->first_cluster;
+    if (fs->fat_type == FAT32) entry->clusterHi = inode->first_cluster >> 16;
+    bdirty(b);
+    brelse(b);
+    // What the dentry cache has on the file is out of date now
+    dcache_invalidate_dir(fs, inode->parent);
+    return true;
+}
 
-/// Finds inode and fills out remaining inode parameters.
-/// NOTE: Requires dir and mount to be filled in so it can know where to look.
-/// TODO: Maybe rework that?
-int fat_find_inode(inode_t* inode)
+/// Makes sure the file has clusters for size bytes. alloc_lock has to be held.
+static bool grow(struct fat_fs* fs, inode_t* inode, uint32_t size)
 {
-    inode->f_size = 0;
-    fat_filetable_t* file_tables = kmalloc(sizeof(fat_filetable_t) * MAX_FILES);
-    size_t num_tables = 0;
-    list_directory(fat, file_tables, MAX_FILES, &num_tables);
-
-    for (size_t i = 0; i < num_tables; i++) {
-        // Check if name matches
-        if (strncmp(inode->dir->filename, file_tables[i].name, 8)) continue;
-        if (strncmp(inode->dir->file_extension, file_tables[i].ext, 3)) continue;
-        // TODO: Add more checks, too lazy rn so it just checks file name and calls it quits
-
-        // Now we just fill out the inode
-        inode->f_size = file_tables[i].size;
-        // NOTE: Does not correctly offset based on root dir or data sectors yet.
-        // Planning on doing that in fat_open_sector()
-        inode->init_sector
-            = inode->mount->partition->start + (file_tables[i].cluster - 2) * fat_boot->sectors_per_cluster;
-        break;
-    }
-
-    kfree(file_tables);
-    if (inode->f_size)
-        return 0;
-    else
-        return 1;
+    size_t cluster_size = (size_t)fs->sectors_per_cluster * fs->sector_size;
+    uint32_t want = (size + cluster_size - 1) / cluster_size;
+    // Files may own clusters past their size, count what the chain really has
+    uint32_t have = 0;
+    uint32_t last = 0;
+    for (uint32_t c = inode->first_cluster; c && c < FAT_CHAIN_BAD; c = fat_entry(fs, c)) {
+        last = c;
+        have++;
+    }
+    if (have >= want) return true;
+    uint32_t first = alloc_chain(fs, last, want - have);
+    if (!first) {
+        klog_warn("fat: no room for %d more clusters\n", want - have);
+        return false;
+    }
+    if (!inode->first_cluster) {
+        inode->first_cluster = first;
+        inode->init_sector = fs->lba_start + cluster_sector(fs, first);
+    }
+    return true;
 }
 
-// TODO: Currently only supports reading from root_dir
-static void list_directory(struct fat_fs* fs, fat_filetable_t* tables, size_t tables_size, size_t* num_tables)
+/// Writes zeroes over [from, to) of the file, which has clusters for it
+static bool zero_range(struct fat_fs* fs, inode_t* inode, uint32_t from, uint32_t to, struct readahead* ra)
 {
-    uint8_t fat_table[fs->sector_size];
-    // Controls which directory we read
-    uint8_t active_cluster = 2;
-    fat_open_cluster(fs, (uint16_t*)fat_table, fs->sector_size / 2, active_cluster, fs->first_root_dir_sector);
+    size_t chunk = (size_t)fs->sectors_per_cluster * fs->sector_size;
+    char* zeroes = kmalloc(chunk);
+    if (!zeroes) return false;
+    memset(zeroes, 0, chunk);
+    bool ok = true;
+    while (from < to && ok) {
+        size_t n = to - from < chunk ? to - from : chunk;
+        ok = transfer(fs, inode, BIO_WRITE, from, zeroes, n, ra);
+        from += n;
+    }
+    kfree(zeroes);
+    return ok;
+}
 
-    for (size_t i = 0; i < fs->sector_size; i += 64) {
-        if (fat_table[i] == 0x0) {
-            break;
-        } else if (fat_table[i] == 0xE5) {
-            // TODO: Unused entry
-            continue;
-        }
-        // tables = (fat_filetable_t)fat_table[i];
-        if (fat_table[i + 10] == 0x0F) {
-            puts("long file name entry not supported");
-            continue;
+int fat_write_file(inode_t* inode, uint32_t offset, const char* buffer, size_t len, struct readahead* ra)
+{
+    struct fat_fs* fs = inode->mount->fs_private;
+    if (!fs->used_map || offset + len < offset) return -1;
+    if (!len) return 0;
+    uint32_t end = offset + len;
+    mutex_lock(&fs->alloc_lock);
+    uint32_t old_first = inode->first_cluster;
+    size_t old_size = inode->f_size;
+    bool ok = end <= old_size || grow(fs, inode, end);
+    // Whatever lies between the old end and offset reads as zeroes
+    if (ok && offset > old_size) ok = zero_range(fs, inode, old_size, offset, ra);
+    ok = ok && transfer(fs, inode, BIO_WRITE, offset, (char*)buffer, len, ra);
+    if (ok && end > old_size) inode->f_size = end;
+    // Clusters given to the file have to be recorded even if writing into them failed
+    if (inode->f_size != old_size || inode->first_cluster != old_first) ok = update_entry(fs, inode) && ok;
+    mutex_unlock(&fs->alloc_lock);
+    return ok ? (int)len : -1;
+}
+
+int fat_truncate(inode_t* inode, uint32_t size, struct readahead* ra)
+{
+    struct fat_fs* fs = inode->mount->fs_private;
+    if (!fs->used_map) return -1;
+    if (size > inode->f_size) {
+        mutex_lock(&fs->alloc_lock);
+        uint32_t old_first = inode->first_cluster;
+        bool ok = grow(fs, inode, size) && zero_range(fs, inode, inode->f_size, size, ra);
+        if (ok) inode->f_size = size;
+        if (ok || inode->first_cluster != old_first) ok = update_entry(fs, inode) && ok;
+        mutex_unlock(&fs->alloc_lock);
+        return ok ? 0 : -1;
+    }
+
+    mutex_lock(&fs->alloc_lock);
+    size_t cluster_size = (size_t)fs->sectors_per_cluster * fs->sector_size;
+    uint32_t keep = (size + cluster_size - 1) / cluster_size;
+    bool ok = true;
+    if (inode->first_cluster) {
+        if (!keep) {
+            ok = free_chain(fs, inode->first_cluster);
+            inode->first_cluster = 0;
+            inode->init_sector = 0;
         } else {
-            memcpy(tables, fat_table + i, 32);
-            for (uint8_t j = 0; j < 8; j++) {
-                if (tables->name[j] == ' ') tables->name[j] = '\0';
-                if (j < 3) {
-                    if (tables->ext[j] == ' ') tables->ext[j] = '\0';
-                }
+            // The last cluster kept ends the chain, everything after it goes
+            uint32_t last = seek_cluster(fs, inode, ra, keep - 1);
+            uint32_t rest = last < FAT_CHAIN_BAD ? fat_entry(fs, last) : FAT_CHAIN_BAD;
+            if (last < FAT_CHAIN_BAD && rest < FAT_CHAIN_BAD) {
+                mutex_lock(&fs->table_lock);
+                ok = table_set(fs, last, FAT_EOC);
+                mutex_unlock(&fs->table_lock);
+                ok = ok && free_chain(fs, rest);
             }
-            tables++;
-            (*num_tables)++;
         }
     }
-    return;
+    inode->f_size = size;
+    inode->generation++;
+    ok = update_entry(fs, inode) && ok;
+    mutex_unlock(&fs->alloc_lock);
+    return ok ? 0 : -1;
 }
 
-static int fat_open_sector(
-    const struct fat_fs* fs, uint16_t* buffer, uint16_t buffer_size, uint32_t sector, uint8_t type)
+void fat_close_file(void* file_start) { kfree(file_start); }
+
+/// Reads the entry at i of a directory sector that holds a long name piece into name, if it continues the run
+/// of pieces seen so far. Returns the sequence number still expected, 0 once the run is broken.
+static uint8_t lfn_piece(const uint8_t* entry, char* name, uint8_t expected, uint8_t* checksum)
 {
-    uint32_t offset = 0;
-    if (type == DIRECTORY_TYPE) {
-        offset = fs->first_root_dir_sector;
-    } else if (type == FILE_TYPE) {
-        offset = fs->first_data_sector;
+    // Offsets of the 13 UCS-2 characters in a long name entry
+    static const uint8_t chars[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+    uint8_t seq = entry[0] & 0x1F;
+    if (entry[0] & 0x40) {
+        // The last piece comes first on disk
+        if (seq == 0 || seq > (DCACHE_NAME_MAX + 12) / 13) return 0;
+        expected = seq;
+        *checksum = entry[13];
+        name[seq * 13 < DCACHE_NAME_MAX ? seq * 13 : DCACHE_NAME_MAX] = '\0';
+    } else if (seq != expected || entry[13] != *checksum) {
+        return 0;
     }
-    uint16_t read_buff[256] = { 0 };
-    printf("Reading from sector: %d\n", sector + offset);
-    if (!fs->device->rw_handler(fs->device, OP_READ, read_buff, sector + offset, fs->device->sec_size, 1)) {
-        printf("Could not read from disk\n");
-        return -1;
+    for (size_t i = 0; i < 13; i++) {
+        size_t at = (size_t)(seq - 1) * 13 + i;
+        if (at >= DCACHE_NAME_MAX) break;
+        uint16_t c = entry[chars[i]] | (entry[chars[i] + 1] << 8);
+        if (c == 0) {
+            name[at] = '\0';
+            break;
+        }
+        // Only ASCII survives, there's nowhere to put the rest
+        name[at] = c < 0x80 ? (char)c : '?';
     }
-    // Copy into caller's buffer, manually making sure we don't read past end of read_buff
-    if (buffer_size <= 256) {
-        memcpy(buffer, read_buff, buffer_size);
-    } else {
-        memcpy(buffer, read_buff, 256);
+    return expected;
+}
+
+static uint8_t short_checksum(const fat_filetable_t* entry)
+{
+    const uint8_t* name = (const uint8_t*)entry->name;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < 11; i++)
+        sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+    return sum;
+}
+
+/// The 8.3 name of entry as NAME.EXT, without the padding
+static void short_name(const fat_filetable_t* entry, char* name)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < 8 && entry->name[i] != ' '; i++)
+        name[len++] = entry->name[i];
+    // 0xE5 marks free entries, names starting with it are stored with 0x05
+    if (len && (uint8_t)name[0] == 0x05) name[0] = (char)0xE5;
+    if (entry->ext[0] != ' ') {
+        name[len++] = '.';
+        for (size_t i = 0; i < 3 && entry->ext[i] != ' '; i++)
+            name[len++] = entry->ext[i];
     }
-    return 0;
+    name[len] = '\0';
 }
 
-// sector should be either first_root_dir_sector or first_data_sector, specifys where to look for sector i think
-static void* fat_open_cluster(
-    const struct fat_fs* fs, uint16_t* buffer, uint16_t buffer_size, uint32_t cluster, uint16_t sector)
+/// Puts every name in directory dir into the dentry cache, the long one and the 8.3 one. dir is the first
+/// cluster of the directory, 0 for the root.
+static bool scan_directory(struct fat_fs* fs, uint32_t dir)
 {
-    uint16_t read_buff[256] = { 0 };
-    uint32_t lba_addr = fs->lba_start + (cluster - 2) * fat_boot->sectors_per_cluster;
-    printf("lba_addr: %d\n", lba_addr);
-    if (!fs->device->rw_handler(fs->device, OP_READ, read_buff, lba_addr + sector, fs->device->sec_size, 1)) {
-        printf("Could not read from disk\n");
-        return NULL;
+    // FAT12/16 keep the root directory in a fixed area in front of the data, FAT32 chains it like any other
+    uint32_t cluster = dir ? dir : fs->fat_type == FAT32 ? fs->root_cluster : 0;
+    uint32_t sector = cluster ? cluster_sector(fs, cluster) : fs->first_root_dir_sector;
+    uint32_t left = cluster ? fs->sectors_per_cluster : fs->root_dir_sectors;
+    char* long_name = kmalloc(DCACHE_NAME_MAX + 1);
+    if (!long_name) return false;
+    long_name[0] = '\0';
+    char name[13];
+    uint8_t expected = 0;
+    uint8_t checksum = 0;
+    uint32_t token = dcache_fill_begin(fs, dir);
+    bool ok = true;
+
+    while (left) {
+        struct buf* b = bread(&fs->device->bdev, fs->lba_start + sector);
+        if (!b) {
+            klog_err("fat: could not read directory sector %d\n", sector);
+            ok = false;
+            break;
+        }
+        bool end = false;
+        for (size_t i = 0; i < fs->sector_size; i += sizeof(fat_filetable_t)) {
+            const fat_filetable_t* entry = (const fat_filetable_t*)(b->data + i);
+            // A free entry that was never used ends the directory
+            if (entry->name[0] == 0x0) {
+                end = true;
+                break;
+            }
+            if ((uint8_t)entry->name[0] == 0xE5) {
+                expected = 0;
+                continue;
+            }
+            // Long name pieces come right before their 8.3 entry, the last piece first
+            if (entry->attrib == FAT_ATTR_LFN) {
+                expected = lfn_piece(b->data + i, long_name, expected, &checksum);
+                if (expected)
+                    expected--;
+                else
+                    long_name[0] = '\0';
+                continue;
+            }
+            // Only a complete run whose checksum matches belongs to this entry
+            bool has_long = expected == 0 && long_name[0] && checksum == short_checksum(entry);
+            expected = 0;
+            checksum = 0;
+            if (entry->attrib & FAT_ATTR_VOLUME_ID) continue;
+
+            // The high half only means something on FAT32
+            struct dcache_entry found = {
+                .ino = entry->cluster | (fs->fat_type == FAT32 ? (uint32_t)entry->clusterHi << 16 : 0),
+                .size = entry->size,
+                .attrib = entry->attrib,
+                .loc = sector,
+                .loc_offset = i,
+            };
+            short_name(entry, name);
+            dcache_add(fs, dir, name, &found);
+            if (has_long) dcache_add(fs, dir, long_name, &found);
+            long_name[0] = '\0';
+        }
+        brelse(b);
+        if (end) break;
+
+        sector++;
+        if (--left || !cluster) continue;
+        cluster = fat_entry(fs, cluster);
+        if (cluster == FAT_CHAIN_END) break;
+        if (cluster == FAT_CHAIN_BAD) {
+            klog_err("fat: broken cluster chain in directory %d\n", dir);
+            ok = false;
+            break;
+        }
+        sector = cluster_sector(fs, cluster);
+        left = fs->sectors_per_cluster;
     }
-    // Copy into caller's buffer, manually making sure we don't read past end of read_buff
-    if (buffer_size <= 256) {
-        return memcpy(buffer, read_buff, buffer_size);
-    } else {
-        return memcpy(buffer, read_buff, 256);
+
+    if (ok) dcache_fill_end(fs, dir, token);
+    kfree(long_name);
+    return ok;
+}
+
+/// Looks name up in directory dir, reading the directory in only if the dentry cache can't tell
+static bool fat_lookup(struct fat_fs* fs, uint32_t dir, const char* name, struct dcache_entry* out)
+{
+    int res = dcache_lookup(fs, dir, name, out);
+    if (res >= 0) return res;
+    if (!scan_directory(fs, dir)) return false;
+    res = dcache_lookup(fs, dir, name, out);
+    // Entries may have been evicted again on a busy cache, then the directory isn't complete and a negative
+    // entry keeps the next lookup off the disk
+    if (res < 0) dcache_add_negative(fs, dir, name);
+    return res > 0;
+}
+
+/// Walks path a component at a time from the root, each has to be a directory. name is scratch space for
+/// DCACHE_NAME_MAX characters.
+static bool resolve_dir(struct fat_fs* fs, const char* path, char* name, uint32_t* dir)
+{
+    struct dcache_entry entry;
+    *dir = 0;
+    while (path && *path) {
+        size_t len = 0;
+        while (path[len] && path[len] != '/')
+            len++;
+        if (len > DCACHE_NAME_MAX) return false;
+        if (len) {
+            memcpy(name, path, len);
+            name[len] = '\0';
+            if (!fat_lookup(fs, *dir, name, &entry) || !(entry.attrib & FAT_ATTR_DIRECTORY)) return false;
+            *dir = entry.ino;
+        }
+        path += path[len] ? len + 1 : len;
     }
+    return true;
+}
+
+/// Finds inode and fills out remaining inode parameters.
+/// NOTE: Requires dir and mount to be filled in so it can know where to look.
+/// TODO: Maybe rework that?
+int fat_find_inode(inode_t* inode)
+{
+    struct fat_fs* fs = inode->mount->fs_private;
+    inode->f_size = 0;
+    char* name = kmalloc(DCACHE_NAME_MAX + 1);
+    if (!name) return 1;
+
+    uint32_t dir;
+    struct dcache_entry entry;
+    bool found = false;
+    if (resolve_dir(fs, inode->dir->path, name, &dir)) {
+        if (inode->dir->file_extension[0])
+            snprintf(name, DCACHE_NAME_MAX + 1, "%s.%s", inode->dir->filename, inode->dir->file_extension);
+        else
+            snprintf(name, DCACHE_NAME_MAX + 1, "%s", inode->dir->filename);
+        // TODO: Support directories
+        if (fat_lookup(fs, dir, name, &entry) && !(entry.attrib & FAT_ATTR_DIRECTORY)) {
+            // Now we just fill out the inode, empty files have no clusters
+            inode->f_size = entry.size;
+            inode->first_cluster = entry.ino;
+            inode->init_sector = entry.ino ? fs->lba_start + cluster_sector(fs, inode->first_cluster) : 0;
+            inode->parent = dir;
+            inode->entry_sector = entry.loc;
+            inode->entry_offset = entry.loc_offset;
+            found = true;
+        }
+    }
+
+    kfree(name);
+    return found ? 0 : 1;
 }
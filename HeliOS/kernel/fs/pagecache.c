@@ -0,0 +1,257 @@
+#include <kernel/fs/pagecache.h>
+#include <kernel/klog.h>
+#include <kernel/memory.h>
+#include <kernel/sched.h>
+#include <kernel/spinlock.h>
+#include <string.h>
+
+static struct cached_page pages[PCACHE_PAGES];
+static struct cached_page* hash[PCACHE_HASH_SIZE];
+// Unreferenced pages, most recently released at the head
+static struct cached_page* lru_head = NULL;
+static struct cached_page* lru_tail = NULL;
+// Guards the hash, the LRU list and every page's flags and refs. Page data is only written while loading.
+static spinlock_t cache_lock = SPINLOCK_INIT;
+// Woken when a load finishes
+static struct wait_queue load_wait;
+static uint32_t hits = 0;
+static uint32_t misses = 0;
+
+static inline size_t hash_of(const inode_t* inode, uint32_t index)
+{
+    return (index ^ ((uintptr_t)inode >> 4) ^ ((uintptr_t)inode >> 12)) & (PCACHE_HASH_SIZE - 1);
+}
+
+static void lru_remove(struct cached_page* p)
+{
+    if (p->lru_prev)
+        p->lru_prev->lru_next = p->lru_next;
+    else
+        lru_head = p->lru_next;
+    if (p->lru_next)
+        p->lru_next->lru_prev = p->lru_prev;
+    else
+        lru_tail = p->lru_prev;
+    p->lru_prev = p->lru_next = NULL;
+}
+
+static void lru_push(struct cached_page* p)
+{
+    p->lru_prev = NULL;
+    p->lru_next = lru_head;
+    if (lru_head)
+        lru_head->lru_prev = p;
+    else
+        lru_tail = p;
+    lru_head = p;
+}
+
+/// Queues p to be reused before anything else
+static void lru_push_tail(struct cached_page* p)
+{
+    p->lru_prev = lru_tail;
+    p->lru_next = NULL;
+    if (lru_tail)
+        lru_tail->lru_next = p;
+    else
+        lru_head = p;
+    lru_tail = p;
+}
+
+static struct cached_page* lookup(const inode_t* inode, uint32_t index)
+{
+    for (struct cached_page* p = hash[hash_of(inode, index)]; p; p = p->hash_next) {
+        if (p->inode == inode && p->index == index) return p;
+    }
+    return NULL;
+}
+
+static void hash_remove(struct cached_page* p)
+{
+    struct cached_page** link = &hash[hash_of(p->inode, p->index)];
+    while (*link != p)
+        link = &(*link)->hash_next;
+    *link = p->hash_next;
+    p->hash_next = NULL;
+    p->inode = NULL;
+    p->flags = 0;
+}
+
+static void grab(struct cached_page* p)
+{
+    if (p->refs++ == 0) lru_remove(p);
+}
+
+/// Takes the oldest unreferenced page for index of inode, cache_lock has to be held
+static struct cached_page* claim(inode_t* inode, uint32_t index)
+{
+    struct cached_page* p = lru_tail;
+    if (!p) return NULL;
+    if (p->inode) hash_remove(p);
+    p->inode = inode;
+    p->index = index;
+    p->flags = 0;
+    size_t bucket = hash_of(inode, index);
+    p->hash_next = hash[bucket];
+    hash[bucket] = p;
+    grab(p);
+    return p;
+}
+
+void pcache_init()
+{
+    wait_queue_init(&load_wait);
+    for (size_t i = 0; i < PCACHE_PAGES; i++)
+        lru_push(pages + i);
+}
+
+/// Reads the page in through its filesystem, zeroing whatever lies past the end of the file
+static bool load(struct cached_page* p, struct readahead* ra)
+{
+    if (!p->data) p->data = (uint8_t*)kalloc_frames(1);
+    if (!p->data) return false;
+    const inode_t* inode = p->inode;
+    uint32_t offset = p->index * PAGE_SIZE;
+    size_t len = 0;
+    if (offset < inode->f_size) len = inode->f_size - offset < PAGE_SIZE ? inode->f_size - offset : PAGE_SIZE;
+    if (len) {
+        int res = inode->mount->filesystem->read_handler(inode, offset, (char*)p->data, len, ra);
+        if (res != (int)len) return false;
+    }
+    memset(p->data + len, 0, PAGE_SIZE - len);
+    return true;
+}
+
+struct cached_page* pcache_get(inode_t* inode, uint32_t index, struct readahead* ra)
+{
+    uint32_t flags = spin_lock_irqsave(&cache_lock);
+    struct cached_page* p = lookup(inode, index);
+    if (p)
+        grab(p);
+    else
+        p = claim(inode, index);
+    if (!p) {
+        spin_unlock_irqrestore(&cache_lock, flags);
+        klog_warn("pcache: every page is in use\n");
+        return NULL;
+    }
+
+    while (true) {
+        if (p->flags & PAGE_VALID) {
+            hits++;
+            spin_unlock_irqrestore(&cache_lock, flags);
+            return p;
+        }
+        if (!(p->flags & PAGE_LOADING)) break;
+        spin_unlock_irqrestore(&cache_lock, flags);
+        wait_event(&load_wait, !(p->flags & PAGE_LOADING));
+        flags = spin_lock_irqsave(&cache_lock);
+    }
+    // Nobody had it, or their read failed. Others wait for us while we load.
+    p->flags |= PAGE_LOADING;
+    misses++;
+    spin_unlock_irqrestore(&cache_lock, flags);
+
+    bool ok = load(p, ra);
+
+    flags = spin_lock_irqsave(&cache_lock);
+    p->flags &= ~PAGE_LOADING;
+    if (ok) p->flags |= PAGE_VALID;
+    spin_unlock_irqrestore(&cache_lock, flags);
+    wake_up(&load_wait);
+    if (!ok) {
+        klog_err("pcache: could not read page %d of %s\n", index, inode->key);
+        pcache_put(p);
+        return NULL;
+    }
+    return p;
+}
+
+struct cached_page* pcache_find(inode_t* inode, uint32_t index)
+{
+    uint32_t flags = spin_lock_irqsave(&cache_lock);
+    struct cached_page* p = lookup(inode, index);
+    if (p && p->flags & PAGE_VALID) {
+        grab(p);
+        hits++;
+    } else {
+        p = NULL;
+    }
+    spin_unlock_irqrestore(&cache_lock, flags);
+    return p;
+}
+
+bool pcache_cached(const inode_t* inode, uint32_t index)
+{
+    uint32_t flags = spin_lock_irqsave(&cache_lock);
+    struct cached_page* p = lookup(inode, index);
+    bool cached = p && p->flags & PAGE_VALID;
+    spin_unlock_irqrestore(&cache_lock, flags);
+    return cached;
+}
+
+void pcache_put(struct cached_page* page)
+{
+    if (!page) return;
+    uint32_t flags = spin_lock_irqsave(&cache_lock);
+    if (--page->refs == 0) {
+        // Failed loads aren't worth keeping, they go first next time
+        if (!(page->flags & (PAGE_VALID | PAGE_LOADING))) {
+            hash_remove(page);
+            lru_push_tail(page);
+        } else {
+            lru_push(page);
+        }
+    }
+    spin_unlock_irqrestore(&cache_lock, flags);
+}
+
+void pcache_update(inode_t* inode, uint32_t offset, const void* data, size_t len)
+{
+    const uint8_t* src = data;
+    size_t done = 0;
+    while (done < len) {
+        uint32_t pos = offset + done;
+        size_t in = pos % PAGE_SIZE;
+        size_t n = PAGE_SIZE - in < len - done ? PAGE_SIZE - in : len - done;
+        // Not a hit, nobody asked for the page
+        uint32_t flags = spin_lock_irqsave(&cache_lock);
+        struct cached_page* p = lookup(inode, pos / PAGE_SIZE);
+        if (p && p->flags & PAGE_VALID)
+            grab(p);
+        else
+            p = NULL;
+        spin_unlock_irqrestore(&cache_lock, flags);
+        if (p) {
+            if (src)
+                memcpy(p->data + in, src + done, n);
+            else
+                memset(p->data + in, 0, n);
+            pcache_put(p);
+        }
+        done += n;
+    }
+}
+
+void pcache_drop_inode(inode_t* inode)
+{
+    uint32_t flags = spin_lock_irqsave(&cache_lock);
+    for (size_t i = 0; i < PCACHE_PAGES; i++) {
+        struct cached_page* p = pages + i;
+        if (p->inode != inode) continue;
+        if (p->refs) {
+            klog_err("pcache: page %d of %s is still referenced\n", p->index, inode->key);
+            continue;
+        }
+        hash_remove(p);
+        lru_remove(p);
+        lru_push_tail(p);
+    }
+    spin_unlock_irqrestore(&cache_lock, flags);
+}
+
+void pcache_stats(uint32_t* hit_count, uint32_t* miss_count)
+{
+    *hit_count = hits;
+    *miss_count = misses;
+}
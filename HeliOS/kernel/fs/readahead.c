@@ -0,0 +1,35 @@
+#include <kernel/fs/readahead.h>
+
+void ra_init(struct readahead* ra, uint32_t max_window)
+{
+    ra->next = 0;
+    ra->window = 0;
+    ra->ahead = 0;
+    ra->max_window = max_window;
+    ra->cursor_unit = 0;
+    ra->cursor = 0;
+    ra->cursor_gen = 0;
+}
+
+uint32_t ra_access(struct readahead* ra, uint32_t unit, uint32_t limit, uint32_t* start)
+{
+    if (unit == ra->next) {
+        // Reading the first unit counts as sequential, most files are read front to back
+        ra->window = ra->window ? ra->window * 2 : RA_MIN_WINDOW;
+        if (ra->window > ra->max_window) ra->window = ra->max_window;
+    } else {
+        // A seek, whatever was prefetched past the old position is likely wasted
+        ra->window /= 2;
+        ra->ahead = unit + 1;
+    }
+    ra->next = unit + 1;
+    if (ra->ahead < unit + 1) ra->ahead = unit + 1;
+
+    uint32_t target = unit + 1 + ra->window;
+    if (target > limit) target = limit;
+    if (ra->ahead >= target) return 0;
+    *start = ra->ahead;
+    uint32_t count = target - ra->ahead;
+    ra->ahead = target;
+    return count;
+}
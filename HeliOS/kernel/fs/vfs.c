@@ -1,35 +1,65 @@
+#include <kernel/fs/dcache.h>
 #include <kernel/fs/fat.h>
+#include <kernel/fs/pagecache.h>
 #include <kernel/fs/vfs.h>
+#include <kernel/klog.h>
 #include <kernel/liballoc.h>
+#include <kernel/rwlock.h>
+#include <kernel/slab.h>
+#include <kernel/spinlock.h>
+#include <kernel/trace.h>
+#include <kernel/vmalloc.h>
 #include <stdio.h>
+#include <string.h>
 
 mount_t* mounts;
 static uint8_t max_mounts;
 static uint8_t mount_idx;
+// Guards mounts, lookups only read it
+static rwlock_t mount_lock = RWLOCK_INIT;
 
 filesystem_t* filesystems;
 static uint8_t max_fs;
 static uint8_t fs_idx = 0;
+static rwlock_t fs_lock = RWLOCK_INIT;
 
-static void register_mount(mount_t mount);
-
-static inode_t** inode_cache;
+// Cached inodes hashed by mount id and full path. Referenced ones stay put, unreferenced ones also sit on
+// the LRU list and the oldest goes once ic_size inodes are cached.
+static inode_t** inode_hash;
+// Buckets, a power of two
+static size_t ic_buckets;
 // Size of inode cache
 static size_t ic_size;
-// Last inserted inode
-static size_t ic_idx = 0;
+static size_t ic_count = 0;
+static inode_t* lru_head = NULL;
+static inode_t* lru_tail = NULL;
+static int ic_next_id = 0;
+static uint32_t ic_hits = 0;
+static uint32_t ic_misses = 0;
+// Guards everything above and every cached inode's bookkeeping. Only held for the table itself, never across
+// a call into a driver or the allocator.
+static spinlock_t ic_lock = SPINLOCK_INIT;
+
+static kmem_cache_t* inode_kcache;
+static kmem_cache_t* file_kcache;
 
 void vfs_init(uint8_t maximum_filesystems, uint8_t maximum_mounts, size_t inode_cache_size)
 {
     max_fs = maximum_filesystems;
     filesystems = (filesystem_t*)kmalloc(sizeof(filesystem_t) * max_fs);
     max_mounts = maximum_mounts;
-    mounts = (mount_t*)kmalloc(sizeof(mount_t) * max_mounts);
+    mounts = (mount_t*)kcalloc(max_mounts, sizeof(mount_t));
     ic_size = inode_cache_size;
-    inode_cache = (inode_t**)kmalloc((sizeof(uintptr_t)) * ic_size);
+    for (ic_buckets = 16; ic_buckets < ic_size; ic_buckets *= 2)
+        ;
+    inode_hash = (inode_t**)kcalloc(ic_buckets, sizeof(inode_t*));
+    inode_kcache = kmem_cache_create("inode", sizeof(inode_t), 0, NULL);
+    file_kcache = kmem_cache_create("file", sizeof(FILE), 0, NULL);
+    dcache_init();
+    pcache_init();
 }
 
-/// Finds file system in list of supported filesystems
+/// Finds file system in list of supported filesystems, fs_lock has to be held
 static filesystem_t* find_filesystem(uint8_t fs_type)
 {
     for (uint8_t i = 0; i < fs_idx; i++) {
@@ -38,123 +68,493 @@ static filesystem_t* find_filesystem(uint8_t fs_type)
     return NULL;
 }
 
+static filesystem_t* lookup_filesystem(uint8_t fs_type)
+{
+    read_lock(&fs_lock);
+    filesystem_t* filesys = find_filesystem(fs_type);
+    read_unlock(&fs_lock);
+    return filesys;
+}
+
 bool register_fs(uint8_t fs)
 {
-    if (find_filesystem(fs)) return false;
+    write_lock(&fs_lock);
+    if (find_filesystem(fs) || fs_idx >= max_fs) {
+        write_unlock(&fs_lock);
+        return false;
+    }
     if (fs == FAT16) {
         filesystem_t filesys;
         filesys.id = fs_idx;
         filesys.fs_type = fs;
         filesys.fs_init = init_fat;
         filesys.read_handler = fat_open_file;
+        filesys.write_handler = fat_write_file;
+        filesys.truncate = fat_truncate;
         filesys.find_inode = fat_find_inode;
         filesystems[fs_idx++] = filesys;
+        write_unlock(&fs_lock);
         return true;
     } else {
+        write_unlock(&fs_lock);
         printf("FS not supported\n");
         return false;
     }
 }
 
-/// Finds inode based on directory information
-/// NOTE: Always turns inode into a malloced structure
-static inode_t* find_inode(const dir_t* dir)
+/// The full path dir names, what its inode is cached under
+static char* inode_key(const dir_t* dir)
+{
+    const char* path = dir->path ? dir->path : "";
+    size_t len = strlen(path) + sizeof(dir->filename) + sizeof(dir->file_extension) + 2;
+    char* key = kmalloc(len);
+    if (!key) return NULL;
+    const char* sep = *path ? "/" : "";
+    if (dir->file_extension[0])
+        snprintf(key, len, "%s%s%s.%s", path, sep, dir->filename, dir->file_extension);
+    else
+        snprintf(key, len, "%s%s%s", path, sep, dir->filename);
+    return key;
+}
+
+static uint32_t inode_hash_of(uint8_t mount_id, const char* key)
+{
+    // FNV-1a, the mount id goes first
+    uint32_t h = (2166136261u ^ mount_id) * 16777619u;
+    for (; *key; key++)
+        h = (h ^ (uint8_t)*key) * 16777619u;
+    return h;
+}
+
+static void lru_remove(inode_t* inode)
+{
+    if (inode->lru_prev)
+        inode->lru_prev->lru_next = inode->lru_next;
+    else
+        lru_head = inode->lru_next;
+    if (inode->lru_next)
+        inode->lru_next->lru_prev = inode->lru_prev;
+    else
+        lru_tail = inode->lru_prev;
+}
+
+static void lru_push(inode_t* inode)
+{
+    inode->lru_prev = NULL;
+    inode->lru_next = lru_head;
+    if (lru_head)
+        lru_head->lru_prev = inode;
+    else
+        lru_tail = inode;
+    lru_head = inode;
+}
+
+static void unhash(inode_t* inode)
+{
+    inode_t** link = inode_hash + (inode->hash & (ic_buckets - 1));
+    while (*link != inode)
+        link = &(*link)->hash_next;
+    *link = inode->hash_next;
+    inode->id = -1;
+    ic_count--;
+}
+
+/// Looks the file up in the inode cache and takes a reference on what it finds, ic_lock has to be held
+static inode_t* lookup_inode(uint8_t mount_id, const char* key, uint32_t hash)
 {
-    for (size_t i = 0; i < ic_idx; i++) {
-        inode_t* curr = inode_cache[i];
-        if (curr == NULL) continue;
-        if (curr->mount->id != dir->mount_id) continue;
-        if (curr->dir->path != dir->path) continue;
-        if (curr->dir->filename != dir->filename) continue;
-        // if (curr.dir->file_extension != dir->file_extension) continue;
-        return inode_cache[i];
+    for (inode_t* curr = inode_hash[hash & (ic_buckets - 1)]; curr; curr = curr->hash_next) {
+        if (curr->hash != hash || curr->mount->id != mount_id || strcmp(curr->key, key)) continue;
+        if (curr->refs++ == 0) lru_remove(curr);
+        return curr;
     }
-    return kcalloc(1, sizeof(inode_t));
+    return NULL;
 }
 
-static void cache_inode(inode_t* inode)
+/// Finds a referenced inode for the file from the cache, NULL on a miss
+static inode_t* find_inode(uint8_t mount_id, const char* key, uint32_t hash)
 {
-    printf("Caching at %d\n", ic_idx);
-    inode->id = ic_idx;
-    inode_cache[ic_idx++] = inode;
+    uint32_t flags = spin_lock_irqsave(&ic_lock);
+    inode_t* inode = lookup_inode(mount_id, key, hash);
+    if (inode)
+        ic_hits++;
+    else
+        ic_misses++;
+    spin_unlock_irqrestore(&ic_lock, flags);
+    return inode;
 }
 
-static void uncache_inode(inode_t* inode)
+static void free_inode(inode_t* inode)
 {
-    inode_cache[inode->id] = NULL;
-    kfree(inode);
+    pcache_drop_inode(inode);
+    kfree(inode->key);
+    kmem_cache_free(inode_kcache, inode);
 }
 
-FILE* vfs_open(dir_t* directory)
+/// Caches a freshly looked up inode unless someone else cached the same file meanwhile, returns whichever ends
+/// up cached with a reference taken. When the cache is full of open files the inode stays uncached.
+static inode_t* cache_inode(inode_t* inode)
+{
+    inode_t* evicted = NULL;
+    uint32_t flags = spin_lock_irqsave(&ic_lock);
+    inode_t* cached = lookup_inode(inode->mount->id, inode->key, inode->hash);
+    if (!cached) {
+        inode->refs = 1;
+        inode->id = -1;
+        if (ic_count >= ic_size && lru_tail) {
+            evicted = lru_tail;
+            lru_remove(evicted);
+            unhash(evicted);
+        }
+        if (ic_count < ic_size) {
+            inode_t** bucket = inode_hash + (inode->hash & (ic_buckets - 1));
+            inode->hash_next = *bucket;
+            *bucket = inode;
+            inode->id = ic_next_id++;
+            ic_count++;
+        }
+    }
+    spin_unlock_irqrestore(&ic_lock, flags);
+    if (evicted) {
+        klog_debug("vfs: evicting inode %s\n", evicted->key);
+        free_inode(evicted);
+    }
+    if (!cached) return inode;
+    free_inode(inode);
+    return cached;
+}
+
+/// Drops a reference. Unreferenced inodes stay cached unless drop is set, uncached ones are freed right away.
+static void put_inode(inode_t* inode, bool drop)
+{
+    bool release = false;
+    uint32_t flags = spin_lock_irqsave(&ic_lock);
+    if (--inode->refs == 0) {
+        if (inode->id >= 0 && drop) unhash(inode);
+        if (inode->id >= 0)
+            lru_push(inode);
+        else
+            release = true;
+    }
+    spin_unlock_irqrestore(&ic_lock, flags);
+    if (release) free_inode(inode);
+}
+
+static FILE* open_file(dir_t* directory, bool* cached)
 {
-    if (directory->mount_id > mount_idx) return NULL;
-    void* file_ptr = NULL;
-    inode_t* file_inode = find_inode(directory);
-    puts("Searched for inode");
+    if (directory->mount_id >= mount_idx) return NULL;
+    read_lock(&mount_lock);
+    mount_t* mount = mounts + directory->mount_id;
+    filesystem_t* filesys = mount->filesystem;
+    // Mounts still being set up have no instance yet
+    bool usable = mount->present && mount->fs_private;
+    read_unlock(&mount_lock);
+    if (!usable) return NULL;
+    char* key = inode_key(directory);
+    if (!key) return NULL;
+    uint32_t hash = inode_hash_of(directory->mount_id, key);
     // First we check if we have already cached this inode
-    if (file_inode->f_size == 0) {
-        puts("Had to ask filesystem to find inode");
+    inode_t* file_inode = find_inode(directory->mount_id, key, hash);
+    klog_debug("vfs: searched for inode\n");
+    *cached = file_inode != NULL;
+    if (file_inode) {
+        kfree(key);
+    } else {
+        klog_debug("vfs: had to ask filesystem to find inode\n");
         // If we can't find the inode we ask the filesystem driver to search the drive
         // We fill the inode slightly to aide driver searching
+        file_inode = kmem_cache_zalloc(inode_kcache);
+        if (!file_inode) {
+            kfree(key);
+            return NULL;
+        }
         file_inode->dir = directory;
-        file_inode->mount = mounts + directory->mount_id;
+        file_inode->mount = mount;
+        file_inode->key = key;
+        file_inode->hash = hash;
         // If the driver can't find it then we return NULL
-        if (mounts[directory->mount_id].filesystem->find_inode(file_inode)) return NULL;
+        int res = filesys->find_inode(file_inode);
+        file_inode->dir = NULL;
+        if (res) {
+            free_inode(file_inode);
+            return NULL;
+        }
         // Cache the inode since we found it
-        cache_inode(file_inode);
-    }
-    puts("Trying to read file");
-    FILE* file = kmalloc(sizeof(FILE));
-    char* file_buff = kmalloc(file_inode->f_size);
-    int res = mounts[directory->mount_id].filesystem->read_handler(file_inode, file_buff, file_inode->f_size);
-    // If successful we can return
-    if (res == 0) {
-        puts("Successfully read file");
-        file->file_ptr = file_buff;
-        file->read_ptr = file_buff;
-        file->file_size = file_inode->f_size;
-        return file;
-    }
-    puts("Did not read file");
-    // if not successful we free the memory
-    kfree(file_inode);
-    kfree(file);
-    kfree(file_buff);
-    return NULL;
+        file_inode = cache_inode(file_inode);
+    }
+    FILE* file = kmem_cache_alloc(file_kcache);
+    if (!file) {
+        put_inode(file_inode, false);
+        return NULL;
+    }
+    file->inode = file_inode;
+    file->pos = 0;
+    file->file_size = file_inode->f_size;
+    ra_init(&file->ra, 0);
+    return file;
+}
+
+FILE* vfs_open(dir_t* directory)
+{
+    TRACE(TRACE_VFS_OPEN, directory->mount_id, 0, 0);
+    bool cached = false;
+    FILE* file = open_file(directory, &cached);
+    TRACE(TRACE_VFS_OPEN_DONE, file ? file->inode : NULL, cached, 0);
+    return file;
 }
 
 void vfs_close(FILE* file)
 {
     // TODO: should probably flush buffers or smthn. Maybe update meta data
-    kfree(file->file_ptr);
-    kfree(file);
+    put_inode(file->inode, false);
+    kmem_cache_free(file_kcache, file);
+}
+
+static int pread_pages(FILE* file, void* buffer, size_t len, uint32_t offset)
+{
+    inode_t* inode = file->inode;
+    // Other handles may have written to the file since
+    file->file_size = inode->f_size;
+    if (offset >= file->file_size || !len) return 0;
+    if (len > file->file_size - offset) len = file->file_size - offset;
+    char* out = buffer;
+    size_t done = 0;
+    while (done < len) {
+        uint32_t pos = offset + done;
+        size_t in = pos % PAGE_SIZE;
+        size_t n = PAGE_SIZE - in < len - done ? PAGE_SIZE - in : len - done;
+        // Small reads are likely to come back and get cached, larger ones only use what's cached already
+        struct cached_page* page
+            = len < PAGE_SIZE ? pcache_get(inode, pos / PAGE_SIZE, &file->ra) : pcache_find(inode, pos / PAGE_SIZE);
+        if (page) {
+            memcpy(out + done, page->data + in, n);
+            pcache_put(page);
+            done += n;
+            continue;
+        }
+        // Stream everything up to the next cached page straight into the buffer
+        while (done + n < len && !pcache_cached(inode, (pos + n) / PAGE_SIZE))
+            n = len - done - n < PAGE_SIZE ? len - done : n + PAGE_SIZE;
+        int res = inode->mount->filesystem->read_handler(inode, pos, out + done, n, &file->ra);
+        if (res < 0) {
+            klog_warn("vfs: could not read %s at %d\n", inode->key, pos);
+            return -1;
+        }
+        done += res;
+        if ((size_t)res < n) break;
+    }
+    return done;
+}
+
+int vfs_pread(FILE* file, void* buffer, size_t len, uint32_t offset)
+{
+    TRACE(TRACE_VFS_READ, file->inode, offset, len);
+    int res = pread_pages(file, buffer, len, offset);
+    TRACE(TRACE_VFS_READ_DONE, file->inode, offset, res);
+    return res;
+}
+
+int vfs_pwrite(FILE* file, const void* buffer, size_t len, uint32_t offset)
+{
+    inode_t* inode = file->inode;
+    filesystem_t* filesys = inode->mount->filesystem;
+    if (!filesys->write_handler) return -1;
+    size_t old_size = inode->f_size;
+    int res = filesys->write_handler(inode, offset, buffer, len, &file->ra);
+    file->file_size = inode->f_size;
+    if (res < 0) {
+        klog_warn("vfs: could not write %s at %d\n", inode->key, offset);
+        return -1;
+    }
+    // The filesystem wrote around the page cache, bring what it holds up to date
+    if (offset > old_size) pcache_update(inode, old_size, NULL, offset - old_size);
+    pcache_update(inode, offset, buffer, len);
+    return res;
+}
+
+int vfs_write(FILE* file, const void* buffer, size_t len)
+{
+    int res = vfs_pwrite(file, buffer, len, file->pos);
+    if (res > 0) file->pos += res;
+    return res;
+}
+
+int vfs_truncate(FILE* file, uint32_t size)
+{
+    inode_t* inode = file->inode;
+    filesystem_t* filesys = inode->mount->filesystem;
+    if (!filesys->truncate) return -1;
+    size_t old_size = inode->f_size;
+    int res = filesys->truncate(inode, size, &file->ra);
+    file->file_size = inode->f_size;
+    if (file->pos > file->file_size) file->pos = file->file_size;
+    if (res) {
+        klog_warn("vfs: could not truncate %s to %d\n", inode->key, size);
+        return -1;
+    }
+    // Cached pages read as zeroes past the end, whichever way the end moved
+    if (size < old_size)
+        pcache_update(inode, size, NULL, old_size - size);
+    else
+        pcache_update(inode, old_size, NULL, size - old_size);
+    return 0;
+}
+
+/// A file mapped by vfs_mmap
+struct file_map {
+    inode_t* inode;
+    uint32_t first; // Page of the file mapped at the start of the area
+    uint32_t pages;
+    struct readahead ra;
+    struct mutex lock; // Held while a fault maps a page
+    struct cached_page* mapped[]; // Pages referenced by the mapping
+};
+
+static int file_map_fault(vm_area_t* area, uintptr_t page)
+{
+    struct file_map* map = area->private;
+    uint32_t i = (page - area->start) / PAGE_SIZE;
+    // Past the end of the file there's nothing to map
+    if ((map->first + i) * PAGE_SIZE >= map->inode->f_size) return -1;
+    mutex_lock(&map->lock);
+    int res = 0;
+    if (!map->mapped[i]) {
+        struct cached_page* p = pcache_get(map->inode, map->first + i, &map->ra);
+        uintptr_t phys = p ? (uintptr_t)p->data - KERNEL_OFFSET : 0;
+        // The page table entry takes a frame reference of its own, vmm_release drops it
+        if (p && !vmm_map_range(page, phys, 1, 0)) {
+            pmm_frame_get(phys);
+            map->mapped[i] = p;
+        } else {
+            pcache_put(p);
+            res = -1;
+        }
+    }
+    mutex_unlock(&map->lock);
+    return res;
+}
+
+static void file_map_release(vm_area_t* area)
+{
+    struct file_map* map = area->private;
+    for (uint32_t i = 0; i < map->pages; i++)
+        pcache_put(map->mapped[i]);
+    put_inode(map->inode, false);
+    kfree(map);
+}
+
+static const struct vm_area_ops file_map_ops = {
+    .fault = file_map_fault,
+    .release = file_map_release,
+};
+
+void* vfs_mmap(FILE* file, uint32_t offset, size_t len)
+{
+    if (offset % PAGE_SIZE || !len || offset >= file->file_size) return NULL;
+    uint32_t pages = CEIL_DIV(len, PAGE_SIZE);
+    struct file_map* map = kmalloc(sizeof(struct file_map) + pages * sizeof(struct cached_page*));
+    if (!map) return NULL;
+    vm_area_t* area = vmalloc_area(pages * PAGE_SIZE, 0);
+    if (!area) {
+        kfree(map);
+        return NULL;
+    }
+    // The mapping outlives the file it came from, it keeps the inode around
+    uint32_t flags = spin_lock_irqsave(&ic_lock);
+    file->inode->refs++;
+    spin_unlock_irqrestore(&ic_lock, flags);
+    map->inode = file->inode;
+    map->first = offset / PAGE_SIZE;
+    map->pages = pages;
+    ra_init(&map->ra, 0);
+    mutex_init(&map->lock);
+    memset(map->mapped, 0, pages * sizeof(struct cached_page*));
+    area->private = map;
+    area->ops = &file_map_ops;
+    return (void*)area->start;
+}
+
+void vfs_munmap(void* addr)
+{
+    vm_area_t* area = vmm_find_area((uintptr_t)addr);
+    if (!area || area->ops != &file_map_ops || area->start != (uintptr_t)addr) {
+        klog_warn("vfs: 0x%X was not returned by vfs_mmap\n", addr);
+        return;
+    }
+    vfree_area(area);
+}
+
+int vfs_read(FILE* file, void* buffer, size_t len)
+{
+    int res = vfs_pread(file, buffer, len, file->pos);
+    if (res > 0) file->pos += res;
+    return res;
+}
+
+int32_t vfs_seek(FILE* file, int32_t offset, int whence)
+{
+    int64_t base;
+    file->file_size = file->inode->f_size;
+    if (whence == VFS_SEEK_SET)
+        base = 0;
+    else if (whence == VFS_SEEK_CUR)
+        base = file->pos;
+    else if (whence == VFS_SEEK_END)
+        base = file->file_size;
+    else
+        return -1;
+    int64_t pos = base + offset;
+    if (pos < 0 || pos > (int64_t)file->file_size) return -1;
+    file->pos = pos;
+    return pos;
+}
+
+void vfs_inode_stats(uint32_t* hits, uint32_t* misses)
+{
+    *hits = ic_hits;
+    *misses = ic_misses;
 }
 
-static void register_mount(mount_t mount)
+void unregister_mount(mount_t mount)
 {
-    printf("Registering mount with id %d\n", mount.id);
-    mounts[fs_idx] = mount;
-    mounts[fs_idx].present = true;
-    fs_idx++;
+    write_lock(&mount_lock);
+    mounts[mount.id].present = false;
+    write_unlock(&mount_lock);
 }
-void unregister_mount(mount_t mount) { mounts[mount.id].present = false; }
 
 int mount(uint8_t id, sATADevice* device, sPartition* partition, uint8_t fs_type)
 {
-    if (id > max_mounts || mounts[id].present) return -1;
+    if (id >= max_mounts) return -1;
     // building mount struct
     mount_t mount;
     mount.device = device;
     mount.partition = partition;
     mount.id = id;
     mount.present = partition->present;
-    mount.filesystem = find_filesystem(fs_type);
+    mount.filesystem = lookup_filesystem(fs_type);
+    mount.fs_private = NULL;
+    if (!mount.filesystem) return -1;
     // If it is present we add it to the array and init filesystem
     if (mount.present) {
+        write_lock(&mount_lock);
+        if (mounts[id].present) {
+            write_unlock(&mount_lock);
+            return -1;
+        }
+        // Claims the slot, it can't be used until the filesystem hands over its instance
         printf("Adding mount to %d\n", id);
         mounts[id] = mount;
+        if (id >= mount_idx) mount_idx = id + 1;
+        write_unlock(&mount_lock);
         puts("Initializing filesystem");
-        mount.filesystem->fs_init(device, partition->start);
+        void* instance = mount.filesystem->fs_init(device, partition->start);
+        write_lock(&mount_lock);
+        mounts[id].fs_private = instance;
+        if (!instance) mounts[id].present = false;
+        write_unlock(&mount_lock);
+        if (!instance) {
+            printf("Could not set up the filesystem on mount %d\n", id);
+            return -1;
+        }
         return 0;
     }
     return 1;
@@ -1,58 +1,89 @@
+#include <kernel/cpu.h>
 #include <kernel/gdt.h>
+#include <kernel/smp.h>
+#include <string.h>
 
-/* Our GDT, with 3 entries, and finally our special GDT pointer */
-struct gdt_entry gdt[3];
-struct gdt_ptr gp;
+/* One GDT for each CPU, and our special GDT pointers */
+struct gdt_entry gdt[MAX_CPUS][GDT_ENTRIES];
+struct gdt_ptr gp[MAX_CPUS];
 
 /* This will be a function in start.asm. We use this to properly
  *  reload the new segment registers */
-extern void gdt_flush();
+extern void gdt_flush(struct gdt_ptr* ptr);
+
+/* Top of the boot stack from boot.asm, the BSP keeps using it */
+extern char stack_top[];
 
 /* Setup a descriptor in the Global Descriptor Table */
-void gdt_set_gate(int index, unsigned long base, unsigned long limit, unsigned char access, unsigned char gran)
+void gdt_set_gate(unsigned int cpu, int index, unsigned long base, unsigned long limit, unsigned char access,
+    unsigned char gran)
 {
+        struct gdt_entry* entry = &gdt[cpu][index];
+
         /* Setup the descriptor base address */
-        gdt[index].base_low = (base & 0xFFFF);
-        gdt[index].base_middle = (base >> 16) & 0xFF;
-        gdt[index].base_high = (base >> 24) & 0xFF;
+        entry->base_low = (base & 0xFFFF);
+        entry->base_middle = (base >> 16) & 0xFF;
+        entry->base_high = (base >> 24) & 0xFF;
 
         /* Setup the descriptor limits */
-        gdt[index].limit_low = (limit & 0xFFFF);
-        gdt[index].granularity = ((limit >> 16) & 0x0F);
+        entry->limit_low = (limit & 0xFFFF);
+        entry->granularity = ((limit >> 16) & 0x0F);
 
         /* Finally, set up the granularity and access flags */
-        gdt[index].granularity |= (gran & 0xF0);
-        gdt[index].access = access;
+        entry->granularity |= (gran & 0xF0);
+        entry->access = access;
 }
 
-/* Should be called by main. This will setup the special GDT
- *  pointer, set up the first 3 entries in our GDT, and then
- *  finally call gdt_flush() in our assembler file in order
- *  to tell the processor where the new GDT is and update the
- *  new segment registers */
-void gdt_init()
+void gdt_init_cpu(struct cpu* cpu)
 {
+        unsigned int id = cpu->id;
+
         /* Setup the GDT pointer and limit */
-        gp.limit = (sizeof(struct gdt_entry) * 3) - 1;
-        gp.base = (unsigned int)&gdt;
+        gp[id].limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
+        gp[id].base = (unsigned int)&gdt[id];
 
         /* Our NULL descriptor */
-        gdt_set_gate(0, 0, 0, 0, 0);
+        gdt_set_gate(id, 0, 0, 0, 0, 0);
 
         /* The second entry is our Code Segment. The base address
          *  is 0, the limit is 4GBytes, it uses 4KByte granularity,
          *  uses 32-bit opcodes, and is a Code Segment descriptor.
          *  Please check the table above in the tutorial in order
          *  to see exactly what each value means */
-        gdt_set_gate(1, 0, 0xFFFFFFFF, 0x9A, 0xCF);
+        gdt_set_gate(id, 1, 0, 0xFFFFFFFF, 0x9A, 0xCF);
 
         /* The third entry is our Data Segment. It's EXACTLY the
          *  same as our code segment, but the descriptor type in
          *  this entry's access byte says it's a Data Segment */
-        gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xCF);
+        gdt_set_gate(id, 2, 0, 0xFFFFFFFF, 0x92, 0xCF);
+
+        /* Byte granular data segment covering just this CPU's
+         *  struct cpu, %gs:0 is its self pointer */
+        gdt_set_gate(id, 3, (uintptr_t)cpu, sizeof(struct cpu) - 1, 0x92, 0x40);
+
+        /* 32 bit available TSS, the I/O bitmap is left out by
+         *  pointing it past the end */
+        memset(&cpu->tss, 0, sizeof(struct tss));
+        cpu->tss.ss0 = GDT_KERNEL_DATA;
+        cpu->tss.esp0 = cpu->stack_top;
+        cpu->tss.iomap_base = sizeof(struct tss);
+        gdt_set_gate(id, 4, (uintptr_t)&cpu->tss, sizeof(struct tss) - 1, 0x89, 0x00);
 
         /* Flush out the old GDT and install the new changes! */
-        gdt_flush();
+        gdt_flush(&gp[id]);
+        asm volatile("mov %0, %%gs" : : "r"(GDT_PERCPU));
+        asm volatile("ltr %0" : : "r"((uint16_t)GDT_TSS));
+}
+
+/* Should be called by main. This will setup the boot CPU's GDT
+ *  and per-CPU data, the other CPUs do the same from smp_init */
+void gdt_init()
+{
+        struct cpu* bsp = &cpus[0];
+        bsp->self = bsp;
+        bsp->id = 0;
+        bsp->stack_top = (uintptr_t)stack_top;
+        gdt_init_cpu(bsp);
 
         // TODO: Add logging to some kprintf type thing.
 }
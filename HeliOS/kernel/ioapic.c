@@ -0,0 +1,134 @@
+#include <kernel/interrupts.h>
+#include <kernel/ioapic.h>
+#include <kernel/memory.h>
+#include <kernel/vmalloc.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define IOREGSEL 0x00
+#define IOWIN 0x10
+
+#define IOAPIC_VER 0x01
+#define IOAPIC_REDTBL(n) (0x10 + 2 * (n))
+
+#define REDIR_ACTIVE_LOW (1 << 13)
+#define REDIR_LEVEL (1 << 15)
+#define REDIR_MASKED (1 << 16)
+#define REDIR_DEST_SHIFT 24 // In the high dword
+
+struct ioapic {
+    volatile uint32_t* regs;
+    uint32_t gsi_base;
+    uint32_t pins;
+};
+
+// Where each irq below IRQ_GSI_MAX is wired to
+struct irq_pin {
+    struct ioapic* ioapic; // NULL if the irq has no pin
+    uint8_t pin;
+};
+
+static struct ioapic ioapics[ACPI_MAX_IOAPICS];
+static int ioapic_count = 0;
+static struct irq_pin irq_pins[IRQ_GSI_MAX];
+
+static uint32_t ioapic_read(struct ioapic* io, uint8_t reg)
+{
+    io->regs[IOREGSEL / sizeof(uint32_t)] = reg;
+    return io->regs[IOWIN / sizeof(uint32_t)];
+}
+
+static void ioapic_write(struct ioapic* io, uint8_t reg, uint32_t value)
+{
+    io->regs[IOREGSEL / sizeof(uint32_t)] = reg;
+    io->regs[IOWIN / sizeof(uint32_t)] = value;
+}
+
+static struct ioapic* ioapic_for_gsi(uint32_t gsi)
+{
+    for (int i = 0; i < ioapic_count; i++) {
+        if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].pins) return &ioapics[i];
+    }
+    return NULL;
+}
+
+/// Points gsi at irq's vector on the boot CPU, masked
+static void route(int irq, uint32_t gsi, uint32_t flags)
+{
+    struct ioapic* io = ioapic_for_gsi(gsi);
+    if (!io || irq >= IRQ_GSI_MAX) return;
+    uint8_t pin = gsi - io->gsi_base;
+    // Whatever had this pin before loses it
+    for (int other = 0; other < IRQ_GSI_MAX; other++) {
+        if (irq_pins[other].ioapic == io && irq_pins[other].pin == pin) irq_pins[other].ioapic = NULL;
+    }
+    ioapic_write(io, IOAPIC_REDTBL(pin) + 1, 0);
+    ioapic_write(io, IOAPIC_REDTBL(pin), REDIR_MASKED | flags | IRQ_VECTOR(irq));
+    irq_pins[irq].ioapic = io;
+    irq_pins[irq].pin = pin;
+}
+
+int ioapic_init(const struct acpi_madt_info* madt)
+{
+    for (int i = 0; i < madt->ioapic_count; i++) {
+        struct ioapic* io = &ioapics[ioapic_count];
+        io->regs = ioremap(madt->ioapics[i].phys, PAGE_SIZE, PAGE_FLAG_NOCACHE);
+        if (!io->regs) {
+            printf("ioapic_init: couldn't map the IOAPIC at 0x%X\n", madt->ioapics[i].phys);
+            continue;
+        }
+        io->gsi_base = madt->ioapics[i].gsi_base;
+        io->pins = ((ioapic_read(io, IOAPIC_VER) >> 16) & 0xFF) + 1;
+        // Mask everything the firmware may have left enabled
+        for (uint32_t pin = 0; pin < io->pins; pin++)
+            ioapic_write(io, IOAPIC_REDTBL(pin), REDIR_MASKED);
+        ioapic_count++;
+    }
+    if (!ioapic_count) return -1;
+
+    // PCI and everything else past the ISA range is level triggered active low and keeps its own number
+    for (uint32_t gsi = ACPI_ISA_IRQS; gsi < IRQ_GSI_MAX; gsi++)
+        route(gsi, gsi, REDIR_LEVEL | REDIR_ACTIVE_LOW);
+    // ISA IRQs keep the numbers drivers know them by, wherever the firmware wired them. Overrides go last so
+    // they win the pin from whatever irq would have had it by number, e.g. IRQ0 on GSI 2 over IRQ2.
+    for (int pass = 0; pass < 2; pass++) {
+        for (int irq = 0; irq < ACPI_ISA_IRQS; irq++) {
+            bool overridden = madt->isa_gsi[irq] != (uint32_t)irq;
+            if (overridden != (pass == 1)) continue;
+            uint16_t inti = madt->isa_flags[irq];
+            uint32_t flags = 0;
+            if ((inti & ACPI_INTI_POLARITY_MASK) == ACPI_INTI_ACTIVE_LOW) flags |= REDIR_ACTIVE_LOW;
+            if ((inti & ACPI_INTI_TRIGGER_MASK) == ACPI_INTI_LEVEL) flags |= REDIR_LEVEL;
+            route(irq, madt->isa_gsi[irq], flags);
+        }
+    }
+    printf("IOAPIC: %d controllers\n", ioapic_count);
+    return 0;
+}
+
+int ioapic_routed(int irq) { return irq >= 0 && irq < IRQ_GSI_MAX && irq_pins[irq].ioapic; }
+
+void ioapic_mask(int irq)
+{
+    if (!ioapic_routed(irq)) return;
+    struct irq_pin* p = &irq_pins[irq];
+    uint32_t low = ioapic_read(p->ioapic, IOAPIC_REDTBL(p->pin));
+    ioapic_write(p->ioapic, IOAPIC_REDTBL(p->pin), low | REDIR_MASKED);
+}
+
+void ioapic_unmask(int irq)
+{
+    if (!ioapic_routed(irq)) return;
+    struct irq_pin* p = &irq_pins[irq];
+    uint32_t low = ioapic_read(p->ioapic, IOAPIC_REDTBL(p->pin));
+    ioapic_write(p->ioapic, IOAPIC_REDTBL(p->pin), low & ~REDIR_MASKED);
+}
+
+int ioapic_set_dest(int irq, uint8_t apic_id)
+{
+    if (!ioapic_routed(irq)) return -1;
+    struct irq_pin* p = &irq_pins[irq];
+    ioapic_write(p->ioapic, IOAPIC_REDTBL(p->pin) + 1, (uint32_t)apic_id << REDIR_DEST_SHIFT);
+    return 0;
+}
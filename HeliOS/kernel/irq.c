@@ -1,5 +1,15 @@
+#include <kernel/acpi.h>
+#include <kernel/apic.h>
 #include <kernel/asm.h>
 #include <kernel/interrupts.h>
+#include <kernel/ioapic.h>
+#include <kernel/irq_stats.h>
+#include <kernel/ktime.h>
+#include <kernel/sched.h>
+#include <kernel/trace.h>
+#include <kernel/work.h>
+#include <stdbool.h>
+#include <stdio.h>
 
 /* These are own ISRs that point to our special IRQ handler
  *  instead of the regular 'fault_handler' function */
@@ -19,26 +29,78 @@ extern void irq12();
 extern void irq13();
 extern void irq14();
 extern void irq15();
+extern void irq_spurious();
+// Stubs for vectors 48 to 254 from irq.asm
+extern void (*irq_stub_table[IRQ_COUNT - 16])();
 
 /* This array is actually an array of function pointers. We use
- *  this to handle custom IRQ handlers for a given IRQ */
-void* irq_routines[16] = {
-        0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0
-};
+ *  this to handle custom IRQ handlers for a given IRQ, one per
+ *  vector from IRQ_VECTOR_BASE up */
+void* irq_routines[IRQ_COUNT] = { 0 };
+
+// Set once the IOAPIC has taken over from the 8259s
+static bool apic_mode = false;
+
+static void pic_mask(int irq, bool masked)
+{
+        uint16_t port = irq < 8 ? 0x21 : 0xA1;
+        uint8_t bit = 1 << (irq & 7);
+        uint8_t value = inb(port);
+        outb(port, masked ? value | bit : value & ~bit);
+}
+
+void irq_mask(int irq)
+{
+        if (apic_mode)
+                ioapic_mask(irq);
+        else if (irq < 16)
+                pic_mask(irq, true);
+}
+
+void irq_unmask(int irq)
+{
+        if (apic_mode)
+                ioapic_unmask(irq);
+        else if (irq < 16)
+                pic_mask(irq, false);
+}
 
 /* This installs a custom IRQ handler for the given IRQ */
 void irq_install_handler(int irq, void (*handler)(struct irq_regs* r))
 {
         irq_routines[irq] = handler;
+        // The 8259 lines are all open from irq_remap, IOAPIC pins only once someone listens
+        if (apic_mode) ioapic_unmask(irq);
 }
 
 /* This clears the handler for a given IRQ */
 void irq_uninstall_handler(int irq)
 {
+        if (apic_mode) ioapic_mask(irq);
         irq_routines[irq] = 0;
 }
 
+int irq_alloc(void (*handler)(struct irq_regs* r))
+{
+        uint32_t flags = irq_save();
+        for (int irq = IRQ_GSI_MAX; irq < IRQ_LOCAL_BASE; irq++) {
+                if (irq_routines[irq]) continue;
+                irq_routines[irq] = handler;
+                irq_restore(flags);
+                return irq;
+        }
+        irq_restore(flags);
+        return -1;
+}
+
+int irq_set_affinity(int irq, uint8_t apic_id)
+{
+        if (!apic_mode) return -1;
+        return ioapic_set_dest(irq, apic_id);
+}
+
+int irq_using_apic() { return apic_mode; }
+
 /* Normally, IRQs 0 to 7 are mapped to entries 8 to 15. This
  *  is a problem in protected mode, because IDT entry 8 is a
  *  Double Fault! Without remapping, every time IRQ0 fires,
@@ -84,10 +146,40 @@ void irq_init()
         idt_set_gate(45, (unsigned)irq13, 0x08, 0x8E);
         idt_set_gate(46, (unsigned)irq14, 0x08, 0x8E);
         idt_set_gate(47, (unsigned)irq15, 0x08, 0x8E);
+        for (int vec = 48; vec < LAPIC_SPURIOUS_VECTOR; vec++) {
+                idt_set_gate(vec, (unsigned)irq_stub_table[vec - 48], 0x08, 0x8E);
+        }
+        idt_set_gate(LAPIC_SPURIOUS_VECTOR, (unsigned)irq_spurious, 0x08, 0x8E);
 
         asm volatile("sti");
 }
 
+void irq_init_apic()
+{
+        const struct acpi_madt_info* madt = acpi_madt();
+        if (!madt || !madt->ioapic_count || lapic_init() != 0) {
+                puts("IRQ: no IOAPIC, staying on the 8259 PIC");
+                return;
+        }
+
+        uint32_t flags = irq_save();
+        if (ioapic_init(madt) != 0) {
+                irq_restore(flags);
+                puts("IRQ: IOAPIC setup failed, staying on the 8259 PIC");
+                return;
+        }
+        // Shut the 8259s up for good, anything they still raise would arrive on a vector the IOAPIC now owns
+        outb(0x21, 0xFF);
+        outb(0xA1, 0xFF);
+        apic_mode = true;
+        // Bring back the lines that already have handlers
+        for (int irq = 0; irq < IRQ_GSI_MAX; irq++) {
+                if (irq_routines[irq]) ioapic_unmask(irq);
+        }
+        irq_restore(flags);
+        puts("IRQ: routing through the IOAPIC");
+}
+
 /* Each of the IRQ ISRs point to this function, rather than
  *  the 'fault_handler' in 'isrs.c'. The IRQ Controllers need
  *  to be told when you are done servicing them, so you need
@@ -100,24 +192,44 @@ void irq_init()
  *  an EOI, you won't raise any more IRQs */
 void irq_handler(struct irq_regs* r)
 {
+        uint64_t entry = ktime_get_cycles();
+        TRACE(TRACE_IRQ_ENTRY, r->int_no, r->eip, 0);
         /* This is a blank function pointer */
         void (*handler)(struct irq_regs* r);
 
         /* Find out if we have a custom handler to run for this
          *  IRQ, and then finally, run it */
-        handler = irq_routines[r->int_no - 32];
+        handler = irq_routines[r->int_no - IRQ_VECTOR_BASE];
         if (handler) {
                 handler(r);
         }
+        uint64_t handled = ktime_get_cycles();
 
-        /* If the IDT entry that was invoked was greater than 40
-         *  (meaning IRQ8 - 15), then we need to send an EOI to
-         *  the slave controller */
-        if (r->int_no >= 40) {
-                outb(0xA0, 0x20);
+        /* The local APIC acknowledges everything once the IOAPIC is in
+         *  charge, and always its own vectors, the PICs never saw those */
+        if (apic_mode || r->int_no >= IRQ_VECTOR(16)) {
+                lapic_eoi();
+        } else {
+                /* If the IDT entry that was invoked was greater than 40
+                 *  (meaning IRQ8 - 15), then we need to send an EOI to
+                 *  the slave controller */
+                if (r->int_no >= 40) {
+                        outb(0xA0, 0x20);
+                }
+
+                /* In either case, we need to send an EOI to the master
+                 *  interrupt controller too */
+                outb(0x20, 0x20);
         }
 
-        /* In either case, we need to send an EOI to the master
-         *  interrupt controller too */
-        outb(0x20, 0x20);
+        irq_stat_record(r->int_no, handled - entry, ktime_get_cycles() - entry);
+        TRACE(TRACE_IRQ_EXIT, r->int_no, 0, 0);
+
+        /* With the controller acknowledged, whatever the handler
+         *  deferred runs with interrupts back on */
+        if (work_pending()) work_run();
+
+        /* Last, since switching threads only comes back here once
+         *  this one runs again */
+        sched_irq_exit();
 }
@@ -0,0 +1,86 @@
+#include <kernel/asm.h>
+#include <kernel/cpu.h>
+#include <kernel/irq_stats.h>
+#include <kernel/ktime.h>
+#include <stdio.h>
+#include <string.h>
+
+// Every CPU counts into its own copy, the 64-bit sums couldn't be updated from two CPUs at once otherwise
+static struct irq_stat stats[MAX_CPUS][IRQ_STAT_VECTORS];
+
+static inline uint32_t bucket(uint64_t cycles)
+{
+    if (cycles >> 32) return IRQ_STAT_BUCKETS - 1;
+    uint32_t c = cycles;
+    if (c >> IRQ_STAT_MIN_SHIFT == 0) return 0;
+    uint32_t b = 31 - __builtin_clz(c) - IRQ_STAT_MIN_SHIFT;
+    return b < IRQ_STAT_BUCKETS ? b : IRQ_STAT_BUCKETS - 1;
+}
+
+static inline uint32_t clamp32(uint64_t value) { return value >> 32 ? UINT32_MAX : value; }
+
+void irq_stat_record(uint8_t vector, uint64_t handler, uint64_t eoi)
+{
+    // Interrupts are off in the handlers, nothing else writes this CPU's copy meanwhile
+    struct irq_stat* s = &stats[cpu_id()][vector];
+    s->count++;
+    s->handler_cycles += handler;
+    s->eoi_cycles += eoi;
+    if (clamp32(handler) > s->handler_max) s->handler_max = clamp32(handler);
+    if (clamp32(eoi) > s->eoi_max) s->eoi_max = clamp32(eoi);
+    s->handler_hist[bucket(handler)]++;
+    s->eoi_hist[bucket(eoi)]++;
+}
+
+bool irq_stat_get(uint8_t vector, struct irq_stat* out)
+{
+    memset(out, 0, sizeof(struct irq_stat));
+    uint32_t flags = irq_save();
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        const struct irq_stat* s = &stats[cpu][vector];
+        out->count += s->count;
+        out->handler_cycles += s->handler_cycles;
+        out->eoi_cycles += s->eoi_cycles;
+        if (s->handler_max > out->handler_max) out->handler_max = s->handler_max;
+        if (s->eoi_max > out->eoi_max) out->eoi_max = s->eoi_max;
+        for (uint32_t b = 0; b < IRQ_STAT_BUCKETS; b++) {
+            out->handler_hist[b] += s->handler_hist[b];
+            out->eoi_hist[b] += s->eoi_hist[b];
+        }
+    }
+    irq_restore(flags);
+    return out->count != 0;
+}
+
+uint64_t irq_stat_percentile(const uint32_t* hist, uint32_t count, uint32_t pct)
+{
+    if (!count) return 0;
+    uint64_t want = ((uint64_t)count * pct + 99) / 100;
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < IRQ_STAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= want) return 1ull << (b + IRQ_STAT_MIN_SHIFT + 1);
+    }
+    return 1ull << (IRQ_STAT_BUCKETS + IRQ_STAT_MIN_SHIFT);
+}
+
+void irq_stat_reset()
+{
+    uint32_t flags = irq_save();
+    memset(stats, 0, sizeof(stats));
+    irq_restore(flags);
+}
+
+static inline uint32_t to_us(uint64_t cycles) { return ktime_cycles_to_ns(cycles) / 1000; }
+
+void irq_stat_print()
+{
+    puts("vector      count   avg us   p99 us   max us  to eoi avg/p99/max us");
+    struct irq_stat s;
+    for (int vector = 0; vector < IRQ_STAT_VECTORS; vector++) {
+        if (!irq_stat_get(vector, &s)) continue;
+        printf("%6d %10u %8u %8u %8u  %u/%u/%u\n", vector, s.count, to_us(s.handler_cycles / s.count),
+            to_us(irq_stat_percentile(s.handler_hist, s.count, 99)), to_us(s.handler_max),
+            to_us(s.eoi_cycles / s.count), to_us(irq_stat_percentile(s.eoi_hist, s.count, 99)), to_us(s.eoi_max));
+    }
+}
@@ -1,4 +1,6 @@
 #include <kernel/interrupts.h>
+#include <kernel/irq_stats.h>
+#include <kernel/ktime.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -125,9 +127,12 @@ void fault_handler(struct irq_regs* r)
         /* Display the description for the Exception that occurred.
          *  In this tutorial, we will simply halt the system using an
          *  infinite loop */
-        if (handler)
+        if (handler) {
+            uint64_t entry = ktime_get_cycles();
             handler(r);
-        else {
+            uint64_t cycles = ktime_get_cycles() - entry;
+            irq_stat_record(r->int_no, cycles, cycles);
+        } else {
             puts((char*)exception_messages[r->int_no]);
             puts(" Exception. System Halted!\n");
             for (;;)
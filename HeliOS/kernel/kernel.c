@@ -21,21 +21,38 @@
 // TODO: Pretty sure PMM will perform weird things when reaching max memory
 // TODO: Project restructuring (drivers, kernel, lib, etc.)
 #include "../arch/i386/vga.h"
+#include <kernel/acpi.h>
+#include <kernel/ata/ahci.h>
 #include <kernel/ata/controller.h>
 #include <kernel/ata/device.h>
+#include <kernel/bcache.h>
+#ifdef KERNEL_BENCH
+#include <kernel/bench.h>
+#endif
+#include <kernel/boottrace.h>
 #include <kernel/cpu.h>
+#include <kernel/fbcon.h>
+#include <kernel/fpu.h>
 #include <kernel/fs/fat.h>
 #include <kernel/fs/vfs.h>
 #include <kernel/gdt.h>
 #include <kernel/interrupts.h>
 #include <kernel/keyboard.h>
+#include <kernel/klog.h>
 #include <kernel/liballoc.h>
 #include <kernel/memory.h>
 #include <kernel/multiboot.h>
 #include <kernel/pci/pci.h>
+#include <kernel/profile.h>
+#include <kernel/sched.h>
+#include <kernel/serial.h>
+#include <kernel/smp.h>
 #include <kernel/sys.h>
 #include <kernel/timer.h>
+#include <kernel/trace.h>
 #include <kernel/tty.h>
+#include <kernel/virtio/blk.h>
+#include <kernel/vmm.h>
 #include <stdio.h>
 
 #ifdef KERNEL_DEBUG
@@ -63,10 +80,26 @@ static void test_failed_output(const char* message, uint32_t err_code)
     tty_setcolor(VGA_COLOR_LIGHT_GREY);
 }
 
+/// Prints the file from its current position on, a chunk at a time
+static void print_file(FILE* file)
+{
+    char chunk[128];
+    int n;
+    while ((n = vfs_read(file, chunk, sizeof(chunk) - 1)) > 0) {
+        chunk[n] = '\0';
+        printf("%s", chunk);
+    }
+    putchar('\n');
+}
+
 void kernel_early(multiboot_info_t* mbd, uint32_t magic)
 {
+    // Per-CPU data comes first, spinlocks reach it through %gs
+    BOOT_TRACE("gdt_init", gdt_init());
+
     /* Initialize terminal interface */
-    tty_initialize();
+    BOOT_TRACE("tty_initialize", tty_initialize());
+    BOOT_TRACE("klog_init", klog_init());
 
     /* Make sure the magic number matches for memory mapping*/
     if (magic != MULTIBOOT_BOOTLOADER_MAGIC) {
@@ -103,17 +136,22 @@ void kernel_early(multiboot_info_t* mbd, uint32_t magic)
     tty_enable_cursor(0, 0);
     // tty_disable_cursor();
 
-    puts("Initializing GDT");
-    gdt_init();
-
     puts("Initializing IDT");
-    idt_init();
+    BOOT_TRACE("idt_init", idt_init());
 
     puts("Initializing ISRs");
-    isr_init();
+    BOOT_TRACE("isr_init", isr_init());
 
     puts("Initializing IRQs");
-    irq_init();
+    BOOT_TRACE("irq_init", irq_init());
+
+    // Headless machines only have the serial line, get it logging as early as we can
+    int serial;
+    BOOT_TRACE("serial_init", serial = serial_init(COM1_PORT, SERIAL_DEFAULT_BAUD));
+    if (serial == 0) klog_add_console(serial_console);
+
+    puts("Detecting CPU features");
+    BOOT_TRACE("cpu_init_features", cpu_init_features());
 
     // Have to do some maintenance to make these sane numbers
     kernel_start = (uint32_t)(&kernel_start_raw);
@@ -125,13 +163,28 @@ void kernel_early(multiboot_info_t* mbd, uint32_t magic)
     printf("MEM LOW: 0x%X, MEM HIGH: 0x%X, PHYS START: 0x%X\n", mbd->mem_lower * 1024, mbd->mem_upper * 1024,
         phys_alloc_start);
 #endif
-    init_memory(mbd->mem_upper * 1024, phys_alloc_start);
+    // mbd is only reachable through the boot identity mapping until init_memory replaces it
+    bool have_fb;
+    BOOT_TRACE("fbcon_probe", have_fb = fbcon_probe(mbd) == 0);
+    BOOT_TRACE("init_memory", init_memory(mbd, phys_alloc_start));
+    if (have_fb) BOOT_TRACE("tty_use_framebuffer", tty_use_framebuffer());
+
+    puts("Initializing ACPI");
+    BOOT_TRACE("acpi_init", acpi_init());
+    BOOT_TRACE("irq_init_apic", irq_init_apic());
 
     puts("Initializing Timer");
-    timer_init();
+    BOOT_TRACE("timer_init", timer_init());
+
+    puts("Starting the scheduler");
+    BOOT_TRACE("sched_init", sched_init());
+    BOOT_TRACE("fpu_init", fpu_init());
+
+    puts("Starting other CPUs");
+    BOOT_TRACE("smp_init", smp_init());
 
     puts("Initializing Keyboard");
-    keyboard_init();
+    BOOT_TRACE("keyboard_init", keyboard_init());
 }
 
 void kernel_main()
@@ -146,14 +199,40 @@ void kernel_main()
     test_passed_output("Interrupts Passed");
 
     // Physical memory manager testing
-    uint8_t res = test_pmm();
+    uint8_t res;
+    BOOT_TRACE("test_pmm", res = test_pmm());
     if (!res) {
         test_passed_output("PMM passed");
+        pmm_print_zones();
     } else {
         test_failed_output("PMM FAILED WITH ERROR CODE: ", res);
         panic("\tPMM FAILURE");
     }
 
+#ifdef VMM_TESTING
+    puts("Testing demand paging:");
+    vm_area_t* area = vmm_reserve(0x40000000, 2 * PAGE_SIZE, VMA_WRITE);
+    uint32_t* page = (uint32_t*)0x40000000;
+    bool vmm_passed = area && page[1] == 0;
+    page[0] = 0xC0FFEE;
+    page[PAGE_SIZE / 4] = 0xFACE;
+    vm_area_t* clone = area ? vmm_clone_cow(area, 0x40100000) : NULL;
+    uint32_t* copy = (uint32_t*)0x40100000;
+    vmm_passed = vmm_passed && clone && copy[0] == 0xC0FFEE;
+    // Writing the clone has to leave the original alone
+    if (vmm_passed) copy[0] = 0xBEEF;
+    vmm_passed = vmm_passed && page[0] == 0xC0FFEE && copy[0] == 0xBEEF;
+    // And writing the original has to leave the clone alone, both sides share the frame until then
+    if (vmm_passed) page[PAGE_SIZE / 4] = 0xDEAD;
+    vmm_passed = vmm_passed && copy[PAGE_SIZE / 4] == 0xFACE && page[PAGE_SIZE / 4] == 0xDEAD;
+    vmm_release(clone);
+    vmm_release(area);
+    if (vmm_passed)
+        test_passed_output("Demand paging passed");
+    else
+        test_failed_output("DEMAND PAGING FAILED: ", 1);
+#endif
+
 #ifdef KMALLOC_TESTING
     puts("Testing liballoc:");
     int* test = (int*)kmalloc(sizeof(int));
@@ -168,18 +247,37 @@ void kernel_main()
     printf("\tkmalloc returned address: 0x%X, set value to: %d\n", test3, *test3);
     kfree(test2);
     kfree(test3);
+    liballoc_print_stats(4);
 #endif
 
-    list_devices();
-    ctrl_init();
+#ifdef PROFILE_BOOT
+    // Samples device bring-up and the file tests, dumped over serial once they're done
+    profile_start(1, true);
+#endif
+#ifdef TRACE_BOOT
+    // Every tracepoint from device bring-up on, what's left in the rings goes over serial after the file tests
+    trace_start(TRACE_ALL);
+#endif
+    BOOT_TRACE("pci_init", pci_init());
+    BOOT_TRACE("list_devices", list_devices());
+    BOOT_TRACE("bcache_init", bcache_init());
+    BOOT_TRACE("ctrl_init", ctrl_init());
+    BOOT_TRACE("ahci_init", ahci_init());
+    BOOT_TRACE("virtio_blk_init", virtio_blk_init());
     puts("VFS Testing");
-    vfs_init(8, 8, 16);
+    BOOT_TRACE("vfs_init", vfs_init(8, 8, 16));
 
     puts("Registering FAT16");
-    register_fs(FAT16);
+    BOOT_TRACE("register_fs", register_fs(FAT16));
     puts("Registered FAT16\nMounting drive");
-    sATADevice* fat_device = ctrl_get_device(3);
-    mount(0, fat_device, &fat_device->part_table[0], FAT16);
+    // Only the channel holding the disk has to be done probing
+    sATADevice* fat_device;
+    BOOT_TRACE("ata wait", fat_device = ctrl_wait_device(3));
+    // Machines without IDE have the disk behind AHCI
+    if (!fat_device->present && ahci_get_device(0)) fat_device = ahci_get_device(0);
+    if (!fat_device->present && virtio_blk_get_device(0)) fat_device = virtio_blk_get_device(0);
+    BOOT_TRACE("mount", mount(0, fat_device, &fat_device->part_table[0], FAT16));
+    boot_trace_print();
 
     // puts("Time to initialize FAT");
     // Device 3 is the FAT device, hardcoding for now
@@ -199,15 +297,39 @@ void kernel_main()
     puts("Opening file");
     FILE* data = vfs_open(&directory);
     if (data) {
-        puts(data->read_ptr);
+        print_file(data);
         vfs_close(data);
     }
     puts("Opening file again");
     FILE* data2 = vfs_open(&directory);
-    if (data) {
-        puts(data2->read_ptr);
+    if (data2) {
+        // Start over from the second half, to go through seeking too
+        vfs_seek(data2, data2->file_size / 2, VFS_SEEK_SET);
+        print_file(data2);
+        // The mapping shares the page cache's copy and stays valid after the file is closed
+        size_t size = data2->file_size;
+        const char* map = vfs_mmap(data2, 0, size);
         vfs_close(data2);
+        if (map) {
+            for (size_t i = 0; i < size && i < 64; i++)
+                putchar(map[i]);
+            putchar('\n');
+            vfs_munmap((void*)map);
+        }
     }
+    uint32_t inode_hits, inode_misses;
+    vfs_inode_stats(&inode_hits, &inode_misses);
+    printf("inode cache: %d hits, %d misses\n", inode_hits, inode_misses);
+#ifdef PROFILE_BOOT
+    profile_dump();
+#endif
+#ifdef TRACE_BOOT
+    trace_dump();
+#endif
+
+#ifdef KERNEL_BENCH
+    bench_run(&fat_device->bdev, 0);
+#endif
     // fat_close_file(data);
     // for (size_t i = 0; i < 4; i++) {
     //     sATADevice* dev = ctrl_get_device(i);
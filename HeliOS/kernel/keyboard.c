@@ -1,8 +1,18 @@
 #include <kernel/asm.h>
 #include <kernel/interrupts.h>
 #include <kernel/keyboard.h>
+#include <kernel/work.h>
+#include <stdint.h>
 #include <stdio.h>
 
+// Scancodes are only read in the interrupt, translating and echoing them is deferred
+#define SCANCODE_RING_SIZE 64
+
+static volatile uint8_t scancodes[SCANCODE_RING_SIZE];
+static volatile uint32_t scancode_head = 0;
+static uint32_t scancode_tail = 0;
+static struct work keyboard_work;
+
 /* KBDUS means US Keyboard Layout. This is a scancode table
  *  used to layout a standard US keyboard. I have left some
  *  comments in to give you an idea of what key is what, even
@@ -47,38 +57,57 @@ unsigned char kbdus[128] = {
         0, /* All other keys are undefined */
 };
 
+/* Turns the scancodes the interrupt collected into characters */
+static void keyboard_process(void* data)
+{
+        (void)data;
+        while (scancode_tail != scancode_head) {
+                unsigned char scancode = scancodes[scancode_tail % SCANCODE_RING_SIZE];
+                scancode_tail++;
+
+                /* If the top bit of the byte we read from the keyboard is
+                 *  set, that means that a key has just been released */
+                if (scancode & 0x80) {
+                        /* You can use this one to see if the user released the
+                         *  shift, alt, or control keys... */
+                } else {
+                        /* Here, a key was just pressed. Please note that if you
+                         *  hold a key down, you will get repeated key press
+                         *  interrupts. */
+
+                        /* Just to show you how this works, we simply translate
+                         *  the keyboard scancode into an ASCII value, and then
+                         *  display it to the screen. You can get creative and
+                         *  use some flags to see if a shift is pressed and use a
+                         *  different layout, or you can add another 128 entries
+                         *  to the above layout to correspond to 'shift' being
+                         *  held. If shift is held using the larger lookup table,
+                         *  you would add 128 to the scancode when you look for it */
+                        putchar(kbdus[scancode]);
+                }
+        }
+}
+
 /* Handles the keyboard interrupt */
 void keyboard_handler(struct irq_regs* r)
 {
         (void)r;
-        unsigned char scancode;
-
-        /* Read from the keyboard's data buffer */
-        scancode = inb(0x60);
 
-        /* If the top bit of the byte we read from the keyboard is
-         *  set, that means that a key has just been released */
-        if (scancode & 0x80) {
-                /* You can use this one to see if the user released the
-                 *  shift, alt, or control keys... */
-        } else {
-                /* Here, a key was just pressed. Please note that if you
-                 *  hold a key down, you will get repeated key press
-                 *  interrupts. */
+        /* Read from the keyboard's data buffer, that's all the
+         *  controller needs to raise the next one */
+        unsigned char scancode = inb(0x60);
 
-                /* Just to show you how this works, we simply translate
-                 *  the keyboard scancode into an ASCII value, and then
-                 *  display it to the screen. You can get creative and
-                 *  use some flags to see if a shift is pressed and use a
-                 *  different layout, or you can add another 128 entries
-                 *  to the above layout to correspond to 'shift' being
-                 *  held. If shift is held using the larger lookup table,
-                 *  you would add 128 to the scancode when you look for it */
-                putchar(kbdus[scancode]);
+        /* Drop keys nobody got around to rather than overwrite
+         *  ones still waiting */
+        if (scancode_head - scancode_tail < SCANCODE_RING_SIZE) {
+                scancodes[scancode_head % SCANCODE_RING_SIZE] = scancode;
+                scancode_head++;
         }
+        work_queue(&keyboard_work);
 }
 
 void keyboard_init()
 {
+        work_setup(&keyboard_work, keyboard_process, NULL);
         irq_install_handler(1, keyboard_handler);
 }
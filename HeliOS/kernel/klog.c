@@ -0,0 +1,111 @@
+#include <kernel/klog.h>
+#include <kernel/timer.h>
+#include <kernel/tty.h>
+#include <stdio.h>
+#include <string.h>
+
+int klog_level = KLOG_INFO;
+
+static struct klog_record ring[KLOG_RECORDS];
+// Next sequence number to hand out, producers claim a record with a single atomic add
+static volatile uint32_t head = 0;
+// Next sequence number to flush, only touched by whoever holds flushing
+static uint32_t tail = 0;
+static volatile uint32_t flushing = 0;
+static uint32_t dropped = 0;
+
+static klog_console_t consoles[KLOG_MAX_CONSOLES];
+static int num_consoles = 0;
+
+static const char* level_tags[] = { "ERR", "WARN", "INFO", "DEBUG" };
+
+static void tty_console(const char* data, size_t len) { tty_write(data, len); }
+
+/// kprintf output becomes info records, split up if a chunk doesn't fit in one
+static void klog_sink(void* ctx, const char* data, size_t len)
+{
+    (void)ctx;
+    while (len) {
+        size_t n = len < KLOG_TEXT_SIZE - 1 ? len : KLOG_TEXT_SIZE - 1;
+        klog_write(KLOG_INFO, "%.*s", (int)n, data);
+        data += n;
+        len -= n;
+    }
+}
+
+void klog_init()
+{
+    klog_add_console(tty_console);
+    kprintf_set_sink(klog_sink, NULL);
+}
+
+int klog_add_console(klog_console_t console)
+{
+    if (num_consoles >= KLOG_MAX_CONSOLES) return -1;
+    consoles[num_consoles++] = console;
+    return 0;
+}
+
+void klog_vwrite(int level, const char* format, va_list args)
+{
+    uint32_t seq = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+    struct klog_record* rec = &ring[seq & (KLOG_RECORDS - 1)];
+    // Mark it in progress so the flusher doesn't print a half written record
+    __atomic_store_n(&rec->seq, seq - 1, __ATOMIC_RELAXED);
+    rec->ticks = timer_get_ticks();
+    rec->level = level;
+    int len = vsnprintf(rec->text, KLOG_TEXT_SIZE, format, args);
+    rec->len = len < KLOG_TEXT_SIZE ? len : KLOG_TEXT_SIZE - 1;
+    __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+}
+
+void klog_write(int level, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    klog_vwrite(level, format, args);
+    va_end(args);
+}
+
+static void emit(const char* data, size_t len)
+{
+    for (int i = 0; i < num_consoles; i++)
+        consoles[i](data, len);
+}
+
+void klog_flush()
+{
+    if (__atomic_exchange_n(&flushing, 1, __ATOMIC_ACQUIRE)) return;
+
+    uint32_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    // Producers lapped us, skip what was overwritten
+    if (end - tail > KLOG_RECORDS) {
+        dropped += end - tail - KLOG_RECORDS;
+        tail = end - KLOG_RECORDS;
+    }
+    while (tail != end) {
+        struct klog_record* rec = &ring[tail & (KLOG_RECORDS - 1)];
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != tail) {
+            // Still being written, pick it up next time
+            if ((int32_t)(rec->seq - tail) < 0) break;
+            dropped++;
+            tail++;
+            continue;
+        }
+        // Copy it out first, a producer that wraps around could overwrite it while the console is slow
+        struct klog_record copy = *rec;
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != tail) continue;
+        tail++;
+
+        char prefix[32];
+        int n = snprintf(prefix, sizeof(prefix), "[%5u.%03u] ", copy.ticks / 1000, copy.ticks % 1000);
+        if (copy.level < KLOG_INFO) n += snprintf(prefix + n, sizeof(prefix) - n, "%s: ", level_tags[copy.level]);
+        emit(prefix, n);
+        emit(copy.text, copy.len);
+        if (!copy.len || copy.text[copy.len - 1] != '\n') emit("\n", 1);
+    }
+
+    __atomic_store_n(&flushing, 0, __ATOMIC_RELEASE);
+}
+
+uint32_t klog_dropped() { return dropped; }
@@ -0,0 +1,60 @@
+#include <kernel/asm.h>
+#include <kernel/cpu.h>
+#include <kernel/ktime.h>
+#include <kernel/timer.h>
+#include <stdio.h>
+
+// Longest PIT channel 2 wait that fits its 16 bit counter
+#define CALIBRATE_MS 50
+// Fixed point fraction bits for cycles to ns, leaves room for TSCs from 10 MHz to well past 10 GHz
+#define NS_SHIFT 22
+
+static uint32_t tsc_khz = 0;
+static bool tsc_stable = false;
+static uint64_t tsc_base; // TSC at calibration, ktime starts from the timer clock at that point
+static uint64_t ns_base;
+static uint32_t ns_mult; // ns per cycle << NS_SHIFT
+
+/// (a * mul) >> shift without needing a 96 bit intermediate
+static inline uint64_t mul_u64_u32_shr(uint64_t a, uint32_t mul, unsigned int shift)
+{
+    uint32_t lo = a;
+    uint32_t hi = a >> 32;
+    uint64_t result = ((uint64_t)lo * mul) >> shift;
+    if (hi) result += ((uint64_t)hi * mul) << (32 - shift);
+    return result;
+}
+
+void ktime_init()
+{
+    if (!cpu_check_tsc()) return;
+
+    uint32_t flags = irq_save();
+    uint64_t start = rdtsc();
+    pit_wait(CALIBRATE_MS);
+    uint64_t end = rdtsc();
+    irq_restore(flags);
+
+    tsc_khz = (end - start) / CALIBRATE_MS;
+    if (!tsc_khz) return;
+    ns_mult = (1000000ull << NS_SHIFT) / tsc_khz;
+    ns_base = timer_now_ns();
+    tsc_base = rdtsc();
+    // Without the invariant bit the rate follows P-states, fine for cycle counts but not for telling time
+    tsc_stable = cpu_check_invariant_tsc();
+    printf("TSC: %d kHz%s\n", tsc_khz, tsc_stable ? ", invariant" : "");
+}
+
+uint64_t ktime_cycles_to_ns(uint64_t cycles) { return tsc_khz ? mul_u64_u32_shr(cycles, ns_mult, NS_SHIFT) : cycles; }
+
+uint64_t ktime_get_ns()
+{
+    if (!tsc_stable) return timer_now_ns();
+    return ns_base + mul_u64_u32_shr(rdtsc() - tsc_base, ns_mult, NS_SHIFT);
+}
+
+uint64_t ktime_get_cycles() { return tsc_khz ? rdtsc() : ktime_get_ns(); }
+
+uint32_t ktime_tsc_khz() { return tsc_khz; }
+
+bool ktime_tsc_stable() { return tsc_stable; }
@@ -1,6 +1,11 @@
 
+#include <kernel/asm.h>
+#include <kernel/cpu.h>
 #include <kernel/liballoc.h>
+#include <kernel/trace.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
 /**  Durand's Amazing Super Duper Memory functions.  */
 
@@ -41,8 +46,19 @@
         }                                                                                          \
     }
 
+// Bytes malloc adds to every request to make room for the alignment information
+#define SIZE_OVERHEAD (ALIGNMENT > 1 ? ALIGNMENT + ALIGN_INFO : 0)
+
+// Per-CPU magazines sit in front of malloc and free for small sizes. Freed objects are parked there and
+// handed straight back to the next malloc of the same class, without the heap lock.
+#define MAG_MIN_SHIFT 4 ///< Smallest class is 16 bytes
+#define MAG_CLASSES 6 ///< Classes are powers of two from 16 to 512 bytes
+#define MAG_MAX_SIZE (1ul << (MAG_MIN_SHIFT + MAG_CLASSES - 1))
+#define MAG_ROUNDS 32 ///< Objects a magazine holds, half of them go back to the heap when it overflows
+
 #define LIBALLOC_MAGIC 0xc001c0de
 #define LIBALLOC_DEAD 0xdeaddead
+#define LIBALLOC_CACHED 0xcafebabe ///< Freed, but kept in its major on a size class list
 
 #if defined DEBUG || defined INFO
 #include <stdio.h>
@@ -61,6 +77,7 @@ struct liballoc_major {
     unsigned int pages; ///< The number of pages in the block.
     unsigned int size; ///< The number of pages in the block.
     unsigned int usage; ///< The number of bytes used in the block.
+    unsigned int live; ///< Minors handed out and not freed, cached ones don't count.
     struct liballoc_minor* first; ///< A pointer to the first allocated memory in the block.
 };
 
@@ -75,10 +92,14 @@ struct liballoc_minor {
     unsigned int magic; ///< A magic number to idenfity correctness.
     unsigned int size; ///< The size of the memory allocated. Could be 1 byte or more.
     unsigned int req_size; ///< The size of memory requested.
+    void* site; ///< Return address of the malloc call, for the allocation site table.
 };
 
 static struct liballoc_major* l_memRoot = NULL; ///< The root memory block acquired from the system.
 static struct liballoc_major* l_bestBet = NULL; ///< The major with the most free memory.
+/// Freed minors of each size class, still linked into their majors. Small allocations pop these in O(1)
+/// instead of searching the majors for space.
+static struct liballoc_minor* l_classFree[MAG_CLASSES] = { NULL };
 
 static unsigned int l_pageSize = 4096; ///< The size of an individual page. Set up in liballoc_init.
 static unsigned int l_pageCount
@@ -90,38 +111,31 @@ static long long l_warningCount = 0; ///< Number of warnings encountered
 static long long l_errorCount = 0; ///< Number of actual errors
 static long long l_possibleOverruns = 0; ///< Number of possible overruns
 
-// ***********   HELPER FUNCTIONS  *******************************
+/// Size class list links, stored in the payload of a cached minor
+struct liballoc_cached {
+    struct liballoc_minor* next;
+    struct liballoc_minor* prev;
+};
 
-static void* liballoc_memset(void* s, int c, size_t n)
-{
-    unsigned int i;
-    for (i = 0; i < n; i++)
-        ((char*)s)[i] = c;
+#define CACHED_LINKS(min) ((struct liballoc_cached*)((uintptr_t)(min) + sizeof(struct liballoc_minor)))
 
-    return s;
-}
-static void* liballoc_memcpy(void* s1, const void* s2, size_t n)
-{
-    char* cdest;
-    char* csrc;
-    unsigned int* ldest = (unsigned int*)s1;
-    unsigned int* lsrc = (unsigned int*)s2;
-
-    while (n >= sizeof(unsigned int)) {
-        *ldest++ = *lsrc++;
-        n -= sizeof(unsigned int);
-    }
+struct liballoc_magazine {
+    unsigned int count;
+    void* rounds[MAG_ROUNDS];
+};
 
-    cdest = (char*)ldest;
-    csrc = (char*)lsrc;
+static struct liballoc_magazine l_magazines[MAX_CPUS][MAG_CLASSES];
 
-    while (n > 0) {
-        *cdest++ = *csrc++;
-        n -= 1;
-    }
+// Statistics are updated with plain atomics outside the heap lock, cheap enough to leave on all the time.
+static unsigned int l_histogram[LIBALLOC_HIST_BUCKETS] = { 0 }; ///< Requests by power of two size.
+static struct liballoc_site l_sites[LIBALLOC_SITES]; ///< Open addressed on the return address.
+#define SITE_PROBES 8 ///< Slots tried before a site is left uncounted
 
-    return s1;
-}
+// ***********   HELPER FUNCTIONS  *******************************
+
+// The libc versions are picked for this CPU at boot
+static inline void* liballoc_memset(void* s, int c, size_t n) { return memset(s, c, n); }
+static inline void* liballoc_memcpy(void* s1, const void* s2, size_t n) { return memcpy(s1, s2, n); }
 
 #if defined DEBUG || defined INFO
 static void liballoc_dump()
@@ -158,6 +172,140 @@ static void liballoc_dump()
 
 // ***************************************************************
 
+static void free_locked(void* ptr);
+
+static inline struct liballoc_minor* minor_of(void* ptr)
+{
+    UNALIGN(ptr);
+    return (struct liballoc_minor*)((uintptr_t)ptr - sizeof(struct liballoc_minor));
+}
+
+/// Finds or claims the table slot for an allocation site, NULL if its probe sequence is full
+static struct liballoc_site* site_lookup(void* site)
+{
+    unsigned int idx = ((uintptr_t)site >> 2) * 2654435761u;
+    for (unsigned int i = 0; i < SITE_PROBES; i++) {
+        struct liballoc_site* slot = &l_sites[(idx + i) % LIBALLOC_SITES];
+        void* curr = __atomic_load_n(&slot->site, __ATOMIC_RELAXED);
+        if (curr == site) return slot;
+        if (curr == NULL) {
+            if (__atomic_compare_exchange_n(&slot->site, &curr, site, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+                || curr == site)
+                return slot;
+        }
+    }
+    return NULL;
+}
+
+static void account_alloc(void* p, size_t req_size, void* site)
+{
+    unsigned int bucket = req_size <= 1 ? 0 : 32 - __builtin_clz(req_size - 1);
+    if (bucket >= LIBALLOC_HIST_BUCKETS) bucket = LIBALLOC_HIST_BUCKETS - 1;
+    __atomic_fetch_add(&l_histogram[bucket], 1, __ATOMIC_RELAXED);
+    if (p == NULL) return;
+
+    struct liballoc_minor* min = minor_of(p);
+    min->site = site;
+    struct liballoc_site* slot = site_lookup(site);
+    if (slot) {
+        __atomic_fetch_add(&slot->allocs, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&slot->live_bytes, min->size, __ATOMIC_RELAXED);
+    }
+}
+
+static void account_free(struct liballoc_minor* min)
+{
+    struct liballoc_site* slot = site_lookup(min->site);
+    if (slot) __atomic_fetch_sub(&slot->live_bytes, min->size, __ATOMIC_RELAXED);
+}
+
+/// Size class for a small request, MAG_MAX_SIZE at most
+static inline int mag_class(size_t size)
+{
+    if (size <= (1ul << MAG_MIN_SHIFT)) return 0;
+    return 32 - __builtin_clz(size - 1) - MAG_MIN_SHIFT;
+}
+
+static inline size_t mag_class_size(int cls) { return 1ul << (cls + MAG_MIN_SHIFT); }
+
+// Magazines are per-CPU, so only our own interrupt handlers can race with us. Masking them is enough.
+static void* mag_pop(int cls)
+{
+    uint32_t flags = irq_save();
+    struct liballoc_magazine* mag = &l_magazines[cpu_id()][cls];
+    void* p = mag->count ? mag->rounds[--mag->count] : NULL;
+    irq_restore(flags);
+    return p;
+}
+
+static void mag_push(int cls, void* p)
+{
+    void* spill[MAG_ROUNDS / 2];
+    unsigned int nspill = 0;
+
+    uint32_t flags = irq_save();
+    struct liballoc_magazine* mag = &l_magazines[cpu_id()][cls];
+    if (mag->count == MAG_ROUNDS) {
+        // Full, send the older half back to the heap in one go
+        for (; nspill < MAG_ROUNDS / 2; nspill++)
+            spill[nspill] = mag->rounds[nspill];
+        for (unsigned int i = nspill; i < MAG_ROUNDS; i++)
+            mag->rounds[i - nspill] = mag->rounds[i];
+        mag->count -= nspill;
+    }
+    mag->rounds[mag->count++] = p;
+    irq_restore(flags);
+
+    if (!nspill) return;
+    liballoc_lock();
+    for (unsigned int i = 0; i < nspill; i++)
+        free_locked(spill[i]);
+    liballoc_unlock();
+}
+
+/// Size class of a minor, or -1 if it wasn't rounded to one
+static int minor_class(struct liballoc_minor* min)
+{
+    if (min->size < SIZE_OVERHEAD) return -1;
+    size_t size = min->size - SIZE_OVERHEAD;
+    if (!size || size > MAG_MAX_SIZE || mag_class_size(mag_class(size)) != size) return -1;
+    return mag_class(size);
+}
+
+static void class_push(int cls, struct liballoc_minor* min)
+{
+    CACHED_LINKS(min)->prev = NULL;
+    CACHED_LINKS(min)->next = l_classFree[cls];
+    if (l_classFree[cls]) CACHED_LINKS(l_classFree[cls])->prev = min;
+    l_classFree[cls] = min;
+}
+
+static void class_remove(int cls, struct liballoc_minor* min)
+{
+    struct liballoc_cached* links = CACHED_LINKS(min);
+    if (links->prev)
+        CACHED_LINKS(links->prev)->next = links->next;
+    else
+        l_classFree[cls] = links->next;
+    if (links->next) CACHED_LINKS(links->next)->prev = links->prev;
+}
+
+/// Reuses a cached minor of the class, the heap lock has to be held
+static void* class_pop(int cls, unsigned int req_size)
+{
+    struct liballoc_minor* min = l_classFree[cls];
+    void* p;
+    if (min == NULL) return NULL;
+    class_remove(cls, min);
+    min->magic = LIBALLOC_MAGIC;
+    min->req_size = req_size;
+    min->block->live++;
+    l_inuse += min->size;
+    p = (void*)((uintptr_t)min + sizeof(struct liballoc_minor));
+    ALIGN(p);
+    return p;
+}
+
 static struct liballoc_major* allocate_new_page(unsigned int size)
 {
     unsigned int st;
@@ -194,6 +342,7 @@ static struct liballoc_major* allocate_new_page(unsigned int size)
     maj->size = st * l_pageSize;
     maj->usage = sizeof(struct liballoc_major);
     maj->first = NULL;
+    maj->live = 0;
 
     l_allocated += maj->size;
 
@@ -208,7 +357,30 @@ static struct liballoc_major* allocate_new_page(unsigned int size)
     return maj;
 }
 
-void* PREFIX(malloc)(size_t req_size)
+static void* malloc_slow(size_t req_size);
+
+/// malloc with the allocation charged to site
+static void* malloc_from(size_t req_size, void* site)
+{
+    size_t orig_size = req_size;
+    void* p = NULL;
+    // Small sizes are rounded up to their class, so anything parked in the class's magazine fits
+    if (req_size && req_size <= MAG_MAX_SIZE) {
+        int cls = mag_class(req_size);
+        req_size = mag_class_size(cls);
+        p = mag_pop(cls);
+        // realloc may have shrunk it while it belonged to someone else
+        if (p) minor_of(p)->req_size = req_size;
+    }
+    if (!p) p = malloc_slow(req_size);
+    account_alloc(p, orig_size, site);
+    TRACE(TRACE_HEAP_ALLOC, p, orig_size, site);
+    return p;
+}
+
+void* PREFIX(malloc)(size_t req_size) { return malloc_from(req_size, __builtin_return_address(0)); }
+
+static void* malloc_slow(size_t req_size)
 {
     int startedBet = 0;
     unsigned long long bestSize = 0;
@@ -228,6 +400,15 @@ void* PREFIX(malloc)(size_t req_size)
 
     liballoc_lock();
 
+    // A freed block of this class is sitting in some major, no need to go looking for space
+    if (req_size && req_size <= MAG_MAX_SIZE) {
+        p = class_pop(mag_class(req_size), req_size);
+        if (p != NULL) {
+            liballoc_unlock();
+            return p;
+        }
+    }
+
     if (size == 0) {
         l_warningCount += 1;
 #if defined DEBUG || defined INFO
@@ -235,7 +416,7 @@ void* PREFIX(malloc)(size_t req_size)
         FLUSH();
 #endif
         liballoc_unlock();
-        return PREFIX(malloc)(1);
+        return malloc_slow(1);
     }
 
     if (l_memRoot == NULL) {
@@ -340,6 +521,7 @@ void* PREFIX(malloc)(size_t req_size)
             maj->first->size = size;
             maj->first->req_size = req_size;
             maj->usage += size + sizeof(struct liballoc_minor);
+            maj->live++;
 
             l_inuse += size;
 
@@ -377,6 +559,7 @@ void* PREFIX(malloc)(size_t req_size)
             maj->first->size = size;
             maj->first->req_size = req_size;
             maj->usage += size + sizeof(struct liballoc_minor);
+            maj->live++;
 
             l_inuse += size;
 
@@ -421,6 +604,7 @@ void* PREFIX(malloc)(size_t req_size)
                     min->size = size;
                     min->req_size = req_size;
                     maj->usage += size + sizeof(struct liballoc_minor);
+                    maj->live++;
 
                     l_inuse += size;
 
@@ -459,6 +643,7 @@ void* PREFIX(malloc)(size_t req_size)
                     min->next->prev = new_min;
                     min->next = new_min;
                     maj->usage += size + sizeof(struct liballoc_minor);
+                    maj->live++;
 
                     l_inuse += size;
 
@@ -523,7 +708,6 @@ void* PREFIX(malloc)(size_t req_size)
 void PREFIX(free)(void* ptr)
 {
     struct liballoc_minor* min;
-    struct liballoc_major* maj;
 
     if (ptr == NULL) {
         l_warningCount += 1;
@@ -534,10 +718,31 @@ void PREFIX(free)(void* ptr)
 #endif
         return;
     }
-
-    UNALIGN(ptr);
+    TRACE(TRACE_HEAP_FREE, ptr, 0, __builtin_return_address(0));
+
+    // Class sized blocks can only have come from the rounding in malloc, park them in a magazine
+    min = minor_of(ptr);
+    if (min->magic == LIBALLOC_MAGIC) {
+        account_free(min);
+        if (minor_class(min) >= 0) {
+            mag_push(minor_class(min), ptr);
+            return;
+        }
+    }
 
     liballoc_lock(); // lockit
+    free_locked(ptr);
+    liballoc_unlock(); // release the lock
+}
+
+/// Returns ptr to its major block, the heap lock has to be held
+static void free_locked(void* ptr)
+{
+    struct liballoc_minor* min;
+    struct liballoc_major* maj;
+    int cls;
+
+    UNALIGN(ptr);
 
     min = (struct liballoc_minor*)((uintptr_t)ptr - sizeof(struct liballoc_minor));
 
@@ -556,7 +761,7 @@ void PREFIX(free)(void* ptr)
 #endif
         }
 
-        if (min->magic == LIBALLOC_DEAD) {
+        if (min->magic == LIBALLOC_DEAD || min->magic == LIBALLOC_CACHED) {
 #if defined DEBUG || defined INFO
             printf("liballoc: ERROR: multiple PREFIX(free)() attempt on %x from %x.\n", ptr,
                 __builtin_return_address(0));
@@ -571,7 +776,6 @@ void PREFIX(free)(void* ptr)
         }
 
         // being lied to...
-        liballoc_unlock(); // release the lock
         return;
     }
 
@@ -584,6 +788,16 @@ void PREFIX(free)(void* ptr)
 
     l_inuse -= min->size;
 
+    // Class sized blocks stay where they are for the next malloc of the class, unless they are the last
+    // thing keeping the major alive
+    cls = minor_class(min);
+    if (cls >= 0 && maj->live > 1) {
+        min->magic = LIBALLOC_CACHED;
+        class_push(cls, min);
+        maj->live--;
+        return;
+    }
+
     maj->usage -= (min->size + sizeof(struct liballoc_minor));
     min->magic = LIBALLOC_DEAD; // No mojo.
 
@@ -594,6 +808,14 @@ void PREFIX(free)(void* ptr)
     // Might empty the block. This was the first
     // minor.
 
+    // Only cached minors left, take them off their class lists so the whole major goes back
+    maj->live--;
+    if (maj->live == 0) {
+        for (min = maj->first; min != NULL; min = min->next)
+            class_remove(minor_class(min), min);
+        maj->first = NULL;
+    }
+
     // We need to clean up after the majors now....
 
     if (maj->first == NULL) // Block completely unused.
@@ -618,8 +840,6 @@ void PREFIX(free)(void* ptr)
     printf("OK\n");
     FLUSH();
 #endif
-
-    liballoc_unlock(); // release the lock
 }
 
 void* PREFIX(calloc)(size_t nobj, size_t size)
@@ -629,7 +849,7 @@ void* PREFIX(calloc)(size_t nobj, size_t size)
 
     real_size = nobj * size;
 
-    p = PREFIX(malloc)(real_size);
+    p = malloc_from(real_size, __builtin_return_address(0));
 
     liballoc_memset(p, 0, real_size);
 
@@ -649,7 +869,7 @@ void* PREFIX(realloc)(void* p, size_t size)
     }
 
     // In the case of a NULL pointer, return a simple malloc.
-    if (p == NULL) return PREFIX(malloc)(size);
+    if (p == NULL) return malloc_from(size, __builtin_return_address(0));
 
     // Unalign the pointer if required.
     ptr = p;
@@ -675,7 +895,7 @@ void* PREFIX(realloc)(void* p, size_t size)
 #endif
         }
 
-        if (min->magic == LIBALLOC_DEAD) {
+        if (min->magic == LIBALLOC_DEAD || min->magic == LIBALLOC_CACHED) {
 #if defined DEBUG || defined INFO
             printf("liballoc: ERROR: multiple PREFIX(free)() attempt on %x from %x.\n", ptr,
                 __builtin_return_address(0));
@@ -707,9 +927,57 @@ void* PREFIX(realloc)(void* p, size_t size)
     liballoc_unlock();
 
     // If we got here then we're reallocating to a block bigger than us.
-    ptr = PREFIX(malloc)(size); // We need to allocate new memory
+    ptr = malloc_from(size, __builtin_return_address(0)); // We need to allocate new memory
     liballoc_memcpy(ptr, p, real_size);
     PREFIX(free)(p);
 
     return ptr;
 }
+
+void liballoc_get_stats(struct liballoc_stats* stats)
+{
+    liballoc_lock();
+    stats->allocated = l_allocated;
+    stats->inuse = l_inuse;
+    stats->warnings = l_warningCount;
+    stats->errors = l_errorCount;
+    stats->possible_overruns = l_possibleOverruns;
+    liballoc_unlock();
+    for (unsigned int i = 0; i < LIBALLOC_HIST_BUCKETS; i++)
+        stats->histogram[i] = __atomic_load_n(&l_histogram[i], __ATOMIC_RELAXED);
+}
+
+size_t liballoc_top_sites(struct liballoc_site* out, size_t n)
+{
+    size_t found = 0;
+    for (unsigned int i = 0; i < LIBALLOC_SITES; i++) {
+        struct liballoc_site site = l_sites[i];
+        if (site.site == NULL) continue;
+        // Insertion into the sorted output, n is small
+        size_t pos = found < n ? found : n;
+        while (pos > 0 && out[pos - 1].live_bytes < site.live_bytes) {
+            if (pos < n) out[pos] = out[pos - 1];
+            pos--;
+        }
+        if (pos < n) out[pos] = site;
+        if (found < n) found++;
+    }
+    return found;
+}
+
+void liballoc_print_stats(size_t top_n)
+{
+    struct liballoc_stats stats;
+    struct liballoc_site sites[LIBALLOC_SITES];
+    liballoc_get_stats(&stats);
+    printf("Heap: %u KiB from the PMM, %u KiB in use, %u errors, %u possible overruns\n",
+        (unsigned int)(stats.allocated / 1024), (unsigned int)(stats.inuse / 1024), (unsigned int)stats.errors,
+        (unsigned int)stats.possible_overruns);
+    for (unsigned int i = 0; i < LIBALLOC_HIST_BUCKETS; i++) {
+        if (stats.histogram[i]) printf("\t<= %u bytes: %u\n", 1u << i, stats.histogram[i]);
+    }
+    if (top_n > LIBALLOC_SITES) top_n = LIBALLOC_SITES;
+    size_t found = liballoc_top_sites(sites, top_n);
+    for (size_t i = 0; i < found; i++)
+        printf("\t0x%X: %u bytes live, %u allocations\n", sites[i].site, sites[i].live_bytes, sites[i].allocs);
+}
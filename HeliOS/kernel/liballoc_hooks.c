@@ -1,26 +1,46 @@
 #include <kernel/memory.h>
+#include <kernel/spinlock.h>
+#include <kernel/vmalloc.h>
 #include <stddef.h>
 
-// Locks memory structures by disabling interrupts (really basic way)
+static spinlock_t heap_lock = SPINLOCK_INIT;
+// Interrupt state from before the lock was taken, only touched while holding it
+static uint32_t heap_irq_flags;
+
+// Locks memory structures, interrupts stay off while held so IRQ handlers can't deadlock on it
 int liballoc_lock()
 {
-    asm volatile("cli");
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    heap_irq_flags = flags;
     return 0;
 }
 
-// Unlocks memory structures by enabling interrupts again (really basic way)
+// Unlocks memory structures, interrupts go back to what they were before liballoc_lock
 int liballoc_unlock()
 {
-    asm volatile("sti");
+    spin_unlock_irqrestore(&heap_lock, heap_irq_flags);
     return 0;
 }
 
+// Anything bigger than liballoc's default chunk is a single large allocation, those only need to be
+// virtually contiguous
+#define LIBALLOC_CHUNK_PAGES 16
+
 // Returns and allocs [pages] number of contiguous pages
-void* liballoc_alloc(size_t pages) { return (void*)kalloc_frames(pages); }
+void* liballoc_alloc(size_t pages)
+{
+    if (pages > LIBALLOC_CHUNK_PAGES) return vmalloc(pages * PAGE_SIZE);
+    void* chunk = (void*)kalloc_frames(pages);
+    // Physical memory may just be too fragmented for a contiguous run
+    return chunk ? chunk : vmalloc(pages * PAGE_SIZE);
+}
 
 // Frees [pages] number of contiguous pages, starting at first_page
 int liballoc_free(void* first_page, size_t pages)
 {
-    kfree_frames((uintptr_t)first_page, pages);
+    if (is_vmalloc_addr(first_page))
+        vfree(first_page);
+    else
+        kfree_frames((uintptr_t)first_page, pages);
     return 0;
 }
@@ -1,22 +1,36 @@
+#include <kernel/asm.h>
+#include <kernel/cpu.h>
+#include <kernel/dma.h>
 #include <kernel/interrupts.h>
 #include <kernel/memory.h>
 #include <kernel/multiboot.h>
+#include <kernel/spinlock.h>
 #include <kernel/sys.h>
+#include <kernel/trace.h>
 #include <kernel/tty.h>
+#include <kernel/vmm.h>
 #include <stdio.h>
 #include <string.h>
 
 static uint32_t page_frame_min;
-static uint32_t page_frame_max;
+// Frames currently handed out
 static uint32_t total_alloc;
+// Allocation requests that couldn't be satisfied
+static uint32_t failed_allocs;
+// Next-fit cursor for single frame allocations
 static uint32_t last_frame;
+// Guards the zones, the frame pool, frame descriptors and the zero pool. IRQ handlers allocate too, so it
+// is always taken with interrupts off.
+static spinlock_t pmm_lock = SPINLOCK_INIT;
 
 extern uint32_t kernel_end;
 
 extern void write_cr3(uint32_t pointer);
 
-#define PAGE_FLAG_PRESENT (1 << 0)
-#define PAGE_FLAG_WRITE   (1 << 1)
+#define CR4_PSE (1 << 4)
+#define CR4_PGE (1 << 7)
+#define CR0_WP (1 << 16)
+
 // How many entries wide the frame bitset is
 #define BITSET_WIDTH 32
 
@@ -24,9 +38,74 @@ extern void write_cr3(uint32_t pointer);
 #define OFFSET_FROM_BIT(a)                (a % BITSET_WIDTH)
 #define GET_VIRT_ADDR(pd_index, tb_index) (((tb_index * 1024) + pd_index) * 4)
 
+// ISA DMA can only reach the first 16 MiB
+#define DMA_ZONE_SIZE (16 * 1024 * 1024)
+
+// Largest block the buddy allocator tracks, 2^20 frames covers the whole 4 GiB address space
+#define BUDDY_MAX_ORDER PMM_MAX_ORDER
+// Marks the end of a free list
+#define FRAME_NONE 0xFFFFFFFF
+
+// Frames kept cleared ahead of time for kalloc_zeroed_frames
+#define ZERO_POOL_SIZE 64
+// Frames cleared per idle call, small enough that a pending interrupt never waits long
+#define ZERO_POOL_BATCH 4
+
+// Single frames come out of whole bitmap words borrowed from the buddy allocator as order 5 blocks
+#define POOL_ORDER 5
+// How many completely free words the pool holds on to before giving them back to the buddy allocator
+#define POOL_SPARE_WORDS 4
+
+enum FRAME_FLAGS {
+    FRAME_FREE = (1 << 0), // Frame is the first frame of a block sitting in a buddy free list
+    FRAME_POOL = (1 << 1), // Set on the first frame of a bitmap word owned by the single frame pool
+    FRAME_RESERVED = (1 << 2), // Not usable RAM according to the memory map, or taken by the kernel image
+};
+
+/// Per frame bookkeeping for the buddy allocator. Free list links live here instead of inside the
+/// frames so the allocator never has to touch the memory it hands out.
+typedef struct frame {
+    uint32_t next;  // Next block in the free list
+    uint32_t prev;  // Previous block in the free list
+    uint8_t order;  // Order of the block this frame heads, only valid with FRAME_FREE
+    uint8_t flags;
+    uint16_t refcount; // Mappings sharing the frame, 1 from allocation until freed
+} frame_t;
+
+/// A physically contiguous range of frames with its own buddy free lists. Blocks are never merged
+/// across zones, so DMA frames stay available until ordinary allocations have used up normal memory.
+typedef struct zone {
+    const char* name;
+    uint32_t start; // First frame of the zone
+    uint32_t end;   // One past the last frame of the zone
+    // Heads of the free lists, one per order
+    uint32_t free_lists[BUDDY_MAX_ORDER + 1];
+    // Number of frames currently sitting in the free lists
+    uint32_t free_frames;
+    // Blocks in each free list
+    uint32_t nr_blocks[BUDDY_MAX_ORDER + 1];
+    // Usable frames the memory map reported in this zone
+    uint32_t present_frames;
+} zone_t;
+
 uint32_t* frame_bitset;
 uint32_t nframes;
 
+static frame_t* frames;
+static zone_t zones[PMM_NUM_ZONES];
+
+// One bit per bitmap word, clear when the word belongs to the single frame pool and still has a free
+// frame. Finding a free single frame is then a find-first-zero here followed by one in the word itself.
+static uint32_t* frame_summary;
+static uint32_t nwords;
+// Free frames and completely free words held by the pool
+static uint32_t pool_free;
+static uint32_t pool_free_words;
+
+// Stack of pre-zeroed frames, kernel virtual addresses
+static uintptr_t zero_pool[ZERO_POOL_SIZE];
+static size_t zero_pool_count;
+
 page_dir_t* kernel_page_dir;
 
 uintptr_t placement_ptr;
@@ -37,8 +116,9 @@ void bootstrap_malloc_startat(uintptr_t address) { placement_ptr = address; }
 // Phys does the conversion from virtual to phys for us
 uintptr_t bootstrap_malloc_real(size_t size, int align, uintptr_t* phys)
 {
-    if (align && (placement_ptr & 0xFFFFF000)) {
-        placement_ptr &= 0xFFFFF000;
+    // Round up to the next page, rounding down would hand out the tail of the previous allocation
+    if (align && (placement_ptr & 0xFFF)) {
+        placement_ptr = (placement_ptr + PAGE_SIZE) & 0xFFFFF000;
     }
     if (phys) *phys = placement_ptr - KERNEL_OFFSET;
     uintptr_t addr = placement_ptr;
@@ -46,37 +126,181 @@ uintptr_t bootstrap_malloc_real(size_t size, int align, uintptr_t* phys)
     return addr;
 }
 
-// Initialize bitmap, only need stop location, will pull start from placement_ptr
+static void set_frame_range(uint32_t first, size_t count);
+static void clear_frame_range(uint32_t first, size_t count);
+static void buddy_free_range(uint32_t first, size_t count);
+static inline bool frame_is_used(uint32_t frame);
+
+/// Clamps a memory map entry to whole frames below 4 GiB. Returns false if nothing is left.
+static bool mmap_entry_frames(const multiboot_memory_map_t* entry, bool shrink, uint32_t* first, uint32_t* end)
+{
+    if (entry->addr_high) return false;
+    uint64_t start = entry->addr_low;
+    uint64_t stop = start + ((uint64_t)entry->len_high << 32 | entry->len_low);
+    if (stop > 0x100000000ULL) stop = 0x100000000ULL;
+    // Usable ranges shrink to the frames they fully contain, reserved ones grow to every frame they touch
+    if (shrink) {
+        *first = CEIL_DIV(start, PAGE_SIZE);
+        *end = stop / PAGE_SIZE;
+    } else {
+        *first = start / PAGE_SIZE;
+        *end = CEIL_DIV(stop, PAGE_SIZE);
+    }
+    return *first < *end;
+}
+
+#define for_each_mmap_entry(entry, mbd)                                                                        \
+    for (multiboot_memory_map_t* entry = (multiboot_memory_map_t*)((mbd)->mmap_addr + KERNEL_OFFSET);          \
+         (uintptr_t)entry < (mbd)->mmap_addr + KERNEL_OFFSET + (mbd)->mmap_length;                             \
+         entry = (multiboot_memory_map_t*)((uintptr_t)entry + entry->size + sizeof(entry->size)))
+
+/// True if any reserved memory map entry touches [first, end)
+static bool mmap_range_reserved(multiboot_info_t* mbd, uint32_t first, uint32_t end)
+{
+    for_each_mmap_entry(entry, mbd)
+    {
+        uint32_t start, stop;
+        if (entry->type == MULTIBOOT_MEMORY_AVAILABLE || !mmap_entry_frames(entry, false, &start, &stop)) continue;
+        if (start < end && stop > first) return true;
+    }
+    return false;
+}
+
+/// First frame of count usable frames at or above min and inside the direct map, FRAME_NONE if there are none
+static uint32_t mmap_find_frames(multiboot_info_t* mbd, uint32_t min, uint32_t count)
+{
+    for_each_mmap_entry(entry, mbd)
+    {
+        uint32_t first, end;
+        if (entry->type != MULTIBOOT_MEMORY_AVAILABLE || !mmap_entry_frames(entry, true, &first, &end)) continue;
+        if (first < min) first = min;
+        if (end > DIRECT_MAP_SIZE / PAGE_SIZE) end = DIRECT_MAP_SIZE / PAGE_SIZE;
+        if (first < end && end - first >= count && !mmap_range_reserved(mbd, first, first + count)) return first;
+    }
+    return FRAME_NONE;
+}
+
+static void zone_setup(zone_t* zone, const char* name, uint32_t start, uint32_t end)
+{
+    if (end > nframes) end = nframes;
+    if (start > end) start = end;
+    zone->name = name;
+    zone->start = start;
+    zone->end = end;
+    for (size_t i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        zone->free_lists[i] = FRAME_NONE;
+        zone->nr_blocks[i] = 0;
+    }
+    zone->free_frames = 0;
+    zone->present_frames = 0;
+}
+
+static inline zone_t* zone_of(uint32_t frame)
+{
+    if (frame < zones[ZONE_DMA].end) return &zones[ZONE_DMA];
+    if (frame < zones[ZONE_NORMAL].end) return &zones[ZONE_NORMAL];
+    return &zones[ZONE_HIGH];
+}
+
+// Builds the free map from the multiboot memory map, will pull the first usable frame from placement_ptr
 // That way I can malloc the bitmap dynamically.
-void pmm_init(uint32_t mem_high)
-{
-    uint32_t mem_low = placement_ptr - KERNEL_OFFSET;
-    // round up division
-    page_frame_min = CEIL_DIV(mem_low, PAGE_SIZE);
-    page_frame_max = mem_high / PAGE_SIZE;
-    nframes = (page_frame_max - page_frame_min) / BITSET_WIDTH;
-    // nframes = page_frame_max - page_frame_min;
+void pmm_init(multiboot_info_t* mbd)
+{
+    // Size everything after the highest usable frame, holes below it just stay marked used
+    nframes = 0;
+    for_each_mmap_entry(entry, mbd)
+    {
+        uint32_t first, end;
+        if (entry->type != MULTIBOOT_MEMORY_AVAILABLE || !mmap_entry_frames(entry, true, &first, &end)) continue;
+        if (end > nframes) nframes = end;
+    }
     total_alloc = 0;
+    failed_allocs = 0;
+
+    // Allocate the bitmap and the frame descriptors
+    size_t bitset_size = sizeof(uint32_t) * CEIL_DIV(nframes, BITSET_WIDTH);
+    frame_bitset = (uint32_t*)bootstrap_malloc_real(bitset_size, 1, NULL);
+    nwords = CEIL_DIV(nframes, BITSET_WIDTH);
+    size_t summary_size = sizeof(uint32_t) * CEIL_DIV(nwords, BITSET_WIDTH);
+    frame_summary = (uint32_t*)bootstrap_malloc_real(summary_size, 0, NULL);
+    // The descriptors run to megabytes with lots of RAM, keep them out of the DMA zone whenever there is room.
+    // Small machines without any usable memory past it fall back to right behind the kernel.
+    uint32_t frames_pages = CEIL_DIV(sizeof(frame_t) * nframes, PAGE_SIZE);
+    uint32_t frames_min = CEIL_DIV(placement_ptr - KERNEL_OFFSET, PAGE_SIZE);
+    if (frames_min < DMA_ZONE_SIZE / PAGE_SIZE) frames_min = DMA_ZONE_SIZE / PAGE_SIZE;
+    uint32_t frames_first = mmap_find_frames(mbd, frames_min, frames_pages);
+    if (frames_first != FRAME_NONE)
+        frames = (frame_t*)((uintptr_t)frames_first * PAGE_SIZE + KERNEL_OFFSET);
+    else
+        frames = (frame_t*)bootstrap_malloc_real(sizeof(frame_t) * nframes, 1, NULL);
+    // First set all to used and reserved
+    memset(frame_bitset, 0xFF, bitset_size);
+    for (uint32_t i = 0; i < nframes; i++) {
+        frames[i].next = frames[i].prev = FRAME_NONE;
+        frames[i].order = 0;
+        frames[i].flags = FRAME_RESERVED;
+        frames[i].refcount = 0;
+    }
+    // The pool starts out empty
+    memset(frame_summary, 0xFF, summary_size);
+    pool_free = 0;
+    pool_free_words = 0;
+
+    zone_setup(&zones[ZONE_DMA], "DMA", 0, DMA_ZONE_SIZE / PAGE_SIZE);
+    zone_setup(&zones[ZONE_NORMAL], "Normal", DMA_ZONE_SIZE / PAGE_SIZE, DIRECT_MAP_SIZE / PAGE_SIZE);
+    zone_setup(&zones[ZONE_HIGH], "High", DIRECT_MAP_SIZE / PAGE_SIZE, nframes);
 
-    // Shrink number of frames
-    nframes = nframes - (sizeof(uint32_t) * nframes) % PAGE_SIZE;
-    // Allocate the bitmap
-    frame_bitset = (uint32_t*)bootstrap_malloc_real(sizeof(uint32_t) * nframes, 1, NULL);
-    // printf("MIN: 0x%X, MAX: 0x%X\n", page_frame_min, page_frame_max);
-    // First set all to used
-    memset(frame_bitset, 0xFF, sizeof(uint32_t) * nframes);
     // NOTE: for now i will just select placement_ptr as start for phys, unsure if there is a better
-    // way. Now we set unused (past placement_ptr)
-    // TODO: make this a memset?
-    for (size_t i = CEIL_DIV((placement_ptr - KERNEL_OFFSET) / PAGE_SIZE, BITSET_WIDTH);
-         i < INDEX_FROM_BIT(nframes); i++) {
-        frame_bitset[i] = 0;
+    // way. This keeps the kernel image, the boot structures and everything below 1 MiB out of the free map.
+    page_frame_min = CEIL_DIV(placement_ptr - KERNEL_OFFSET, PAGE_SIZE);
+    last_frame = page_frame_min;
+
+    // Clear usable ranges, then mark reserved ones again in case the firmware handed us overlapping entries
+    for_each_mmap_entry(entry, mbd)
+    {
+        uint32_t first, end;
+        if (entry->type != MULTIBOOT_MEMORY_AVAILABLE || !mmap_entry_frames(entry, true, &first, &end)) continue;
+        if (first < page_frame_min) first = page_frame_min;
+        if (first >= end) continue;
+        clear_frame_range(first, end - first);
+    }
+    for_each_mmap_entry(entry, mbd)
+    {
+        uint32_t first, end;
+        if (entry->type == MULTIBOOT_MEMORY_AVAILABLE || !mmap_entry_frames(entry, false, &first, &end)) continue;
+        if (end > nframes) end = nframes;
+        if (first >= end) continue;
+        set_frame_range(first, end - first);
+    }
+    if (frames_first != FRAME_NONE) set_frame_range(frames_first, frames_pages);
+
+    // Every run still clear is usable, hand it to the zone it lives in
+    uint32_t frame = page_frame_min;
+    while (frame < nframes) {
+        if (frame_bitset[INDEX_FROM_BIT(frame)] == 0xFFFFFFFF && !OFFSET_FROM_BIT(frame)) {
+            frame += BITSET_WIDTH;
+            continue;
+        }
+        if (frame_is_used(frame)) {
+            frame++;
+            continue;
+        }
+        uint32_t run = frame;
+        while (frame < nframes && !frame_is_used(frame)) {
+            frames[frame].flags &= ~FRAME_RESERVED;
+            zone_of(frame)->present_frames++;
+            frame++;
+        }
+        buddy_free_range(run, frame - run);
     }
+
+    // Set aside the contiguous DMA pool before anything gets a chance to fragment the DMA zone
+    dma_init();
 }
 
 // TODO: Separate kernel heap and userspace heap, right now i'm only working with kernel but
 //       userspace should start at virt: 0x0
-void init_memory(uint32_t mem_high, uint32_t phys_alloc_start)
+void init_memory(multiboot_info_t* mbd, uint32_t phys_alloc_start)
 {
     uint32_t address = (phys_alloc_start) & 0xFFFFF000;
 #ifdef KERNEL_DEBUG
@@ -88,35 +312,58 @@ void init_memory(uint32_t mem_high, uint32_t phys_alloc_start)
     kernel_page_dir = (page_dir_t*)bootstrap_malloc_real(sizeof(page_dir_t), 1, &pd_phys);
     memset((unsigned char*)kernel_page_dir, 0, sizeof(page_dir_t));
     kernel_page_dir->physical_addr = pd_phys;
+
+    bool pse = cpu_check_pse();
+    uint32_t global = cpu_check_pge() ? PAGE_FLAG_GLOBAL : 0;
     uintptr_t map_addr = 0x0;
-    // Allocate space for paging structure. Only up until 1022, since 1023 will point to beginning
-    // of directory. Also map kernel space.
-    for (size_t i = 0; i < 1023; i++) {
+    // Only map the direct map (0xC0000000 up to VMALLOC_START) up front, tables for the vmalloc window and
+    // everything below the kernel are created on first use by get_page_table.
+    for (size_t i = KERNEL_PD_START; i < VMALLOC_START >> 22; i++) {
+        // Straight to 4 MiB pages when the CPU has them, no tables to allocate and far fewer TLB entries
+        if (pse) {
+            kernel_page_dir->physical_tables[i] = map_addr | global | PAGE_FLAG_HUGE | 0x3;
+            map_addr += 1024 * PAGE_SIZE;
+            continue;
+        }
         uintptr_t table_physaddr;
         kernel_page_dir->tables[i]
             = (page_table_t*)bootstrap_malloc_real(sizeof(page_table_t), 1, &table_physaddr);
-        kernel_page_dir->physical_tables[i] = table_physaddr | 0x2;
-        // Map kernel space (above 0xC0000000)
-        if (i >= 768) {
-            for (size_t j = 0; j < 1024; j++) {
-                kernel_page_dir->tables[i]->pages[j] = map_addr | 0x3;
-                map_addr += PAGE_SIZE;
-            }
-            kernel_page_dir->physical_tables[i] |= 0x3;
+        for (size_t j = 0; j < 1024; j++) {
+            kernel_page_dir->tables[i]->pages[j] = map_addr | global | 0x3;
+            map_addr += PAGE_SIZE;
         }
+        kernel_page_dir->physical_tables[i] = table_physaddr | 0x3;
     }
     // Map last entry to beginning of directory
-    kernel_page_dir->physical_tables[1023] = kernel_page_dir->physical_addr | 0x3;
+    kernel_page_dir->physical_tables[RECURSIVE_PD_SLOT] = kernel_page_dir->physical_addr | 0x3;
 
+    // Boot code already turns on PSE for its own 4 MiB mappings, set it anyway before loading ours
+    if (pse) write_cr4(read_cr4() | CR4_PSE);
     write_cr3((uint32_t)kernel_page_dir->physical_addr);
+    if (global) write_cr4(read_cr4() | CR4_PGE);
+    // Read-only pages have to fault for ring 0 too, copy-on-write depends on it. APs copy CR0 from here.
+    write_cr0(read_cr0() | CR0_WP);
 
-    pmm_init(mem_high);
+    // GRUB hands us physical pointers, read them through the higher half now that the identity map is gone
+    pmm_init((multiboot_info_t*)((uintptr_t)mbd + KERNEL_OFFSET));
     reload_cr3();
     install_isr_handler(14, page_fault);
 }
 
 // This might just invalidate the TLB telling the processor to double check the page dir
-void invalidate(uint32_t vaddr) { asm volatile("invlpg %0" ::"m"(vaddr)); }
+void invalidate(uint32_t vaddr) { asm volatile("invlpg (%0)" ::"r"(vaddr) : "memory"); }
+
+void flush_tlb_all()
+{
+    uint32_t cr4 = read_cr4();
+    // Global entries survive CR3 reloads, toggling PGE is the only way to drop them too
+    if (cr4 & CR4_PGE) {
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    } else {
+        reload_cr3();
+    }
+}
 
 void reload_cr3()
 {
@@ -127,97 +374,483 @@ void reload_cr3()
                  : "%eax");
 }
 
+page_table_t* get_page_table(uintptr_t vaddr, bool create)
+{
+    uint32_t pd_index = vaddr >> 22;
+    if (pd_index == RECURSIVE_PD_SLOT) return NULL;
+    uintptr_t pde = kernel_page_dir->physical_tables[pd_index];
+    // 4 MiB mappings have no table behind them
+    if (pde & PAGE_FLAG_HUGE) return NULL;
+    if (kernel_page_dir->tables[pd_index]) return kernel_page_dir->tables[pd_index];
+    if (!create) return NULL;
+
+    uintptr_t table = kalloc_zeroed_frames(1);
+    if (!table) return NULL;
+    kernel_page_dir->tables[pd_index] = (page_table_t*)table;
+    uint32_t flags = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE;
+    if (pd_index < KERNEL_PD_START) flags |= PAGE_FLAG_USER;
+    kernel_page_dir->physical_tables[pd_index] = (table - KERNEL_OFFSET) | flags;
+    return kernel_page_dir->tables[pd_index];
+}
+
 uintptr_t get_physaddr(uintptr_t virtualaddr)
 {
     unsigned long pdindex = (unsigned long)virtualaddr >> 22;
     unsigned long ptindex = (unsigned long)virtualaddr >> 12 & 0x03FF;
 
     unsigned long* pd = (unsigned long*)0xFFFFF000;
-    // TODO: Here you need to check whether the PD entry is present.
+    if (!(pd[pdindex] & PAGE_FLAG_PRESENT)) return 0;
+    if (pd[pdindex] & PAGE_FLAG_HUGE) return (uintptr_t)((pd[pdindex] & 0xFFC00000) + (virtualaddr & 0x3FFFFF));
 
     unsigned long* pt = ((unsigned long*)0xFFC00000) + (0x400 * pdindex);
-    // TODO: Here you need to check whether the PT entry is present.
+    if (!(pt[ptindex] & PAGE_FLAG_PRESENT)) return 0;
 
     return (uintptr_t)((pt[ptindex] & ~0xFFF) + ((unsigned long)virtualaddr & 0xFFF));
 }
 
-// TODO: Maxes out at 32 frames.
-// TODO: Fragmentation issues when num_frames goes past 32-bit border (between indexes)
-//
-// Gets frame number from memory bitset
-uint32_t find_frames(size_t num_frames)
-{
-    size_t init_offset = 0;
-    size_t consecutive_free = 0;
-    // iterate through bitset, then if we have enough frames we break out to mark them
-    for (size_t i = 0; i < INDEX_FROM_BIT(nframes); i++) {
-        // Means no bits are free
-        if (frame_bitset[i] == 0xFFFFFFFF) {
-            init_offset = 0;
-            consecutive_free = 0;
-            continue;
-        }
-        // Iterate through all bits
-        for (int j = 0; j < BITSET_WIDTH; j++) {
-            uint32_t to_test = 1 << j;
-            if (!(frame_bitset[i] & to_test)) {
-                if (!init_offset) init_offset = j;
-                consecutive_free++;
-            } else if (consecutive_free > 0 && consecutive_free < num_frames) {
-                init_offset = 0;
-                consecutive_free = 0;
-            }
+/// Marks [first, first + count) as used in the frame bitset
+static void set_frame_range(uint32_t first, size_t count)
+{
+    uint32_t frame = first;
+    uint32_t end = first + count;
+    // Single bits until we are word aligned, then whole words
+    for (; frame < end && OFFSET_FROM_BIT(frame); frame++)
+        frame_bitset[INDEX_FROM_BIT(frame)] |= (0x1u << OFFSET_FROM_BIT(frame));
+    for (; frame + BITSET_WIDTH <= end; frame += BITSET_WIDTH)
+        frame_bitset[INDEX_FROM_BIT(frame)] = 0xFFFFFFFF;
+    for (; frame < end; frame++)
+        frame_bitset[INDEX_FROM_BIT(frame)] |= (0x1u << OFFSET_FROM_BIT(frame));
+}
+
+/// Marks [first, first + count) as free in the frame bitset
+static void clear_frame_range(uint32_t first, size_t count)
+{
+    uint32_t frame = first;
+    uint32_t end = first + count;
+    for (; frame < end && OFFSET_FROM_BIT(frame); frame++)
+        frame_bitset[INDEX_FROM_BIT(frame)] &= ~(0x1u << OFFSET_FROM_BIT(frame));
+    for (; frame + BITSET_WIDTH <= end; frame += BITSET_WIDTH)
+        frame_bitset[INDEX_FROM_BIT(frame)] = 0;
+    for (; frame < end; frame++)
+        frame_bitset[INDEX_FROM_BIT(frame)] &= ~(0x1u << OFFSET_FROM_BIT(frame));
+}
+
+static inline bool frame_is_used(uint32_t frame)
+{
+    return frame_bitset[INDEX_FROM_BIT(frame)] & (0x1u << OFFSET_FROM_BIT(frame));
+}
+
+/// Smallest order whose block holds num_frames
+static inline uint32_t order_for(size_t num_frames)
+{
+    if (num_frames <= 1) return 0;
+    return BITSET_WIDTH - __builtin_clz(num_frames - 1);
+}
+
+/// Pushes at the head, buddy lookups go through the frame descriptors so the lists never need walking
+static void free_list_push(zone_t* zone, uint32_t order, uint32_t frame)
+{
+    uint32_t next = zone->free_lists[order];
+    frames[frame].prev = FRAME_NONE;
+    frames[frame].next = next;
+    if (next != FRAME_NONE) frames[next].prev = frame;
+    zone->free_lists[order] = frame;
+    frames[frame].order = order;
+    frames[frame].flags |= FRAME_FREE;
+    zone->nr_blocks[order]++;
+}
+
+static void free_list_remove(zone_t* zone, uint32_t order, uint32_t frame)
+{
+    if (frames[frame].prev != FRAME_NONE)
+        frames[frames[frame].prev].next = frames[frame].next;
+    else
+        zone->free_lists[order] = frames[frame].next;
+    if (frames[frame].next != FRAME_NONE) frames[frames[frame].next].prev = frames[frame].prev;
+    frames[frame].flags &= ~FRAME_FREE;
+    zone->nr_blocks[order]--;
+}
+
+/// Pops a block of 2^order frames from a zone, splitting a larger block if needed.
+/// Returns the first frame of the block or FRAME_NONE.
+static uint32_t buddy_alloc(zone_t* zone, uint32_t order)
+{
+    uint32_t curr = order;
+    while (curr <= BUDDY_MAX_ORDER && zone->free_lists[curr] == FRAME_NONE)
+        curr++;
+    if (curr > BUDDY_MAX_ORDER) return FRAME_NONE;
+
+    uint32_t frame = zone->free_lists[curr];
+    free_list_remove(zone, curr, frame);
+    // Hand the upper halves back until the block is the size we want
+    while (curr > order) {
+        curr--;
+        free_list_push(zone, curr, frame + (1 << curr));
+    }
+    zone->free_frames -= 1 << order;
+    return frame;
+}
+
+/// Returns a block of 2^order frames, merging it with its buddy for as long as the buddy is free.
+/// Blocks never cross a zone boundary, so neither do merges.
+static void buddy_free(uint32_t frame, uint32_t order)
+{
+    zone_t* zone = zone_of(frame);
+    zone->free_frames += 1 << order;
+    while (order < BUDDY_MAX_ORDER) {
+        uint32_t buddy = frame ^ (1 << order);
+        if (buddy < zone->start || buddy >= zone->end) break;
+        // A free buddy of the same size always starts its own block, since any larger free block
+        // containing it would also contain us.
+        if (!(frames[buddy].flags & FRAME_FREE) || frames[buddy].order != order) break;
+        free_list_remove(zone, order, buddy);
+        frame &= buddy;
+        order++;
+    }
+    free_list_push(zone, order, frame);
+}
+
+/// Frees an arbitrary run of frames by splitting it into the largest aligned blocks that fit in their zone
+static void buddy_free_range(uint32_t first, size_t count)
+{
+    while (count > 0) {
+        size_t limit = zone_of(first)->end - first;
+        if (limit > count) limit = count;
+        uint32_t order = first ? __builtin_ctz(first) : BUDDY_MAX_ORDER;
+        if (order > BUDDY_MAX_ORDER) order = BUDDY_MAX_ORDER;
+        while ((1u << order) > limit)
+            order--;
+        buddy_free(first, order);
+        first += 1 << order;
+        count -= 1 << order;
+    }
+}
+
+static inline bool frame_in_pool(uint32_t frame)
+{
+    return frames[frame & ~(BITSET_WIDTH - 1)].flags & FRAME_POOL;
+}
+
+static inline void summary_set(uint32_t word) { frame_summary[INDEX_FROM_BIT(word)] |= 0x1u << OFFSET_FROM_BIT(word); }
+
+static inline void summary_clear(uint32_t word)
+{
+    frame_summary[INDEX_FROM_BIT(word)] &= ~(0x1u << OFFSET_FROM_BIT(word));
+}
+
+/// Borrows an order 5 block from the normal zone, which is exactly one bitmap word
+static bool pool_refill()
+{
+    uint32_t frame = buddy_alloc(&zones[ZONE_NORMAL], POOL_ORDER);
+    if (frame == FRAME_NONE) return false;
+    uint32_t word = INDEX_FROM_BIT(frame);
+    // Bits are already clear since the frames were free in the buddy allocator
+    frames[frame].flags |= FRAME_POOL;
+    summary_clear(word);
+    pool_free += BITSET_WIDTH;
+    pool_free_words++;
+    last_frame = frame;
+    return true;
+}
+
+/// Hands a completely free pool word back to the buddy allocator
+static void pool_release(uint32_t word)
+{
+    uint32_t frame = word * BITSET_WIDTH;
+    frames[frame].flags &= ~FRAME_POOL;
+    summary_set(word);
+    pool_free -= BITSET_WIDTH;
+    pool_free_words--;
+    buddy_free(frame, POOL_ORDER);
+}
+
+/// Gives every completely free pool word back, so multi-frame allocations can use them
+static void pool_drain()
+{
+    for (uint32_t word = 0; word < nwords && pool_free_words; word++) {
+        if (frame_in_pool(word * BITSET_WIDTH) && frame_bitset[word] == 0) pool_release(word);
+    }
+}
+
+/// Next-fit: keeps taking from the word of the last single frame handed out, then searches the summary
+static uint32_t pool_alloc()
+{
+    if (!pool_free && !pool_refill()) return FRAME_NONE;
+
+    uint32_t word = INDEX_FROM_BIT(last_frame);
+    if (frame_summary[INDEX_FROM_BIT(word)] & (0x1u << OFFSET_FROM_BIT(word))) {
+        uint32_t summary_words = CEIL_DIV(nwords, BITSET_WIDTH);
+        uint32_t idx = INDEX_FROM_BIT(word);
+        // pool_free guarantees a clear summary bit somewhere, so this only wraps when the cursor is past it
+        while (frame_summary[idx] == 0xFFFFFFFF) {
+            if (++idx == summary_words) idx = 0;
         }
-        if (consecutive_free >= num_frames) {
-            return ((i * BITSET_WIDTH) + init_offset);
-        } else {
-            consecutive_free = 0;
-            init_offset = 0;
+        word = idx * BITSET_WIDTH + __builtin_ctz(~frame_summary[idx]);
+    }
+    uint32_t bit = __builtin_ctz(~frame_bitset[word]);
+
+    if (frame_bitset[word] == 0) pool_free_words--;
+    frame_bitset[word] |= 0x1u << bit;
+    if (frame_bitset[word] == 0xFFFFFFFF) summary_set(word);
+    pool_free--;
+
+    last_frame = word * BITSET_WIDTH + bit;
+    return last_frame;
+}
+
+static void pool_free_frame(uint32_t frame)
+{
+    uint32_t word = INDEX_FROM_BIT(frame);
+    if (frame_bitset[word] == 0xFFFFFFFF) summary_clear(word);
+    frame_bitset[word] &= ~(0x1u << OFFSET_FROM_BIT(frame));
+    pool_free++;
+    if (frame_bitset[word] == 0 && ++pool_free_words > POOL_SPARE_WORDS && word != INDEX_FROM_BIT(last_frame))
+        pool_release(word);
+}
+
+/// Frees a run of frames that isn't part of the pool back to the buddy allocator
+static void release_run(uint32_t first, size_t count)
+{
+    if (!count) return;
+    clear_frame_range(first, count);
+    buddy_free_range(first, count);
+}
+
+/// Tries to allocate num_frames from a single zone. Returns the first frame or FRAME_NONE.
+static uint32_t zone_alloc(zone_t* zone, size_t num_frames)
+{
+    if (num_frames == 1) {
+        // Only the normal zone feeds the pool, the others hand out single frames straight from the buddy lists
+        uint32_t frame = zone == &zones[ZONE_NORMAL] ? pool_alloc() : FRAME_NONE;
+        // Memory too fragmented for a whole word, take whatever single frame the buddy allocator has
+        if (frame == FRAME_NONE) {
+            frame = buddy_alloc(zone, 0);
+            if (frame == FRAME_NONE) return FRAME_NONE;
+            set_frame_range(frame, 1);
         }
+        return frame;
+    }
+
+    uint32_t order = order_for(num_frames);
+    if (order > BUDDY_MAX_ORDER || num_frames > pmm_free_frames(zone - zones)) return FRAME_NONE;
+    uint32_t first_frame = buddy_alloc(zone, order);
+    if (first_frame == FRAME_NONE && zone == &zones[ZONE_NORMAL] && pool_free_words) {
+        pool_drain();
+        first_frame = buddy_alloc(zone, order);
+    }
+    if (first_frame == FRAME_NONE) return FRAME_NONE;
+    // Give back whatever the power of two rounding took beyond what was asked for
+    size_t excess = (1 << order) - num_frames;
+    if (excess) buddy_free_range(first_frame + num_frames, excess);
+    set_frame_range(first_frame, num_frames);
+    return first_frame;
+}
+
+uintptr_t kalloc_phys_frames(size_t num_frames, uint8_t zone)
+{
+    if (num_frames == 0 || zone >= PMM_NUM_ZONES) return 0;
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    // Fall back towards the scarcer zones below, never above what the caller can address
+    for (int z = zone; z >= 0; z--) {
+        uint32_t frame = zone_alloc(&zones[z], num_frames);
+        if (frame == FRAME_NONE) continue;
+        for (size_t i = 0; i < num_frames; i++)
+            frames[frame + i].refcount = 1;
+        total_alloc += num_frames;
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        TRACE(TRACE_PMM_ALLOC, frame * PAGE_SIZE, num_frames, __builtin_return_address(0));
+        return frame * PAGE_SIZE;
     }
+    failed_allocs++;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return 0;
+}
 
-    // If no memory is found
+uintptr_t kalloc_frames(size_t num_frames)
+{
+    // Frame 0 is never handed out, so a zero physical address always means failure
+    uintptr_t phys = kalloc_phys_frames(num_frames, ZONE_NORMAL);
+    if (phys) return phys + KERNEL_OFFSET;
+    // Out of memory, the zero pool is the last place a single frame can come from
+    if (num_frames == 1) {
+        uint32_t flags = spin_lock_irqsave(&pmm_lock);
+        uintptr_t frame = zero_pool_count ? zero_pool[--zero_pool_count] : 0;
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        return frame;
+    }
     return 0;
 }
 
-/// I beliebe frame_addr is virtual addr
-static void set_frame(uintptr_t frame_addr)
+uintptr_t kalloc_zeroed_frames(size_t num_frames)
 {
-    uint32_t frame = frame_addr / PAGE_SIZE;
-    uint32_t idx = INDEX_FROM_BIT(frame);
-    uint32_t off = OFFSET_FROM_BIT(frame);
-    frame_bitset[idx] |= (0x1 << off);
+    if (num_frames == 1) {
+        uint32_t flags = spin_lock_irqsave(&pmm_lock);
+        uintptr_t frame = zero_pool_count ? zero_pool[--zero_pool_count] : 0;
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        if (frame) return frame;
+    }
+    uintptr_t frame = kalloc_frames(num_frames);
+    if (frame) memset((void*)frame, 0, num_frames * PAGE_SIZE);
+    return frame;
 }
 
-/// I beliebe frame_addr is virtual addr
-static void clear_frame(uintptr_t frame_addr)
+void pmm_zero_idle()
 {
-    uint32_t frame = frame_addr / PAGE_SIZE;
-    uint32_t idx = INDEX_FROM_BIT(frame);
-    uint32_t off = OFFSET_FROM_BIT(frame);
-    frame_bitset[idx] &= ~(0x1 << off);
+    for (size_t i = 0; i < ZERO_POOL_BATCH && zero_pool_count < ZERO_POOL_SIZE; i++) {
+        // Cleared outside the lock, nobody else knows about the frame yet
+        uintptr_t frame = kalloc_frames(1);
+        if (!frame) return;
+        memset((void*)frame, 0, PAGE_SIZE);
+        uint32_t flags = spin_lock_irqsave(&pmm_lock);
+        bool room = zero_pool_count < ZERO_POOL_SIZE;
+        if (room) zero_pool[zero_pool_count++] = frame;
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        if (!room) {
+            kfree_frames(frame, 1);
+            return;
+        }
+    }
 }
 
-uintptr_t kalloc_frames(size_t num_frames)
+/// kfree_phys_frames with pmm_lock held
+static void free_frames_locked(uintptr_t phys, size_t num_frames)
 {
-    if (num_frames == 0) return NULL;
-    uint32_t first_frame = find_frames(num_frames);
-    if (first_frame == 0) return NULL;
-    for (size_t i = first_frame; i < num_frames + first_frame; i++) {
-        // printf("allocating frame 0x%X\n", (i * PAGE_SIZE));
-        set_frame(i * PAGE_SIZE);
+    uint32_t frame = phys / PAGE_SIZE;
+    if (frame < page_frame_min || frame + num_frames > nframes) {
+        printf("kfree_frames: 0x%X is not a managed frame\n", phys);
+        return;
+    }
+    for (size_t i = 0; i < num_frames; i++) {
+        if (frames[frame + i].flags & FRAME_RESERVED) {
+            printf("kfree_frames: 0x%X is not a managed frame\n", phys + i * PAGE_SIZE);
+            return;
+        }
+        if (!frame_is_used(frame + i)) {
+            printf("kfree_frames: double free of frame 0x%X\n", phys + i * PAGE_SIZE);
+            return;
+        }
     }
-    // printf("\n");
-    return first_frame * PAGE_SIZE + KERNEL_OFFSET;
+    for (size_t i = 0; i < num_frames; i++)
+        frames[frame + i].refcount = 0;
+    total_alloc -= num_frames;
+    if (num_frames == 1 && frame_in_pool(frame)) {
+        pool_free_frame(frame);
+        return;
+    }
+    // Pool frames go back to their word, everything in between goes back to the buddy allocator
+    uint32_t run = frame;
+    for (uint32_t curr = frame; curr < frame + num_frames; curr++) {
+        if (!frame_in_pool(curr)) continue;
+        release_run(run, curr - run);
+        pool_free_frame(curr);
+        run = curr + 1;
+    }
+    release_run(run, frame + num_frames - run);
 }
 
 // TODO: return error code if freeing failed
-void kfree_frames(uintptr_t first_frame, size_t num_frames)
+void kfree_phys_frames(uintptr_t phys, size_t num_frames)
 {
     if (num_frames == 0) return;
-    for (size_t i = 0; i < num_frames; i++) {
-        // printf("Freeing frame 0x%X\n", first_frame + (i * PAGE_SIZE) - KERNEL_OFFSET);
-        clear_frame(first_frame + (i * PAGE_SIZE) - KERNEL_OFFSET);
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    free_frames_locked(phys, num_frames);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    TRACE(TRACE_PMM_FREE, phys, num_frames, __builtin_return_address(0));
+}
+
+void kfree_frames(uintptr_t first_frame, size_t num_frames)
+{
+    if (first_frame < KERNEL_OFFSET) {
+        printf("kfree_frames: 0x%X is not a kernel address\n", first_frame);
+        return;
+    }
+    kfree_phys_frames(first_frame - KERNEL_OFFSET, num_frames);
+}
+
+/// Looks up the descriptor of an allocated frame, NULL if phys isn't one
+static frame_t* allocated_frame(uintptr_t phys, const char* caller)
+{
+    uint32_t frame = phys / PAGE_SIZE;
+    if (frame < page_frame_min || frame >= nframes || (frames[frame].flags & FRAME_RESERVED)
+        || !frame_is_used(frame) || !frames[frame].refcount) {
+        printf("%s: 0x%X is not an allocated frame\n", caller, phys);
+        return NULL;
+    }
+    return &frames[frame];
+}
+
+void pmm_frame_get(uintptr_t phys)
+{
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    frame_t* frame = allocated_frame(phys, "pmm_frame_get");
+    if (frame && frame->refcount < 0xFFFF) frame->refcount++;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+void pmm_frame_put(uintptr_t phys)
+{
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    frame_t* frame = allocated_frame(phys, "pmm_frame_put");
+    if (frame && --frame->refcount == 0) free_frames_locked(phys & ~(PAGE_SIZE - 1), 1);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+uint16_t pmm_frame_refs(uintptr_t phys)
+{
+    uint32_t frame = phys / PAGE_SIZE;
+    return frame < nframes ? frames[frame].refcount : 0;
+}
+
+size_t pmm_free_frames(int zone)
+{
+    if (zone < 0) {
+        size_t total = pool_free;
+        for (size_t i = 0; i < PMM_NUM_ZONES; i++)
+            total += zones[i].free_frames;
+        return total;
+    }
+    if (zone >= PMM_NUM_ZONES) return 0;
+    // Pool frames are always borrowed from the normal zone
+    return zones[zone].free_frames + (zone == ZONE_NORMAL ? pool_free : 0);
+}
+
+void pmm_get_stats(pmm_stats_t* stats)
+{
+    memset(stats, 0, sizeof(pmm_stats_t));
+    stats->used_frames = total_alloc;
+    stats->failed_allocs = failed_allocs;
+    for (size_t i = 0; i < PMM_NUM_ZONES; i++) {
+        stats->zone_present[i] = zones[i].present_frames;
+        stats->zone_free[i] = pmm_free_frames(i);
+        stats->present_frames += zones[i].present_frames;
+        stats->free_frames += stats->zone_free[i];
+        for (size_t order = 0; order <= BUDDY_MAX_ORDER; order++)
+            stats->free_blocks[order] += zones[i].nr_blocks[order];
+    }
+}
+
+uint32_t pmm_fragmentation_index(uint32_t order)
+{
+    if (order > BUDDY_MAX_ORDER) return 1000;
+    size_t free = pool_free;
+    size_t usable = order == 0 ? pool_free : 0;
+    for (size_t i = 0; i < PMM_NUM_ZONES; i++) {
+        free += zones[i].free_frames;
+        for (size_t j = order; j <= BUDDY_MAX_ORDER; j++)
+            usable += zones[i].nr_blocks[j] << j;
+    }
+    if (!free) return 1000;
+    return (free - usable) * 1000 / free;
+}
+
+void pmm_print_zones()
+{
+    for (size_t i = 0; i < PMM_NUM_ZONES; i++) {
+        zone_t* zone = &zones[i];
+        if (!zone->present_frames) continue;
+        printf("Zone %s: 0x%X-0x%X, %d of %d KiB free\n", zone->name, zone->start * PAGE_SIZE,
+            zone->end * PAGE_SIZE - 1, pmm_free_frames(i) * (PAGE_SIZE / 1024),
+            zone->present_frames * (PAGE_SIZE / 1024));
     }
 }
 
@@ -226,6 +859,12 @@ void page_fault(struct irq_regs* r)
     uint32_t fault_addr;
     asm volatile("mov %%cr2, %0" : "=r"(fault_addr));
 
+    // File backed areas may have to wait for the disk, which needs interrupts. Let them back in if the
+    // faulting code had them.
+    if (r->eflags & 0x200) asm volatile("sti");
+    // Demand-zero and copy-on-write faults inside a VMA are resolved, everything else is a real bug
+    if (vmm_handle_fault(fault_addr, r->err_code) == 0) return;
+
     int present = !(r->err_code & 0x1);
     int rw = r->err_code & 0x2;
     int user = r->err_code & 0x4;
@@ -237,6 +876,21 @@ void page_fault(struct irq_regs* r)
     panic("Page Fault");
 }
 
+static bool runs_overlap(uintptr_t a, size_t a_frames, uintptr_t b, size_t b_frames)
+{
+    return a < b + b_frames * PAGE_SIZE && b < a + a_frames * PAGE_SIZE;
+}
+
+/// Checks that every frame of an allocated run is marked in the bitmap
+static bool run_is_marked(uintptr_t addr, size_t num_frames)
+{
+    uint32_t frame = (addr - KERNEL_OFFSET) / PAGE_SIZE;
+    for (size_t i = 0; i < num_frames; i++) {
+        if (!frame_is_used(frame + i)) return false;
+    }
+    return true;
+}
+
 // TODO: Should check for large fragmentation
 // TODO: Should we return error code instead of panicing and printing a ton of stuff?
 uint8_t test_pmm()
@@ -244,6 +898,7 @@ uint8_t test_pmm()
     bool passed = true;
     uint8_t err_code = UNKNOWN;
     puts("PMM Testing:");
+    size_t init_free = pmm_free_frames(-1);
     // Get initial free location to compare after everything is freed
     uintptr_t init_frame = kalloc_frames(1);
     // printf("Initial 1 frame alloc: 0x%X\n", init_frame);
@@ -292,6 +947,29 @@ uint8_t test_pmm()
         }
     }
 
+    // Runs past the old 32 frame limit, with a small run first to push the others off word alignment
+    static const size_t run_sizes[] = { 3, 40, 33, 1000, 4096 };
+    const size_t num_runs = sizeof(run_sizes) / sizeof(run_sizes[0]);
+    uintptr_t runs[sizeof(run_sizes) / sizeof(run_sizes[0])] = { 0 };
+    for (size_t k = 0; k < num_runs; k++) {
+        runs[k] = kalloc_frames(run_sizes[k]);
+        if (!runs[k] || !run_is_marked(runs[k], run_sizes[k])) {
+            passed = false;
+            err_code |= LARGE_RUN;
+            err_code &= ~UNKNOWN;
+        }
+        for (size_t l = 0; runs[k] && l < k; l++) {
+            if (runs[l] && runs_overlap(runs[k], run_sizes[k], runs[l], run_sizes[l])) {
+                passed = false;
+                err_code |= OVERLAP;
+                err_code &= ~UNKNOWN;
+            }
+        }
+    }
+    for (size_t k = 0; k < num_runs; k++) {
+        if (runs[k]) kfree_frames(runs[k], run_sizes[k]);
+    }
+
     // Making sure freeing works properly, this should match init_frame
     uintptr_t after_frame = kalloc_frames(1);
     // printf("After 1 frame alloc: 0x%X\n", after_frame);
@@ -301,6 +979,12 @@ uint8_t test_pmm()
         err_code |= IA_DIFF;
         err_code &= ~UNKNOWN;
     }
+    // Everything was freed, so every frame should be back in the free lists
+    if (pmm_free_frames(-1) != init_free) {
+        passed = false;
+        err_code |= FREE_DIFF;
+        err_code &= ~UNKNOWN;
+    }
 
     if (passed) err_code = PASSED;
 
@@ -1,4 +1,5 @@
 #include "../arch/i386/vga.h"
+#include <kernel/klog.h>
 #include <kernel/sys.h>
 #include <kernel/tty.h>
 #include <stdio.h>
@@ -7,6 +8,8 @@
 void panic(char* message)
 {
     asm volatile("cli");
+    // Whatever was logged right before is usually the best hint
+    klog_flush();
     tty_setcolor(VGA_COLOR_RED);
     puts("KERNEL PANIC!");
     puts(message);
@@ -1,18 +1,38 @@
 // https://wiki.osdev.org/PCI
 // https://www.pcilookup.com/
+#include <kernel/acpi.h>
 #include <kernel/asm.h>
+#include <kernel/ktime.h>
 #include <kernel/liballoc.h>
+#include <kernel/memory.h>
 #include <kernel/pci/pci.h>
+#include <kernel/rwlock.h>
+#include <kernel/slab.h>
+#include <kernel/vmalloc.h>
+#include <stdbool.h>
 #include <stdio.h>
 
 #define VENDOR_INVALID 0xFFFF
 
-// TODO: Dynamiclly allocate
-pci_device_t* devices[32];
-uint8_t device_idx = 0;
+// Lookup table buckets, have to stay a power of two
+#define PCI_HASH_SIZE 64
+
+// In scan order, grows as the scan finds more
+static pci_device_t** devices = NULL;
+static size_t device_count = 0;
+static size_t device_capacity = 0;
+// Chains through id_next and class_next, keyed by device id and by class and subclass
+static pci_device_t* by_id[PCI_HASH_SIZE];
+static pci_device_t* by_class[PCI_HASH_SIZE];
+// Guards the device list and the lookup tables, only the bus scan writes
+static rwlock_t devices_lock = RWLOCK_INIT;
+// Configuration space goes through one address/data port pair, an access is two port writes that can't interleave
+static spinlock_t config_lock = SPINLOCK_INIT;
+
+static kmem_cache_t* device_cache;
 
 enum {
-    BUS_COUNT = 8,
+    BUS_COUNT = 256,
     DEV_COUNT = 32,
     FUNC_COUNT = 8,
 };
@@ -28,74 +48,307 @@ enum dev_type {
     CARD_BUS_BRIDGE = 0x2,
 };
 
-const pci_device_t* get_device_by_index(uint8_t index)
+/* ACPI MCFG, one entry per ECAM window */
+struct mcfg_entry {
+    uint64_t base;
+    uint16_t segment;
+    uint8_t start_bus;
+    uint8_t end_bus;
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct mcfg {
+    struct acpi_sdt_header header;
+    uint64_t reserved;
+    struct mcfg_entry entries[];
+} __attribute__((packed));
+
+/* every function gets 4 KiB of ECAM space, a bus 1 MiB */
+#define ECAM_BUS_SIZE (DEV_COUNT * FUNC_COUNT * 4096)
+
+// Segment 0's window, buses are mapped one by one as the scan reaches them
+static uintptr_t ecam_phys = 0;
+static uint8_t ecam_start_bus = 0;
+static uint8_t ecam_end_bus = 0;
+static volatile uint8_t* ecam_bus[BUS_COUNT];
+// Buses already scanned, so a misconfigured bridge can't send the scan around in circles
+static uint32_t scanned[BUS_COUNT / 32];
+static size_t bus_count = 0;
+
+static inline size_t hash_id(uint16_t device_id) { return (device_id ^ (device_id >> 6)) & (PCI_HASH_SIZE - 1); }
+
+static inline size_t hash_class(uint8_t base_class, uint8_t sub_class)
 {
-    if (index > device_idx)
-        return NULL;
-    else
-        return devices[index];
+    return ((base_class << 3) ^ sub_class) & (PCI_HASH_SIZE - 1);
+}
+
+const pci_device_t* get_device_by_index(size_t index)
+{
+    read_lock(&devices_lock);
+    const pci_device_t* dev = index < device_count ? devices[index] : NULL;
+    read_unlock(&devices_lock);
+    return dev;
 }
 
 const pci_device_t* get_device_by_id(uint16_t device_id)
 {
-    for (uint8_t i = 0; i <= device_idx; i++) {
-        if (devices[i]->device_id == device_id) return devices[i];
-    }
-    return NULL;
+    read_lock(&devices_lock);
+    const pci_device_t* dev = by_id[hash_id(device_id)];
+    while (dev && dev->device_id != device_id)
+        dev = dev->id_next;
+    read_unlock(&devices_lock);
+    return dev;
 }
 
 const pci_device_t* get_device_by_class(uint8_t base_class, uint8_t sub_class)
 {
-    for (uint8_t i = 0; i <= device_idx; i++) {
-        if (devices[i]->base_class == base_class && devices[i]->sub_class == sub_class)
-            return devices[i];
-    }
-    return NULL;
+    read_lock(&devices_lock);
+    const pci_device_t* dev = by_class[hash_class(base_class, sub_class)];
+    while (dev && (dev->base_class != base_class || dev->sub_class != sub_class))
+        dev = dev->class_next;
+    read_unlock(&devices_lock);
+    return dev;
+}
+
+const pci_device_t* pci_find_device(uint16_t vendor_id, uint16_t device_id, const pci_device_t* from)
+{
+    read_lock(&devices_lock);
+    const pci_device_t* dev = from ? from->id_next : by_id[hash_id(device_id)];
+    while (dev && (dev->device_id != device_id || dev->vendor_id != vendor_id))
+        dev = dev->id_next;
+    read_unlock(&devices_lock);
+    return dev;
+}
+
+static inline volatile uint32_t* ecam_address(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset)
+{
+    return (volatile uint32_t*)(ecam_bus[bus] + ((uint32_t)slot << 15) + ((uint32_t)func << 12) + (offset & 0xFC));
 }
 
 const uint32_t pci_config_read_word(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset)
 {
-    uint32_t address;
-    uint32_t lbus = (uint32_t)bus;
-    uint32_t lslot = (uint32_t)slot;
-    uint32_t lfunc = (uint32_t)func;
-    uint16_t tmp = 0;
+    // A single load, nothing to serialize
+    if (ecam_bus[bus]) return *ecam_address(bus, slot, func, offset);
 
-    // Create configuration
-    address = (uint32_t)((lbus << 16) | (lslot << 11) | (lfunc << 8) | (offset & 0xFC)
-        | ((uint32_t)(0x80000000)));
+    uint32_t address = ((uint32_t)bus << 16) | ((uint32_t)slot << 11) | ((uint32_t)func << 8) | (offset & 0xFC)
+        | 0x80000000;
+    uint32_t flags = spin_lock_irqsave(&config_lock);
+    outdword(IOPORT_PCI_CFG_ADDR, address);
+    uint32_t value = indword(IOPORT_PCI_CFG_DATA);
+    spin_unlock_irqrestore(&config_lock, flags);
+    return value;
+}
 
+void pci_config_write_word(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value)
+{
+    if (ecam_bus[bus]) {
+        *ecam_address(bus, slot, func, offset) = value;
+        return;
+    }
+
+    uint32_t address = ((uint32_t)bus << 16) | ((uint32_t)slot << 11) | ((uint32_t)func << 8) | (offset & 0xFC)
+        | 0x80000000;
+    uint32_t flags = spin_lock_irqsave(&config_lock);
     outdword(IOPORT_PCI_CFG_ADDR, address);
-    return indword(IOPORT_PCI_CFG_DATA);
+    outdword(IOPORT_PCI_CFG_DATA, value);
+    spin_unlock_irqrestore(&config_lock, flags);
+}
+
+/// Finds segment 0's ECAM window in the MCFG, port I/O stays in use without one
+static void ecam_init()
+{
+    struct mcfg* mcfg = (struct mcfg*)acpi_find_table("MCFG");
+    if (!mcfg) return;
+    size_t count = (mcfg->header.length - sizeof(struct mcfg)) / sizeof(struct mcfg_entry);
+    for (size_t i = 0; i < count; i++) {
+        struct mcfg_entry* entry = mcfg->entries + i;
+        // Physical addresses past 4 GiB are out of reach without PAE
+        if (entry->segment != 0 || entry->base >> 32) continue;
+        ecam_phys = entry->base;
+        ecam_start_bus = entry->start_bus;
+        ecam_end_bus = entry->end_bus;
+        return;
+    }
+}
+
+/// Maps the bus's ECAM space if the window covers it
+static void ecam_map_bus(uint8_t bus)
+{
+    if (!ecam_phys || ecam_bus[bus] || bus < ecam_start_bus || bus > ecam_end_bus) return;
+    // The window starts at start_bus, not at bus 0
+    ecam_bus[bus] = ioremap(ecam_phys + (uintptr_t)(bus - ecam_start_bus) * ECAM_BUS_SIZE, ECAM_BUS_SIZE,
+        PAGE_FLAG_NOCACHE);
+}
+
+static void add_device(pci_device_t* dev)
+{
+    write_lock(&devices_lock);
+    if (device_count == device_capacity) {
+        size_t capacity = device_capacity ? device_capacity * 2 : 32;
+        pci_device_t** grown = krealloc(devices, capacity * sizeof(pci_device_t*));
+        if (!grown) {
+            write_unlock(&devices_lock);
+            kmem_cache_free(device_cache, dev);
+            puts("PCI: no memory for the device list");
+            return;
+        }
+        devices = grown;
+        device_capacity = capacity;
+    }
+    devices[device_count++] = dev;
+    // Appended, so lookups keep returning the first one the scan found
+    pci_device_t** link = &by_id[hash_id(dev->device_id)];
+    while (*link)
+        link = &(*link)->id_next;
+    *link = dev;
+    link = &by_class[hash_class(dev->base_class, dev->sub_class)];
+    while (*link)
+        link = &(*link)->class_next;
+    *link = dev;
+    write_unlock(&devices_lock);
+}
+
+static void scan_bus(uint8_t bus);
+
+static void scan_function(uint8_t bus, uint8_t slot, uint8_t func, uint32_t id)
+{
+    pci_device_t* dev = (pci_device_t*)kmem_cache_zalloc(device_cache);
+    if (!dev) return;
+    dev->bus = bus;
+    dev->dev = slot;
+    dev->func = func;
+    dev->device_id = id >> 16;
+    dev->vendor_id = id & 0xFFFF;
+    uint32_t val = pci_config_read_word(bus, slot, func, PCI_REG_CLASS);
+    dev->base_class = val >> 24;
+    dev->sub_class = (val >> 16) & 0xFF;
+    dev->prog_interface = (val >> 8) & 0xFF;
+    dev->rev_id = val & 0xFF;
+    val = pci_config_read_word(bus, slot, func, PCI_REG_HEADER);
+    dev->type = (val >> 16) & 0xFF;
+    add_device(dev);
+
+    if ((dev->type & ~PCI_HEADER_MULTIFUNC) == PCI_PCI_BRIDGE) {
+        uint8_t secondary = (pci_config_read_word(bus, slot, func, PCI_REG_BUS) >> 8) & 0xFF;
+        // Firmware leaves bridges it didn't configure at 0, we don't number buses ourselves
+        if (secondary)
+            scan_bus(secondary);
+        else
+            printf("PCI: bridge (%d, %d, %d) has no bus number\n", bus, slot, func);
+    }
+}
+
+static void scan_slot(uint8_t bus, uint8_t slot)
+{
+    uint32_t id = pci_config_read_word(bus, slot, 0, 0);
+    if ((id & 0xFFFF) == VENDOR_INVALID) return;
+    scan_function(bus, slot, 0, id);
+    // Single function devices may decode every function number to function 0
+    if (!((pci_config_read_word(bus, slot, 0, PCI_REG_HEADER) >> 16) & PCI_HEADER_MULTIFUNC)) return;
+    for (uint8_t func = 1; func < FUNC_COUNT; func++) {
+        id = pci_config_read_word(bus, slot, func, 0);
+        if ((id & 0xFFFF) != VENDOR_INVALID) scan_function(bus, slot, func, id);
+    }
+}
+
+static void scan_bus(uint8_t bus)
+{
+    if (scanned[bus / 32] & (1u << (bus % 32))) return;
+    scanned[bus / 32] |= 1u << (bus % 32);
+    bus_count++;
+    ecam_map_bus(bus);
+    for (uint8_t slot = 0; slot < DEV_COUNT; slot++)
+        scan_slot(bus, slot);
+}
+
+void pci_init()
+{
+    if (!device_cache) device_cache = kmem_cache_create("pci_device", sizeof(pci_device_t), 0, NULL);
+    uint64_t start = ktime_get_ns();
+    ecam_init();
+    ecam_map_bus(0);
+
+    // A multifunction host bridge has one function per root bus
+    if ((pci_config_read_word(0, 0, 0, PCI_REG_HEADER) >> 16) & PCI_HEADER_MULTIFUNC) {
+        for (uint8_t func = 0; func < FUNC_COUNT; func++) {
+            if ((pci_config_read_word(0, 0, func, 0) & 0xFFFF) != VENDOR_INVALID) scan_bus(func);
+        }
+    } else {
+        scan_bus(0);
+    }
+    printf("PCI: %d devices on %d buses through %s in %llu us\n", device_count, bus_count,
+        ecam_phys ? "ECAM" : "port I/O", (ktime_get_ns() - start) / 1000);
 }
 
 void list_devices()
 {
     puts("(bus, dev, func)");
-    for (uint8_t i = 0; i < BUS_COUNT; i++) {
-        for (uint8_t j = 0; j < DEV_COUNT; j++) {
-            for (uint8_t k = 0; k < FUNC_COUNT; k++) {
-                uint32_t val = pci_config_read_word(i, j, k, 0);
-                if ((val & 0xFFFF) == VENDOR_INVALID) continue;
-
-                printf("(%d, %d, %d) 0x%X\n", i, j, k, val);
-                pci_device_t* dev = (pci_device_t*)kmalloc(sizeof(pci_device_t));
-                dev->bus = i;
-                dev->dev = j;
-                dev->func = k;
-                dev->device_id = val >> 16;
-                dev->vendor_id = val & 0xFFFF;
-                val = pci_config_read_word(i, j, k, 0x8);
-                dev->base_class = val >> 24;
-                dev->sub_class = (val >> 16) & 0xFF;
-                dev->prog_interface = (val >> 8) & 0xFF;
-                // printf("bc: 0x%X, sc: 0x%X\n", dev->base_class, dev->sub_class);
-                // printf("PIf: 0x%X\n", dev->prog_interface);
-                val = pci_config_read_word(i, j, k, 0xC);
-                dev->type = (val >> 16) & 0xFF;
-                // printf("type: 0x%X\n", dev->type);
-                devices[device_idx++] = dev;
-            }
-        }
+    read_lock(&devices_lock);
+    for (size_t i = 0; i < device_count; i++) {
+        const pci_device_t* dev = devices[i];
+        printf("(%d, %d, %d) 0x%X\n", dev->bus, dev->dev, dev->func,
+            ((uint32_t)dev->device_id << 16) | dev->vendor_id);
+    }
+    read_unlock(&devices_lock);
+}
+
+uint8_t pci_find_capability(const pci_device_t* dev, uint8_t cap_id)
+{
+    if (!(pci_config_read_word(dev->bus, dev->dev, dev->func, PCI_REG_COMMAND) & PCI_STATUS_CAP_LIST)) return 0;
+    uint8_t ptr = pci_config_read_word(dev->bus, dev->dev, dev->func, PCI_REG_CAP_PTR) & 0xFC;
+    // Bounded in case a broken device links the list into a loop
+    for (size_t i = 0; ptr && i < 48; i++) {
+        uint32_t cap = pci_config_read_word(dev->bus, dev->dev, dev->func, ptr);
+        if ((cap & 0xFF) == cap_id) return ptr;
+        ptr = (cap >> 8) & 0xFC;
     }
+    return 0;
+}
+
+int pci_enable_msi(const pci_device_t* dev, uint8_t vector, uint8_t apic_id)
+{
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_MSI);
+    if (!cap) return -1;
+    // Message control sits in the upper half of the capability header
+    uint32_t control = pci_config_read_word(dev->bus, dev->dev, dev->func, cap);
+    bool is64 = control & (1 << 23);
+    pci_config_write_word(dev->bus, dev->dev, dev->func, cap + 4, 0xFEE00000 | ((uint32_t)apic_id << 12));
+    if (is64) {
+        pci_config_write_word(dev->bus, dev->dev, dev->func, cap + 8, 0);
+        pci_config_write_word(dev->bus, dev->dev, dev->func, cap + 12, vector);
+    } else {
+        pci_config_write_word(dev->bus, dev->dev, dev->func, cap + 8, vector);
+    }
+    // A single message, edge triggered, then enable
+    control &= ~(0x7 << 20);
+    control |= 1 << 16;
+    pci_config_write_word(dev->bus, dev->dev, dev->func, cap, control);
+    return 0;
+}
+
+int pci_enable_msix(const pci_device_t* dev, uint16_t entry, uint8_t vector, uint8_t apic_id)
+{
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_MSIX);
+    if (!cap) return -1;
+    uint32_t control = pci_config_read_word(dev->bus, dev->dev, dev->func, cap);
+    if (entry > ((control >> 16) & 0x7FF)) return -1;
+    // The table lives in one of the memory BARs, the low 3 bits of the offset pick which
+    uint32_t table = pci_config_read_word(dev->bus, dev->dev, dev->func, cap + 4);
+    uint32_t bar = pci_config_read_word(dev->bus, dev->dev, dev->func, PCI_REG_BAR0 + (table & 0x7) * 4);
+    if (bar & 1) return -1;
+    uintptr_t phys = (bar & ~0xF) + (table & ~0x7) + entry * 16;
+    volatile uint32_t* vec = ioremap(phys, 16, PAGE_FLAG_NOCACHE);
+    if (!vec) return -1;
+
+    // Enabled with the function masked so nothing fires while the entry is half written
+    control |= (1u << 31) | (1 << 30);
+    pci_config_write_word(dev->bus, dev->dev, dev->func, cap, control);
+    vec[0] = 0xFEE00000 | ((uint32_t)apic_id << 12);
+    vec[1] = 0;
+    vec[2] = vector;
+    vec[3] &= ~1u;
+    control &= ~(1 << 30);
+    pci_config_write_word(dev->bus, dev->dev, dev->func, cap, control);
+    iounmap((void*)vec);
+    return 0;
 }
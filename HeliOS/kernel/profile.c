@@ -0,0 +1,109 @@
+#include <kernel/ktime.h>
+#include <kernel/memory.h>
+#include <kernel/profile.h>
+#include <kernel/serial.h>
+#include <kernel/smp.h>
+#include <kernel/timer.h>
+#include <stdio.h>
+
+// Frames further apart than this can't be on the same kernel stack, the chain is garbage from there on
+#define MAX_FRAME_SIZE (64 * 1024)
+
+/* Samples of one CPU, only its own timer interrupt writes them */
+struct profile_ring {
+    struct profile_sample samples[PROFILE_RING];
+    uint32_t head; ///< Samples taken since the start, the ring holds the last PROFILE_RING of them
+    uint64_t next; ///< Cycle count the next sample is due at
+};
+
+volatile bool profile_enabled = false;
+static struct profile_ring rings[MAX_CPUS];
+static uint32_t period_ms;
+static uint64_t period_cycles;
+static bool walk_stack;
+
+/// Follows the saved ebp chain upwards from frame. Stops at anything that doesn't look like the next frame
+/// up the same stack or isn't mapped, so a function without a frame only cuts the chain short.
+static uint8_t walk(uintptr_t frame, uint32_t* stack)
+{
+    uint8_t depth = 0;
+    uintptr_t checked = 0;
+    while (depth < PROFILE_DEPTH && frame >= KERNEL_OFFSET && !(frame & 3)) {
+        // Both words of the frame sit on the same page, it's aligned
+        if (frame >> 12 != checked) {
+            if (!get_physaddr(frame)) break;
+            checked = frame >> 12;
+        }
+        const uint32_t* fp = (const uint32_t*)frame;
+        if (!fp[1]) break;
+        stack[depth++] = fp[1];
+        if (fp[0] <= frame || fp[0] - frame > MAX_FRAME_SIZE) break;
+        frame = fp[0];
+    }
+    return depth;
+}
+
+void profile_record(struct irq_regs* r)
+{
+    // User mode has no symbols in the kernel image
+    if ((r->cs & 3) != 0) return;
+    unsigned int cpu = cpu_id();
+    struct profile_ring* ring = rings + cpu;
+    uint64_t now = ktime_get_cycles();
+    if (now < ring->next) return;
+    ring->next = now + period_cycles;
+    struct profile_sample* s = ring->samples + (ring->head++ & (PROFILE_RING - 1));
+    s->eip = r->eip;
+    s->cpu = cpu;
+    s->depth = walk_stack ? walk(r->ebp, s->stack) : 0;
+}
+
+void profile_start(uint32_t period, bool callgraph)
+{
+    profile_stop();
+    if (!period) period = 1;
+    for (unsigned int i = 0; i < MAX_CPUS; i++) {
+        rings[i].head = 0;
+        rings[i].next = 0;
+    }
+    period_ms = period;
+    // Without a TSC the counter is ktime's nanoseconds
+    period_cycles = ktime_tsc_khz() ? (uint64_t)ktime_tsc_khz() * period : period * 1000000ull;
+    walk_stack = callgraph;
+    timer_sample_period(period);
+    __atomic_store_n(&profile_enabled, true, __ATOMIC_RELEASE);
+}
+
+void profile_stop()
+{
+    if (!profile_enabled) return;
+    __atomic_store_n(&profile_enabled, false, __ATOMIC_RELEASE);
+    timer_sample_period(0);
+}
+
+void profile_dump()
+{
+    profile_stop();
+    char line[16 + 9 * (PROFILE_DEPTH + 1)];
+    uint32_t total = 0;
+    uint32_t dropped = 0;
+    int n = snprintf(line, sizeof(line), "PROFILE begin period_ms=%u\n", period_ms);
+    serial_write(COM1_PORT, line, n);
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct profile_ring* ring = rings + cpu;
+        uint32_t kept = ring->head < PROFILE_RING ? ring->head : PROFILE_RING;
+        dropped += ring->head - kept;
+        for (uint32_t i = ring->head - kept; i != ring->head; i++) {
+            const struct profile_sample* s = ring->samples + (i & (PROFILE_RING - 1));
+            n = snprintf(line, sizeof(line), "S %u %X", s->cpu, s->eip);
+            for (uint8_t d = 0; d < s->depth; d++)
+                n += snprintf(line + n, sizeof(line) - n, " %X", s->stack[d]);
+            line[n++] = '\n';
+            serial_write(COM1_PORT, line, n);
+        }
+        total += kept;
+    }
+    n = snprintf(line, sizeof(line), "PROFILE end samples=%u dropped=%u\n", total, dropped);
+    serial_write(COM1_PORT, line, n);
+    serial_drain(COM1_PORT);
+}
@@ -0,0 +1,460 @@
+#include <kernel/asm.h>
+#include <kernel/fpu.h>
+#include <kernel/klog.h>
+#include <kernel/liballoc.h>
+#include <kernel/memory.h>
+#include <kernel/sched.h>
+#include <kernel/smp.h>
+#include <kernel/sys.h>
+#include <kernel/timer.h>
+#include <kernel/work.h>
+#include <stddef.h>
+
+#define EFLAGS_IF 0x200
+
+/// Threads waiting for one CPU. Each CPU only switches between its own threads, other CPUs take the lock to
+/// wake threads onto it or to steal from it while they have nothing to run.
+struct runqueue {
+    spinlock_t lock;
+    struct thread* head;
+    struct thread* tail;
+    volatile unsigned int count; ///< Threads on the queue, current isn't
+    struct thread* volatile current;
+    struct thread* idle; ///< NULL until the CPU takes part in scheduling
+    struct thread* prev; ///< Just switched away from, finish_switch is done with it
+    volatile bool need_resched;
+};
+
+static struct runqueue runqueues[MAX_CPUS];
+static struct thread boot_thread;
+static struct thread idle_threads[MAX_CPUS];
+static bool started = false;
+
+extern void switch_context(uint32_t* old_esp, uint32_t new_esp);
+
+static inline struct runqueue* this_rq() { return &runqueues[cpu_id()]; }
+
+static void enqueue(struct runqueue* rq, struct thread* t)
+{
+    t->next = NULL;
+    if (rq->tail)
+        rq->tail->next = t;
+    else
+        rq->head = t;
+    rq->tail = t;
+    rq->count++;
+}
+
+static struct thread* dequeue(struct runqueue* rq)
+{
+    struct thread* t = rq->head;
+    if (!t) return NULL;
+    rq->head = t->next;
+    if (!rq->head) rq->tail = NULL;
+    rq->count--;
+    t->next = NULL;
+    return t;
+}
+
+static inline bool stealable(struct runqueue* victim) { return victim->count && victim->current != victim->idle; }
+
+/// Takes the longest waiting thread from a CPU that is busy with another one, called with rq locked. Victims
+/// are only trylocked, so two CPUs stealing from each other can't deadlock.
+static struct thread* steal(struct runqueue* rq)
+{
+    unsigned int self = rq - runqueues;
+    for (unsigned int i = 1; i < MAX_CPUS; i++) {
+        struct runqueue* victim = &runqueues[(self + i) % MAX_CPUS];
+        if (!stealable(victim) || !spin_trylock(&victim->lock)) continue;
+        struct thread* t = stealable(victim) ? dequeue(victim) : NULL;
+        if (t) t->cpu = self;
+        spin_unlock(&victim->lock);
+        if (t) return t;
+    }
+    return NULL;
+}
+
+/// First thing on the stack of the thread schedule() switched to. Interrupts are still off.
+static void finish_switch()
+{
+    struct runqueue* rq = this_rq();
+    struct thread* prev = rq->prev;
+    rq->prev = NULL;
+    if (!prev) return;
+    bool dead = prev->state == THREAD_DEAD;
+    // From here another CPU may pick prev up, its stack is no longer in use
+    __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+    if (dead && prev->stack) {
+        fpu_release(prev);
+        kfree_frames(prev->stack, THREAD_STACK_FRAMES);
+        kfree(prev);
+    }
+}
+
+/// Lets rq's CPU know it has something new to run
+static void kick(struct runqueue* rq)
+{
+    unsigned int cpu = rq - runqueues;
+    if (cpu == cpu_id())
+        sched_kick();
+    else
+        smp_send_reschedule(cpu);
+}
+
+static void __schedule(bool preempt)
+{
+    uint32_t flags = irq_save();
+    struct runqueue* rq = this_rq();
+    spin_lock(&rq->lock);
+    rq->need_resched = false;
+    struct thread* prev = rq->current;
+    // Preempted on the way to blocking, keep it around as if woken so its wait can't get lost
+    if (preempt && prev->state == THREAD_BLOCKED) prev->state = THREAD_RUNNABLE;
+    if (prev != rq->idle && prev->state == THREAD_RUNNABLE) enqueue(rq, prev);
+    struct thread* next = dequeue(rq);
+    if (!next) next = steal(rq);
+    if (!next) next = rq->idle;
+    if (next == prev) {
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+        return;
+    }
+    rq->current = next;
+    rq->prev = prev;
+    spin_unlock(&rq->lock);
+
+    // A thread that was just woken or stolen may still be switching away on its old CPU
+    while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE))
+        asm volatile("pause");
+    next->on_cpu = true;
+    if (this_cpu()->fpu_live) fpu_switch_out(prev);
+    switch_context(&prev->esp, next->esp);
+    finish_switch();
+    irq_restore(flags);
+}
+
+void schedule()
+{
+    if (started) __schedule(false);
+}
+
+void sched_yield() { schedule(); }
+
+void sched_irq_exit()
+{
+    if (!started) return;
+    if (this_rq()->need_resched && preempt_count() == 0) __schedule(true);
+}
+
+bool sched_tick()
+{
+    if (!started) return false;
+    struct runqueue* rq = this_rq();
+    bool waiting = rq->count > 0;
+    if (waiting) rq->need_resched = true;
+    return waiting;
+}
+
+void sched_kick()
+{
+    struct runqueue* rq = this_rq();
+    // Idle CPUs switch right away, busy ones at the end of the slice
+    if (rq->current == rq->idle)
+        rq->need_resched = true;
+    else
+        timer_slice_start();
+}
+
+struct thread* thread_current()
+{
+    if (!started) return NULL;
+    uint32_t flags = irq_save();
+    struct thread* t = this_rq()->current;
+    irq_restore(flags);
+    return t;
+}
+
+bool sched_can_block()
+{
+    if (!started) return false;
+    uint32_t flags = irq_save();
+    struct runqueue* rq = this_rq();
+    bool can = rq->current != rq->idle && preempt_count() == 0 && (flags & EFLAGS_IF);
+    irq_restore(flags);
+    return can;
+}
+
+static void __attribute__((noreturn)) thread_start()
+{
+    finish_switch();
+    struct thread* self = thread_current();
+    asm volatile("sti");
+    self->entry(self->arg);
+    thread_exit();
+    __builtin_unreachable();
+}
+
+/// Gives t a stack laid out the way switch_context leaves a switched out thread, so it returns into
+/// thread_start the first time it is picked
+static int thread_setup(struct thread* t, const char* name, thread_fn_t entry, void* arg)
+{
+    t->stack = kalloc_frames(THREAD_STACK_FRAMES);
+    if (!t->stack) return -1;
+    uint32_t* sp = (uint32_t*)(t->stack + THREAD_STACK_FRAMES * PAGE_SIZE);
+    *--sp = 0; // thread_start's return address, it never returns
+    *--sp = (uintptr_t)thread_start;
+    *--sp = 0; // ebp
+    *--sp = 0; // ebx
+    *--sp = 0; // esi
+    *--sp = 0; // edi
+    *--sp = 0x2; // eflags with interrupts off, thread_start turns them on
+    t->esp = (uintptr_t)sp;
+    t->state = THREAD_RUNNABLE;
+    t->on_cpu = false;
+    t->next = NULL;
+    t->entry = entry;
+    t->arg = arg;
+    t->name = name;
+    t->fpu = NULL;
+    return 0;
+}
+
+struct thread* thread_create(const char* name, thread_fn_t entry, void* arg)
+{
+    if (!started) return NULL;
+    struct thread* t = kmalloc(sizeof(struct thread));
+    if (!t) return NULL;
+    if (thread_setup(t, name, entry, arg) != 0) {
+        kfree(t);
+        return NULL;
+    }
+
+    // Least loaded CPU, a busy one counts its current thread too
+    uint32_t flags = irq_save();
+    struct runqueue* best = NULL;
+    unsigned int best_load = 0;
+    for (unsigned int i = 0; i < MAX_CPUS; i++) {
+        struct runqueue* rq = &runqueues[i];
+        if (!rq->idle) continue;
+        unsigned int load = rq->count + (rq->current != rq->idle);
+        if (!best || load < best_load) {
+            best = rq;
+            best_load = load;
+        }
+    }
+    spin_lock(&best->lock);
+    t->cpu = best - runqueues;
+    enqueue(best, t);
+    kick(best);
+    spin_unlock(&best->lock);
+    irq_restore(flags);
+    return t;
+}
+
+void thread_exit()
+{
+    if (!started) return;
+    asm volatile("cli");
+    thread_current()->state = THREAD_DEAD;
+    schedule();
+    panic("thread_exit: dead thread was scheduled again");
+}
+
+void thread_wake(struct thread* t)
+{
+    if (!t) return;
+    uint32_t flags = irq_save();
+    // t->cpu only changes under the lock of the queue it is moving away from
+    struct runqueue* rq;
+    while (true) {
+        unsigned int cpu = __atomic_load_n(&t->cpu, __ATOMIC_RELAXED);
+        rq = &runqueues[cpu];
+        spin_lock(&rq->lock);
+        if (t->cpu == cpu) break;
+        spin_unlock(&rq->lock);
+    }
+    if (t->state == THREAD_BLOCKED) {
+        t->state = THREAD_RUNNABLE;
+        // Still on its way into schedule(), which now sees it runnable and keeps it going
+        if (rq->current != t) {
+            enqueue(rq, t);
+            kick(rq);
+        }
+    }
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+}
+
+/// What a CPU runs while its queue is empty. Picks up deferred work and idle chores, steals from busy CPUs
+/// and otherwise halts until an interrupt brings something new.
+static void __attribute__((noreturn)) idle_loop()
+{
+    struct runqueue* rq = this_rq();
+    bool boot_cpu = rq == &runqueues[0];
+    while (true) {
+        work_run();
+        if (boot_cpu) {
+            // Neither of these takes locks yet, keep them to one CPU
+            pmm_zero_idle();
+            klog_flush();
+        }
+        // Check and halt with interrupts off so a wakeup can't slip in between, sti only takes effect after hlt
+        asm volatile("cli");
+        bool runnable = rq->need_resched || rq->count;
+        for (unsigned int i = 0; i < MAX_CPUS && !runnable; i++)
+            runnable = stealable(&runqueues[i]);
+        if (runnable) {
+            schedule();
+            asm volatile("sti");
+        } else {
+            asm volatile("sti\n\thlt");
+        }
+    }
+}
+
+static void idle_main(void* arg)
+{
+    (void)arg;
+    idle_loop();
+}
+
+void sched_init()
+{
+    struct runqueue* rq = &runqueues[0];
+    struct thread* idle = &idle_threads[0];
+    if (thread_setup(idle, "idle", idle_main, NULL) != 0) panic("sched_init: no memory for the idle thread");
+    idle->cpu = 0;
+
+    // Whatever called us carries on as the first thread, on the boot stack
+    boot_thread.state = THREAD_RUNNABLE;
+    boot_thread.on_cpu = true;
+    boot_thread.cpu = 0;
+    boot_thread.name = "main";
+    rq->current = &boot_thread;
+    rq->idle = idle;
+    started = true;
+}
+
+void sched_start_ap()
+{
+    unsigned int cpu = cpu_id();
+    struct runqueue* rq = &runqueues[cpu];
+    struct thread* idle = &idle_threads[cpu];
+    idle->state = THREAD_RUNNABLE;
+    idle->on_cpu = true;
+    idle->cpu = cpu;
+    idle->name = "idle";
+
+    uint32_t flags = spin_lock_irqsave(&rq->lock);
+    rq->current = idle;
+    rq->idle = idle;
+    spin_unlock_irqrestore(&rq->lock, flags);
+    asm volatile("sti");
+    idle_loop();
+}
+
+void wait_queue_init(struct wait_queue* wq)
+{
+    spin_lock_init(&wq->lock);
+    wq->head = NULL;
+}
+
+void wake_up(struct wait_queue* wq)
+{
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    for (struct wait_entry* e = wq->head; e; e = e->next)
+        thread_wake(e->thread);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+static void wait_timeout_expired(void* data)
+{
+    struct wait_state* ws = data;
+    struct thread* t = ws->entry.thread;
+    ws->expired = true;
+    thread_wake(t);
+}
+
+/// Marks the caller blocked, it keeps running until it calls schedule(). The store has to be visible before
+/// the condition is read, or a wakeup in between would find the thread still runnable and be lost.
+static inline void prepare_block(struct thread* t) { __atomic_store_n(&t->state, THREAD_BLOCKED, __ATOMIC_SEQ_CST); }
+
+void wait_begin(struct wait_state* ws, struct wait_queue* wq, uint32_t millis)
+{
+    ws->entry.thread = thread_current();
+    ws->entry.next = NULL;
+    ws->wq = wq;
+    ws->expired = false;
+    ws->timed = millis != 0;
+    ws->block = sched_can_block();
+    if (ws->timed) {
+        timer_setup(&ws->timer, wait_timeout_expired, ws);
+        timer_add(&ws->timer, millis);
+    }
+    if (!ws->block) {
+        ws->flags = irq_save();
+        return;
+    }
+    if (wq) {
+        uint32_t flags = spin_lock_irqsave(&wq->lock);
+        ws->entry.next = wq->head;
+        wq->head = &ws->entry;
+        spin_unlock_irqrestore(&wq->lock, flags);
+    }
+    prepare_block(ws->entry.thread);
+}
+
+bool wait_sleep(struct wait_state* ws)
+{
+    if (ws->expired) return false;
+    if (ws->block) {
+        schedule();
+        prepare_block(ws->entry.thread);
+    } else {
+        asm volatile("sti\n\thlt\n\tcli");
+    }
+    return true;
+}
+
+void wait_end(struct wait_state* ws)
+{
+    if (ws->block) {
+        ws->entry.thread->state = THREAD_RUNNABLE;
+        if (ws->wq) {
+            uint32_t flags = spin_lock_irqsave(&ws->wq->lock);
+            struct wait_entry** pp = &ws->wq->head;
+            while (*pp && *pp != &ws->entry)
+                pp = &(*pp)->next;
+            if (*pp) *pp = ws->entry.next;
+            spin_unlock_irqrestore(&ws->wq->lock, flags);
+        }
+    } else {
+        irq_restore(ws->flags);
+    }
+    if (ws->timed) timer_del(&ws->timer);
+}
+
+void mutex_init(struct mutex* m)
+{
+    m->locked = false;
+    wait_queue_init(&m->wait);
+}
+
+bool mutex_trylock(struct mutex* m) { return !__atomic_exchange_n(&m->locked, true, __ATOMIC_ACQUIRE); }
+
+void mutex_lock(struct mutex* m)
+{
+    if (sched_can_block()) {
+        wait_event(&m->wait, mutex_trylock(m));
+        return;
+    }
+    // Nothing wakes a halted CPU when the holder lets go, spin like a spinlock would
+    while (!mutex_trylock(m))
+        asm volatile("pause");
+}
+
+void mutex_unlock(struct mutex* m)
+{
+    __atomic_store_n(&m->locked, false, __ATOMIC_RELEASE);
+    wake_up(&m->wait);
+}
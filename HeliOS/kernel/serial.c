@@ -0,0 +1,177 @@
+#include <kernel/asm.h>
+#include <kernel/interrupts.h>
+#include <kernel/serial.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// Register offsets from the base port
+#define UART_DATA 0 // RBR/THR, divisor low with DLAB
+#define UART_IER 1 // Interrupt enable, divisor high with DLAB
+#define UART_IIR 2 // Interrupt identification on read, FIFO control on write
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_MSR 6
+
+#define IER_RX 0x01
+#define IER_THRE 0x02
+#define LCR_8N1 0x03
+#define LCR_DLAB 0x80
+#define FCR_ENABLE_CLEAR 0xC7 // Enable and clear both FIFOs, RX trigger at 14 bytes
+#define MCR_DTR_RTS_OUT2 0x0B // OUT2 gates the IRQ line on PC UARTs
+#define MCR_LOOPBACK 0x1E
+#define LSR_THRE 0x20
+#define LSR_TEMT 0x40
+#define IIR_NONE 0x01
+#define IIR_FIFO 0xC0
+
+#define UART_CLOCK 115200
+#define FIFO_SIZE 16
+
+struct serial_port {
+    uint16_t base;
+    uint8_t irq;
+    bool present;
+    uint8_t fifo; ///< Bytes we can push per THR empty interrupt, 1 on a plain 8250/16450
+    char ring[SERIAL_TX_RING_SIZE];
+    volatile uint32_t head; ///< Next free slot, written by serial_write
+    volatile uint32_t tail; ///< Next byte to send, written by the IRQ handler
+};
+
+static struct serial_port ports[] = {
+    { .base = COM1_PORT, .irq = 4 },
+    { .base = COM2_PORT, .irq = 3 },
+};
+
+static struct serial_port* find_port(uint16_t base)
+{
+    for (size_t i = 0; i < sizeof(ports) / sizeof(ports[0]); i++)
+        if (ports[i].base == base) return &ports[i];
+    return NULL;
+}
+
+/// Moves as much of the ring into the FIFO as fits. Interrupts have to be off.
+static void tx_kick(struct serial_port* p)
+{
+    // A busy THR still gets IER_THRE below, its interrupt comes once the FIFO drains
+    bool ready = inb(p->base + UART_LSR) & LSR_THRE;
+    for (int i = 0; ready && i < p->fifo && p->tail != p->head; i++) {
+        outb(p->base + UART_DATA, p->ring[p->tail & (SERIAL_TX_RING_SIZE - 1)]);
+        p->tail++;
+    }
+    // Only ask for THR empty interrupts while there's something left to send
+    outb(p->base + UART_IER, IER_RX | (p->tail != p->head ? IER_THRE : 0));
+}
+
+static void serial_handle(struct serial_port* p)
+{
+    uint8_t iir;
+    while (!((iir = inb(p->base + UART_IIR)) & IIR_NONE)) {
+        switch ((iir >> 1) & 0x7) {
+        case 0: // Modem status
+            inb(p->base + UART_MSR);
+            break;
+        case 1: // THR empty
+            tx_kick(p);
+            break;
+        case 2: // Received data, nothing reads the serial line yet
+        case 6: // Character timeout
+            while (inb(p->base + UART_LSR) & 0x01)
+                inb(p->base + UART_DATA);
+            break;
+        case 3: // Line status
+            inb(p->base + UART_LSR);
+            break;
+        }
+    }
+}
+
+static void com1_handler(struct irq_regs* r)
+{
+    (void)r;
+    serial_handle(&ports[0]);
+}
+
+static void com2_handler(struct irq_regs* r)
+{
+    (void)r;
+    serial_handle(&ports[1]);
+}
+
+int serial_init(uint16_t port, uint32_t baud)
+{
+    struct serial_port* p = find_port(port);
+    if (!p || !baud || UART_CLOCK % baud) return -1;
+    uint16_t divisor = UART_CLOCK / baud;
+
+    outb(port + UART_IER, 0x00);
+    outb(port + UART_LCR, LCR_DLAB);
+    outb(port + UART_DATA, divisor & 0xFF);
+    outb(port + UART_IER, divisor >> 8);
+    outb(port + UART_LCR, LCR_8N1);
+    outb(port + UART_IIR, FCR_ENABLE_CLEAR);
+
+    // Make sure something is actually there before we wait on it
+    outb(port + UART_MCR, MCR_LOOPBACK);
+    outb(port + UART_DATA, 0xAE);
+    if (inb(port + UART_DATA) != 0xAE) return -1;
+
+    p->fifo = (inb(port + UART_IIR) & IIR_FIFO) == IIR_FIFO ? FIFO_SIZE : 1;
+    p->head = p->tail = 0;
+    p->present = true;
+    irq_install_handler(p->irq, p == &ports[0] ? com1_handler : com2_handler);
+    outb(port + UART_MCR, MCR_DTR_RTS_OUT2);
+    outb(port + UART_IER, IER_RX);
+    return 0;
+}
+
+void serial_write(uint16_t port, const char* data, size_t len)
+{
+    struct serial_port* p = find_port(port);
+    if (!p || !p->present) return;
+
+    while (len) {
+        uint32_t flags = irq_save();
+        while (len && p->head - p->tail < SERIAL_TX_RING_SIZE) {
+            p->ring[p->head & (SERIAL_TX_RING_SIZE - 1)] = *data++;
+            p->head++;
+            len--;
+        }
+        tx_kick(p);
+        irq_restore(flags);
+        // Ring is full, let the UART catch up. Poll as well in case we were called with interrupts off.
+        if (len) {
+            flags = irq_save();
+            while (!(inb(p->base + UART_LSR) & LSR_THRE))
+                ;
+            tx_kick(p);
+            irq_restore(flags);
+        }
+    }
+}
+
+void serial_drain(uint16_t port)
+{
+    struct serial_port* p = find_port(port);
+    if (!p || !p->present) return;
+    while (true) {
+        uint32_t flags = irq_save();
+        tx_kick(p);
+        bool done = p->tail == p->head && (inb(p->base + UART_LSR) & LSR_TEMT);
+        irq_restore(flags);
+        if (done) return;
+    }
+}
+
+void serial_console(const char* data, size_t len)
+{
+    // The terminal on the other end wants CRLF
+    const char* start = data;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != '\n') continue;
+        serial_write(COM1_PORT, start, data + i - start);
+        serial_write(COM1_PORT, "\r\n", 2);
+        start = data + i + 1;
+    }
+    serial_write(COM1_PORT, start, data + len - start);
+}
@@ -0,0 +1,211 @@
+#include <kernel/memory.h>
+#include <kernel/slab.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// Marks the end of a slab's free list
+#define SLAB_END 0xFFFF
+// Largest slab we build, has to stay a power of two so slabs stay aligned to their size
+#define SLAB_MAX_FRAMES 8
+// Slabs grow until at least this many objects fit
+#define SLAB_MIN_OBJECTS 8
+// Empty slabs a cache keeps around before handing frames back to the PMM
+#define SLAB_SPARE_EMPTY 1
+
+#define ALIGN_UP(value, align) (((value) + (align) - 1) & ~((align) - 1))
+
+// The cache that kmem_cache_t's themselves are allocated from
+static kmem_cache_t cache_cache;
+static bool cache_cache_ready = false;
+static spinlock_t cache_cache_lock = SPINLOCK_INIT;
+
+static void list_push(kmem_slab_t** list, kmem_slab_t* slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+static void list_remove(kmem_slab_t** list, kmem_slab_t* slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+}
+
+/// Bytes taken by the slab header and free list for a given object count
+static inline size_t header_size(const kmem_cache_t* cache, size_t objs)
+{
+    return ALIGN_UP(sizeof(kmem_slab_t) + objs * sizeof(uint16_t), cache->align);
+}
+
+static void cache_setup(kmem_cache_t* cache, const char* name, size_t size, size_t align, kmem_ctor ctor)
+{
+    if (align < sizeof(void*)) align = sizeof(void*);
+    memset(cache, 0, sizeof(kmem_cache_t));
+    cache->name = name;
+    cache->align = align;
+    cache->obj_size = ALIGN_UP(size, align);
+    cache->ctor = ctor;
+    spin_lock_init(&cache->lock);
+
+    // Grow the slab until enough objects fit to make the header worth it
+    size_t frames = 1;
+    size_t objs = 0;
+    while (true) {
+        size_t bytes = frames * PAGE_SIZE;
+        objs = (bytes - sizeof(kmem_slab_t)) / (cache->obj_size + sizeof(uint16_t));
+        while (objs > 0 && header_size(cache, objs) + objs * cache->obj_size > bytes)
+            objs--;
+        if (objs >= SLAB_MIN_OBJECTS || frames == SLAB_MAX_FRAMES) break;
+        frames *= 2;
+    }
+    if (objs >= SLAB_END) objs = SLAB_END - 1;
+    cache->slab_frames = frames;
+    cache->objs_per_slab = objs;
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor ctor)
+{
+    if (size == 0 || (align & (align - 1))) return NULL;
+    uint32_t flags = spin_lock_irqsave(&cache_cache_lock);
+    if (!cache_cache_ready) {
+        cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), 0, NULL);
+        cache_cache_ready = true;
+    }
+    spin_unlock_irqrestore(&cache_cache_lock, flags);
+
+    kmem_cache_t* cache = kmem_cache_alloc(&cache_cache);
+    if (!cache) return NULL;
+    cache_setup(cache, name, size, align, ctor);
+    if (cache->objs_per_slab == 0) {
+        printf("kmem_cache_create: %s objects of %d bytes don't fit in a slab\n", name, size);
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+    return cache;
+}
+
+/// Grabs frames for a new slab, threads its free list and runs the constructor on every object
+static kmem_slab_t* slab_create(kmem_cache_t* cache)
+{
+    kmem_slab_t* slab = (kmem_slab_t*)kalloc_frames(cache->slab_frames);
+    if (!slab) return NULL;
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->objects = (void*)((uintptr_t)slab + header_size(cache, cache->objs_per_slab));
+    slab->first_free = 0;
+    for (uint16_t i = 0; i < cache->objs_per_slab; i++) {
+        slab->free_list[i] = i + 1;
+        if (cache->ctor) cache->ctor((void*)((uintptr_t)slab->objects + i * cache->obj_size));
+    }
+    slab->free_list[cache->objs_per_slab - 1] = SLAB_END;
+    cache->num_slabs++;
+    return slab;
+}
+
+static void slab_destroy(kmem_cache_t* cache, kmem_slab_t* slab)
+{
+    cache->num_slabs--;
+    kfree_frames((uintptr_t)slab, cache->slab_frames);
+}
+
+static void destroy_list(kmem_cache_t* cache, kmem_slab_t* slab)
+{
+    while (slab) {
+        kmem_slab_t* next = slab->next;
+        slab_destroy(cache, slab);
+        slab = next;
+    }
+}
+
+void kmem_cache_destroy(kmem_cache_t* cache)
+{
+    if (!cache) return;
+    if (cache->num_active) printf("kmem_cache_destroy: %s still has %d objects\n", cache->name, cache->num_active);
+    destroy_list(cache, cache->empty);
+    destroy_list(cache, cache->partial);
+    destroy_list(cache, cache->full);
+    kmem_cache_free(&cache_cache, cache);
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache)
+{
+    uint32_t flags = spin_lock_irqsave(&cache->lock);
+    kmem_slab_t* slab = cache->partial;
+    if (!slab) {
+        // Reuse an empty slab before asking the PMM for more
+        slab = cache->empty;
+        if (slab) {
+            list_remove(&cache->empty, slab);
+            cache->num_empty--;
+        } else {
+            slab = slab_create(cache);
+            if (!slab) {
+                spin_unlock_irqrestore(&cache->lock, flags);
+                return NULL;
+            }
+        }
+        list_push(&cache->partial, slab);
+    }
+
+    uint16_t idx = slab->first_free;
+    slab->first_free = slab->free_list[idx];
+    slab->inuse++;
+    cache->num_active++;
+    if (slab->first_free == SLAB_END) {
+        list_remove(&cache->partial, slab);
+        list_push(&cache->full, slab);
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return (void*)((uintptr_t)slab->objects + idx * cache->obj_size);
+}
+
+void* kmem_cache_zalloc(kmem_cache_t* cache)
+{
+    void* obj = kmem_cache_alloc(cache);
+    if (obj) memset(obj, 0, cache->obj_size);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* obj)
+{
+    if (!obj) return;
+    kmem_slab_t* slab = (kmem_slab_t*)((uintptr_t)obj & ~(cache->slab_frames * PAGE_SIZE - 1));
+    if (slab->cache != cache) {
+        printf("kmem_cache_free: 0x%X does not belong to %s\n", obj, cache->name);
+        return;
+    }
+    uintptr_t offset = (uintptr_t)obj - (uintptr_t)slab->objects;
+    if (offset % cache->obj_size || offset / cache->obj_size >= cache->objs_per_slab) {
+        printf("kmem_cache_free: 0x%X is not an object of %s\n", obj, cache->name);
+        return;
+    }
+
+    uint16_t idx = offset / cache->obj_size;
+    uint32_t flags = spin_lock_irqsave(&cache->lock);
+    bool was_full = slab->first_free == SLAB_END;
+    slab->free_list[idx] = slab->first_free;
+    slab->first_free = idx;
+    slab->inuse--;
+    cache->num_active--;
+
+    if (was_full) {
+        list_remove(&cache->full, slab);
+        list_push(&cache->partial, slab);
+    }
+    if (slab->inuse == 0) {
+        list_remove(&cache->partial, slab);
+        if (cache->num_empty >= SLAB_SPARE_EMPTY) {
+            slab_destroy(cache, slab);
+        } else {
+            list_push(&cache->empty, slab);
+            cache->num_empty++;
+        }
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
@@ -0,0 +1,229 @@
+#include <kernel/acpi.h>
+#include <kernel/apic.h>
+#include <kernel/asm.h>
+#include <kernel/fpu.h>
+#include <kernel/interrupts.h>
+#include <kernel/memory.h>
+#include <kernel/sched.h>
+#include <kernel/smp.h>
+#include <kernel/sys.h>
+#include <kernel/timer.h>
+#include <stdio.h>
+#include <string.h>
+
+// How long an AP gets to report in after its SIPIs
+#define AP_START_TIMEOUT_MS 100
+
+struct cpu cpus[MAX_CPUS];
+static volatile unsigned int cpu_count = 1;
+
+// Filled in for each AP before it is started, layout matches trampoline.asm
+struct trampoline_params {
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t stack;
+    uint32_t entry;
+} __attribute__((packed));
+
+extern char trampoline_start[];
+extern char trampoline_end[];
+extern char trampoline_params[];
+extern void idt_load();
+
+// The AP being started, only one comes up at a time
+static struct cpu* volatile booting_cpu;
+
+// Current TLB shootdown, serialized by shootdown_lock
+static spinlock_t shootdown_lock = SPINLOCK_INIT;
+static const uintptr_t* volatile shootdown_pages;
+static volatile size_t shootdown_count;
+static volatile uint32_t shootdown_pending;
+volatile uint32_t tlb_shootdown_mask = 0;
+
+unsigned int smp_cpu_count() { return cpu_count; }
+
+void smp_send_ipi(unsigned int cpu, uint8_t vector)
+{
+    uint32_t flags = irq_save();
+    lapic_send_ipi(cpus[cpu].apic_id, LAPIC_ICR_FIXED | vector);
+    irq_restore(flags);
+}
+
+static void reschedule_handler(struct irq_regs* r)
+{
+    (void)r;
+    sched_kick();
+}
+
+void smp_tlb_poll()
+{
+    uint32_t bit = 1u << this_cpu()->id;
+    // Whichever comes first, the IPI or a lock spinner, does the work and the other finds nothing
+    if (!(__atomic_fetch_and(&tlb_shootdown_mask, ~bit, __ATOMIC_ACQUIRE) & bit)) return;
+    if (shootdown_count == 0) {
+        flush_tlb_all();
+    } else {
+        for (size_t i = 0; i < shootdown_count; i++)
+            invalidate(shootdown_pages[i]);
+    }
+    __atomic_fetch_sub(&shootdown_pending, 1, __ATOMIC_RELEASE);
+}
+
+static void tlb_handler(struct irq_regs* r)
+{
+    (void)r;
+    smp_tlb_poll();
+}
+
+static void call_handler(struct irq_regs* r)
+{
+    (void)r;
+    struct cpu* cpu = this_cpu();
+    smp_call_fn fn = cpu->call_fn;
+    if (!fn) return;
+    cpu->call_fn = NULL;
+    fn(cpu->call_arg);
+    __atomic_store_n(&cpu->call_done, true, __ATOMIC_RELEASE);
+}
+
+void smp_send_reschedule(unsigned int cpu)
+{
+    if (cpu < MAX_CPUS && cpus[cpu].online) smp_send_ipi(cpu, IPI_RESCHEDULE_VECTOR);
+}
+
+void smp_tlb_shootdown(const uintptr_t* pages, size_t count)
+{
+    if (cpu_count < 2) return;
+    spin_lock(&shootdown_lock);
+    unsigned int self = this_cpu()->id;
+    shootdown_pages = pages;
+    shootdown_count = count;
+    uint32_t targets = 0;
+    uint32_t pending = 0;
+    for (unsigned int i = 0; i < MAX_CPUS; i++) {
+        if (i == self || !cpus[i].online) continue;
+        targets |= 1u << i;
+        pending++;
+    }
+    shootdown_pending = pending;
+    __atomic_store_n(&tlb_shootdown_mask, targets, __ATOMIC_RELEASE);
+    for (unsigned int i = 0; i < MAX_CPUS; i++) {
+        if (targets & (1u << i)) smp_send_ipi(i, IPI_TLB_VECTOR);
+    }
+    while (__atomic_load_n(&shootdown_pending, __ATOMIC_ACQUIRE))
+        asm volatile("pause");
+    spin_unlock(&shootdown_lock);
+}
+
+int smp_call_function(unsigned int cpu, smp_call_fn fn, void* arg, bool wait)
+{
+    if (cpu >= MAX_CPUS || !cpus[cpu].online) return -1;
+    if (cpu == this_cpu()->id) {
+        uint32_t flags = irq_save();
+        fn(arg);
+        irq_restore(flags);
+        return 0;
+    }
+    struct cpu* target = &cpus[cpu];
+    spin_lock(&target->call_lock);
+    target->call_arg = arg;
+    target->call_done = false;
+    __atomic_store_n(&target->call_fn, fn, __ATOMIC_RELEASE);
+    smp_send_ipi(cpu, IPI_CALL_VECTOR);
+    // The mailbox is only free again once fn has been picked up and run
+    while (!__atomic_load_n(&target->call_done, __ATOMIC_ACQUIRE)) {
+        if (!wait && !target->call_fn) break;
+        cpu_relax();
+    }
+    spin_unlock(&target->call_lock);
+    return 0;
+}
+
+/// Where the trampoline lands once paging is on, on the AP's own stack
+static void __attribute__((noreturn)) ap_main()
+{
+    struct cpu* cpu = booting_cpu;
+    gdt_init_cpu(cpu);
+    idt_load();
+    lapic_enable_local();
+    fpu_init_cpu();
+    __atomic_fetch_add(&cpu_count, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+    timer_init_ap();
+    // This flow becomes the CPU's idle thread
+    sched_start_ap();
+}
+
+/// INIT, then two SIPIs as the MP spec has it. Returns true once the AP reports in.
+static bool start_ap(struct cpu* cpu)
+{
+    uint32_t flags = irq_save();
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    pit_wait(10);
+    for (int i = 0; i < 2 && !cpu->online; i++) {
+        lapic_send_ipi(cpu->apic_id, LAPIC_ICR_STARTUP | (SMP_TRAMPOLINE >> 12));
+        pit_wait(1);
+    }
+    irq_restore(flags);
+    for (int waited = 0; waited < AP_START_TIMEOUT_MS && !__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE); waited++)
+        pit_wait(1);
+    return cpu->online;
+}
+
+void smp_init()
+{
+    const struct acpi_madt_info* madt = acpi_madt();
+    if (!madt || madt->cpu_count < 2 || !lapic_present()) {
+        puts("SMP: only the boot CPU");
+        return;
+    }
+
+    cpus[0].apic_id = lapic_id();
+    cpus[0].online = true;
+    irq_install_handler(IPI_RESCHEDULE_VECTOR - IRQ_VECTOR_BASE, reschedule_handler);
+    irq_install_handler(IPI_TLB_VECTOR - IRQ_VECTOR_BASE, tlb_handler);
+    irq_install_handler(IPI_CALL_VECTOR - IRQ_VECTOR_BASE, call_handler);
+
+    uint8_t* trampoline = (uint8_t*)(SMP_TRAMPOLINE + KERNEL_OFFSET);
+    memcpy(trampoline, trampoline_start, trampoline_end - trampoline_start);
+    struct trampoline_params* params = (struct trampoline_params*)(trampoline + (trampoline_params - trampoline_start));
+    params->cr0 = read_cr0();
+    params->cr3 = read_cr3();
+    params->cr4 = read_cr4();
+    params->entry = (uintptr_t)ap_main;
+
+    // The trampoline turns paging on while running from low memory, borrow the direct map's first 4 MiB
+    uintptr_t saved_pde = kernel_page_dir->physical_tables[0];
+    kernel_page_dir->physical_tables[0] = kernel_page_dir->physical_tables[KERNEL_PD_START];
+
+    unsigned int next = 1;
+    for (int i = 0; i < madt->cpu_count && next < MAX_CPUS; i++) {
+        uint8_t apic_id = madt->cpu_apic_ids[i];
+        if (apic_id == cpus[0].apic_id) continue;
+        uintptr_t stack = kalloc_frames(SMP_STACK_FRAMES);
+        if (!stack) {
+            puts("SMP: out of memory for AP stacks");
+            break;
+        }
+        struct cpu* cpu = &cpus[next];
+        cpu->self = cpu;
+        cpu->id = next;
+        cpu->apic_id = apic_id;
+        cpu->stack_top = stack + SMP_STACK_FRAMES * PAGE_SIZE;
+        spin_lock_init(&cpu->call_lock);
+        params->stack = cpu->stack_top;
+        booting_cpu = cpu;
+        if (start_ap(cpu)) {
+            next++;
+        } else {
+            printf("SMP: CPU with APIC ID %d didn't start\n", apic_id);
+            kfree_frames(stack, SMP_STACK_FRAMES);
+        }
+    }
+
+    kernel_page_dir->physical_tables[0] = saved_pde;
+    flush_tlb_all();
+    smp_tlb_shootdown(NULL, 0);
+    printf("SMP: %d CPUs online\n", cpu_count);
+}
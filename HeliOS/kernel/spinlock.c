@@ -0,0 +1,14 @@
+#include <kernel/spinlock.h>
+#include <stdio.h>
+
+void lock_stats_print(const char* name, const struct lock_stats* stats)
+{
+    if (!stats) {
+        printf("%s: lock stats not built in, define LOCK_STATS\n", name);
+        return;
+    }
+    uint32_t acquired = stats->acquired;
+    uint32_t contended = stats->contended;
+    printf("%s: %d acquired, %d contended (%d%%)\n", name, acquired, contended,
+        acquired ? (uint32_t)((uint64_t)contended * 100 / acquired) : 0);
+}
@@ -1,17 +1,75 @@
+#include <kernel/apic.h>
 #include <kernel/asm.h>
 #include <kernel/interrupts.h>
+#include <kernel/klog.h>
+#include <kernel/ktime.h>
+#include <kernel/memory.h>
+#include <kernel/profile.h>
+#include <kernel/sched.h>
+#include <kernel/seqlock.h>
+#include <kernel/smp.h>
+#include <kernel/spinlock.h>
 #include <kernel/sys.h>
+#include <kernel/timer.h>
+#include <kernel/work.h>
+#include <stdbool.h>
 #include <stdio.h>
 
 const int PIT_CLK = 1193180;
 
+#define NS_PER_SEC 1000000000ull
+// How long the LAPIC timer is counted against PIT channel 2 at boot
+#define CALIBRATE_MS 10
+// Shortest one-shot we program, anything closer just fires right away
+#define MIN_EVENT_NS 1000
+
 /* This will keep track of how many ticks that the system
  *  has been running for */
 unsigned int ticks = 0;
 unsigned long ticker = 0;
-uint32_t countdown = 0;
 static uint32_t phase = 18;
 
+// Tickless mode: the LAPIC timer is only armed for the next deadline instead of firing every millisecond.
+// Time is the start of the current one-shot plus however much of it has counted down.
+static bool tickless = false;
+static uint64_t lapic_hz; // LAPIC timer counts per second at divide by 16
+static uint64_t event_base_ns; // Time the current one-shot was started
+static uint32_t event_count; // What it was started with
+static uint64_t next_deadline = UINT64_MAX;
+static volatile uint32_t events = 0; // LAPIC timer interrupts taken, for timer_poll
+static uint64_t slice_end = UINT64_MAX; // When the running thread's slice is up, only while others wait
+// While the profiler runs: how often the boot CPU's clock event has to come around at least, and the period of
+// the APs' ticks. Those are only shortened, sched_tick still runs once a slice.
+static uint64_t sample_ns = 0;
+static volatile uint32_t ap_tick_ms = SCHED_SLICE_MS;
+static uint32_t ap_elapsed[MAX_CPUS];
+
+// Only the boot CPU runs the clock event and the wheel. The other CPUs tell time from its last event plus
+// the TSC cycles since, and hand their deadlines over with an IPI.
+static seqlock_t clock_lock = SEQLOCK_INIT;
+static uint64_t clock_ns;
+static uint64_t clock_cycles;
+static spinlock_t remote_lock = SPINLOCK_INIT;
+static uint64_t remote_deadline = UINT64_MAX;
+
+// Timer wheel: WHEEL_LEVELS levels of WHEEL_SIZE slots at 1 ms resolution. Level 0 holds timers due within
+// WHEEL_SIZE ms of wheel_clock, one slot per millisecond, each level above covers WHEEL_SIZE times more with
+// coarser slots. Every time level 0 wraps, the next slot of the level above is cascaded down, so insertion,
+// removal and expiry are all O(1) without ever walking timers that aren't due.
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+// Further out than the top level reaches, such timers sit in its last slot and get re-sorted when it cascades
+#define WHEEL_MAX_DELTA ((1u << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+static struct timer* wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint32_t wheel_clock = 0; // Next millisecond to be processed, everything before has expired
+static uint32_t wheel_pending = 0;
+// Any CPU adds and removes timers, callbacks run with it dropped
+static spinlock_t wheel_lock = SPINLOCK_INIT;
+static struct timer* volatile running_timer = NULL;
+
 void timer_phase(int hz)
 {
     phase = hz;
@@ -21,6 +79,151 @@ void timer_phase(int hz)
     outb(0x40, (divisor >> 8) & 0xFF); /* Set high byte of divisor */
 }
 
+void pit_wait(uint32_t ms)
+{
+    uint16_t count = PIT_CLK / 1000 * ms;
+    // Gate channel 2 on with the speaker disconnected
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+    outb(0x43, 0xB0); // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+    outb(0x42, count & 0xFF);
+    outb(0x42, count >> 8);
+    // Restart the gate so counting starts now, bit 5 goes high at terminal count
+    uint8_t gate = inb(0x61);
+    outb(0x61, gate & ~0x01);
+    outb(0x61, gate | 0x01);
+    while (!(inb(0x61) & 0x20)) { }
+}
+
+static inline uint64_t counts_to_ns(uint64_t counts) { return counts * NS_PER_SEC / lapic_hz; }
+
+/// Current time in tickless mode, interrupts have to be off. An invariant TSC is exact, otherwise
+/// it's pieced together from the LAPIC one-shots.
+static uint64_t lapic_now()
+{
+    if (ktime_tsc_stable()) return ktime_get_ns();
+    return event_base_ns + counts_to_ns(event_count - lapic_timer_current());
+}
+
+/// Time on a CPU other than the boot CPU in tickless mode
+static uint64_t remote_now()
+{
+    uint32_t seq;
+    uint64_t ns, cycles;
+    do {
+        seq = read_seqbegin(&clock_lock);
+        ns = clock_ns;
+        cycles = clock_cycles;
+    } while (read_seqretry(&clock_lock, seq));
+    return ktime_tsc_khz() ? ns + ktime_cycles_to_ns(rdtsc() - cycles) : ns;
+}
+
+/// Arms the LAPIC timer for deadline, or as far out as it goes if deadline is UINT64_MAX. Interrupts have to be off.
+static void program_event(uint64_t deadline)
+{
+    uint64_t now = lapic_now();
+    uint64_t delta = deadline > now + MIN_EVENT_NS ? deadline - now : MIN_EVENT_NS;
+    uint64_t counts = delta / NS_PER_SEC * lapic_hz + delta % NS_PER_SEC * lapic_hz / NS_PER_SEC;
+    if (counts > 0xFFFFFFFF) counts = 0xFFFFFFFF;
+    if (counts == 0) counts = 1;
+    event_base_ns = now;
+    event_count = counts;
+    lapic_timer_oneshot(counts);
+
+    write_seqlock(&clock_lock);
+    clock_ns = now;
+    clock_cycles = ktime_tsc_khz() ? rdtsc() : 0;
+    write_sequnlock(&clock_lock);
+}
+
+/// Links t into the slot matching how far out it expires, wheel_lock has to be held
+static void wheel_insert(struct timer* t)
+{
+    uint32_t expires = t->expires;
+    uint32_t delta = expires - wheel_clock;
+    if (delta > WHEEL_MAX_DELTA) expires = wheel_clock + WHEEL_MAX_DELTA;
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && expires - wheel_clock >= 1u << (WHEEL_BITS * (level + 1)))
+        level++;
+    struct timer** slot = &wheel[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+    t->next = *slot;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+}
+
+static void wheel_unlink(struct timer* t)
+{
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+/// Moves everything in a slot of an upper level one level down, returns the slot index
+static uint32_t cascade(int level)
+{
+    uint32_t idx = (wheel_clock >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    struct timer* t = wheel[level][idx];
+    wheel[level][idx] = NULL;
+    while (t) {
+        struct timer* next = t->next;
+        wheel_insert(t);
+        t = next;
+    }
+    return idx;
+}
+
+/// Expires everything due up to and including now, from the boot CPU's timer interrupt
+static void run_timers(uint32_t now)
+{
+    spin_lock(&wheel_lock);
+    if (!wheel_pending) {
+        // Nothing to walk past, just catch up
+        if ((int32_t)(now - wheel_clock) >= 0) wheel_clock = now + 1;
+        spin_unlock(&wheel_lock);
+        return;
+    }
+    while ((int32_t)(now - wheel_clock) >= 0) {
+        uint32_t idx = wheel_clock & WHEEL_MASK;
+        if (idx == 0) {
+            for (int level = 1; level < WHEEL_LEVELS && cascade(level) == 0; level++) { }
+        }
+        struct timer** slot = &wheel[0][idx];
+        while (*slot) {
+            struct timer* t = *slot;
+            wheel_unlink(t);
+            wheel_pending--;
+            // Re-adding from the callback lands in a later slot, so this loop still terminates
+            running_timer = t;
+            spin_unlock(&wheel_lock);
+            t->callback(t->data);
+            spin_lock(&wheel_lock);
+            running_timer = NULL;
+        }
+        wheel_clock++;
+        if (!wheel_pending) {
+            if ((int32_t)(now - wheel_clock) >= 0) wheel_clock = now + 1;
+            break;
+        }
+    }
+    spin_unlock(&wheel_lock);
+}
+
+/// When the wheel next needs to run, wheel_lock has to be held. Past level 0 this is the next cascade, at worst every WHEEL_SIZE ms while
+/// only far off timers are pending.
+static uint64_t wheel_next_ns()
+{
+    if (!wheel_pending) return UINT64_MAX;
+    uint32_t clk = wheel_clock;
+    for (int i = 0; i < WHEEL_SIZE; i++, clk++) {
+        if (i > 0 && (clk & WHEEL_MASK) == 0) break;
+        if (wheel[0][clk & WHEEL_MASK]) break;
+    }
+    return (uint64_t)clk * 1000000;
+}
+
 // NOTE: I have changed the timer phase so now it fires every ~1ms
 //
 /* Handles the timer. In this case, it's very simple: We
@@ -30,10 +233,11 @@ void timer_phase(int hz)
  *  been smoking something funky */
 void timer_handler(struct irq_regs* r)
 {
+    profile_tick(r);
     /* Increment our 'tick count' */
     ticks++;
-    // Decrement sleep countdown, should be every 1ms
-    if (countdown > 0) countdown--;
+    run_timers(ticks);
+    if (ticks % SCHED_SLICE_MS == 0) sched_tick();
     /* Every 18 clocks (approximately 1 second), we will
      *  display a message on the screen */
     if (ticks % phase == 0) {
@@ -42,20 +246,254 @@ void timer_handler(struct irq_regs* r)
     }
 }
 
+/// One-shot expired, account for the time it covered and arm the next deadline
+static void lapic_timer_handler(struct irq_regs* r)
+{
+    profile_tick(r);
+    // The other CPUs only run a periodic tick for their own threads
+    unsigned int cpu = cpu_id();
+    if (cpu != 0) {
+        ap_elapsed[cpu] += ap_tick_ms;
+        if (ap_elapsed[cpu] >= SCHED_SLICE_MS) {
+            ap_elapsed[cpu] = 0;
+            sched_tick();
+        }
+        return;
+    }
+    events++;
+    event_base_ns += counts_to_ns(event_count);
+    event_count = 0;
+    uint64_t now = lapic_now();
+    ticks = now / 1000000;
+    run_timers(ticks);
+    if (next_deadline <= now) next_deadline = UINT64_MAX;
+    if (slice_end <= now) slice_end = sched_tick() ? now + SCHED_SLICE_MS * 1000000ull : UINT64_MAX;
+    if (slice_end < next_deadline) next_deadline = slice_end;
+    spin_lock(&wheel_lock);
+    uint64_t wheel_deadline = wheel_next_ns();
+    spin_unlock(&wheel_lock);
+    if (wheel_deadline < next_deadline) next_deadline = wheel_deadline;
+    if (sample_ns && now + sample_ns < next_deadline) next_deadline = now + sample_ns;
+    program_event(next_deadline);
+}
+
+uint64_t timer_now_ns()
+{
+    if (ktime_tsc_stable()) return ktime_get_ns();
+    if (!tickless) return (uint64_t)ticks * 1000000;
+    uint32_t flags = irq_save();
+    uint64_t now = cpu_id() == 0 ? lapic_now() : remote_now();
+    irq_restore(flags);
+    return now;
+}
+
+unsigned int timer_get_ticks() { return tickless ? timer_now_ns() / 1000000 : ticks; }
+
+/// Makes sure the clock event fires by deadline
+static void arm_deadline(uint64_t deadline)
+{
+    uint32_t flags = irq_save();
+    if (cpu_id() != 0) {
+        spin_lock(&remote_lock);
+        bool earlier = deadline < remote_deadline;
+        if (earlier) remote_deadline = deadline;
+        spin_unlock(&remote_lock);
+        if (earlier) smp_send_ipi(0, IPI_TIMER_VECTOR);
+    } else if (deadline < next_deadline) {
+        next_deadline = deadline;
+        program_event(deadline);
+    }
+    irq_restore(flags);
+}
+
+/// Picks up a deadline another CPU handed over
+static void timer_ipi_handler(struct irq_regs* r)
+{
+    (void)r;
+    spin_lock(&remote_lock);
+    uint64_t deadline = remote_deadline;
+    remote_deadline = UINT64_MAX;
+    spin_unlock(&remote_lock);
+    arm_deadline(deadline);
+}
+
+void timer_slice_start()
+{
+    // The PIT and the other CPUs' periodic ticks come around anyway
+    if (!tickless || cpu_id() != 0) return;
+    uint32_t flags = irq_save();
+    if (slice_end == UINT64_MAX) {
+        slice_end = lapic_now() + SCHED_SLICE_MS * 1000000ull;
+        arm_deadline(slice_end);
+    }
+    irq_restore(flags);
+}
+
 /* Waits until the timer at least one time.
  * Added optimize attribute to stop compiler from
  * optimizing away the while loop and causing the kernel to hang. */
 void __attribute__((optimize("O0"))) timer_poll()
 {
+    if (tickless) {
+        uint32_t seen = events;
+        arm_deadline(timer_now_ns() + 1000000);
+        while (seen == events) { }
+        return;
+    }
     while (0 == ticks) { }
 }
 
+void timer_setup(struct timer* t, timer_callback_t callback, void* data)
+{
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->callback = callback;
+    t->data = data;
+}
+
+void timer_add(struct timer* t, uint32_t millis)
+{
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    if (t->pprev) {
+        wheel_unlink(t);
+        wheel_pending--;
+    }
+    uint32_t now = timer_get_ticks();
+    // Nothing is waiting on the ticks the wheel hasn't caught up on yet, skip them
+    if (!wheel_pending && (int32_t)(now - wheel_clock) >= 0) wheel_clock = now + 1;
+    t->expires = now + (millis ? millis : 1);
+    wheel_insert(t);
+    wheel_pending++;
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    if (tickless) arm_deadline((uint64_t)t->expires * 1000000);
+}
+
+bool timer_del(struct timer* t)
+{
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    bool pending = t->pprev != NULL;
+    if (pending) {
+        wheel_unlink(t);
+        wheel_pending--;
+    }
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    // The callback may be running on the boot CPU right now, t has to stay around until it's done
+    while (running_timer == t)
+        asm volatile("pause");
+    return pending;
+}
+
+static void timeout_expired(void* data) { *(volatile bool*)data = true; }
+
+void timer_start_timeout(struct timer* t, volatile bool* expired, uint32_t millis)
+{
+    *expired = false;
+    timer_setup(t, timeout_expired, (void*)expired);
+    timer_add(t, millis);
+}
+
 void sleep(uint32_t millis)
 {
-    countdown = millis;
-    while (countdown > 0) {
-        halt();
+    if (!millis) return;
+    // Threads give the CPU up, only the idle loop and early boot have to halt through the wait
+    if (sched_can_block()) {
+        struct wait_state ws;
+        wait_begin(&ws, NULL, millis);
+        while (wait_sleep(&ws)) { }
+        wait_end(&ws);
+        return;
+    }
+
+    volatile bool done;
+    struct timer t;
+    timer_start_timeout(&t, &done, millis);
+    uint32_t flags = irq_save();
+    while (true) {
+        irq_restore(flags);
+        // Use the wait for leftover deferred work, to get pages cleared ahead of time and the log out
+        work_run();
+        pmm_zero_idle();
+        klog_flush();
+        // Check and halt with interrupts off so the wakeup can't slip in between, sti only takes effect after hlt
+        asm volatile("cli");
+        if (done) break;
+        asm volatile("sti\n\thlt");
+    }
+    irq_restore(flags);
+}
+
+void usleep(uint64_t micros)
+{
+    // The wheel works in milliseconds, only the boot CPU's LAPIC can do better for short waits
+    if (!tickless || micros >= 1000 || cpu_id() != 0) {
+        sleep(CEIL_DIV(micros, 1000));
+        return;
+    }
+
+    uint64_t target = timer_now_ns() + micros * 1000;
+    arm_deadline(target);
+    while (true) {
+        work_run();
+        pmm_zero_idle();
+        klog_flush();
+        asm volatile("cli");
+        if (timer_now_ns() >= target) break;
+        asm volatile("sti\n\thlt");
     }
+    asm volatile("sti");
+}
+
+/// Counts how fast the LAPIC timer runs against the PIT, then hands timekeeping over to it
+static void lapic_timer_setup()
+{
+    uint32_t flags = irq_save();
+    lapic_timer_oneshot(0xFFFFFFFF);
+    pit_wait(CALIBRATE_MS);
+    uint32_t elapsed = 0xFFFFFFFF - lapic_timer_current();
+    lapic_timer_stop();
+    irq_restore(flags);
+
+    lapic_hz = (uint64_t)elapsed * (1000 / CALIBRATE_MS);
+    if (!lapic_hz) return;
+    printf("LAPIC timer: %d kHz\n", (uint32_t)(lapic_hz / 1000));
+
+    flags = irq_save();
+    irq_install_handler(IRQ_LAPIC_TIMER, lapic_timer_handler);
+    irq_install_handler(IPI_TIMER_VECTOR - IRQ_VECTOR_BASE, timer_ipi_handler);
+    // The PIT stays programmed for anything still polling it but its line is masked, so idle CPUs stay asleep
+    irq_mask(0);
+    event_base_ns = (uint64_t)ticks * 1000000;
+    event_count = 0;
+    tickless = true;
+    program_event(UINT64_MAX);
+    irq_restore(flags);
+}
+
+void timer_init_ap()
+{
+    if (lapic_hz) lapic_timer_periodic(lapic_hz * ap_tick_ms / 1000);
+}
+
+static void ap_retick(void* arg)
+{
+    (void)arg;
+    ap_elapsed[cpu_id()] = 0;
+    timer_init_ap();
+}
+
+void timer_sample_period(uint32_t millis)
+{
+    // Ticking faster than the slice only pays off for the profiler, a slice is the most the APs wait
+    uint32_t ap_ms = millis && millis < SCHED_SLICE_MS ? millis : SCHED_SLICE_MS;
+    uint32_t flags = irq_save();
+    sample_ns = millis * 1000000ull;
+    if (tickless && millis) arm_deadline(timer_now_ns() + sample_ns);
+    irq_restore(flags);
+    if (ap_ms == ap_tick_ms) return;
+    ap_tick_ms = ap_ms;
+    for (unsigned int cpu = 1; cpu < MAX_CPUS; cpu++)
+        smp_call_function(cpu, ap_retick, NULL, true);
 }
 
 /* Sets up the system clock by installing the timer handler
@@ -65,4 +503,6 @@ void timer_init()
     /* Installs 'timer_handler' to IRQ0 */
     irq_install_handler(0, timer_handler);
     timer_phase(1000);
+    ktime_init();
+    if (lapic_init() == 0) lapic_timer_setup();
 }
@@ -0,0 +1,116 @@
+#include <kernel/cpu.h>
+#include <kernel/ktime.h>
+#include <kernel/liballoc.h>
+#include <kernel/serial.h>
+#include <kernel/trace.h>
+#include <stdio.h>
+
+struct trace_ring {
+    struct trace_record records[TRACE_RING];
+    uint32_t head; ///< Slots claimed since trace_start
+};
+
+volatile uint32_t trace_mask = 0;
+static struct trace_ring rings[MAX_CPUS];
+
+static const char* const names[TRACE_EVENTS] = {
+    [TRACE_PMM_ALLOC] = "pmm_alloc",
+    [TRACE_PMM_FREE] = "pmm_free",
+    [TRACE_HEAP_ALLOC] = "heap_alloc",
+    [TRACE_HEAP_FREE] = "heap_free",
+    [TRACE_IRQ_ENTRY] = "irq_entry",
+    [TRACE_IRQ_EXIT] = "irq_exit",
+    [TRACE_BLOCK_SUBMIT] = "block_submit",
+    [TRACE_BLOCK_COMPLETE] = "block_complete",
+    [TRACE_VFS_OPEN] = "vfs_open",
+    [TRACE_VFS_OPEN_DONE] = "vfs_open_done",
+    [TRACE_VFS_READ] = "vfs_read",
+    [TRACE_VFS_READ_DONE] = "vfs_read_done",
+};
+
+void trace_record(uint16_t event, uint32_t a, uint32_t b, uint32_t c)
+{
+    // A thread moved to another CPU after this still only claims a slot of its own
+    unsigned int cpu = cpu_id();
+    struct trace_ring* ring = rings + cpu;
+    uint32_t pos = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    struct trace_record* r = ring->records + (pos & (TRACE_RING - 1));
+    // Readers skip the slot until seq says it's whole again
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->event = event;
+    r->cpu = cpu;
+    r->tsc = ktime_get_cycles();
+    r->a = a;
+    r->b = b;
+    r->c = c;
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+void trace_start(uint32_t mask)
+{
+    trace_stop();
+    for (unsigned int i = 0; i < MAX_CPUS; i++) {
+        rings[i].head = 0;
+        for (size_t j = 0; j < TRACE_RING; j++)
+            rings[i].records[j].seq = 0;
+    }
+    __atomic_store_n(&trace_mask, mask & TRACE_ALL, __ATOMIC_RELEASE);
+}
+
+void trace_stop() { __atomic_store_n(&trace_mask, 0, __ATOMIC_RELEASE); }
+
+size_t trace_read(unsigned int cpu, struct trace_record* out, size_t max)
+{
+    if (cpu >= MAX_CPUS) return 0;
+    struct trace_ring* ring = rings + cpu;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t pos = head > TRACE_RING ? head - TRACE_RING : 0;
+    size_t n = 0;
+    for (; pos != head && n < max; pos++) {
+        const struct trace_record* r = ring->records + (pos & (TRACE_RING - 1));
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != pos + 1) continue;
+        out[n] = *r;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        // Lapped while copying, the copy may be torn
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != pos + 1) continue;
+        n++;
+    }
+    return n;
+}
+
+const char* trace_event_name(uint16_t event) { return event < TRACE_EVENTS ? names[event] : "unknown"; }
+
+void trace_dump()
+{
+    trace_stop();
+    struct trace_record* records[MAX_CPUS] = { 0 };
+    size_t count[MAX_CPUS] = { 0 };
+    size_t next[MAX_CPUS] = { 0 };
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!rings[cpu].head) continue;
+        records[cpu] = kmalloc(TRACE_RING * sizeof(struct trace_record));
+        if (records[cpu]) count[cpu] = trace_read(cpu, records[cpu], TRACE_RING);
+    }
+
+    char line[96];
+    int n = snprintf(line, sizeof(line), "TRACE begin tsc_khz=%u\n", ktime_tsc_khz());
+    serial_write(COM1_PORT, line, n);
+    // Each ring is in order already, merge them by always taking the oldest head
+    while (true) {
+        int pick = -1;
+        for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if (next[cpu] == count[cpu]) continue;
+            if (pick < 0 || records[cpu][next[cpu]].tsc < records[pick][next[pick]].tsc) pick = cpu;
+        }
+        if (pick < 0) break;
+        const struct trace_record* r = &records[pick][next[pick]++];
+        n = snprintf(line, sizeof(line), "T %llu %u %s %X %X %X\n", r->tsc, r->cpu, trace_event_name(r->event), r->a,
+            r->b, r->c);
+        serial_write(COM1_PORT, line, n);
+    }
+    serial_write(COM1_PORT, "TRACE end\n", 10);
+    serial_drain(COM1_PORT);
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++)
+        kfree(records[cpu]);
+}
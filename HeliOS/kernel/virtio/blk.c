@@ -0,0 +1,318 @@
+#include <kernel/apic.h>
+#include <kernel/asm.h>
+#include <kernel/ata/device.h>
+#include <kernel/dma.h>
+#include <kernel/interrupts.h>
+#include <kernel/pci/pci.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <kernel/virtio/blk.h>
+#include <kernel/work.h>
+#include <stddef.h>
+#include <stdio.h>
+
+static const int VIRTIO_BLK_POLL_INTERVAL = 2; /* ms, how often completions are looked for without interrupts */
+
+static const uint32_t VIRTIO_BLK_FEATURES = VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH
+    | VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_RING_F_EVENT_IDX;
+
+/* what one ring slot points at: header, data segments and status, described by its own indirect table */
+struct vblk_req {
+    struct virtio_blk_req_hdr hdr;
+    volatile uint8_t status;
+    uint8_t pad[15];
+    struct virtq_desc table[VIRTIO_BLK_MAX_SEGS + 2];
+} __attribute__((packed));
+
+typedef struct {
+    const pci_device_t* pci;
+    uint16_t io_base;
+    uint32_t features;
+    struct virtqueue vq;
+    /* request slots, slot i always goes out through descriptor i */
+    struct vblk_req* reqs;
+    uintptr_t reqs_phys;
+    uint16_t num_reqs;
+    uint16_t max_segs;
+    /* guards the queue and the slot state */
+    spinlock_t lock;
+    uint64_t busy;
+    struct bio* bios[VIRTIO_BLK_MAX_REQS];
+    /* -1 while completions are polled for */
+    int irq;
+    bool msix;
+    struct work reap;
+    struct timer poll;
+    sATADevice device;
+} sVirtioBlk;
+
+static sVirtioBlk disks[VIRTIO_BLK_MAX_DEVICES];
+static size_t num_disks = 0;
+
+static void vblk_reap(void* data)
+{
+    sVirtioBlk* disk = data;
+    struct bio* done[VIRTIO_BLK_MAX_REQS];
+    bool ok[VIRTIO_BLK_MAX_REQS];
+    size_t num_done = 0;
+
+    uint32_t flags = spin_lock_irqsave(&disk->lock);
+    do {
+        uint32_t id, len;
+        while (vq_next_used(&disk->vq, &id, &len)) {
+            if (id >= disk->num_reqs || !(disk->busy & (1ULL << id))) {
+                printf("virtio-blk: device finished unknown request %d\n", id);
+                continue;
+            }
+            done[num_done] = disk->bios[id];
+            ok[num_done++] = disk->reqs[id].status == VIRTIO_BLK_S_OK;
+            disk->bios[id] = NULL;
+            disk->busy &= ~(1ULL << id);
+        }
+        // With the event index this asks for one interrupt when the next request finishes, not one per request
+    } while (vq_enable_cb(&disk->vq));
+    if (disk->irq < 0 && disk->busy) timer_add(&disk->poll, VIRTIO_BLK_POLL_INTERVAL);
+    spin_unlock_irqrestore(&disk->lock, flags);
+
+    // block_done may start the next requests right away, which takes the lock again
+    for (size_t i = 0; i < num_done; i++)
+        block_done(done[i], ok[i]);
+}
+
+static void vblk_poll(void* data)
+{
+    sVirtioBlk* disk = data;
+    work_queue(&disk->reap);
+}
+
+static void vblk_irq_handler(struct irq_regs* r)
+{
+    int irq = r->int_no - IRQ_VECTOR_BASE;
+    for (size_t i = 0; i < num_disks; i++) {
+        sVirtioBlk* disk = disks + i;
+        if (disk->irq != irq) continue;
+        // INTx may be shared, the ISR tells whether it was us and lowers the line. MSI-X is ours alone.
+        if (!disk->msix && !(inb(disk->io_base + VIRTIO_REG_ISR) & 1)) continue;
+        work_queue(&disk->reap);
+    }
+}
+
+static bool vblk_start(struct block_device* bdev, struct bio* req, int op, void* buffer, uint64_t lba, size_t count)
+{
+    sVirtioBlk* disk = bdev->driver_data;
+    if (op == BIO_WRITE && disk->features & VIRTIO_BLK_F_RO) return false;
+    // Without a cache to flush the device writes through, a barrier is done once it's issued
+    if (op == BIO_FLUSH && !(disk->features & VIRTIO_BLK_F_FLUSH)) {
+        block_done(req, true);
+        return true;
+    }
+
+    // The block layer keeps at most num_reqs requests outstanding, so there is a free slot
+    uint32_t flags = spin_lock_irqsave(&disk->lock);
+    uint16_t slot = 0;
+    while (slot < disk->num_reqs && disk->busy & (1ULL << slot))
+        slot++;
+    if (slot == disk->num_reqs) {
+        spin_unlock_irqrestore(&disk->lock, flags);
+        return false;
+    }
+    disk->busy |= 1ULL << slot;
+    spin_unlock_irqrestore(&disk->lock, flags);
+
+    struct vblk_req* r = disk->reqs + slot;
+    uintptr_t r_phys = disk->reqs_phys + slot * sizeof(struct vblk_req);
+    r->hdr.type = op == BIO_FLUSH ? VIRTIO_BLK_T_FLUSH : op == BIO_WRITE ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    r->hdr.reserved = 0;
+    r->hdr.sector = op == BIO_FLUSH ? 0 : lba;
+    r->status = 0xFF;
+
+    size_t n = 0;
+    r->table[n++]
+        = (struct virtq_desc) { r_phys + offsetof(struct vblk_req, hdr), sizeof(r->hdr), VIRTQ_DESC_F_NEXT, 0 };
+    // One segment per physically contiguous run
+    uint16_t data_flags = VIRTQ_DESC_F_NEXT | (op == BIO_READ ? VIRTQ_DESC_F_WRITE : 0);
+    uintptr_t virt = (uintptr_t)buffer;
+    size_t bytes = op == BIO_FLUSH ? 0 : count * disk->device.sec_size;
+    bool fits = true;
+    while (bytes && fits) {
+        uintptr_t phys = get_physaddr(virt);
+        size_t len = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+        if (len > bytes) len = bytes;
+        struct virtq_desc* last = r->table + n - 1;
+        if (n > 1 && last->addr + last->len == phys) {
+            last->len += len;
+        } else if (phys && n - 1 < disk->max_segs) {
+            r->table[n++] = (struct virtq_desc) { phys, len, data_flags, 0 };
+        } else {
+            fits = false;
+        }
+        virt += len;
+        bytes -= len;
+    }
+    if (!fits) {
+        printf("virtio-blk: buffer for 0x%llX doesn't fit a request\n", lba);
+        flags = spin_lock_irqsave(&disk->lock);
+        disk->busy &= ~(1ULL << slot);
+        spin_unlock_irqrestore(&disk->lock, flags);
+        return false;
+    }
+    r->table[n++] = (struct virtq_desc) { r_phys + offsetof(struct vblk_req, status), 1, VIRTQ_DESC_F_WRITE, 0 };
+    for (size_t i = 0; i + 1 < n; i++)
+        r->table[i].next = i + 1;
+
+    flags = spin_lock_irqsave(&disk->lock);
+    disk->bios[slot] = req;
+    struct virtq_desc* desc = disk->vq.desc + slot;
+    desc->addr = r_phys + offsetof(struct vblk_req, table);
+    desc->len = n * sizeof(struct virtq_desc);
+    desc->flags = VIRTQ_DESC_F_INDIRECT;
+    desc->next = 0;
+    vq_publish(&disk->vq, slot);
+    if (disk->irq < 0) timer_add(&disk->poll, VIRTIO_BLK_POLL_INTERVAL);
+    spin_unlock_irqrestore(&disk->lock, flags);
+    return true;
+}
+
+static void vblk_commit(struct block_device* bdev)
+{
+    sVirtioBlk* disk = bdev->driver_data;
+    uint32_t flags = spin_lock_irqsave(&disk->lock);
+    vq_kick(&disk->vq);
+    spin_unlock_irqrestore(&disk->lock, flags);
+}
+
+static bool vblk_read_write(
+    sATADevice* device, uint16_t op, void* buffer, uint64_t lba, size_t secSize, size_t secCount)
+{
+    (void)secSize;
+    int bop = op == OP_FLUSH ? BIO_FLUSH : op == OP_WRITE ? BIO_WRITE : BIO_READ;
+    return !block_rw(&device->bdev, bop, lba, secCount, buffer);
+}
+
+/// Routes the queue's interrupt to us: MSI-X with a local APIC, the firmware's INTx line on the 8259s
+static void setup_irq(sVirtioBlk* disk)
+{
+    disk->irq = -1;
+    disk->msix = false;
+    if (lapic_present()) {
+        int irq = irq_alloc(vblk_irq_handler);
+        if (irq >= 0 && !pci_enable_msix(disk->pci, 0, IRQ_VECTOR(irq), lapic_id())) {
+            // The queue only uses entry 0 if the device took it
+            outword(disk->io_base + VIRTIO_REG_CONFIG_VECTOR, VIRTIO_NO_VECTOR);
+            outword(disk->io_base + VIRTIO_REG_QUEUE_SELECT, 0);
+            outword(disk->io_base + VIRTIO_REG_QUEUE_VECTOR, 0);
+            if (inw(disk->io_base + VIRTIO_REG_QUEUE_VECTOR) == 0) {
+                disk->irq = irq;
+                disk->msix = true;
+                return;
+            }
+        }
+        if (irq >= 0) irq_uninstall_handler(irq);
+    }
+    // Only the 8259 numbering matches the line register, the IOAPIC pin would need the ACPI routing tables
+    uint8_t line = pci_config_read_word(disk->pci->bus, disk->pci->dev, disk->pci->func, PCI_REG_INTERRUPT) & 0xFF;
+    if (!irq_using_apic() && line < 16) {
+        disk->irq = line;
+        irq_install_handler(line, vblk_irq_handler);
+    }
+}
+
+static bool vblk_probe(sVirtioBlk* disk, uint8_t id)
+{
+    const pci_device_t* pci = disk->pci;
+    uint32_t command = pci_config_read_word(pci->bus, pci->dev, pci->func, PCI_REG_COMMAND) & 0xFFFF;
+    pci_config_write_word(pci->bus, pci->dev, pci->func, PCI_REG_COMMAND,
+        command | PCI_CMD_IO | PCI_CMD_MEMORY | PCI_CMD_BUS_MASTER);
+    uint32_t bar = pci_config_read_word(pci->bus, pci->dev, pci->func, PCI_REG_BAR0);
+    if (!(bar & 1)) {
+        puts("virtio-blk: BAR0 isn't an I/O BAR");
+        return false;
+    }
+    disk->io_base = bar & ~0x3;
+    spin_lock_init(&disk->lock);
+    work_setup(&disk->reap, vblk_reap, disk);
+    timer_setup(&disk->poll, vblk_poll, disk);
+
+    disk->features = virtio_negotiate(disk->io_base, VIRTIO_BLK_FEATURES);
+    // One ring slot per request only works with indirect tables, every device we know of offers them
+    if (!(disk->features & VIRTIO_RING_F_INDIRECT_DESC)) {
+        puts("virtio-blk: no indirect descriptors");
+        virtio_set_status(disk->io_base, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+    if (!vq_init(&disk->vq, disk->io_base, 0, disk->features & VIRTIO_RING_F_EVENT_IDX)) {
+        virtio_set_status(disk->io_base, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+    disk->num_reqs = disk->vq.size < VIRTIO_BLK_MAX_REQS ? disk->vq.size : VIRTIO_BLK_MAX_REQS;
+    disk->reqs = dma_alloc(sizeof(struct vblk_req) * disk->num_reqs, 16, 0, &disk->reqs_phys);
+    if (!disk->reqs) {
+        puts("virtio-blk: no memory for requests");
+        virtio_set_status(disk->io_base, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+    setup_irq(disk);
+
+    uint16_t config = disk->io_base + VIRTIO_REG_CONFIG(disk->msix);
+    disk->max_segs = VIRTIO_BLK_MAX_SEGS;
+    if (disk->features & VIRTIO_BLK_F_SEG_MAX) {
+        uint32_t seg_max = indword(config + VIRTIO_BLK_CFG_SEG_MAX);
+        if (seg_max && seg_max < disk->max_segs) disk->max_segs = seg_max;
+    }
+    uint64_t capacity = indword(config + VIRTIO_BLK_CFG_CAPACITY)
+        | ((uint64_t)indword(config + VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+    virtio_set_status(disk->io_base, VIRTIO_STATUS_DRIVER_OK);
+
+    sATADevice* device = &disk->device;
+    device->id = id;
+    device->present = true;
+    device->sec_size = ATA_SEC_SIZE;
+    device->lba48 = 1;
+    device->use_dma = true;
+    device->sectors = capacity;
+    device->ctrl = NULL;
+    device->rw_handler = vblk_read_write;
+    printf("virtio-blk %d: 0x%llX sectors, %d requests in flight, %s%s, interrupts by %s\n", id, capacity,
+        disk->num_reqs, disk->features & VIRTIO_RING_F_EVENT_IDX ? "event index" : "no event index",
+        disk->features & VIRTIO_BLK_F_RO ? ", read-only" : "",
+        disk->msix ? "MSI-X" : disk->irq >= 0 ? "INTx" : "polling");
+
+    snprintf(device->bdev.name, sizeof(device->bdev.name), "vd%c", 'a' + id);
+    device->bdev.sec_size = device->sec_size;
+    device->bdev.sectors = device->sectors;
+    device->bdev.start = vblk_start;
+    device->bdev.commit = vblk_commit;
+    device->bdev.depth = disk->num_reqs;
+    device->bdev.driver_data = disk;
+    block_register(&device->bdev);
+
+    // Goes through the queue like everything after it
+    uint16_t buffer[256];
+    if (!vblk_read_write(device, OP_READ, buffer, 0, device->sec_size, 1)) {
+        puts("Unable to read partition table");
+        device->present = false;
+        return true;
+    }
+    part_fill_partitions(device->part_table, buffer);
+    part_print(device->part_table);
+    return true;
+}
+
+void virtio_blk_init()
+{
+    const pci_device_t* pci = NULL;
+    while (num_disks < VIRTIO_BLK_MAX_DEVICES && (pci = pci_find_device(VIRTIO_VENDOR, VIRTIO_BLK_DEVICE_ID, pci))) {
+        sVirtioBlk* disk = disks + num_disks;
+        disk->pci = pci;
+        // The handler only looks at disks below num_disks, a probed one stays counted since its block device
+        // is registered
+        num_disks++;
+        if (!vblk_probe(disk, num_disks - 1)) num_disks--;
+    }
+}
+
+sATADevice* virtio_blk_get_device(uint8_t id)
+{
+    if (id >= num_disks || !disks[id].device.present) return NULL;
+    return &disks[id].device;
+}
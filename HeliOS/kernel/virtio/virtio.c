@@ -0,0 +1,105 @@
+#include <kernel/asm.h>
+#include <kernel/dma.h>
+#include <kernel/virtio/virtio.h>
+#include <stdio.h>
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+static inline uint16_t* used_event(struct virtqueue* vq) { return &vq->avail->ring[vq->size]; }
+static inline volatile uint16_t* avail_event(struct virtqueue* vq)
+{
+    return (volatile uint16_t*)&vq->used->ring[vq->size];
+}
+
+uint32_t virtio_negotiate(uint16_t io_base, uint32_t wanted)
+{
+    outb(io_base + VIRTIO_REG_STATUS, 0);
+    outb(io_base + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(io_base + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    uint32_t features = indword(io_base + VIRTIO_REG_DEVICE_FEATURES) & wanted;
+    outdword(io_base + VIRTIO_REG_GUEST_FEATURES, features);
+    return features;
+}
+
+void virtio_set_status(uint16_t io_base, uint8_t status)
+{
+    outb(io_base + VIRTIO_REG_STATUS, inb(io_base + VIRTIO_REG_STATUS) | status);
+}
+
+bool vq_init(struct virtqueue* vq, uint16_t io_base, uint16_t index, bool event_idx)
+{
+    outword(io_base + VIRTIO_REG_QUEUE_SELECT, index);
+    uint16_t size = inw(io_base + VIRTIO_REG_QUEUE_SIZE);
+    if (!size) return false;
+    size_t used_offset = ALIGN_UP(sizeof(struct virtq_desc) * size + sizeof(uint16_t) * (3 + size), VIRTQ_ALIGN);
+    size_t mem_size = used_offset + sizeof(uint16_t) * 3 + sizeof(struct virtq_used_elem) * size;
+    uintptr_t phys;
+    // Zeroed, so both rings start out empty
+    uint8_t* mem = dma_alloc(mem_size, VIRTQ_ALIGN, 0, &phys);
+    if (!mem) {
+        printf("virtio: no memory for a queue of %d\n", size);
+        return false;
+    }
+
+    vq->io_base = io_base;
+    vq->index = index;
+    vq->size = size;
+    vq->event_idx = event_idx;
+    vq->desc = (struct virtq_desc*)mem;
+    vq->avail = (struct virtq_avail*)(mem + sizeof(struct virtq_desc) * size);
+    vq->used = (struct virtq_used*)(mem + used_offset);
+    vq->mem = mem;
+    vq->mem_size = mem_size;
+    vq->last_used = 0;
+    vq->kicked = 0;
+    outdword(io_base + VIRTIO_REG_QUEUE_PFN, phys / VIRTQ_ALIGN);
+    return true;
+}
+
+void vq_publish(struct virtqueue* vq, uint16_t head)
+{
+    vq->avail->ring[vq->avail->idx % vq->size] = head;
+    // The entry has to be visible before the index that covers it
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    vq->avail->idx++;
+}
+
+void vq_kick(struct virtqueue* vq)
+{
+    uint16_t idx = vq->avail->idx;
+    uint16_t old = vq->kicked;
+    if (idx == old) return;
+    vq->kicked = idx;
+    // The device reads avail_event or flags after it saw our index, so the index store can't pass the load
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bool notify;
+    if (vq->event_idx)
+        // Whether avail_event lies in the entries published since the last kick
+        notify = (uint16_t)(idx - *avail_event(vq) - 1) < (uint16_t)(idx - old);
+    else
+        notify = !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    if (notify) outword(vq->io_base + VIRTIO_REG_QUEUE_NOTIFY, vq->index);
+}
+
+bool vq_next_used(struct virtqueue* vq, uint32_t* id, uint32_t* len)
+{
+    if (vq->last_used == vq->used->idx) return false;
+    // The element is only valid once we saw the index move past it
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    volatile struct virtq_used_elem* elem = &vq->used->ring[vq->last_used % vq->size];
+    *id = elem->id;
+    *len = elem->len;
+    vq->last_used++;
+    return true;
+}
+
+bool vq_enable_cb(struct virtqueue* vq)
+{
+    if (vq->event_idx)
+        *used_event(vq) = vq->last_used;
+    else
+        vq->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    // Same race as in vq_kick the other way around, the device may have used more before it saw the event
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return vq->last_used != vq->used->idx;
+}
@@ -0,0 +1,194 @@
+#include <kernel/memory.h>
+#include <kernel/slab.h>
+#include <kernel/spinlock.h>
+#include <kernel/vmalloc.h>
+#include <kernel/vmm.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// Unmapped page left after every area so overruns fault instead of corrupting the next one
+#define GUARD_PAGES 1
+
+typedef struct vmap_area {
+    uintptr_t start;
+    size_t pages; // Mapped pages, not counting the guard
+    bool io; // Maps device memory from ioremap, the frames aren't ours to free
+    vm_area_t* vma; // Demand mapped through vmalloc_area, NULL otherwise
+    struct vmap_area* next;
+} vmap_area_t;
+
+// Sorted by start address
+static vmap_area_t* vmap_areas;
+static kmem_cache_t* vmap_cache;
+// Guards vmap_areas and the cache's creation. Mapping and unmapping happen outside of it, the area is
+// already on the list while it gets mapped so nobody else gets the same addresses.
+static spinlock_t vmap_lock = SPINLOCK_INIT;
+
+/// First fit search for a hole of pages + GUARD_PAGES in the window. Returns the link to insert
+/// the new area at through link, and its address, or 0 if the window is full. vmap_lock has to be held.
+static uintptr_t find_hole(size_t pages, vmap_area_t*** link)
+{
+    size_t span = (pages + GUARD_PAGES) * PAGE_SIZE;
+    uintptr_t addr = VMALLOC_START;
+    vmap_area_t** curr = &vmap_areas;
+    while (*curr) {
+        if ((*curr)->start - addr >= span) break;
+        addr = (*curr)->start + ((*curr)->pages + GUARD_PAGES) * PAGE_SIZE;
+        curr = &(*curr)->next;
+    }
+    if (VMALLOC_END - addr < span) return 0;
+    *link = curr;
+    return addr;
+}
+
+/// Unmaps and frees the first pages pages of an area
+static void unmap_area(uintptr_t start, size_t pages)
+{
+    for (size_t i = 0; i < pages; i++) {
+        uintptr_t phys = get_physaddr(start + i * PAGE_SIZE);
+        // Nothing touches the area anymore, so the frame can go back before the TLB flush below
+        if (phys) kfree_phys_frames(phys, 1);
+    }
+    vmm_unmap_range(start, pages);
+}
+
+/// Puts a new area of pages on the list, NULL if the window or memory ran out
+static vmap_area_t* reserve_area(size_t pages, bool io)
+{
+    uint32_t flags = spin_lock_irqsave(&vmap_lock);
+    if (!vmap_cache) vmap_cache = kmem_cache_create("vmap_area", sizeof(vmap_area_t), 0, NULL);
+    vmap_area_t* area = vmap_cache ? kmem_cache_alloc(vmap_cache) : NULL;
+    vmap_area_t** link;
+    uintptr_t start = area ? find_hole(pages, &link) : 0;
+    if (start) {
+        area->start = start;
+        area->pages = pages;
+        area->io = io;
+        area->vma = NULL;
+        area->next = *link;
+        *link = area;
+    } else if (area) {
+        kmem_cache_free(vmap_cache, area);
+        area = NULL;
+    }
+    spin_unlock_irqrestore(&vmap_lock, flags);
+    return area;
+}
+
+/// Takes an area from reserve_area back off the list and frees it
+static void drop_area(vmap_area_t* area)
+{
+    uint32_t flags = spin_lock_irqsave(&vmap_lock);
+    vmap_area_t** link = &vmap_areas;
+    while (*link != area)
+        link = &(*link)->next;
+    *link = area->next;
+    spin_unlock_irqrestore(&vmap_lock, flags);
+    kmem_cache_free(vmap_cache, area);
+}
+
+void* vmalloc(size_t size)
+{
+    if (!size) return NULL;
+    size_t pages = CEIL_DIV(size, PAGE_SIZE);
+    vmap_area_t* area = reserve_area(pages, false);
+    if (!area) return NULL;
+    uintptr_t start = area->start;
+
+    for (size_t i = 0; i < pages; i++) {
+        uintptr_t phys = kalloc_phys_frames(1, ZONE_HIGH);
+        if (!phys || vmm_map_range(start + i * PAGE_SIZE, phys, 1, PAGE_FLAG_WRITE)) {
+            if (phys) kfree_phys_frames(phys, 1);
+            unmap_area(start, i);
+            drop_area(area);
+            return NULL;
+        }
+    }
+    return (void*)start;
+}
+
+/// Unlinks and returns the area starting at start if it is of the kind given by io and vma, NULL otherwise.
+/// Areas of another kind stay where they are, so a wrong free can't leak them.
+static vmap_area_t* take_area(uintptr_t start, bool io, const vm_area_t* vma)
+{
+    uint32_t flags = spin_lock_irqsave(&vmap_lock);
+    vmap_area_t** link = &vmap_areas;
+    while (*link && (*link)->start != start)
+        link = &(*link)->next;
+    vmap_area_t* area = *link;
+    if (area && (area->io != io || area->vma != vma)) area = NULL;
+    if (area) *link = area->next;
+    spin_unlock_irqrestore(&vmap_lock, flags);
+    return area;
+}
+
+void vfree(void* addr)
+{
+    if (!addr) return;
+    vmap_area_t* area = take_area((uintptr_t)addr, false, NULL);
+    if (!area) {
+        printf("vfree: 0x%X was not returned by vmalloc\n", addr);
+        return;
+    }
+    unmap_area(area->start, area->pages);
+    kmem_cache_free(vmap_cache, area);
+}
+
+void* ioremap(uintptr_t phys, size_t size, uint32_t flags)
+{
+    if (!size) return NULL;
+    uintptr_t offset = phys & (PAGE_SIZE - 1);
+    size_t pages = CEIL_DIV(size + offset, PAGE_SIZE);
+    vmap_area_t* area = reserve_area(pages, true);
+    if (!area) return NULL;
+    if (vmm_map_range(area->start, phys - offset, pages, PAGE_FLAG_WRITE | flags)) {
+        drop_area(area);
+        return NULL;
+    }
+    return (void*)(area->start + offset);
+}
+
+void iounmap(void* addr)
+{
+    if (!addr) return;
+    vmap_area_t* area = take_area((uintptr_t)addr & ~(PAGE_SIZE - 1), true, NULL);
+    if (!area) {
+        printf("iounmap: 0x%X was not returned by ioremap\n", addr);
+        return;
+    }
+    vmm_unmap_range(area->start, area->pages);
+    kmem_cache_free(vmap_cache, area);
+}
+
+vm_area_t* vmalloc_area(size_t size, uint32_t flags)
+{
+    if (!size) return NULL;
+    size_t pages = CEIL_DIV(size, PAGE_SIZE);
+    vmap_area_t* area = reserve_area(pages, false);
+    if (!area) return NULL;
+    // Nothing is mapped yet, the fault handler fills the area in as it's touched
+    vm_area_t* vma = vmm_reserve(area->start, pages * PAGE_SIZE, flags);
+    if (!vma) {
+        drop_area(area);
+        return NULL;
+    }
+    area->vma = vma;
+    return vma;
+}
+
+void vfree_area(vm_area_t* vma)
+{
+    if (!vma) return;
+    vmap_area_t* area = take_area(vma->start, false, vma);
+    if (!area) {
+        printf("vfree_area: 0x%X was not returned by vmalloc_area\n", vma->start);
+        return;
+    }
+    vmm_release(vma);
+    kmem_cache_free(vmap_cache, area);
+}
+
+int is_vmalloc_addr(const void* addr)
+{
+    return (uintptr_t)addr >= VMALLOC_START && (uintptr_t)addr < VMALLOC_END;
+}
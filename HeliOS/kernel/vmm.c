@@ -0,0 +1,294 @@
+#include <kernel/fpu.h>
+#include <kernel/memory.h>
+#include <kernel/slab.h>
+#include <kernel/smp.h>
+#include <kernel/spinlock.h>
+#include <kernel/vmm.h>
+#include <stdio.h>
+#include <string.h>
+
+// With PD slot 1023 pointing back at the directory, every PTE shows up in this 4 MiB window
+#define PTE_WINDOW ((uint32_t*)0xFFC00000)
+
+#define PAGE_ALIGN_DOWN(a) ((a) & ~(PAGE_SIZE - 1))
+// Pages covered by one page table
+#define PAGES_PER_TABLE 1024
+
+// Page fault error code bits
+#define FAULT_PRESENT  (1 << 0)
+#define FAULT_WRITE    (1 << 1)
+#define FAULT_USER     (1 << 2)
+#define FAULT_RESERVED (1 << 3)
+
+// Sorted by start address
+static vm_area_t* areas;
+static kmem_cache_t* area_cache;
+// Guards areas and the cache's creation, irqsave since the fault handler looks areas up
+static spinlock_t area_lock = SPINLOCK_INIT;
+
+static inline uint32_t* pte_for(uintptr_t vaddr) { return &PTE_WINDOW[vaddr >> 12]; }
+
+/// PTE for vaddr if its page table exists, NULL otherwise
+static inline uint32_t* lookup_pte(uintptr_t vaddr)
+{
+    return get_page_table(vaddr, false) ? pte_for(vaddr) : NULL;
+}
+
+void tlb_batch_init(tlb_batch_t* batch)
+{
+    batch->count = 0;
+    batch->overflow = false;
+    batch->global = false;
+}
+
+void tlb_batch_add(tlb_batch_t* batch, uintptr_t vaddr, uint32_t flags)
+{
+    // Entries that were never present can't be cached
+    if (!(flags & PAGE_FLAG_PRESENT)) return;
+    if (flags & PAGE_FLAG_GLOBAL) batch->global = true;
+    if (batch->overflow) return;
+    if (batch->count == TLB_BATCH_MAX) {
+        batch->overflow = true;
+        return;
+    }
+    batch->pages[batch->count++] = vaddr;
+}
+
+void tlb_batch_flush(tlb_batch_t* batch)
+{
+    if (batch->overflow) {
+        if (batch->global)
+            flush_tlb_all();
+        else
+            reload_cr3();
+    } else {
+        for (size_t i = 0; i < batch->count; i++)
+            invalidate(batch->pages[i]);
+    }
+    // Every CPU shares kernel_page_dir, the others may have cached the same entries
+    if (batch->overflow || batch->count) smp_tlb_shootdown(batch->pages, batch->overflow ? 0 : batch->count);
+    tlb_batch_init(batch);
+}
+
+/// Clears every PTE in [virt, virt + num_pages), returning stale entries to the batch
+static void unmap_pages(uintptr_t virt, size_t num_pages, tlb_batch_t* batch)
+{
+    while (num_pages > 0) {
+        // Whatever is left of the current table
+        size_t chunk = PAGES_PER_TABLE - ((virt >> 12) % PAGES_PER_TABLE);
+        if (chunk > num_pages) chunk = num_pages;
+        uint32_t pd_index = virt >> 22;
+        uintptr_t pde = kernel_page_dir->physical_tables[pd_index];
+
+        if (pde & PAGE_FLAG_HUGE) {
+            printf("vmm_unmap_range: 0x%X is part of a 4 MiB mapping\n", virt);
+        } else if (kernel_page_dir->tables[pd_index]) {
+            for (size_t i = 0; i < chunk; i++) {
+                uint32_t* pte = pte_for(virt + i * PAGE_SIZE);
+                tlb_batch_add(batch, virt + i * PAGE_SIZE, *pte);
+                *pte = 0;
+            }
+        }
+        virt += chunk * PAGE_SIZE;
+        num_pages -= chunk;
+    }
+}
+
+int vmm_map_range(uintptr_t virt, uintptr_t phys, size_t num_pages, uint32_t flags)
+{
+    virt = PAGE_ALIGN_DOWN(virt);
+    phys = PAGE_ALIGN_DOWN(phys);
+    flags = (flags & 0xFFF) | PAGE_FLAG_PRESENT;
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+
+    for (size_t mapped = 0; mapped < num_pages;) {
+        uintptr_t vaddr = virt + mapped * PAGE_SIZE;
+        // Makes sure the table exists, after that the recursive window can reach its entries
+        if (!get_page_table(vaddr, true)) {
+            printf("vmm_map_range: can't get a page table for 0x%X\n", vaddr);
+            unmap_pages(virt, mapped, &batch);
+            tlb_batch_flush(&batch);
+            return -1;
+        }
+        size_t chunk = PAGES_PER_TABLE - ((vaddr >> 12) % PAGES_PER_TABLE);
+        if (chunk > num_pages - mapped) chunk = num_pages - mapped;
+        uint32_t* pte = pte_for(vaddr);
+        for (size_t i = 0; i < chunk; i++) {
+            tlb_batch_add(&batch, vaddr + i * PAGE_SIZE, pte[i]);
+            pte[i] = (phys + (mapped + i) * PAGE_SIZE) | flags;
+        }
+        mapped += chunk;
+    }
+    tlb_batch_flush(&batch);
+    return 0;
+}
+
+void vmm_unmap_range(uintptr_t virt, size_t num_pages)
+{
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    unmap_pages(PAGE_ALIGN_DOWN(virt), num_pages, &batch);
+    tlb_batch_flush(&batch);
+}
+
+vm_area_t* vmm_find_area(uintptr_t addr)
+{
+    uint32_t irq = spin_lock_irqsave(&area_lock);
+    vm_area_t* found = NULL;
+    for (vm_area_t* area = areas; area && area->start <= addr; area = area->next) {
+        if (addr < area->end) {
+            found = area;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&area_lock, irq);
+    return found;
+}
+
+vm_area_t* vmm_reserve(uintptr_t start, size_t size, uint32_t flags)
+{
+    if (!size || (start | size) & (PAGE_SIZE - 1) || start + size < start) return NULL;
+    uintptr_t end = start + size;
+    // Areas are mapped with 4 KiB pages, they can't live inside the direct map or the recursive window
+    for (uintptr_t addr = start; addr < end && addr >= start; addr = (addr & ~0x3FFFFF) + 0x400000) {
+        if ((addr >> 22) == RECURSIVE_PD_SLOT || kernel_page_dir->physical_tables[addr >> 22] & PAGE_FLAG_HUGE)
+            return NULL;
+    }
+
+    uint32_t irq = spin_lock_irqsave(&area_lock);
+    vm_area_t** link = &areas;
+    while (*link && (*link)->start < end) {
+        if ((*link)->end > start) {
+            spin_unlock_irqrestore(&area_lock, irq);
+            return NULL;
+        }
+        link = &(*link)->next;
+    }
+
+    if (!area_cache) area_cache = kmem_cache_create("vm_area", sizeof(vm_area_t), 0, NULL);
+    vm_area_t* area = area_cache ? kmem_cache_alloc(area_cache) : NULL;
+    if (area) {
+        area->start = start;
+        area->end = end;
+        area->flags = flags;
+        area->ops = NULL;
+        area->private = NULL;
+        area->next = *link;
+        *link = area;
+    }
+    spin_unlock_irqrestore(&area_lock, irq);
+    return area;
+}
+
+void vmm_release(vm_area_t* area)
+{
+    if (!area) return;
+    // Off the list first, so faults on it stop finding it while the pages go away
+    uint32_t irq = spin_lock_irqsave(&area_lock);
+    vm_area_t** link = &areas;
+    while (*link && *link != area)
+        link = &(*link)->next;
+    if (*link) *link = area->next;
+    spin_unlock_irqrestore(&area_lock, irq);
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    for (uintptr_t page = area->start; page < area->end; page += PAGE_SIZE) {
+        uint32_t* pte = lookup_pte(page);
+        if (!pte || !(*pte & PAGE_FLAG_PRESENT)) continue;
+        uintptr_t phys = *pte & ~(PAGE_SIZE - 1);
+        tlb_batch_add(&batch, page, *pte);
+        *pte = 0;
+        pmm_frame_put(phys);
+    }
+    tlb_batch_flush(&batch);
+    if (area->ops && area->ops->release) area->ops->release(area);
+    kmem_cache_free(area_cache, area);
+}
+
+vm_area_t* vmm_clone_cow(vm_area_t* src, uintptr_t dst)
+{
+    // Pages the source hasn't touched would come up zeroed in the clone
+    if (src->ops) return NULL;
+    vm_area_t* area = vmm_reserve(dst, src->end - src->start, src->flags);
+    if (!area) return NULL;
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    for (uintptr_t page = src->start; page < src->end; page += PAGE_SIZE) {
+        uint32_t* pte = lookup_pte(page);
+        if (!pte || !(*pte & PAGE_FLAG_PRESENT)) continue;
+        uintptr_t target = dst + (page - src->start);
+        if (!get_page_table(target, true)) {
+            tlb_batch_flush(&batch);
+            vmm_release(area);
+            return NULL;
+        }
+        // Both sides lose write access until one of them faults and gets its own copy
+        if (*pte & PAGE_FLAG_WRITE) {
+            tlb_batch_add(&batch, page, *pte);
+            *pte = (*pte & ~PAGE_FLAG_WRITE) | PAGE_FLAG_COW;
+        }
+        pmm_frame_get(*pte & ~(PAGE_SIZE - 1));
+        *pte_for(target) = *pte;
+    }
+    tlb_batch_flush(&batch);
+    return area;
+}
+
+/// PTE flags for a page that belongs to area alone
+static inline uint32_t area_page_flags(const vm_area_t* area)
+{
+    uint32_t flags = PAGE_FLAG_PRESENT;
+    if (area->flags & VMA_WRITE) flags |= PAGE_FLAG_WRITE;
+    if (area->flags & VMA_USER) flags |= PAGE_FLAG_USER;
+    return flags;
+}
+
+int vmm_handle_fault(uintptr_t addr, uint32_t err_code)
+{
+    vm_area_t* area = vmm_find_area(addr);
+    if (!area || err_code & FAULT_RESERVED) return -1;
+    if (err_code & FAULT_WRITE && !(area->flags & VMA_WRITE)) return -1;
+    if (err_code & FAULT_USER && !(area->flags & VMA_USER)) return -1;
+    uintptr_t page = PAGE_ALIGN_DOWN(addr);
+
+    // First touch, back it with a zeroed frame or whatever the area maps
+    if (!(err_code & FAULT_PRESENT) && area->ops) {
+        // Mapped files may have to wait for the disk, which a kernel_fpu section can't
+        if (kernel_fpu_active()) {
+            printf("vmm: fault on file backed 0x%X inside a kernel_fpu section\n", addr);
+            return -1;
+        }
+        return area->ops->fault(area, page);
+    }
+    if (!(err_code & FAULT_PRESENT)) {
+        uintptr_t frame = kalloc_zeroed_frames(1);
+        if (!frame) return -1;
+        if (vmm_map_range(page, frame - KERNEL_OFFSET, 1, area_page_flags(area))) {
+            kfree_frames(frame, 1);
+            return -1;
+        }
+        return 0;
+    }
+
+    // Write to a present page, only legal when it's shared copy-on-write
+    uint32_t* pte = lookup_pte(page);
+    if (!pte || !(*pte & PAGE_FLAG_COW)) return -1;
+    uintptr_t phys = *pte & ~(PAGE_SIZE - 1);
+    // Everyone else already made their own copy, take the frame back
+    if (pmm_frame_refs(phys) == 1) {
+        *pte = phys | area_page_flags(area);
+        invalidate(page);
+        return 0;
+    }
+    uintptr_t copy = kalloc_frames(1);
+    if (!copy) return -1;
+    // The old mapping is still readable, so copy through it
+    memcpy((void*)copy, (void*)page, PAGE_SIZE);
+    *pte = (copy - KERNEL_OFFSET) | area_page_flags(area);
+    invalidate(page);
+    pmm_frame_put(phys);
+    return 0;
+}
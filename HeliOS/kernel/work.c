@@ -0,0 +1,63 @@
+#include <kernel/asm.h>
+#include <kernel/spinlock.h>
+#include <kernel/work.h>
+#include <stddef.h>
+
+// FIFO so work runs in the order the interrupts came in
+static struct work* head = NULL;
+static struct work** tail = &head;
+static bool draining = false;
+// Any CPU can queue and drain, only one drains at a time so items never run concurrently
+static spinlock_t work_lock = SPINLOCK_INIT;
+
+void work_setup(struct work* w, work_fn_t fn, void* data)
+{
+    w->next = NULL;
+    w->fn = fn;
+    w->data = data;
+    w->queued = false;
+}
+
+bool work_queue(struct work* w)
+{
+    uint32_t flags = spin_lock_irqsave(&work_lock);
+    if (w->queued) {
+        spin_unlock_irqrestore(&work_lock, flags);
+        return false;
+    }
+    w->queued = true;
+    w->next = NULL;
+    *tail = w;
+    tail = &w->next;
+    spin_unlock_irqrestore(&work_lock, flags);
+    return true;
+}
+
+bool work_pending() { return head != NULL; }
+
+void work_run()
+{
+    uint32_t flags = spin_lock_irqsave(&work_lock);
+    if (draining) {
+        spin_unlock_irqrestore(&work_lock, flags);
+        return;
+    }
+    draining = true;
+    // Items can't be switched away from halfway, a nested interrupt would otherwise run the rest elsewhere
+    preempt_disable();
+    while (head) {
+        struct work* w = head;
+        head = w->next;
+        if (!head) tail = &head;
+        // Cleared before running so the item can queue itself again
+        w->queued = false;
+        spin_unlock(&work_lock);
+        asm volatile("sti");
+        w->fn(w->data);
+        asm volatile("cli");
+        spin_lock(&work_lock);
+    }
+    preempt_enable();
+    draining = false;
+    spin_unlock_irqrestore(&work_lock, flags);
+}
@@ -11,12 +11,24 @@
 
 // printf.c
 
-static void print(const char* data);
+/// Receives formatted output in chunks, ctx is whatever was passed along with the sink
+typedef void (*printf_sink_t)(void* ctx, const char* data, size_t len);
+
 int printf(const char* __restrict format, ...);
 int vprintf(const char* __restrict, va_list);
 int sprintf(char* str, const char* __restrict format, ...);
-static void parse_hex(unsigned int value, bool cap);
-static void parse_num(unsigned int value, unsigned int base);
+int snprintf(char* str, size_t size, const char* __restrict format, ...);
+int vsnprintf(char* str, size_t size, const char* __restrict format, va_list args);
+/// Formats straight into a sink, the building block for everything above
+int vsinkprintf(printf_sink_t sink, void* ctx, const char* __restrict format, va_list args);
+
+#if defined(__is_libk) || defined(__is_kernel)
+/// printf for kernel messages, goes wherever kprintf_set_sink pointed it (the console by default)
+int kprintf(const char* __restrict format, ...);
+int vkprintf(const char* __restrict format, va_list args);
+/// Redirects kprintf, NULL restores the console
+void kprintf_set_sink(printf_sink_t sink, void* ctx);
+#endif
 
 // putchar.c
 int putchar(int);
@@ -7,5 +7,19 @@
 size_t strlen(const char*);
 void* memset(void*, int, size_t);
 void* memcpy(void* dest, const void* src, size_t count);
+void* memmove(void* dest, const void* src, size_t count);
 int strcmp(const char* str1, const char* str2);
 int strncmp(const char* str1, const char* str2, size_t count);
+int memcmp(const void* ptr1, const void* ptr2, size_t count);
+void* memchr(const void* ptr, int value, size_t count);
+
+// CPU features the mem* routines can use, handed over by the kernel once CPUID has been read
+enum {
+    STRING_FEAT_SSE2 = 1 << 0, ///< SSE2 with OS support enabled in CR4
+    STRING_FEAT_ERMS = 1 << 1, ///< Enhanced rep movsb/stosb
+};
+
+/// Picks the fastest memcpy/memset for the given STRING_FEAT_* flags
+void string_select(unsigned int features);
+void memcpy_select(unsigned int features);
+void memset_select(unsigned int features);
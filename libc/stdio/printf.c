@@ -2,156 +2,310 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
-// Testing
+#if defined(__is_libk)
 #include <kernel/tty.h>
+#endif
+
+// Formatted output is collected on the caller's stack and handed to the sink in chunks this big,
+// so a normal line reaches the sink in a single write and nothing is shared between callers.
+#define CHUNK_SIZE 256
 
-#define BUF_SIZE 1024
+struct format_state {
+    char chunk[CHUNK_SIZE];
+    size_t used; ///< Bytes waiting in chunk
+    size_t total; ///< Everything produced so far, which is what the printf family returns
+    printf_sink_t sink;
+    void* ctx;
+};
 
-static char buffer[BUF_SIZE] = { '\0' };
-static size_t pointer = 0;
+// Conversion flags
+#define FLAG_LEFT (1 << 0)
+#define FLAG_ZERO (1 << 1)
+#define FLAG_PLUS (1 << 2)
+#define FLAG_SPACE (1 << 3)
+#define FLAG_ALT (1 << 4)
 
-static void parse_hex(unsigned int value, bool cap)
+static void flush(struct format_state* state)
 {
-    const char* fmt = cap ? "0123456789ABCDEF" : "0123456789abcdef";
-    bool zero = true; // Stores if all digits so far have been zero
-    for (int i = 7; i >= 0; i--) {
-        char c = fmt[(value >> (i * 4)) & 0xF];
-        // if we have only seen zeros, we just skip them
-        if (zero && c == '0') continue;
-        zero = false;
-        buffer[pointer++] = c;
-    }
+    if (state->used) state->sink(state->ctx, state->chunk, state->used);
+    state->used = 0;
 }
 
-static void parse_num(unsigned int value, unsigned int base)
+static void emit(struct format_state* state, const char* data, size_t len)
 {
+    state->total += len;
+    while (len) {
+        size_t room = CHUNK_SIZE - state->used;
+        size_t n = len < room ? len : room;
+        memcpy(state->chunk + state->used, data, n);
+        state->used += n;
+        data += n;
+        len -= n;
+        if (state->used == CHUNK_SIZE) flush(state);
+    }
+}
 
-    size_t i = 0;
-    int temp_buffer[16] = { 0 };
+static void emit_repeat(struct format_state* state, char c, int count)
+{
+    for (; count > 0; count--)
+        emit(state, &c, 1);
+}
 
-    // Gets digit from right to left and converts to ascii
-    do {
-        temp_buffer[i] = (value % base) + '0';
-        i++;
-        value /= base;
-    } while (value != 0);
-    // Iterates over array and prints it
-    for (; i > 0; i--) {
-        buffer[pointer++] = temp_buffer[i - 1];
-    }
+/// Writes digits (already converted) with sign/prefix and padding to width. A precision of 0 or more is the
+/// minimum number of digits, the flag's zero padding is ignored then.
+static void emit_field(struct format_state* state, const char* prefix, const char* digits, size_t len,
+    int precision, int width, int flags)
+{
+    int zeros = precision > (int)len ? precision - (int)len : 0;
+    if (precision >= 0) flags &= ~FLAG_ZERO;
+    int pad = width - (int)(strlen(prefix) + zeros + len);
+    if (!(flags & FLAG_LEFT) && !(flags & FLAG_ZERO)) emit_repeat(state, ' ', pad);
+    emit(state, prefix, strlen(prefix));
+    if (!(flags & FLAG_LEFT) && (flags & FLAG_ZERO)) emit_repeat(state, '0', pad);
+    emit_repeat(state, '0', zeros);
+    emit(state, digits, len);
+    if (flags & FLAG_LEFT) emit_repeat(state, ' ', pad);
 }
 
-int printf(const char* restrict format, ...)
+/// Converts value into the end of buf, returning where the digits start
+static char* convert(char* end, unsigned long long value, unsigned int base, bool cap, bool wide)
 {
-    va_list args;
-    va_start(args, format);
-    int result = vprintf(format, args);
-    // puts(buffer);
-    print(buffer);
-    va_end(args);
-    return result;
+    const char* fmt = cap ? "0123456789ABCDEF" : "0123456789abcdef";
+    char* p = end;
+    // Stay on 32 bit division unless the argument really was 64 bit
+    if (!wide) {
+        uint32_t v = value;
+        do {
+            *--p = fmt[v % base];
+            v /= base;
+        } while (v);
+    } else {
+        do {
+            *--p = fmt[value % base];
+            value /= base;
+        } while (value);
+    }
+    return p;
 }
 
-// TODO: Buffer overflow protections
-//       Error codes (including other supporting funcs)
-//       Add proper buffer flushing, the real printf only outputs when:
-//          \n is encountered
-//          an input needs to happen
-//          program exit (doesnt apply to kernel so we can just always write after function call)
-int vprintf(const char* restrict format, va_list args)
+static size_t format_args(struct format_state* state, const char* restrict format, va_list args)
 {
-    if (strlen(format) > BUF_SIZE) return EOVERFLOW;
+    while (*format) {
+        // Copy literal runs in one go
+        const char* start = format;
+        while (*format && *format != '%')
+            format++;
+        if (format != start) emit(state, start, format - start);
+        if (!*format) break;
+        format++;
 
-    pointer = 0;
-    memset(buffer, 0, BUF_SIZE);
+        int flags = 0;
+        for (;; format++) {
+            if (*format == '-')
+                flags |= FLAG_LEFT;
+            else if (*format == '0')
+                flags |= FLAG_ZERO;
+            else if (*format == '+')
+                flags |= FLAG_PLUS;
+            else if (*format == ' ')
+                flags |= FLAG_SPACE;
+            else if (*format == '#')
+                flags |= FLAG_ALT;
+            else
+                break;
+        }
 
-    while (*format != '\0') {
+        int width = 0;
+        if (*format == '*') {
+            width = va_arg(args, int);
+            if (width < 0) {
+                flags |= FLAG_LEFT;
+                width = -width;
+            }
+            format++;
+        }
+        while (*format >= '0' && *format <= '9')
+            width = width * 10 + (*format++ - '0');
 
-        if (pointer >= BUF_SIZE) return EOVERFLOW;
+        int precision = -1;
+        if (*format == '.') {
+            format++;
+            precision = 0;
+            if (*format == '*') {
+                precision = va_arg(args, int);
+                format++;
+            }
+            while (*format >= '0' && *format <= '9')
+                precision = precision * 10 + (*format++ - '0');
+        }
 
-        // Check if no special option is present
-        if ((format[0] != '%') && (format[0] != '\\')) {
-            buffer[pointer++] = format[0];
+        // long and size_t are 32 bit here, only ll changes what we pull off the stack
+        int longs = 0;
+        while (*format == 'l' || *format == 'z' || *format == 'h') {
+            if (*format == 'l') longs++;
             format++;
-            continue;
-        } // else if (format[0] == '\\') {
-        //     switch (format[0]) {
-        //     case '\\':
-        //         buffer[pointer++] = '\\';
-        //         break;
-        //     case 'n':
-        //         buffer[pointer++] = '\n';
-        //         break;
-        //         format++;
-        //         continue;
-        //     }
-        // }
-
-        // Step forward past '%' to get argument and handle
-        // format++;
-        switch (*++format) {
-        case 's': {
-            const char* s = va_arg(args, const char*);
-            while (*s)
-                buffer[pointer++] = *s++;
-            break;
         }
-        case 'c':
-            buffer[pointer++] = (char)va_arg(args, int); // Char promotes to int
+        bool wide = longs >= 2;
+
+        char digits[24];
+        char* end = digits + sizeof(digits);
+        switch (*format) {
+        case '%':
+            emit(state, "%", 1);
             break;
-        case 'x': {
-            unsigned int value = va_arg(args, unsigned int);
-            parse_hex(value, false);
+        case 'c': {
+            char c = (char)va_arg(args, int); // Char promotes to int
+            emit_field(state, "", &c, 1, -1, width, flags & FLAG_LEFT);
             break;
         }
-        case 'X': {
-            unsigned int value = va_arg(args, unsigned int);
-            parse_hex(value, true);
+        case 's': {
+            const char* s = va_arg(args, const char*);
+            if (!s) s = "(null)";
+            size_t len = strlen(s);
+            if (precision >= 0 && (size_t)precision < len) len = precision;
+            emit_field(state, "", s, len, -1, width, flags & FLAG_LEFT);
             break;
         }
         case 'd':
         case 'i': {
-            int value = va_arg(args, int);
-            if (value < 0) {
-                buffer[pointer++] = '-';
-                value *= -1;
-            }
-            parse_num(value, 10);
+            long long value = wide ? va_arg(args, long long) : va_arg(args, int);
+            unsigned long long magnitude = value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+            const char* sign = value < 0 ? "-" : (flags & FLAG_PLUS) ? "+" : (flags & FLAG_SPACE) ? " " : "";
+            // A zero with precision 0 has no digits at all
+            char* p = value || precision ? convert(end, magnitude, 10, false, wide) : end;
+            emit_field(state, sign, p, end - p, precision, width, flags);
             break;
         }
-        case 'u': {
-            unsigned int value = va_arg(args, unsigned int);
-            parse_num(value, 10);
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X': {
+            unsigned long long value = wide ? va_arg(args, unsigned long long) : va_arg(args, unsigned int);
+            unsigned int base = *format == 'u' ? 10 : *format == 'o' ? 8 : 16;
+            const char* prefix = "";
+            if ((flags & FLAG_ALT) && value && base == 16) prefix = *format == 'X' ? "0X" : "0x";
+            char* p = value || precision ? convert(end, value, base, *format == 'X', wide) : end;
+            // # on octal only makes sure the first digit is a 0, precision padding may already do that
+            if ((flags & FLAG_ALT) && base == 8 && (p == end || *p != '0') && precision <= end - p) prefix = "0";
+            emit_field(state, prefix, p, end - p, precision, width, flags);
             break;
         }
-        case 'o': {
-            unsigned int value = va_arg(args, unsigned int);
-            parse_num(value, 8);
+        case 'p': {
+            char* p = convert(end, (uintptr_t)va_arg(args, void*), 16, false, false);
+            emit_field(state, "0x", p, end - p, -1, width, flags);
             break;
         }
+        default:
+            // Unknown conversion, show it as written so the mistake is visible
+            emit(state, "%", 1);
+            if (!*format) return state->total;
+            emit(state, format, 1);
+            break;
         }
         format++;
-        continue;
     }
-    return pointer;
+    return state->total;
+}
+
+int vsinkprintf(printf_sink_t sink, void* ctx, const char* restrict fmt, va_list args)
+{
+    struct format_state state;
+    state.used = 0;
+    state.total = 0;
+    state.sink = sink;
+    state.ctx = ctx;
+    size_t result = format_args(&state, fmt, args);
+    flush(&state);
+    return result > INT_MAX ? EOVERFLOW : (int)result;
+}
+
+struct string_sink {
+    char* str;
+    size_t size; ///< Room including the terminator
+    size_t pos;
+};
+
+static void string_write(void* ctx, const char* data, size_t len)
+{
+    struct string_sink* out = ctx;
+    if (out->pos + 1 < out->size) {
+        size_t room = out->size - 1 - out->pos;
+        memcpy(out->str + out->pos, data, len < room ? len : room);
+    }
+    out->pos += len;
 }
 
-int sprintf(char* str, const char* __restrict format, ...)
+int vsnprintf(char* str, size_t size, const char* restrict format, va_list args)
+{
+    struct string_sink out = { str, size, 0 };
+    int result = vsinkprintf(string_write, &out, format, args);
+    if (size) str[out.pos < size ? out.pos : size - 1] = '\0';
+    return result;
+}
+
+int snprintf(char* str, size_t size, const char* restrict format, ...)
 {
     va_list args;
     va_start(args, format);
-    int result = vprintf(format, args);
-    str = buffer;
+    int result = vsnprintf(str, size, format, args);
+    va_end(args);
+    return result;
+}
+
+int sprintf(char* str, const char* restrict format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int result = vsnprintf(str, SIZE_MAX, format, args);
     va_end(args);
     return result;
 }
 
 #if defined(__is_libk)
-// TODO: Make this call puts and output full string instead of each char
-static void print(const char* data) { tty_writestring(data); }
+static void tty_sink(void* ctx, const char* data, size_t len)
+{
+    (void)ctx;
+    tty_write(data, len);
+}
+
+int vprintf(const char* restrict format, va_list args) { return vsinkprintf(tty_sink, NULL, format, args); }
+
+int printf(const char* restrict format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int result = vprintf(format, args);
+    va_end(args);
+    return result;
+}
+
+// Where kprintf output goes, the console until something else takes over
+static printf_sink_t kernel_sink = tty_sink;
+static void* kernel_ctx = NULL;
+
+void kprintf_set_sink(printf_sink_t sink, void* ctx)
+{
+    kernel_sink = sink ? sink : tty_sink;
+    kernel_ctx = sink ? ctx : NULL;
+}
+
+int vkprintf(const char* restrict format, va_list args)
+{
+    return vsinkprintf(kernel_sink, kernel_ctx, format, args);
+}
+
+int kprintf(const char* restrict format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int result = vkprintf(format, args);
+    va_end(args);
+    return result;
+}
 
 #else
 // TODO: Proper libc print
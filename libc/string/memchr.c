@@ -0,0 +1,22 @@
+#include "word.h"
+#include <string.h>
+
+void* memchr(const void* ptr, int value, size_t count)
+{
+    const unsigned char* s = ptr;
+    unsigned char c = value;
+    for (; count && !IS_ALIGNED(s); s++, count--)
+        if (*s == c) return (void*)s;
+
+    // XOR clears the bytes matching c, so it becomes a zero byte search
+    word_t mask = c * WORD_ONES;
+    const word_t* w = (const word_t*)s;
+    while (count >= WORD_SIZE && !HAS_ZERO(*w ^ mask)) {
+        w++;
+        count -= WORD_SIZE;
+    }
+
+    for (s = (const unsigned char*)w; count; s++, count--)
+        if (*s == c) return (void*)s;
+    return NULL;
+}
@@ -0,0 +1,29 @@
+#include "word.h"
+#include <stdint.h>
+#include <string.h>
+
+int memcmp(const void* ptr1, const void* ptr2, size_t count)
+{
+    const unsigned char* s1 = ptr1;
+    const unsigned char* s2 = ptr2;
+
+    if (((uintptr_t)s1 & (WORD_SIZE - 1)) == ((uintptr_t)s2 & (WORD_SIZE - 1))) {
+        for (; count && !IS_ALIGNED(s1); s1++, s2++, count--)
+            if (*s1 != *s2) return *s1 - *s2;
+
+        // Skip equal words, the bytes of the first differing one are sorted out below
+        const word_t* w1 = (const word_t*)s1;
+        const word_t* w2 = (const word_t*)s2;
+        while (count >= WORD_SIZE && *w1 == *w2) {
+            w1++;
+            w2++;
+            count -= WORD_SIZE;
+        }
+        s1 = (const unsigned char*)w1;
+        s2 = (const unsigned char*)w2;
+    }
+
+    for (; count; s1++, s2++, count--)
+        if (*s1 != *s2) return *s1 - *s2;
+    return 0;
+}
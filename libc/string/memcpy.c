@@ -1,10 +1,96 @@
 #include <stdint.h>
 #include <string.h>
 
-void* memcpy(void* dest, const void* src, size_t count)
+#if defined(__is_libk)
+#include <kernel/fpu.h>
+#endif
+
+// Below this the SSE2 loop doesn't win back the cost of aligning and claiming the registers
+#define SSE2_THRESHOLD 256
+
+/// Plain dwords with rep movsd, works on every CPU we boot on
+static void* memcpy_movsd(void* dest, const void* src, size_t count)
+{
+    void* d = dest;
+    size_t dwords = count / 4;
+    size_t bytes = count % 4;
+    asm volatile("rep movsl\n\t"
+                 "mov %3, %2\n\t"
+                 "rep movsb"
+        : "+D"(d), "+S"(src), "+c"(dwords)
+        : "r"(bytes)
+        : "memory");
+    return dest;
+}
+
+/// With ERMS the microcode picks the widest moves itself, so a single rep movsb is fastest
+static void* memcpy_erms(void* dest, const void* src, size_t count)
+{
+    void* d = dest;
+    asm volatile("rep movsb" : "+D"(d), "+S"(src), "+c"(count) : : "memory");
+    return dest;
+}
+
+/**
+ * 64 bytes per iteration through xmm0-3. In the kernel the loop is a kernel_fpu_begin section,
+ * which keeps the running thread's registers safe and interrupts off. Sections can't sleep, so
+ * anything that may fault into a mapped file is copied with rep movsd instead.
+ */
+__attribute__((target("sse2"))) static void* memcpy_sse2(void* dest, const void* src, size_t count)
 {
-    for (size_t i = 0; i < count; i++) {
-        ((uint8_t*)dest)[i] = ((uint8_t*)src)[i];
-    }
+    if (count < SSE2_THRESHOLD) return memcpy_movsd(dest, src, count);
+#if defined(__is_libk)
+    if (!kernel_fpu_range_ok(dest, count) || !kernel_fpu_range_ok(src, count))
+        return memcpy_movsd(dest, src, count);
+#endif
+
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+    // Aligned stores, the loads can stay unaligned
+    size_t head = -(uintptr_t)d & 15;
+    memcpy_movsd(d, s, head);
+    d += head;
+    s += head;
+    count -= head;
+
+    size_t blocks = count / 64;
+#if defined(__is_libk)
+    kernel_fpu_begin();
+#endif
+    asm volatile("1:\n\t"
+                 "movdqu (%1), %%xmm0\n\t"
+                 "movdqu 16(%1), %%xmm1\n\t"
+                 "movdqu 32(%1), %%xmm2\n\t"
+                 "movdqu 48(%1), %%xmm3\n\t"
+                 "movdqa %%xmm0, (%0)\n\t"
+                 "movdqa %%xmm1, 16(%0)\n\t"
+                 "movdqa %%xmm2, 32(%0)\n\t"
+                 "movdqa %%xmm3, 48(%0)\n\t"
+                 "add $64, %0\n\t"
+                 "add $64, %1\n\t"
+                 "dec %2\n\t"
+                 "jnz 1b"
+        : "+r"(d), "+r"(s), "+r"(blocks)
+        :
+        : "xmm0", "xmm1", "xmm2", "xmm3", "memory", "cc");
+#if defined(__is_libk)
+    kernel_fpu_end();
+#endif
+
+    memcpy_movsd(d, s, count % 64);
     return dest;
 }
+
+static void* (*memcpy_impl)(void*, const void*, size_t) = memcpy_movsd;
+
+void* memcpy(void* dest, const void* src, size_t count) { return memcpy_impl(dest, src, count); }
+
+void memcpy_select(unsigned int features)
+{
+    if (features & STRING_FEAT_ERMS)
+        memcpy_impl = memcpy_erms;
+    else if (features & STRING_FEAT_SSE2)
+        memcpy_impl = memcpy_sse2;
+    else
+        memcpy_impl = memcpy_movsd;
+}
@@ -0,0 +1,27 @@
+#include <stdint.h>
+#include <string.h>
+
+void* memmove(void* dest, const void* src, size_t count)
+{
+    // Copying forwards is only unsafe when dest starts inside src
+    if ((uintptr_t)dest - (uintptr_t)src >= count) return memcpy(dest, src, count);
+
+    uint8_t* d = (uint8_t*)dest + count;
+    const uint8_t* s = (const uint8_t*)src + count;
+    for (size_t tail = count % 4; tail; tail--)
+        *--d = *--s;
+
+    // Backwards rep movsd starts from the last dword, the direction flag has to be cleared again after
+    size_t dwords = count / 4;
+    if (dwords) {
+        d -= 4;
+        s -= 4;
+        asm volatile("std\n\t"
+                     "rep movsl\n\t"
+                     "cld"
+            : "+D"(d), "+S"(s), "+c"(dwords)
+            :
+            : "memory");
+    }
+    return dest;
+}
@@ -1,10 +1,85 @@
+#include <stdint.h>
 #include <string.h>
 
-void* memset(void* bufptr, int value, size_t size)
+#if defined(__is_libk)
+#include <kernel/fpu.h>
+#endif
+
+#define SSE2_THRESHOLD 256
+
+/// Fills with rep stosd, the byte spread over all four lanes of eax
+static void* memset_stosd(void* bufptr, int value, size_t size)
+{
+    void* d = bufptr;
+    uint32_t fill = (uint8_t)value * 0x01010101u;
+    size_t dwords = size / 4;
+    size_t bytes = size % 4;
+    asm volatile("rep stosl\n\t"
+                 "mov %3, %1\n\t"
+                 "rep stosb"
+        : "+D"(d), "+c"(dwords)
+        : "a"(fill), "r"(bytes)
+        : "memory");
+    return bufptr;
+}
+
+static void* memset_erms(void* bufptr, int value, size_t size)
+{
+    void* d = bufptr;
+    asm volatile("rep stosb" : "+D"(d), "+c"(size) : "a"(value) : "memory");
+    return bufptr;
+}
+
+/// Same register rules as memcpy_sse2, only xmm0 is touched
+__attribute__((target("sse2"))) static void* memset_sse2(void* bufptr, int value, size_t size)
 {
-    unsigned char* buf = (unsigned char*)bufptr;
-    for (size_t i = 0; i < size; i++) {
-        buf[i] = (unsigned char)value;
-    }
+    if (size < SSE2_THRESHOLD) return memset_stosd(bufptr, value, size);
+#if defined(__is_libk)
+    if (!kernel_fpu_range_ok(bufptr, size)) return memset_stosd(bufptr, value, size);
+#endif
+
+    uint8_t* d = bufptr;
+    size_t head = -(uintptr_t)d & 15;
+    memset_stosd(d, value, head);
+    d += head;
+    size -= head;
+
+    uint32_t fill = (uint8_t)value * 0x01010101u;
+    size_t blocks = size / 64;
+#if defined(__is_libk)
+    kernel_fpu_begin();
+#endif
+    asm volatile("movd %2, %%xmm0\n\t"
+                 "pshufd $0, %%xmm0, %%xmm0\n\t"
+                 "1:\n\t"
+                 "movdqa %%xmm0, (%0)\n\t"
+                 "movdqa %%xmm0, 16(%0)\n\t"
+                 "movdqa %%xmm0, 32(%0)\n\t"
+                 "movdqa %%xmm0, 48(%0)\n\t"
+                 "add $64, %0\n\t"
+                 "dec %1\n\t"
+                 "jnz 1b"
+        : "+r"(d), "+r"(blocks)
+        : "r"(fill)
+        : "xmm0", "memory", "cc");
+#if defined(__is_libk)
+    kernel_fpu_end();
+#endif
+
+    memset_stosd(d, value, size % 64);
     return bufptr;
 }
+
+static void* (*memset_impl)(void*, int, size_t) = memset_stosd;
+
+void* memset(void* bufptr, int value, size_t size) { return memset_impl(bufptr, value, size); }
+
+void memset_select(unsigned int features)
+{
+    if (features & STRING_FEAT_ERMS)
+        memset_impl = memset_erms;
+    else if (features & STRING_FEAT_SSE2)
+        memset_impl = memset_sse2;
+    else
+        memset_impl = memset_stosd;
+}
@@ -1,35 +1,55 @@
+#include "word.h"
 #include <stdint.h>
 #include <string.h>
 
 int strcmp(const char* str1, const char* str2)
 {
-    uint32_t i = 0;
-    while (1) {
-        if (str1[i] < str2[i])
-            return -1;
-        else if (str1[i] > str2[i])
-            return 1;
-        else {
-            if (str1[i] == '\0') return 0;
-
-            ++i;
+    const unsigned char* s1 = (const unsigned char*)str1;
+    const unsigned char* s2 = (const unsigned char*)str2;
+
+    // Words only line up when both strings share the same misalignment
+    if (((uintptr_t)s1 & (WORD_SIZE - 1)) == ((uintptr_t)s2 & (WORD_SIZE - 1))) {
+        for (; !IS_ALIGNED(s1); s1++, s2++)
+            if (*s1 != *s2 || !*s1) return (*s1 > *s2) - (*s1 < *s2);
+
+        const word_t* w1 = (const word_t*)s1;
+        const word_t* w2 = (const word_t*)s2;
+        while (*w1 == *w2 && !HAS_ZERO(*w1)) {
+            w1++;
+            w2++;
         }
+        s1 = (const unsigned char*)w1;
+        s2 = (const unsigned char*)w2;
+    }
+
+    while (*s1 == *s2 && *s1) {
+        s1++;
+        s2++;
     }
+    return (*s1 > *s2) - (*s1 < *s2);
 }
 
 int strncmp(const char* str1, const char* str2, size_t count)
 {
-    uint32_t i = 0;
-    while (i < count) {
-        if (str1[i] < str2[i])
-            return -1;
-        else if (str1[i] > str2[i])
-            return 1;
-        else {
-            if (str1[i] == '\0') return 0;
-
-            ++i;
+    const unsigned char* s1 = (const unsigned char*)str1;
+    const unsigned char* s2 = (const unsigned char*)str2;
+
+    if (((uintptr_t)s1 & (WORD_SIZE - 1)) == ((uintptr_t)s2 & (WORD_SIZE - 1))) {
+        for (; count && !IS_ALIGNED(s1); s1++, s2++, count--)
+            if (*s1 != *s2 || !*s1) return (*s1 > *s2) - (*s1 < *s2);
+
+        const word_t* w1 = (const word_t*)s1;
+        const word_t* w2 = (const word_t*)s2;
+        while (count >= WORD_SIZE && *w1 == *w2 && !HAS_ZERO(*w1)) {
+            w1++;
+            w2++;
+            count -= WORD_SIZE;
         }
+        s1 = (const unsigned char*)w1;
+        s2 = (const unsigned char*)w2;
     }
+
+    for (; count; s1++, s2++, count--)
+        if (*s1 != *s2 || !*s1) return (*s1 > *s2) - (*s1 < *s2);
     return 0;
 }
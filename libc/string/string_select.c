@@ -0,0 +1,7 @@
+#include <string.h>
+
+void string_select(unsigned int features)
+{
+    memcpy_select(features);
+    memset_select(features);
+}
@@ -1,9 +1,17 @@
+#include "word.h"
 #include <string.h>
 
 size_t strlen(const char* str)
 {
-    size_t len = 0;
-    while (str[len])
-        len++;
-    return len;
+    const char* s = str;
+    for (; !IS_ALIGNED(s); s++)
+        if (!*s) return s - str;
+
+    const word_t* w = (const word_t*)s;
+    while (!HAS_ZERO(*w))
+        w++;
+
+    for (s = (const char*)w; *s; s++)
+        ;
+    return s - str;
 }
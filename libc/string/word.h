@@ -0,0 +1,15 @@
+#pragma once
+// Helpers for the word at a time string routines
+
+#include <stdint.h>
+
+// Reads through this may alias any other type, aligned reads also never run into the next page
+typedef uint32_t __attribute__((may_alias)) word_t;
+
+#define WORD_SIZE sizeof(word_t)
+#define WORD_ONES 0x01010101u
+#define WORD_HIGHS 0x80808080u
+
+/// Non zero if any byte of x is zero. Only the lowest zero byte is reliable, which is all we need.
+#define HAS_ZERO(x) (((x) - WORD_ONES) & ~(x) & WORD_HIGHS)
+#define IS_ALIGNED(p) (((uintptr_t)(p) & (WORD_SIZE - 1)) == 0)